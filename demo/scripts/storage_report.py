@@ -0,0 +1,56 @@
+#!/usr/bin/env python3
+
+# Accuracy of --storage fp16/bf16 compared to fp32.
+#
+# Deconvolves the demo image with each setting and reports the
+# difference to the fp32 result together with the time and the peak
+# memory from the log files. Run from the demo folder after `make`,
+# or use `make storage-report`. Requires numpy and tifffile.
+
+import re
+import subprocess
+import sys
+
+import numpy as np
+import tifffile
+
+image = 'dapi_001.tif'
+psf = 'PSF_dapi.tif'
+iters = '50'
+
+configs = [('fp32', []),
+           ('fp16', ['--storage', 'fp16']),
+           ('bf16', ['--storage', 'bf16']),
+           ('fp16m', ['--storage', 'fp16', '--storage-momentum']),
+           ('bf16m', ['--storage', 'bf16', '--storage-momentum'])]
+
+
+def log_value(logfile, pattern):
+    with open(logfile) as f:
+        for line in f:
+            m = re.search(pattern, line)
+            if m:
+                return float(m.group(1))
+    return float('nan')
+
+
+def run(name, extra):
+    cmd = ['dw', '--iter', iters, '--float', '--overwrite', '--noplan',
+           '--prefix', name] + extra + [image, psf]
+    print('Running: ' + ' '.join(cmd), file=sys.stderr)
+    subprocess.run(cmd, check=True, stdout=subprocess.DEVNULL)
+    out = name + '_' + image
+    took = log_value(out + '.log.txt', r'^Took: ([0-9.]+)')
+    peak = log_value(out + '.log.txt', r'measured: ([0-9.]+) GB')
+    return tifffile.imread(out).astype(np.float64), took, peak
+
+
+ref, ref_took, ref_peak = run(*configs[0])
+print('| storage | rel. L2 error | max abs error / max | time (s) | peak (GB) |')
+print('|---------|---------------|---------------------|----------|-----------|')
+print(f'| fp32    | 0             | 0                   | {ref_took:8.1f} | {ref_peak:9.2f} |')
+for name, extra in configs[1:]:
+    im, took, peak = run(name, extra)
+    rel = np.linalg.norm(im - ref) / np.linalg.norm(ref)
+    mx = np.max(np.abs(im - ref)) / np.max(ref)
+    print(f'| {name:7} | {rel:13.2e} | {mx:19.2e} | {took:8.1f} | {peak:9.2f} |')
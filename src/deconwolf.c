@@ -19,6 +19,7 @@
 /* Extra modules can be enabled by un-commenting in
  * the header file. */
 #include "dw.h"
+#include "dw_bench.h"
 
 
 static int
@@ -184,6 +185,14 @@ int main(int argc, char ** argv)
         {
             return dw_tiff_merge(argc-1, argv+1);
         }
+        if(strcmp(argv[1], "merge-tiles") == 0)
+        {
+            return dw_merge_tiles(argc-1, argv+1);
+        }
+        if(strcmp(argv[1], "bench") == 0)
+        {
+            return dw_bench(argc-1, argv+1);
+        }
 
         if(strcmp(argv[1], "nuclei") == 0)
         {
@@ -165,69 +165,152 @@ dw_iterator_t * dw_iterator_new(const dw_opts * s)
     {
         it->niter = s->maxiter;
     }
+    it->miniter = s->miniter;
+    it->iter_done = s->iter_done;
+    it->error_every = s->error_every;
+    /* --accel restarts when the error goes up */
+    it->error_always = s->tsv != NULL || s->accel != DW_ACCEL_NONE;
+    it->error_iter = -1;
+    it->lasterror_iter = -1;
+    it->nerror = 0;
 
     return it;
 }
 
+/* Relative change of the error per iteration, between the last two
+ * times that it was set */
+static double dw_iterator_relchange(const dw_iterator_t * it)
+{
+    int steps = it->error_iter - it->lasterror_iter;
+    steps < 1 ? steps = 1 : 0;
+    return fabs(it->error - it->lasterror)/it->error/(double) steps;
+}
+
 int dw_iterator_next(dw_iterator_t * it)
 {
     it->iter++;
+    int stop = 0;
+    /* The error is only compared to the thresholds directly after it
+     * was set, see dw_iterator_need_error */
+    const int fresh = it->error_iter >= 0 && it->error_iter == it->iter - 1;
     switch(it->itertype)
     {
     case DW_ITER_FIXED:
         //printf("DW_ITER_FIXED\n");
         break;
     case DW_ITER_REL:
-        //printf("DW_ITER_REL, %e, %e\n", fabs(it->error - it->lasterror)/it->error, it->relerror);
-        if(it->iter < 2)
-        {
-            it->lasterror = 2*it->error*it->relerror;
-        }
-        if(fabs(it->error - it->lasterror)/it->error < it->relerror)
+        if(fresh && it->nerror >= 2 && it->iter >= it->miniter
+           && dw_iterator_relchange(it) < it->relerror)
         {
-            return -1;
+            stop = 1;
         }
         break;
     case DW_ITER_ABS:
         //printf("DW_ITER_ABS %f < %f ?\n", it->error, it->abserror);
-        if(it->iter > 0 && it->error < it->abserror)
+        if(fresh && it->iter >= it->miniter
+           && it->error < it->abserror)
         {
-            return -1;
+            stop = 1;
         }
         break;
     }
 
     if(it->iter >= it->niter)
     {
+        stop = 1;
+    }
+
+    if(stop)
+    {
+        if(it->iter_done != NULL)
+        {
+            it->iter_done[0] = it->iter;
+        }
         return -1;
     }
 
     return it->iter;
 }
 
+int dw_iterator_need_error(const dw_iterator_t * it)
+{
+    if(it->error_always)
+    {
+        return 1;
+    }
+    /* The last iteration, so that the final error is shown */
+    if(it->iter + 1 >= it->niter)
+    {
+        return 1;
+    }
+    if(it->error_every > 0)
+    {
+        return (it->iter + 1) % it->error_every == 0;
+    }
+    /* Default: only when it is used to stop */
+    return it->itertype != DW_ITER_FIXED;
+}
+
 void dw_iterator_set_error(dw_iterator_t * it, float err)
 {
     it->lasterror = it->error;
+    it->lasterror_iter = it->error_iter;
     it->error = err;
+    it->error_iter = it->iter;
+    it->nerror++;
+}
+
+void dw_iterator_resume(dw_iterator_t * it, int iter,
+                        float error, float lasterror)
+{
+    /* As if the loop had been run iter times */
+    it->iter = iter - 1;
+    it->error = error;
+    it->lasterror = lasterror;
+    it->error_iter = it->iter;
+    it->lasterror_iter = it->iter - (it->error_every > 1 ? it->error_every : 1);
+    it->nerror = iter < 2 ? iter : 2;
+}
+
+int dw_error_row(int64_t row, float f)
+{
+    if(f >= 1)
+    {
+        return 1;
+    }
+    /* splitmix64 finalizer */
+    uint64_t h = (uint64_t) row + 0x9E3779B97F4A7C15ULL;
+    h = (h ^ (h >> 30)) * 0xBF58476D1CE4E5B9ULL;
+    h = (h ^ (h >> 27)) * 0x94D049BB133111EBULL;
+    h = h ^ (h >> 31);
+    return (double) (h >> 11) * 0x1.0p-53 < (double) f;
 }
 
 void dw_iterator_show(dw_iterator_t * it, const dw_opts *s)
 {
+    /* Nothing new to show about the error, see --error-every */
+    const int has_error = it->error_iter == it->iter;
+
     if(s->verbosity > 0){
         printf("\r                                             ");
-        if(s->metric == DW_METRIC_MSE)
+        if(!has_error)
         {
-            printf("\rIteration %3d/%3d, fMSE=%.3e ",
-                   it->iter+1, it->niter, it->error);
-        }
-        if(s->metric == DW_METRIC_IDIV)
-        {
-            printf("\rIteration %3d/%3d, Idiv=%.3e ",
-                   it->iter+1, it->niter, it->error);
+            printf("\rIteration %3d/%3d ", it->iter+1, it->niter);
+        } else {
+            if(s->metric == DW_METRIC_MSE)
+            {
+                printf("\rIteration %3d/%3d, fMSE=%.3e ",
+                       it->iter+1, it->niter, it->error);
+            }
+            if(s->metric == DW_METRIC_IDIV)
+            {
+                printf("\rIteration %3d/%3d, Idiv=%.3e ",
+                       it->iter+1, it->niter, it->error);
+            }
         }
-        if(it->itertype == DW_ITER_REL && it->iter > 1)
+        if(has_error && it->itertype == DW_ITER_REL && it->nerror > 1)
         {
-            double rel = fabs(it->error - it->lasterror)/it->error;
+            double rel = dw_iterator_relchange(it);
             printf("(%.3e", rel);
             if(rel > it->relerror)
             {
@@ -237,7 +320,7 @@ void dw_iterator_show(dw_iterator_t * it, const dw_opts *s)
             }
             printf("%.3e) ", it->relerror);
         }
-        if(it->itertype == DW_ITER_ABS && it->iter > 0)
+        if(has_error && it->itertype == DW_ITER_ABS)
         {
             printf("(");
             if(it->error > it->abserror)
@@ -253,15 +336,21 @@ void dw_iterator_show(dw_iterator_t * it, const dw_opts *s)
 
     if(s->log != NULL && s->log != stdout)
     {
-        if(s->metric == DW_METRIC_MSE)
-        {
-            fprintf(s->log, "Iteration %3d/%3d, fMSE=%e\n",
-                    it->iter+1, it->niter, it->error);
-        }
-        if(s->metric == DW_METRIC_IDIV)
+        if(!has_error)
         {
-            fprintf(s->log, "Iteration %3d/%3d, Idiv=%e\n",
-                    it->iter+1, it->niter, it->error);
+            fprintf(s->log, "Iteration %3d/%3d\n",
+                    it->iter+1, it->niter);
+        } else {
+            if(s->metric == DW_METRIC_MSE)
+            {
+                fprintf(s->log, "Iteration %3d/%3d, fMSE=%e\n",
+                        it->iter+1, it->niter, it->error);
+            }
+            if(s->metric == DW_METRIC_IDIV)
+            {
+                fprintf(s->log, "Iteration %3d/%3d, Idiv=%e\n",
+                        it->iter+1, it->niter, it->error);
+            }
         }
         fflush(s->log);
     }
@@ -282,11 +371,32 @@ dw_opts * dw_opts_new(void)
     s->nThreads_OMP < 1 ? s->nThreads_OMP = 1 : 0;
 
     s->fft_inplace = 1;
+    s->max_mem = 0;
+    s->storage = FIM_FP32;
+    s->storage_momentum = 0;
+    s->otf_cache = NULL;
+    s->batchFile = NULL;
+    s->batchOut = NULL;
+    s->psfFiles = NULL;
+    s->nChannels = 1;
 
     s->nIter = 1; /* Always overwritten if used */
     s->maxiter = 250;
+    s->miniter = 0;
+    s->iter_done = NULL;
+    s->checkpoint_iter = 0;
+    s->checkpoint_time = 0;
+    s->resume = 0;
     s->err_rel = 0.02;
     s->err_abs = 1; /* Always overwritten if used */
+    s->error_every = 0;
+    s->error_sample = 1;
+    s->accel = DW_ACCEL_NONE;
+    s->accel_window = 3;
+    s->first_touch = 0;
+    s->pool = 0;
+    s->stack2d = 0;
+    s->bind = NULL;
     s->nIter_auto = 1;
     s->imFile = NULL;
     s->psfFile = NULL;
@@ -294,6 +404,7 @@ dw_opts * dw_opts_new(void)
     s->logFile = NULL;
     s->refFile = NULL;
     s->tsvFile = NULL;
+    s->traceFile = NULL;
     s->iter_type = DW_ITER_REL;
     s->tsv = NULL;
     s->ref = NULL;
@@ -307,6 +418,16 @@ dw_opts * dw_opts_new(void)
     s->overwrite = 0;
     s->tiling_maxSize = -1;
     s->tiling_padding = 20;
+    s->tiling_maxSizeP = -1;
+    s->tiling_paddingP = 20;
+    s->tile_workers = 1;
+    s->tiling_mmap = 1;
+    s->tile_relerror = 0;
+    s->tile_miniter = 10;
+    s->tile_skip_bg = -1;
+    s->tile_first = -1;
+    s->tile_last = -1;
+    s->tileOutDir = NULL;
     s->method = DW_METHOD_SHB;
     s->fun = deconvolve_shb;
     s->iterdump = 0;
@@ -324,6 +445,7 @@ dw_opts * dw_opts_new(void)
     s->offset = 5;
     s->flatfieldFile = NULL;
     s->lookahead = 0;
+    s->fft_pad = 0;
     s->psigma = 0;
     s->biggs = 1;
     s->metric = DW_METRIC_IDIV;
@@ -339,6 +461,7 @@ dw_opts * dw_opts_new(void)
     }
 
     s->start_condition = DW_START_FLAT;
+    s->pyramid_iter = 20;
 
     return s;
 }
@@ -392,6 +515,13 @@ int64_t int64_t_max(int64_t a, int64_t b)
     return b;
 }
 
+int64_t int64_t_min(int64_t a, int64_t b)
+{
+    if( a < b)
+        return a;
+    return b;
+}
+
 void dw_opts_free(dw_opts ** sp)
 {
     dw_opts * s = sp[0];
@@ -406,6 +536,19 @@ void dw_opts_free(dw_opts ** sp)
     free(s->ref);
     free(s->refFile);
     free(s->tsvFile);
+    free(s->traceFile);
+    free(s->batchFile);
+    free(s->batchOut);
+    free(s->tileOutDir);
+    if(s->psfFiles != NULL)
+    {
+        /* psfFiles[0] is psfFile */
+        for(int kk = 1; kk < s->nChannels; kk++)
+        {
+            free(s->psfFiles[kk]);
+        }
+        free(s->psfFiles);
+    }
     if(s->tsv != NULL)
     {
         fclose(s->tsv);
@@ -418,12 +561,32 @@ void dw_opts_fprint(FILE *f, dw_opts * s)
     f == NULL ? f = stdout : 0;
 
     fprintf(f, "> Settings:\n");
+    if(s->batchFile != NULL)
+    {
+        fprintf(f, "batch:  %s\n", s->batchFile);
+    }
+    if(s->stack2d > 0)
+    {
+        fprintf(f, "2D stacks of up to %d images\n", s->stack2d);
+    }
+    if(s->traceFile != NULL)
+    {
+        fprintf(f, "trace:  %s\n", s->traceFile);
+    }
     fprintf(f, "image:  %s\n", s->imFile);
     if(s->flatfieldFile != NULL)
     {
         fprintf(f, "flat field: %s\n", s->flatfieldFile);
     }
-    fprintf(f, "psf:    %s\n", s->psfFile);
+    if(s->nChannels > 1)
+    {
+        for(int kk = 0; kk < s->nChannels; kk++)
+        {
+            fprintf(f, "psf channel %d: %s\n", kk+1, s->psfFiles[kk]);
+        }
+    } else {
+        fprintf(f, "psf:    %s\n", s->psfFile);
+    }
     fprintf(f, "output: %s\n", s->outFile);
     fprintf(f, "log file: %s\n", s->logFile);
     fprintf(f, "nIter:  %d\n", s->nIter);
@@ -481,6 +644,27 @@ void dw_opts_fprint(FILE *f, dw_opts * s)
                 s->nIter);
         break;
     }
+    if(s->error_every > 0)
+    {
+        fprintf(f, "error evaluated every %d iterations\n", s->error_every);
+    }
+    if(s->error_sample < 1)
+    {
+        fprintf(f, "error evaluated on %.1f%% of the rows\n",
+                100.0*s->error_sample);
+    }
+    if(s->accel == DW_ACCEL_ANDERSON)
+    {
+        fprintf(f, "acceleration: Anderson, window %d\n", s->accel_window);
+    }
+    if(s->first_touch)
+    {
+        fprintf(f, "first touch allocations: YES\n");
+    }
+    if(s->pool)
+    {
+        fprintf(f, "buffer pool: YES\n");
+    }
     if(s->psigma > 0)
     {
         fprintf(f, "pre-filtering enabled, sigma = %f\n", s->psigma);
@@ -493,9 +677,57 @@ void dw_opts_fprint(FILE *f, dw_opts * s)
     {
         fprintf(f, "tiling, maxSize: %d\n", s->tiling_maxSize);
         fprintf(f, "tiling, padding: %d\n", s->tiling_padding);
-    } else {
+    }
+    if(s->tiling_maxSizeP > 0)
+    {
+        fprintf(f, "tiling, maxSize in z: %d\n", s->tiling_maxSizeP);
+        fprintf(f, "tiling, padding in z: %d\n", s->tiling_paddingP);
+    }
+    if(s->tiling_maxSize <= 0 && s->tiling_maxSizeP <= 0)
+    {
         fprintf(f, "tiling: OFF\n");
     }
+    if(s->tile_relerror > 0)
+    {
+        fprintf(f, "tiling, stopping each tile on relative error: %e, "
+                "at least %d iterations\n",
+                s->tile_relerror, s->tile_miniter);
+    }
+    if(s->tile_skip_bg >= 0)
+    {
+        fprintf(f, "tiling, skipping tiles with max below: %f\n",
+                s->tile_skip_bg);
+    }
+    if(s->tileOutDir != NULL)
+    {
+        fprintf(f, "tiling, writing tiles to: %s\n", s->tileOutDir);
+    }
+    if(s->tile_first >= 0)
+    {
+        fprintf(f, "tiling, only tiles: %d-%d\n",
+                s->tile_first+1, s->tile_last+1);
+    }
+    if(s->max_mem > 0)
+    {
+        fprintf(f, "max memory: %zu bytes\n", s->max_mem);
+    }
+    if(s->storage != FIM_FP32)
+    {
+        fprintf(f, "storage: %s%s\n", fim_dtype_name(s->storage),
+                s->storage_momentum ? ", also for the momentum" : "");
+    }
+    if(s->checkpoint_iter > 0)
+    {
+        fprintf(f, "checkpoint every %d iterations\n", s->checkpoint_iter);
+    }
+    if(s->checkpoint_time > 0)
+    {
+        fprintf(f, "checkpoint every %.1f minutes\n", s->checkpoint_time);
+    }
+    if(s->resume)
+    {
+        fprintf(f, "resume: from checkpoint if available\n");
+    }
     fprintf(f, "XY crop factor: %f\n", s->xycropfactor);
     fprintf(f, "Offset: %f\n", s->offset);
     fprintf(f, "Output Format: ");
@@ -536,6 +768,10 @@ void dw_opts_fprint(FILE *f, dw_opts * s)
         ;
     }
     fprintf(f, "FFT lookahead: %d", s->lookahead);
+    if(s->fft_pad > 0)
+    {
+        fprintf(f, "\nFFT job size padding: up to %d", s->fft_pad);
+    }
 
     if(s->onetile == 1)
     {
@@ -574,6 +810,11 @@ void dw_opts_fprint(FILE *f, dw_opts * s)
         break;
     case DW_START_LP:
         fprintf(f, "Low pass filtered\n");
+        break;
+    case DW_START_PYRAMID:
+        fprintf(f, "Pyramid, %d iterations at half resolution\n",
+                s->pyramid_iter);
+        break;
     }
     return;
 }
@@ -671,7 +912,36 @@ void dw_fprint_info(FILE * f, dw_opts * s)
 
 #ifdef _OPENMP
     fprintf(f, "OpenMP: YES\n");
+#if _OPENMP >= 201511
+    {
+        const char * bind = "unknown";
+        switch(omp_get_proc_bind())
+        {
+        case omp_proc_bind_false:
+            bind = "false";
+            break;
+        case omp_proc_bind_true:
+            bind = "true";
+            break;
+        case omp_proc_bind_master:
+            bind = "master";
+            break;
+        case omp_proc_bind_close:
+            bind = "close";
+            break;
+        case omp_proc_bind_spread:
+            bind = "spread";
+            break;
+        }
+        const char * places = getenv("OMP_PLACES");
+        fprintf(f, "OpenMP proc_bind: %s, places: %d (OMP_PLACES=%s)\n",
+                bind, omp_get_num_places(),
+                places == NULL ? "" : places);
+    }
+#endif
 #endif
+    dw_fprint_numa(f);
+    fprintf(f, "SIMD: '%s'\n", fim_simd_name(fim_simd_get()));
 
 #ifdef OPENCL
     fprintf(f, "OpenCL: YES\n");
@@ -700,6 +970,115 @@ void dw_fprint_info(FILE * f, dw_opts * s)
     return;
 }
 
+/* Set s->outFile, s->outFolder and s->logFile based on s->imFile.
+ * out is the argument to --out, i.e., NULL, a file name or a folder */
+static void dw_set_outfile(dw_opts * s, const char * out)
+{
+    free(s->outFile);
+    s->outFile = NULL;
+    free(s->outFolder);
+    s->outFolder = NULL;
+
+    if(out == NULL)
+    {
+        s->outFile = dw_prefix_file(s->imFile, s->prefix);
+
+        char * dname = dw_dirname(s->imFile);
+        s->outFolder = malloc(strlen(dname) + 16);
+        assert(s->outFolder != NULL);
+        sprintf(s->outFolder, "%s%c", dname, FILESEP);
+        free(dname);
+        if(s->verbosity > 1)
+        {
+            printf("outFile: %s, outFolder: %s\n", s->outFile, s->outFolder);
+        }
+    } else {
+        if( dw_isdir(out) )
+        {
+            if(s->verbosity > 0 && s->batchFile == NULL)
+            {
+                printf("--out describes a folder");
+            }
+            s->outFolder = malloc(strlen(out) + 8);
+            assert(s->outFolder != NULL);
+            sprintf(s->outFolder, "%s%c", out, FILESEP);
+            char * basename = dw_basename(s->imFile);
+            char * outfile0 = malloc(strlen(basename) + strlen(s->outFolder) + 8);
+            assert(outfile0 != NULL);
+            sprintf(outfile0, "%s%c%s", s->outFolder, FILESEP, basename);
+            s->outFile = dw_prefix_file(outfile0, s->prefix);
+            free(outfile0);
+            free(basename);
+        } else {
+            s->outFile = strdup(out);
+            assert(s->outFile != NULL);
+            char * dname = dw_dirname(s->outFile);
+            s->outFolder = malloc(strlen(dname) + 16);
+            assert(s->outFolder != NULL);
+            sprintf(s->outFolder, "%s%c", dname, FILESEP);
+            free(dname);
+        }
+    }
+
+    free(s->logFile);
+    s->logFile = malloc(strlen(s->outFile) + 10);
+    assert(s->logFile != NULL);
+    sprintf(s->logFile, "%s.log.txt", s->outFile);
+    return;
+}
+
+/* Output file for channel ch (from 0). With a single channel this is
+ * s->outFile, else "_c1", "_c2", ... is added before the extension */
+static char * dw_channel_file(const dw_opts * s, int ch)
+{
+    if(s->nChannels < 2)
+    {
+        char * outFile = strdup(s->outFile);
+        assert(outFile != NULL);
+        return outFile;
+    }
+    char suffix[32];
+    sprintf(suffix, "c%d", ch+1);
+    return dw_suffix_file(s->outFile, suffix);
+}
+
+/* Identifies the tiles processed with --tile-out, "tiles" or
+ * "tiles<a>-<b>" with --tiles a-b */
+static char * dw_tiles_tag(const dw_opts * s)
+{
+    char * tag = malloc(64);
+    assert(tag != NULL);
+    if(s->tile_first < 0)
+    {
+        sprintf(tag, "tiles");
+    } else {
+        sprintf(tag, "tiles%d-%d", s->tile_first+1, s->tile_last+1);
+    }
+    return tag;
+}
+
+/* Name of a raw copy of an input image, <base>.raw. With --tile-out
+ * several processes might work on the same image so then the tiles
+ * are included in the name as well. */
+static char * dw_raw_copy_file(const dw_opts * s, const char * base)
+{
+    char * tag = NULL;
+    if(s->tileOutDir != NULL)
+    {
+        tag = dw_tiles_tag(s);
+    }
+    char * name = malloc(strlen(base) + 80);
+    assert(name != NULL);
+    if(tag != NULL)
+    {
+        sprintf(name, "%s.%s.raw", base, tag);
+    } else {
+        sprintf(name, "%s.raw", base);
+    }
+    free(tag);
+    return name;
+}
+
 static void
 getCmdLine(int argc, char ** argv, dw_opts * s)
 {
@@ -724,6 +1103,79 @@ getCmdLine(int argc, char ** argv, dw_opts * s)
 }
 
 
+/* Parse a size in bytes with an optional suffix K, M, G or T
+ * (powers of 1024), returns 0 on failure */
+static size_t dw_parse_size(const char * str)
+{
+    char * end = NULL;
+    double v = strtod(str, &end);
+    if(end == str || v <= 0)
+    {
+        return 0;
+    }
+    switch(toupper(*end))
+    {
+    case 'T':
+        v *= 1024;
+        /* fall through */
+    case 'G':
+        v *= 1024;
+        /* fall through */
+    case 'M':
+        v *= 1024;
+        /* fall through */
+    case 'K':
+        v *= 1024;
+        end++;
+        break;
+    case '\0':
+        break;
+    default:
+        return 0;
+    }
+    if(*end == 'B' || *end == 'b')
+    {
+        end++;
+    }
+    if(*end != '\0')
+    {
+        return 0;
+    }
+    return (size_t) v;
+}
+
+/* Codes for the options that have no short version */
+enum {
+    DW_OPT_BATCH = 256,
+    DW_OPT_TILE_WORKERS,
+    DW_OPT_NO_MMAP,
+    DW_OPT_TILESIZE_Z,
+    DW_OPT_TILEPAD_Z,
+    DW_OPT_MAX_MEM,
+    DW_OPT_FFT_PAD,
+    DW_OPT_STORAGE,
+    DW_OPT_STORAGE_MOMENTUM,
+    DW_OPT_TILE_RELERROR,
+    DW_OPT_TILE_MINITER,
+    DW_OPT_TILE_SKIP_BG,
+    DW_OPT_START,
+    DW_OPT_PYRAMID_ITER,
+    DW_OPT_CHECKPOINT,
+    DW_OPT_CHECKPOINT_TIME,
+    DW_OPT_RESUME,
+    DW_OPT_TILES,
+    DW_OPT_TILE_OUT,
+    DW_OPT_ERROR_EVERY,
+    DW_OPT_ERROR_SAMPLE,
+    DW_OPT_ACCEL,
+    DW_OPT_ACCEL_WINDOW,
+    DW_OPT_FIRST_TOUCH,
+    DW_OPT_BIND,
+    DW_OPT_POOL,
+    DW_OPT_STACK2D,
+    DW_OPT_TRACE
+};
+
 void dw_argparsing(int argc, char ** argv, dw_opts * s)
 {
 
@@ -778,6 +1230,34 @@ void dw_argparsing(int argc, char ** argv, dw_opts * s)
         { "psigma",    required_argument, NULL,  'Q' },
         { "expe1",     no_argument,       NULL,  'X' },
         { "cz",        required_argument, NULL,  'Z' },
+        { "batch",     required_argument, NULL, DW_OPT_BATCH },
+        { "tile-workers", required_argument, NULL, DW_OPT_TILE_WORKERS },
+        { "no-mmap",   no_argument,       NULL, DW_OPT_NO_MMAP },
+        { "tilesize-z", required_argument, NULL, DW_OPT_TILESIZE_Z },
+        { "tilepad-z", required_argument, NULL, DW_OPT_TILEPAD_Z },
+        { "max-mem",   required_argument, NULL, DW_OPT_MAX_MEM },
+        { "fft-pad",   required_argument, NULL, DW_OPT_FFT_PAD },
+        { "storage",   required_argument, NULL, DW_OPT_STORAGE },
+        { "storage-momentum", no_argument, NULL, DW_OPT_STORAGE_MOMENTUM },
+        { "tile-relerror", required_argument, NULL, DW_OPT_TILE_RELERROR },
+        { "tile-miniter", required_argument, NULL, DW_OPT_TILE_MINITER },
+        { "tile-skip-bg", required_argument, NULL, DW_OPT_TILE_SKIP_BG },
+        { "start",     required_argument, NULL, DW_OPT_START },
+        { "pyramid-iter", required_argument, NULL, DW_OPT_PYRAMID_ITER },
+        { "checkpoint", required_argument, NULL, DW_OPT_CHECKPOINT },
+        { "checkpoint-time", required_argument, NULL, DW_OPT_CHECKPOINT_TIME },
+        { "resume",    no_argument, NULL, DW_OPT_RESUME },
+        { "tiles",     required_argument, NULL, DW_OPT_TILES },
+        { "tile-out",  required_argument, NULL, DW_OPT_TILE_OUT },
+        { "error-every", required_argument, NULL, DW_OPT_ERROR_EVERY },
+        { "error-sample", required_argument, NULL, DW_OPT_ERROR_SAMPLE },
+        { "accel",     required_argument, NULL, DW_OPT_ACCEL },
+        { "accel-window", required_argument, NULL, DW_OPT_ACCEL_WINDOW },
+        { "first-touch", no_argument, NULL, DW_OPT_FIRST_TOUCH },
+        { "bind",      required_argument, NULL, DW_OPT_BIND },
+        { "pool",      no_argument, NULL, DW_OPT_POOL },
+        { "stack2d",   required_argument, NULL, DW_OPT_STACK2D },
+        { "trace",     required_argument, NULL, DW_OPT_TRACE },
         { NULL,           0,                 NULL,   0   }
     };
 
@@ -1013,83 +1493,429 @@ void dw_argparsing(int argc, char ** argv, dw_opts * s)
         case 'Z':
             s->zcrop = atoi(optarg);
             break;
-        default:
-            fprintf(stderr, "dw got an unknown command line argument. Exiting!\n");
-            exit(EXIT_FAILURE);
-        }
-    }
-
-
-    if(s->offset < 0)
-    {
-        printf("WARNING: A negative offset not allowed, setting it to 0\n");
-        s->offset = 0;
-    }
-
-    if(s->zcrop < 0)
-    {
-        fprintf(stderr,
-                "the zcrop value (--cz) can not be negative\n");
-        exit(EXIT_FAILURE);
-    }
-
-    if(s->zcrop > 0)
-    {
-        if(s->auto_zcrop > 0)
-        {
-            fprintf(stderr, "zcrop and auto_zcrop can not be combined\n");
-            exit(EXIT_FAILURE);
-        }
-        if(s->tiling_maxSize > 0)
-        {
-            fprintf(stderr, "zcrop can not be combined with tiling\n");
-        }
-    }
-
-    if( (s->auto_zcrop > 0) && (s->tiling_maxSize > 0))
-    {
-        fprintf(stderr, "auto_zcrop can not be combined with tiling\n");
-        exit(EXIT_FAILURE);
-    }
-
-    if(use_gpu)
-    {
-#ifdef OPENCL
-        if(s->method == DW_METHOD_SHB)
+        case DW_OPT_NO_MMAP:
+            s->tiling_mmap = 0;
+            break;
+        case DW_OPT_TILESIZE_Z:
+            s->tiling_maxSizeP = atoi(optarg);
+            break;
+        case DW_OPT_TILEPAD_Z:
+            s->tiling_paddingP = atoi(optarg);
+            if(s->tiling_paddingP < 0)
+            {
+                fprintf(stderr, "--tilepad-z can not be negative\n");
+                exit(EXIT_FAILURE);
+            }
+            break;
+        case DW_OPT_STORAGE:
         {
-            s->method = DW_METHOD_SHBCL2;
-            s->fun = &deconvolve_shb_cl2;
+            int type = fim_dtype_parse(optarg);
+            if(type < 0)
+            {
+                fprintf(stderr, "--storage should be fp32, fp16 or bf16\n");
+                exit(EXIT_FAILURE);
+            }
+            s->storage = type;
+            break;
         }
-#else
-        printf("WARNING: dw was not compiled with GPU support\n");
+        case DW_OPT_STORAGE_MOMENTUM:
+            s->storage_momentum = 1;
+            break;
+        case DW_OPT_FFT_PAD:
+            s->fft_pad = atoi(optarg);
+            if(s->fft_pad < 0)
+            {
+                fprintf(stderr, "--fft-pad can not be negative\n");
+                exit(EXIT_FAILURE);
+            }
+            break;
+        case DW_OPT_MAX_MEM:
+            s->max_mem = dw_parse_size(optarg);
+            if(s->max_mem == 0)
+            {
+                fprintf(stderr, "Could not parse --max-mem %s\n", optarg);
+                exit(EXIT_FAILURE);
+            }
+            break;
+        case DW_OPT_TILE_WORKERS:
+            if(strcmp(optarg, "auto") == 0)
+            {
+                s->tile_workers = 0;
+            } else {
+                s->tile_workers = atoi(optarg);
+                if(s->tile_workers < 1)
+                {
+                    fprintf(stderr, "--tile-workers should be a positive number or auto\n");
+                    exit(EXIT_FAILURE);
+                }
+            }
+            break;
+        case DW_OPT_TILE_RELERROR:
+            s->tile_relerror = atof(optarg);
+            if(s->tile_relerror <= 0)
+            {
+                fprintf(stderr, "--tile-relerror should be positive\n");
+                exit(EXIT_FAILURE);
+            }
+            break;
+        case DW_OPT_TILE_MINITER:
+            s->tile_miniter = atoi(optarg);
+            if(s->tile_miniter < 0)
+            {
+                fprintf(stderr, "--tile-miniter can't be negative\n");
+                exit(EXIT_FAILURE);
+            }
+            break;
+        case DW_OPT_TILE_SKIP_BG:
+            s->tile_skip_bg = atof(optarg);
+            break;
+        case DW_OPT_START:
+            if(strcmp(optarg, "flat") == 0)
+            {
+                s->start_condition = DW_START_FLAT;
+            } else if(strcmp(optarg, "id") == 0)
+            {
+                s->start_condition = DW_START_IDENTITY;
+            } else if(strcmp(optarg, "lp") == 0)
+            {
+                s->start_condition = DW_START_LP;
+            } else if(strcmp(optarg, "pyramid") == 0)
+            {
+                s->start_condition = DW_START_PYRAMID;
+            } else {
+                fprintf(stderr, "--start: unknown initial guess '%s', "
+                        "use flat, id, lp or pyramid\n", optarg);
+                exit(EXIT_FAILURE);
+            }
+            break;
+        case DW_OPT_PYRAMID_ITER:
+            s->pyramid_iter = atoi(optarg);
+            if(s->pyramid_iter < 1)
+            {
+                fprintf(stderr, "--pyramid-iter should be positive\n");
+                exit(EXIT_FAILURE);
+            }
+            break;
+        case DW_OPT_CHECKPOINT:
+            s->checkpoint_iter = atoi(optarg);
+            if(s->checkpoint_iter < 1)
+            {
+                fprintf(stderr, "--checkpoint should be positive\n");
+                exit(EXIT_FAILURE);
+            }
+            break;
+        case DW_OPT_CHECKPOINT_TIME:
+            s->checkpoint_time = atof(optarg);
+            if(s->checkpoint_time <= 0)
+            {
+                fprintf(stderr, "--checkpoint-time should be positive\n");
+                exit(EXIT_FAILURE);
+            }
+            break;
+        case DW_OPT_RESUME:
+            s->resume = 1;
+            break;
+        case DW_OPT_TILES:
+        {
+            /* a-b or a, numbered from 1 like in the log */
+            int a = 0, b = 0;
+            int n = sscanf(optarg, "%d-%d", &a, &b);
+            n == 1 ? b = a : 0;
+            if(n < 1 || a < 1 || b < a)
+            {
+                fprintf(stderr, "--tiles: expected a range like 1-16, got '%s'\n",
+                        optarg);
+                exit(EXIT_FAILURE);
+            }
+            s->tile_first = a-1;
+            s->tile_last = b-1;
+        }
+            break;
+        case DW_OPT_TILE_OUT:
+            free(s->tileOutDir);
+            s->tileOutDir = strdup(optarg);
+            assert(s->tileOutDir != NULL);
+            break;
+        case DW_OPT_ERROR_EVERY:
+            s->error_every = atoi(optarg);
+            if(s->error_every < 1)
+            {
+                fprintf(stderr, "--error-every should be positive\n");
+                exit(EXIT_FAILURE);
+            }
+            break;
+        case DW_OPT_ERROR_SAMPLE:
+            s->error_sample = atof(optarg);
+            if(!(s->error_sample > 0 && s->error_sample <= 1))
+            {
+                fprintf(stderr, "--error-sample should be in (0, 1]\n");
+                exit(EXIT_FAILURE);
+            }
+            break;
+        case DW_OPT_ACCEL:
+            if(strcmp(optarg, "none") == 0)
+            {
+                s->accel = DW_ACCEL_NONE;
+            } else if(strcmp(optarg, "anderson") == 0)
+            {
+                s->accel = DW_ACCEL_ANDERSON;
+            } else {
+                fprintf(stderr, "--accel: unknown method '%s', "
+                        "use none or anderson\n", optarg);
+                exit(EXIT_FAILURE);
+            }
+            break;
+        case DW_OPT_ACCEL_WINDOW:
+            s->accel_window = atoi(optarg);
+            if(s->accel_window < 1 || s->accel_window > 8)
+            {
+                fprintf(stderr, "--accel-window should be in 1-8\n");
+                exit(EXIT_FAILURE);
+            }
+            break;
+        case DW_OPT_FIRST_TOUCH:
+            s->first_touch = 1;
+            break;
+        case DW_OPT_POOL:
+            s->pool = 1;
+            break;
+        case DW_OPT_STACK2D:
+            s->stack2d = atoi(optarg);
+            if(s->stack2d < 1)
+            {
+                fprintf(stderr, "--stack2d should be at least 1\n");
+                exit(EXIT_FAILURE);
+            }
+            break;
+        case DW_OPT_TRACE:
+            free(s->traceFile);
+            s->traceFile = strdup(optarg);
+            assert(s->traceFile != NULL);
+            break;
+        case DW_OPT_BIND:
+            if(strcmp(optarg, "close") == 0)
+            {
+                s->bind = "close";
+            } else if(strcmp(optarg, "spread") == 0)
+            {
+                s->bind = "spread";
+            } else {
+                fprintf(stderr, "--bind: unknown type '%s', "
+                        "use close or spread\n", optarg);
+                exit(EXIT_FAILURE);
+            }
+            break;
+        case DW_OPT_BATCH:
+            free(s->batchFile);
+            s->batchFile = strdup(optarg);
+            assert(s->batchFile != NULL);
+            break;
+        default:
+            fprintf(stderr, "dw got an unknown command line argument. Exiting!\n");
+            exit(EXIT_FAILURE);
+        }
+    }
+
+
+    if(s->offset < 0)
+    {
+        printf("WARNING: A negative offset not allowed, setting it to 0\n");
+        s->offset = 0;
+    }
+
+    if(s->zcrop < 0)
+    {
+        fprintf(stderr,
+                "the zcrop value (--cz) can not be negative\n");
+        exit(EXIT_FAILURE);
+    }
+
+    if(s->zcrop > 0)
+    {
+        if(s->auto_zcrop > 0)
+        {
+            fprintf(stderr, "zcrop and auto_zcrop can not be combined\n");
+            exit(EXIT_FAILURE);
+        }
+        if(s->tiling_maxSize > 0 || s->tiling_maxSizeP > 0)
+        {
+            fprintf(stderr, "zcrop can not be combined with tiling\n");
+        }
+    }
+
+    if( (s->auto_zcrop > 0) && (s->tiling_maxSize > 0 || s->tiling_maxSizeP > 0))
+    {
+        fprintf(stderr, "auto_zcrop can not be combined with tiling\n");
+        exit(EXIT_FAILURE);
+    }
+
+    if(use_gpu)
+    {
+#ifdef OPENCL
+        if(s->method == DW_METHOD_SHB)
+        {
+            s->method = DW_METHOD_SHBCL2;
+            s->fun = &deconvolve_shb_cl2;
+        }
+#else
+        printf("WARNING: dw was not compiled with GPU support\n");
 #endif
     }
 
-    /* Take care of the positional arguments */
-    if(optind + 2 != argc)
+    if(s->storage_momentum && s->storage == FIM_FP32)
+    {
+        fprintf(stderr, "--storage-momentum requires --storage fp16 or bf16\n");
+        exit(EXIT_FAILURE);
+    }
+    if(s->storage != FIM_FP32 && s->method != DW_METHOD_SHB)
+    {
+        fprintf(stderr, "--storage can only be used with --method shb\n");
+        exit(EXIT_FAILURE);
+    }
+    if(s->storage == FIM_BF16)
+    {
+        fprintf(stderr, "WARNING: --storage bf16 keeps only 8 significant "
+                "bits of the image and the weights, the result can differ "
+                "visibly from fp32. Consider fp16\n");
+    }
+    if(s->start_condition == DW_START_PYRAMID
+       && s->method != DW_METHOD_SHB && s->method != DW_METHOD_RL)
+    {
+        fprintf(stderr, "--start pyramid can only be used with "
+                "--method shb or rl\n");
+        exit(EXIT_FAILURE);
+    }
+    if(s->error_sample < 1
+       && s->method != DW_METHOD_SHB && s->method != DW_METHOD_RL)
+    {
+        fprintf(stderr, "--error-sample can only be used with "
+                "--method shb or rl\n");
+        exit(EXIT_FAILURE);
+    }
+    /* The OpenMP runtime only reads OMP_PROC_BIND when loaded, so dw
+     * is started again. Nothing is done if it is already set. */
+    if(s->bind != NULL && dw_exec_with_binding(s->bind, argv))
+    {
+        fprintf(stderr, "WARNING: --bind is not supported on this system, "
+                "set OMP_PROC_BIND and OMP_PLACES instead\n");
+    }
+    fim_set_first_touch(s->first_touch);
+    fim_set_pool(s->pool);
+
+    if(s->accel != DW_ACCEL_NONE)
+    {
+        if(s->method != DW_METHOD_SHB && s->method != DW_METHOD_RL)
+        {
+            fprintf(stderr, "--accel can only be used with "
+                    "--method shb or rl\n");
+            exit(EXIT_FAILURE);
+        }
+        if(s->storage_momentum)
+        {
+            fprintf(stderr, "--accel can't be combined with "
+                    "--storage-momentum\n");
+            exit(EXIT_FAILURE);
+        }
+    }
+    if(s->stack2d > 0)
+    {
+        if(s->batchFile == NULL)
+        {
+            fprintf(stderr, "--stack2d can only be used with --batch\n");
+            exit(EXIT_FAILURE);
+        }
+        if(s->method != DW_METHOD_SHB && s->method != DW_METHOD_RL
+           && s->method != DW_METHOD_ID)
+        {
+            fprintf(stderr, "--stack2d can only be used with "
+                    "--method shb, rl or id\n");
+            exit(EXIT_FAILURE);
+        }
+        /* These would mix the images of a stack */
+        if(s->start_condition == DW_START_LP
+           || s->start_condition == DW_START_PYRAMID)
+        {
+            fprintf(stderr, "--stack2d can't be combined with "
+                    "--start lp or pyramid\n");
+            exit(EXIT_FAILURE);
+        }
+        if(s->accel != DW_ACCEL_NONE)
+        {
+            fprintf(stderr, "--stack2d can't be combined with --accel\n");
+            exit(EXIT_FAILURE);
+        }
+    }
+    if(s->tile_first >= 0 && s->tileOutDir == NULL)
+    {
+        fprintf(stderr, "--tiles requires --tile-out\n");
+        exit(EXIT_FAILURE);
+    }
+    if(s->tileOutDir != NULL)
+    {
+        /* All processes have to use the same tiling, hence no
+         * automatic tiling */
+        if(s->tiling_maxSize <= 0 && s->tiling_maxSizeP <= 0)
+        {
+            fprintf(stderr, "--tile-out requires --tilesize or --tilesize-z\n");
+            exit(EXIT_FAILURE);
+        }
+        if(s->batchFile != NULL)
+        {
+            fprintf(stderr, "--tile-out can't be used with --batch\n");
+            exit(EXIT_FAILURE);
+        }
+        if(!dw_isdir(s->tileOutDir))
+        {
+            fprintf(stderr, "--tile-out: %s is not a folder\n", s->tileOutDir);
+            exit(EXIT_FAILURE);
+        }
+    }
+    if((dw_checkpoint_enabled(s) || s->resume)
+       && s->method != DW_METHOD_SHB && s->method != DW_METHOD_RL)
+    {
+        fprintf(stderr, "--checkpoint, --checkpoint-time and --resume can "
+                "only be used with --method shb or rl\n");
+        exit(EXIT_FAILURE);
+    }
+
+    /* Take care of the positional arguments,
+     * with --batch the images are listed in a separate file.
+     * With more than one PSF the image has one channel per PSF */
+    int nPositional = 2;
+    if(s->batchFile != NULL)
+    {
+        nPositional = 1;
+    }
+    if(optind + nPositional > argc
+       || (s->batchFile != NULL && optind + nPositional != argc))
     {
         printf("Deconwolf: To few input arguments.\n");
         printf("See `%s --help` or `man dw`.\n", argv[0]);
         exit(1);
     }
+    s->nChannels = argc - optind - nPositional + 1;
 
+    if(s->batchFile == NULL)
+    {
 #ifdef WINDOWS
-    /* TODO, see GetFullPathNameA in fileapi.h */
-    s->imFile = strdup(argv[optind]);
+        /* TODO, see GetFullPathNameA in fileapi.h */
+        s->imFile = strdup(argv[optind]);
 #else
-    s->imFile = realpath(argv[optind], 0);
+        s->imFile = realpath(argv[optind], 0);
 #endif
 
-    if(s->imFile == NULL)
-    {
-        fprintf(stderr, "ERROR: Can't read %s\n", argv[optind]);
-        exit(1);
+        if(s->imFile == NULL)
+        {
+            fprintf(stderr, "ERROR: Can't read %s\n", argv[optind]);
+            exit(1);
+        }
+        optind++;
     }
 
 #ifdef WINDOWS
-    s->psfFile = strdup(argv[++optind]);
+    s->psfFile = strdup(argv[optind]);
 #else
-    s->psfFile = realpath(argv[++optind], 0);
+    s->psfFile = realpath(argv[optind], 0);
 #endif
 
     if(s->psfFile == NULL)
@@ -1098,57 +1924,96 @@ void dw_argparsing(int argc, char ** argv, dw_opts * s)
         exit(1);
     }
 
+    if(s->nChannels > 1)
+    {
+        s->psfFiles = calloc(s->nChannels, sizeof(char*));
+        assert(s->psfFiles != NULL);
+        s->psfFiles[0] = s->psfFile;
+        for(int kk = 1; kk < s->nChannels; kk++)
+        {
+#ifdef WINDOWS
+            s->psfFiles[kk] = strdup(argv[optind+kk]);
+#else
+            s->psfFiles[kk] = realpath(argv[optind+kk], 0);
+#endif
+            if(s->psfFiles[kk] == NULL)
+            {
+                fprintf(stderr, "ERROR: Can't read %s\n", argv[optind+kk]);
+                exit(1);
+            }
+        }
+        if(s->refFile != NULL || s->flatfieldFile != NULL)
+        {
+            fprintf(stderr, "ERROR: --ref and --flatfield can't be used "
+                    "with more than one channel\n");
+            exit(EXIT_FAILURE);
+        }
+        if(s->zcrop > 0 || s->auto_zcrop > 0)
+        {
+            fprintf(stderr, "ERROR: --zcrop and --auto-zcrop can't be used "
+                    "with more than one channel\n");
+            exit(EXIT_FAILURE);
+        }
+    }
+
 
-    /* Set s->outFile and s->outFolder based on s->imFile */
-    if(s->outFile == NULL)
+    if(s->batchFile == NULL)
     {
-        s->outFile = dw_prefix_file(s->imFile, s->prefix);
+        /* Set s->outFile and s->outFolder based on s->imFile */
+        char * out = s->outFile;
+        s->outFile = NULL;
+        dw_set_outfile(s, out);
+        free(out);
 
-        char * dname = dw_dirname(s->imFile);
-        s->outFolder = malloc(strlen(dname) + 16);
-        assert(s->outFolder != NULL);
-        sprintf(s->outFolder, "%s%c", dname, FILESEP);
-        free(dname);
-        if(s->verbosity > 1)
+        if(s->tileOutDir != NULL)
         {
-            printf("outFile: %s, outFolder: %s\n", s->outFile, s->outFolder);
+            /* One log file per process, next to the tiles */
+            char * base = dw_basename(s->outFile);
+            char * tag = dw_tiles_tag(s);
+            free(s->logFile);
+            s->logFile = malloc(strlen(s->tileOutDir) + strlen(base)
+                                + strlen(tag) + 16);
+            assert(s->logFile != NULL);
+            sprintf(s->logFile, "%s%c%s.%s.log.txt",
+                    s->tileOutDir, FILESEP, base, tag);
+            free(tag);
+            free(base);
         }
-    } else {
-        if( dw_isdir(s->outFile) )
+
+        /* With --tile-out the output is written by dw merge-tiles */
+        if(! s->iterdump && s->overwrite == 0 && s->tileOutDir == NULL)
         {
-            if(s->verbosity > 0)
+            /* With several channels, stop if all outputs exist */
+            int nExist = 0;
+            char * outFile = NULL;
+            for(int kk = 0; kk < s->nChannels; kk++)
             {
-                printf("--out describes a folder");
+                free(outFile);
+                outFile = dw_channel_file(s, kk);
+                nExist += dw_isfile(outFile);
             }
-            free(s->outFolder);
-            s->outFolder = malloc(strlen(s->outFile) + 8);
-            assert(s->outFolder != NULL);
-            sprintf(s->outFolder, "%s%c", s->outFile, FILESEP);
-            free(s->outFile);
-            char * basename = dw_basename(s->imFile);
-            char * outfile0 = malloc(strlen(basename) + strlen(s->outFolder) + 8);
-            assert(outfile0 != NULL);
-            sprintf(outfile0, "%s%c%s", s->outFolder, FILESEP, basename);
-            s->outFile = dw_prefix_file(outfile0, s->prefix);
-            free(outfile0);
-        } else {
-            char * dname = dw_dirname(s->outFile);
-            free(s->outFolder);
-            s->outFolder = malloc(strlen(dname) + 16);
-            assert(s->outFolder != NULL);
-            sprintf(s->outFolder, "%s%c", dname, FILESEP);
-            free(dname);
+            if(nExist == s->nChannels)
+            {
+                printf("%s already exist. Use --overwrite to overwrite existing files.\n",
+                       outFile);
+                free(outFile);
+                exit(0);
+            }
+            free(outFile);
         }
-    }
-
-    if(! s->iterdump)
-    {
-        if( s->overwrite == 0 && dw_isfile(s->outFile))
+    } else {
+        /* The output names are set per image by dw_run_batch, --out
+         * can only be used to specify a folder */
+        s->batchOut = s->outFile;
+        s->outFile = NULL;
+        if(s->batchOut != NULL && !dw_isdir(s->batchOut))
         {
-            printf("%s already exist. Use --overwrite to overwrite existing files.\n",
-                   s->outFile);
-            exit(0);
+            fprintf(stderr, "ERROR: With --batch, --out has to be an existing folder\n");
+            exit(EXIT_FAILURE);
         }
+        s->logFile = malloc(strlen(s->batchFile) + 10);
+        assert(s->logFile != NULL);
+        sprintf(s->logFile, "%s.log.txt", s->batchFile);
     }
 
     if(s->nThreads_FFT < 1 || s->nThreads_OMP < 1)
@@ -1158,11 +2023,6 @@ void dw_argparsing(int argc, char ** argv, dw_opts * s)
         exit(EXIT_FAILURE);
     }
 
-    s->logFile = malloc(strlen(s->outFile) + 10);
-    assert(s->logFile != NULL);
-    sprintf(s->logFile, "%s.log.txt", s->outFile);
-
-
 
     if(s->tsvFile != NULL)
     {
@@ -1175,8 +2035,16 @@ void dw_argparsing(int argc, char ** argv, dw_opts * s)
         fprintf(s->tsv, "iteration\ttime\tKL\n");
     }
 
-    /* Set the plan to be used with fftw3 */
-    fft_set_plan(s->fftw3_planning);
+    if(s->traceFile != NULL)
+    {
+        if(dw_trace_start(s->traceFile))
+        {
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    /* Set the plan to be used with fftw3 */
+    fft_set_plan(s->fftw3_planning);
     fft_set_inplace(s->fft_inplace);
     if(s->verbosity > 2)
     {
@@ -1185,14 +2053,350 @@ void dw_argparsing(int argc, char ** argv, dw_opts * s)
 }
 
 
+/* Returns 1 if an image of size [M x N x P] should be processed in
+ * tiles, see --tilesize and --tilesize-z */
+static int dw_tiling_needed(const dw_opts * s, int64_t M, int64_t N, int64_t P)
+{
+    if(s->tiling_maxSize > 0 && (M > s->tiling_maxSize || N > s->tiling_maxSize))
+    {
+        return 1;
+    }
+    if(s->tiling_maxSizeP > 0 && P > s->tiling_maxSizeP)
+    {
+        return 1;
+    }
+    return 0;
+}
+
+/* The smallest job size for the border handling, see dw_job_size */
+static void dw_job_size_min(const dw_opts * s,
+                            int64_t M, int64_t N, int64_t P,
+                            int64_t pM, int64_t pN, int64_t pP,
+                            int64_t * wM, int64_t * wN, int64_t * wP)
+{
+    *wM = M + pM -1;
+    *wN = N + pN -1;
+    *wP = P + pP -1;
+
+    if(s->borderQuality == 1)
+    {
+        *wM = M + (pM+1)/2;
+        *wN = N + (pN+1)/2;
+        *wP = P + (pP+1)/2;
+    }
+
+    if(s->borderQuality == 0)
+    {
+        *wM = int64_t_max(M, pM);
+        *wN = int64_t_max(N, pN);
+        *wP = int64_t_max(P, pP);
+    }
+
+    /* A stack of 2D images, see --stack2d. The planes are
+     * transformed one by one so there is nothing to pad along z. */
+    if(fft_get_batch2d())
+    {
+        *wP = P;
+    }
+    return;
+}
+
+/* The largest job size that dw_job_size can return. Used for the
+ * memory estimates since planning could require measurements. */
+static void dw_job_size_max(const dw_opts * s,
+                            int64_t M, int64_t N, int64_t P,
+                            int64_t pM, int64_t pN, int64_t pP,
+                            int64_t * wM, int64_t * wN, int64_t * wP)
+{
+    dw_job_size_min(s, M, N, P, pM, pN, pP, wM, wN, wP);
+    if(s->fft_pad > 0 && s->borderQuality > 0)
+    {
+        *wM > 1 ? *wM += s->fft_pad : 0;
+        *wN > 1 ? *wN += s->fft_pad : 0;
+        *wP > 1 && !fft_get_batch2d() ? *wP += s->fft_pad : 0;
+    }
+    return;
+}
+
+void dw_job_size(const dw_opts * s,
+                 int64_t M, int64_t N, int64_t P,
+                 int64_t pM, int64_t pN, int64_t pP,
+                 int64_t * wM, int64_t * wN, int64_t * wP)
+{
+    dw_job_size_min(s, M, N, P, pM, pN, pP, wM, wN, wP);
+
+    /* Without boundary handling the job size is the period of the
+     * image and can't be changed */
+    if(s->fft_pad > 0 && s->borderQuality > 0)
+    {
+        int64_t one = 1;
+        fft_plan_size(wM, wN, fft_get_batch2d() ? &one : wP,
+                      s->fft_pad, s->verbosity, s->log);
+    }
+    return;
+}
+
+size_t dw_estimate_memory(const dw_opts * s,
+                          int64_t M, int64_t N, int64_t P,
+                          int64_t pM, int64_t pN, int64_t pP)
+{
+    /* The PSF is cropped to the image size, see psf_autocrop_byImage */
+    if(s->borderQuality == 0)
+    {
+        pM = int64_t_min(pM, M);
+        pN = int64_t_min(pN, N);
+        pP = int64_t_min(pP, P);
+    } else {
+        pM = int64_t_min(pM, 2*M-1);
+        pN = int64_t_min(pN, 2*N-1);
+        pP = int64_t_min(pP, 2*P-1);
+    }
+
+    int64_t wM = 0, wN = 0, wP = 0;
+    dw_job_size_max(s, M, N, P, pM, pN, pP, &wM, &wN, &wP);
+
+    /* One real and one Hermitian array of the job size */
+    const size_t R = (size_t) wM*wN*wP*sizeof(float);
+    const size_t C = (size_t) (wM/2+1)*wN*wP*sizeof(fftwf_complex);
+
+    /* Input image and PSF */
+    size_t total = (size_t) M*N*P*sizeof(float)
+        + (size_t) pM*pN*pP*sizeof(float);
+    /* Transfer function and Bertero weights, see dw_otf_get. Assumes
+     * that the PSF is not symmetric. */
+    total += C;
+    /* With --storage the weights use 2 bytes per voxel, and so does
+     * a copy of the input image */
+    const int lowp = s->storage != FIM_FP32;
+    if(s->borderQuality > 0)
+    {
+        total += lowp ? R/2 : R;
+    }
+    if(lowp)
+    {
+        total += (size_t) M*N*P*sizeof(uint16_t);
+    }
+    /* Current and previous guess */
+    total += (lowp && s->storage_momentum) ? R + R/2 : 2*R;
+    /* During iter_shb/iter_rl: the guess and its transform */
+    total += R + C;
+    /* History of --accel */
+    total += (size_t) dw_accel_nvolumes(s)*R;
+    /* The out of place transforms have both input and output
+     * allocated at the same time */
+    if(s->fft_inplace == 0)
+    {
+        total += R;
+    }
+    return total;
+}
+
+/* Estimated peak memory in bytes when the image is processed in tiles
+ * of at most [maxSize x maxSize x maxSizeP], see deconvolve_tiles. */
+static size_t dw_estimate_tiled_memory(const dw_opts * s,
+                                       int64_t M, int64_t N, int64_t P,
+                                       int64_t pM, int64_t pN, int64_t pP,
+                                       int64_t maxSize, int64_t maxSizeP)
+{
+    int64_t tM = int64_t_min(M, maxSize + 2*s->tiling_padding);
+    int64_t tN = int64_t_min(N, maxSize + 2*s->tiling_padding);
+    int64_t tP = P;
+    if(maxSizeP > 0)
+    {
+        tP = int64_t_min(P, maxSizeP + 2*s->tiling_paddingP);
+    }
+    pM = int64_t_min(pM, 2*tM-1);
+    pN = int64_t_min(pN, 2*tN-1);
+    pP = int64_t_min(pP, 2*tP-1);
+    int64_t wM = 0, wN = 0, wP = 0;
+    dw_job_size_max(s, tM, tN, tP, pM, pN, pP, &wM, &wN, &wP);
+    const size_t R = (size_t) wM*wN*wP*sizeof(float);
+    const size_t C = (size_t) (wM/2+1)*wN*wP*sizeof(fftwf_complex);
+    const size_t tile = (size_t) tM*tN*tP*sizeof(float);
+
+    int K = s->tile_workers > 1 ? s->tile_workers : 1;
+    size_t total = K*dw_estimate_memory(s, tM, tN, tP, pM, pN, pP);
+    /* With several channels, the other channels of the tile that is
+     * processed, see deconvolve_tile */
+    const size_t nCh = s->nChannels > 1 ? s->nChannels : 1;
+    total += K*2*(nCh-1)*tile;
+    /* Transfer functions for other tile sizes and channels kept in
+     * the cache */
+    total += (nCh*DW_OTF_CACHE_SIZE-1)*(C + (s->borderQuality > 0 ? R : 0));
+    /* The tile being read and the tile being written */
+    total += 2*nCh*tile;
+    return total;
+}
+
+/* Estimated peak memory in bytes with the current settings */
+static size_t dw_estimate_current(const dw_opts * s,
+                                  int64_t M, int64_t N, int64_t P,
+                                  int64_t pM, int64_t pN, int64_t pP)
+{
+    if(dw_tiling_needed(s, M, N, P))
+    {
+        int64_t maxSize = s->tiling_maxSize;
+        if(maxSize <= 0)
+        {
+            maxSize = int64_t_max(M, N);
+        }
+        return dw_estimate_tiled_memory(s, M, N, P, pM, pN, pP,
+                                        maxSize, s->tiling_maxSizeP);
+    }
+    return dw_estimate_memory(s, M, N, P, pM, pN, pP);
+}
+
+/* Change the settings so that the estimated peak memory fits in
+ * s->max_mem, see --max-mem. In order: in-place FFTs, tiles in x and y
+ * down to 4 x the padding and then tiles in z. Returns the estimated
+ * peak memory, in bytes, for the settings that are used. */
+static size_t dw_apply_max_mem(dw_opts * s,
+                               int64_t M, int64_t N, int64_t P,
+                               int64_t pM, int64_t pN, int64_t pP)
+{
+    size_t est = dw_estimate_current(s, M, N, P, pM, pN, pP);
+    if(s->max_mem == 0 || est <= s->max_mem)
+    {
+        return est;
+    }
+
+    if(s->fft_inplace == 0)
+    {
+        s->fft_inplace = 1;
+        fft_set_inplace(1);
+        fprintf(s->log, "--max-mem: using in-place FFTs\n");
+        est = dw_estimate_current(s, M, N, P, pM, pN, pP);
+        if(est <= s->max_mem)
+        {
+            return est;
+        }
+    }
+
+    if(s->zcrop > 0 || s->auto_zcrop > 0)
+    {
+        warning(stdout);
+        printf("--max-mem: tiling can not be combined with z-cropping, "
+               "the estimated peak memory is %.2f GB\n", est/1e9);
+        fprintf(s->log, "--max-mem: tiling can not be combined with "
+                "z-cropping\n");
+        return est;
+    }
+
+    /* Tiles are only processed one at a time unless asked for */
+    if(s->tile_workers == 0)
+    {
+        s->tile_workers = 1;
+    }
+
+    const int64_t minSize = int64_t_max(4*s->tiling_padding, 16);
+    const int64_t minSizeP = int64_t_max(4*s->tiling_paddingP, 8);
+    int64_t size = s->tiling_maxSize > 0 ? s->tiling_maxSize : int64_t_max(M, N);
+    int64_t sizeP = s->tiling_maxSizeP > 0 ? s->tiling_maxSizeP : P;
+    int found = 0;
+    while(!found)
+    {
+        if(size > minSize)
+        {
+            size = int64_t_max(minSize, (4*size)/5);
+        } else if(sizeP > minSizeP)
+        {
+            sizeP = int64_t_max(minSizeP, (4*sizeP)/5);
+        } else {
+            break;
+        }
+        est = dw_estimate_tiled_memory(s, M, N, P, pM, pN, pP,
+                                       size, sizeP < P ? sizeP : -1);
+        if(est <= s->max_mem)
+        {
+            found = 1;
+        }
+    }
+
+    s->tiling_maxSize = size;
+    s->tiling_maxSizeP = sizeP < P ? sizeP : -1;
+    /* Mapped pages count as resident memory, use plain file io */
+    s->tiling_mmap = 0;
+    fprintf(s->log, "--max-mem: using tiles of size %d, %d in z\n",
+            s->tiling_maxSize, s->tiling_maxSizeP);
+    if(s->verbosity > 0)
+    {
+        printf("--max-mem: using tiles of size %d", s->tiling_maxSize);
+        if(s->tiling_maxSizeP > 0)
+        {
+            printf(", %d in z", s->tiling_maxSizeP);
+        }
+        printf("\n");
+    }
+
+    if(!found)
+    {
+        warning(stdout);
+        printf("--max-mem: could not find settings that fit in %.2f GB, "
+               "the estimated peak memory is %.2f GB\n",
+               s->max_mem/1e9, est/1e9);
+        fprintf(s->log, "--max-mem: could not find settings that fit\n");
+    }
+    return est;
+}
+
+/* Write the estimated and the measured peak memory to the log */
+static void dw_fprint_memory(FILE * f, const dw_opts * s, size_t est)
+{
+    size_t VmPeak = 0, VmHWM = 0;
+    fprintf(f, "Estimated peak memory: %.2f GB", est/1e9);
+    if(s->max_mem > 0)
+    {
+        fprintf(f, " (--max-mem %.2f GB)", s->max_mem/1e9);
+    }
+    if(get_peakMemoryKB(&VmPeak, &VmHWM) == 0)
+    {
+        /* On macOS the peak RSS is returned in the first argument */
+        size_t peak = VmHWM > 0 ? VmHWM : VmPeak;
+        fprintf(f, ", measured: %.2f GB", peak*1024.0/1e9);
+    }
+    fprintf(f, "\n");
+}
+
+/* Make sure that the file is at least N bytes by writing the last
+ * byte. No data is written before that, on most file systems the
+ * file is sparse and reads as zeros. */
+static void fextend(FILE * fid, const char * fname, size_t N)
+{
+    if(N == 0)
+    {
+        return;
+    }
+    if(dw_fseek(fid, N-1, SEEK_SET) != 0 || fputc(0, fid) == EOF)
+    {
+        fprintf(stderr, "%s (%d): Unable to extend %s to %zu bytes\n",
+                __FILE__, __LINE__, fname, N);
+        exit(EXIT_FAILURE);
+    }
+}
+
+/* Read N floats from a raw file, see fim_to_raw */
+static float * dw_read_raw(const char * fname, size_t N)
+{
+    FILE * fid = fopen(fname, "rb");
+    if(fid == NULL)
+    {
+        fprintf(stderr, "ERROR: Can't open %s\n", fname);
+        exit(EXIT_FAILURE);
+    }
+    float * V = fim_malloc(N*sizeof(float));
+    if(fread(V, sizeof(float), N, fid) != N)
+    {
+        fprintf(stderr, "ERROR: Could not read %zu values from %s\n", N, fname);
+        exit(EXIT_FAILURE);
+    }
+    fclose(fid);
+    return V;
+}
+
 void fsetzeros(const char * fname, size_t N)
-/* Create a new file and fill it with N bytes of zeros
+/* Create a new file of N bytes of zeros
  */
 {
-    size_t bsize = 1024*1024;
-    char * buffer = malloc(bsize);
-    assert(buffer != NULL);
-    memset(buffer, 0, bsize);
     FILE * fid = fopen(fname, "wb");
     if(fid == NULL)
     {
@@ -1200,17 +2404,40 @@ void fsetzeros(const char * fname, size_t N)
                 __FILE__, __LINE__, fname);
         exit(EXIT_FAILURE);
     }
-    size_t written = 0;
-    while(written + bsize < N)
+    fextend(fid, fname, N);
+    fclose(fid);
+}
+
+/* Create a float32 npy file of size [M x N x P] with all zeros.
+ * Returns the offset to the data */
+static size_t npy_setzeros(const char * fname,
+                           int64_t M, int64_t N, int64_t P)
+{
+    int shape[3] = {P, N, M};
+    if(npio_write(fname, 3, shape, NULL, NPIO_F32, NPIO_F32) == 0)
+    {
+        fprintf(stderr, "Unable to write to %s\n", fname);
+        exit(EXIT_FAILURE);
+    }
+    npio_t * meta = npio_load_metadata(fname);
+    if(meta == NULL)
     {
-        fwrite(buffer, bsize, 1, fid);
-        written += bsize;
+        fprintf(stderr, "Unable to read from %s\n", fname);
+        exit(EXIT_FAILURE);
     }
-    //  printf("\r %zu / %zu \n", written, N); fflush(stdout);
+    size_t offset = meta->data_offset;
+    npio_free(meta);
 
-    fwrite(buffer, N-written, 1, fid);
+    FILE * fid = fopen(fname, "rb+");
+    if(fid == NULL)
+    {
+        fprintf(stderr, "%s (%d): Unable to open %s\n",
+                __FILE__, __LINE__, fname);
+        exit(EXIT_FAILURE);
+    }
+    fextend(fid, fname, offset + (size_t) M*N*P*sizeof(float));
     fclose(fid);
-    free(buffer);
+    return offset;
 }
 
 void benchmark_write(dw_opts * s, int iter, double fMSE,
@@ -1237,7 +2464,7 @@ void benchmark_write(dw_opts * s, int iter, double fMSE,
             }
         }
     }
-    free(x);
+    fim_free(x);
     struct timespec tnow;
     dw_gettime(&tnow);
     double time = clockdiff(&tnow, &s->tstart);
@@ -1273,40 +2500,6 @@ float getErrorX(const float * restrict y, const float * restrict g, const int64_
 }
 
 
-float getError_idiv(const float * restrict y, const float * restrict g,
-                    const int64_t M, const int64_t N, const int64_t P,
-                    const int64_t wM, const int64_t wN, const int64_t wP)
-{
-    /* Csiszar’s I-Divergence between the input, y, and the forward propagated
-     * current guess */
-
-    if(M > wM || N > wN || P > wP)
-    {
-        fprintf(stderr, "Something is funky with the dimensions of the images.\n");
-        exit(-1);
-    }
-    float idiv = 0;
-#pragma omp parallel for reduction(+: idiv)
-    for(int64_t c = 0; c<P; c++)
-    {
-        for(int64_t b = 0; b<N; b++)
-        {
-            for(int64_t a = 0; a<M; a++)
-            {
-                float obs =  y[a + b*wM + c*wM*wN];
-                float est = g[a + b*M + c * M*N];
-                if(est > 0)
-                {
-                    idiv += obs*logf(obs/est) - obs + est;
-                }
-            }
-        }
-    }
-
-    float idiv_mean = idiv / (float) (M*N*P);
-    return idiv_mean;
-}
-
 /* Return the "error" or distance between the input image and the
    current guess convolved with the PSF. Also known as the forward
    error */
@@ -1322,6 +2515,7 @@ float getError(const float * restrict y, const float * restrict g,
     */
 
     float error = 0;
+    DW_TRACE_BEGIN("getError");
     switch(metric)
     {
     case DW_METRIC_MSE:
@@ -1331,6 +2525,7 @@ float getError(const float * restrict y, const float * restrict g,
         error = get_fIdiv(y, g, M, N, P, wM, wN, wP);
         break;
     }
+    DW_TRACE_END("getError");
 
     return error;
 }
@@ -1384,15 +2579,9 @@ float get_fIdiv(const float * restrict y, const float * restrict g,
     {
         for(int64_t b = 0; b<N; b++)
         {
-            for(int64_t a = 0; a<M; a++)
-            {
-                double yval = y[a + b*wM + c*wM*wN];
-                double gval = g[a + b*M + c * M*N];
-                if(yval > 0 && gval > 0)
-                {
-                    I += gval*logf(gval/yval) - (gval-yval);
-                }
-            }
+            /* One row, where y has stride wM and g stride M */
+            I += fim_simd_idiv_row(y + b*wM + c*wM*wN,
+                                   g + b*M + c*M*N, M);
         }
     }
 
@@ -1455,6 +2644,8 @@ void dw_usage(__attribute__((unused)) const int argc, char ** argv, const dw_opt
 {
     printf("deconwolf: %s\n", deconwolf_version);
     printf("usage: %s [<options>] image.tif psf.tif\n", argv[0]);
+    printf("   or: %s [<options>] --batch list.txt psf.tif\n", argv[0]);
+    printf("   or: %s [<options>] image.tif psf_c1.tif psf_c2.tif ...\n", argv[0]);
 
     printf("\n");
     printf(" Options:\n");
@@ -1465,8 +2656,23 @@ void dw_usage(__attribute__((unused)) const int argc, char ** argv, const dw_opt
     printf(" --out file\n\t"
            "Specify output image name. If not set the input image will be prefixed\n\t"
            "with dw_.\n");
+    printf(" --batch list.txt\n\t"
+           "Deconvolve all images listed in list.txt, one per line, with the\n\t"
+           "same PSF. Faster than running dw once per image. If used, --out\n\t"
+           "has to be a folder.\n");
+    printf(" --stack2d B\n\t"
+           "With --batch, deconvolve up to B 2D images of the same size at\n\t"
+           "once, with batched 2D FFTs. Requires a 2D PSF\n");
     printf(" --iter N\n\t"
            "Specify the number of iterations to use (default: %d)\n", s->nIter);
+    printf(" --error-every k\n\t"
+           "Only evaluate the error every k iterations, and for the last.\n\t"
+           "Without --iter the relative error is then compared per iteration.\n\t"
+           "By default it is evaluated each iteration, or only for the last\n\t"
+           "with --iter\n");
+    printf(" --error-sample f\n\t"
+           "Estimate the error from a fixed subset of f (0 < f <= 1) of the\n\t"
+           "image rows (default: 1, all)\n");
     printf(" --gpu\n\t"
            "Use GPU processing\n");
     printf(" --cldevice n\n\t"
@@ -1483,6 +2689,39 @@ void dw_usage(__attribute__((unused)) const int argc, char ** argv, const dw_opt
     printf(" --tilepad N\n\t"
            "Sets the tiles to overlap by N voxels in tile mode \n\t"
            "(default: %d)\n", s->tiling_padding);
+    printf(" --tilesize-z N\n\t"
+           "Also divide the image into tiles along z, of at most\n\t"
+           "N planes\n");
+    printf(" --tilepad-z N\n\t"
+           "Sets the tiles to overlap by N planes along z\n\t"
+           "(default: %d)\n", s->tiling_paddingP);
+    printf(" --tile-workers K\n\t"
+           "Process K tiles at the same time, each using 1/K of the threads.\n\t"
+           "Use 'auto' to select K based on the number of threads and the\n\t"
+           "available memory (default: 1)\n");
+    printf(" --tile-relerror r\n\t"
+           "In tiled mode, stop each tile on its own when the relative\n\t"
+           "change of the error is below r. The number of iterations is\n\t"
+           "limited by --iter if given, else by --maxiter\n");
+    printf(" --tile-miniter N\n\t"
+           "Run at least N iterations per tile with --tile-relerror\n\t"
+           "(default: %d)\n", s->tile_miniter);
+    printf(" --tile-skip-bg t\n\t"
+           "In tiled mode, don't deconvolve tiles where the max of the input\n\t"
+           "is below t, they are copied to the output as they are\n");
+    printf(" --tile-out dir\n\t"
+           "Write the deconvolved tiles to the folder dir instead of\n\t"
+           "creating the output image, see dw merge-tiles --help\n");
+    printf(" --tiles a-b\n\t"
+           "With --tile-out, only process tile a to b (counted from 1).\n\t"
+           "Used to divide the tiles between processes\n");
+    printf(" --max-mem size\n\t"
+           "Keep the estimated peak memory below size, e.g. 16G or 500M.\n\t"
+           "Enables in-place FFTs and then tiling if needed\n");
+    printf(" --no-mmap\n\t"
+           "Don't use memory mapped files for tiling, use this if\n\t"
+           "the temporary files are on a file system where mmap is\n\t"
+           "slow or not supported\n");
     printf(" --prefix str\n\t"
            "Set the prefix of the output files (default: '%s')\n",
            s->prefix);
@@ -1530,6 +2769,18 @@ void dw_usage(__attribute__((unused)) const int argc, char ** argv, const dw_opt
     printf(" --lookahead N\n\t"
            "Try to do a speed-for-memory trade off by using a N pixels larger\n\t"
            "job size that is better suited for FFT.\n");
+    printf(" --storage type\n\t"
+           "Store the input image and the weights as fp16 or bf16 during the\n\t"
+           "iterations (default: fp32). Only for --method shb. bf16 is not\n\t"
+           "accurate enough for the image and the weights, the result can\n\t"
+           "differ visibly from fp32, use fp16 unless the range is needed\n");
+    printf(" --storage-momentum\n\t"
+           "With --storage, also store the difference between the last two\n\t"
+           "guesses with reduced precision instead of the previous guess\n");
+    printf(" --fft-pad N\n\t"
+           "Allow the job size to grow with up to N voxels in each dimension\n\t"
+           "when that makes the FFTs faster. The time for each size is measured\n\t"
+           "once and saved in ~/.config/deconwolf/ (default: 0, off)\n");
     printf("--method name\n\t"
            "Select what method to use. Valid options: rl, shb, shbcl2\n");
     printf("--start_id\n\t"
@@ -1538,6 +2789,38 @@ void dw_usage(__attribute__((unused)) const int argc, char ** argv, const dw_opt
            "Use the average of the input image as the initial guess. Default\n");
     printf("--start_lp\n\t"
            "Use a low passed version of the input image as the initial guess.\n");
+    printf("--start type\n\t"
+           "Initial guess: flat, id, lp or pyramid. With pyramid the first\n\t"
+           "iterations are run on a 2x downsampled image, only for shb and rl\n");
+    printf("--pyramid-iter N\n\t"
+           "Number of downsampled iterations with --start pyramid (default: %d)\n",
+           s->pyramid_iter);
+    printf("--accel type\n\t"
+           "Accelerate the iterations of shb or rl: none (default) or anderson.\n\t"
+           "With anderson the momentum of shb is not used\n");
+    printf("--accel-window m\n\t"
+           "Number of iterations used by --accel anderson (default: %d).\n\t"
+           "Uses 2m+2 extra volumes of the job size\n", s->accel_window);
+    printf("--first-touch\n\t"
+           "Let all threads zero new images, each the part it will process,\n\t"
+           "so that memory is local to the threads on NUMA systems\n");
+    printf("--pool\n\t"
+           "Recycle large buffers between iterations and tiles instead of\n\t"
+           "allocating new, using huge pages when available\n");
+    printf("--bind type\n\t"
+           "Bind the threads to the cores, close or spread. Restarts dw with\n\t"
+           "OMP_PROC_BIND=type and OMP_PLACES=cores unless already set\n");
+    printf("--trace file.json\n\t"
+           "Write a timeline of the run, with the FFTs, error, updates, tiles\n\t"
+           "and tiff I/O per thread, for https://ui.perfetto.dev\n");
+    printf("--checkpoint N\n\t"
+           "Save the state of the iterations to <output>.ckpt every N\n\t"
+           "iterations. The file is removed when done. Only for shb and rl\n");
+    printf("--checkpoint-time T\n\t"
+           "Save the state every T minutes, can be combined with --checkpoint\n");
+    printf("--resume\n\t"
+           "Continue from <output>.ckpt if it exists and was made with the\n\t"
+           "same image, PSF and settings\n");
     printf(" --noplan\n\t"
            "Don't use any planning optimization for fftw3\n");
     printf(" --no-inplace\n\t"
@@ -1548,6 +2831,8 @@ void dw_usage(__attribute__((unused)) const int argc, char ** argv, const dw_opt
     printf("Additional commands with separate help sections:\n");
     printf("   maxproj      maximum Z-projections\n");
     printf("   merge        merge individual slices to volume\n");
+    printf("   merge-tiles  combine tiles written with --tile-out\n");
+    printf("   bench        time the stages of a deconvolution\n");
 #ifdef dw_module_dots
     printf("   dots         detect dots with sub pixel precision\n");
 #endif
@@ -1656,7 +2941,7 @@ float * psf_autocrop_centerZ(float * psf, int64_t * pM, int64_t * pN, int64_t *
 
     float * psf_cropped = fim_get_cuboid(psf, m, n, p,
                                          m0, m1, n0, n1, p0, p1);
-    free(psf);
+    fim_free(psf);
     pP[0] = p1-p0+1;
     return psf_cropped;
 
@@ -1898,490 +3183,2407 @@ float * psf_autocrop(float * psf, int64_t * pM, int64_t * pN, int64_t * pP,  //
 }
 
 
-static int
-deconvolve_tiles(const int64_t M, const int64_t N, const int64_t P,
-                 const float * restrict psf, const int64_t pM, const int64_t pN, const int64_t pP,
-                 dw_opts * s)
+/* Downsample the PSF with fim_downsample2. The PSF is first padded
+ * so that the max is at an even position, then it ends up at the
+ * center of a coarse voxel and the coarse PSF is not shifted
+ * compared to the downsampled image. */
+static float * psf_downsample2(const float * psf,
+                               int64_t pM, int64_t pN, int64_t pP,
+                               int64_t * qM, int64_t * qN, int64_t * qP)
+{
+    int64_t m = 0, n = 0, p = 0;
+    fim_argmax(psf, pM, pN, pP, &m, &n, &p);
+    const int64_t oM = m % 2;
+    const int64_t oN = n % 2;
+    const int64_t oP = p % 2;
+    const int64_t M = pM + oM;
+    const int64_t N = pN + oN;
+    const int64_t P = pP + oP;
+    float * Z = fim_malloc(M*N*P*sizeof(float));
+    memset(Z, 0, M*N*P*sizeof(float));
+    for(int64_t pp = 0; pp < pP; pp++)
+    {
+        for(int64_t nn = 0; nn < pN; nn++)
+        {
+            memcpy(Z + (pp+oP)*M*N + (nn+oN)*M + oM,
+                   psf + pp*pM*pN + nn*pM,
+                   pM*sizeof(float));
+        }
+    }
+    float * D = fim_downsample2(Z, M, N, P, qM, qN, qP, 0);
+    fim_free(Z);
+    fim_normalize_sum1(D, qM[0], qN[0], qP[0]);
+    return D;
+}
+
+float * dw_pyramid_start(const float * im, int64_t M, int64_t N, int64_t P,
+                         const float * psf, int64_t pM, int64_t pN, int64_t pP,
+                         dw_opts * s)
 {
+    struct timespec t0, t1;
+    dw_gettime(&t0);
 
-    tiling * T = tiling_create(M,N,P, s->tiling_maxSize, s->tiling_padding);
-    if( T == NULL)
+    /* The edges are repeated to not get a dark border */
+    int64_t M2 = 0, N2 = 0, P2 = 0;
+    float * im2 = fim_downsample2(im, M, N, P, &M2, &N2, &P2, 1);
+    int64_t qM = 0, qN = 0, qP = 0;
+    float * psf2 = psf_downsample2(psf, pM, pN, pP, &qM, &qN, &qP);
+
+    if(s->verbosity > 0)
     {
-        fprintf(stderr, "Tiling failed, please check your settings\n");
-        exit(1);
+        printf("Pyramid start: %d iterations at [%" PRId64 " x %" PRId64
+               " x %" PRId64 "]\n", s->pyramid_iter, M2, N2, P2);
     }
+    fprintf(s->log, "Pyramid start: %d iterations at [%" PRId64 " x %" PRId64
+            " x %" PRId64 "]\n", s->pyramid_iter, M2, N2, P2);
+
+    /* Nothing that depends on the full size, i.e. no reference image,
+     * tsv output, iteration dumps or cached transfer functions */
+    dw_opts s2 = *s;
+    s2.start_condition = DW_START_FLAT;
+    s2.iter_type = DW_ITER_FIXED;
+    s2.nIter = s->pyramid_iter;
+    s2.miniter = 0;
+    s2.iter_done = NULL;
+    s2.iterdump = 0;
+    s2.fulldump = 0;
+    s2.ref = NULL;
+    s2.tsv = NULL;
+    s2.otf_cache = NULL;
+    s2.checkpoint_iter = 0;
+    s2.checkpoint_time = 0;
+    s2.resume = 0;
+
+    /* psf2 is freed by s->fun */
+    float * x2 = s->fun(im2, M2, N2, P2, psf2, qM, qN, qP, &s2);
+    fim_free(im2);
+
+    float * x = fim_upsample2(x2, M2, N2, P2, M, N, P);
+    fim_free(x2);
+
+    dw_gettime(&t1);
+    fprintf(s->log, "Pyramid start took %.2f s\n", timespec_diff(&t1, &t0));
+    return x;
+}
 
-    if( T->nTiles == 1)
+/* Zero pad the PSFs to a common size, the largest along each
+ * dimension, so that all channels get the same job size and hence
+ * can share the FFTW plans and the buffers. The PSFs are replaced and
+ * pdims updated. */
+static void psf_pad_common(float ** psf, int64_t * pdims, int nCh)
+{
+    int64_t M = 0, N = 0, P = 0;
+    for(int cc = 0; cc < nCh; cc++)
     {
-        fprintf(stderr, "\n"
-                "ERROR: Only one tile! Please omit the `--tilesize` parameter if "
-                "that is what you intended to to or decrease the value if you "
-                "want to process the image in tiles."
-                "\n\n");
-        exit(1);
+        M = int64_t_max(M, pdims[3*cc]);
+        N = int64_t_max(N, pdims[3*cc+1]);
+        P = int64_t_max(P, pdims[3*cc+2]);
+    }
+
+    for(int cc = 0; cc < nCh; cc++)
+    {
+        const int64_t pM = pdims[3*cc];
+        const int64_t pN = pdims[3*cc+1];
+        const int64_t pP = pdims[3*cc+2];
+        if(pM == M && pN == N && pP == P)
+        {
+            continue;
+        }
+        /* Centered, the exact position does not matter since the
+         * max is shifted to the origin by dw_otf_get */
+        const int64_t oM = (M-pM)/2;
+        const int64_t oN = (N-pN)/2;
+        const int64_t oP = (P-pP)/2;
+        float * Z = fim_malloc(M*N*P*sizeof(float));
+        memset(Z, 0, M*N*P*sizeof(float));
+        for(int64_t pp = 0; pp < pP; pp++)
+        {
+            for(int64_t nn = 0; nn < pN; nn++)
+            {
+                memcpy(Z + (pp+oP)*M*N + (nn+oN)*M + oM,
+                       psf[cc] + pp*pM*pN + nn*pM,
+                       pM*sizeof(float));
+            }
+        }
+        fim_free(psf[cc]);
+        psf[cc] = Z;
+        pdims[3*cc] = M;
+        pdims[3*cc+1] = N;
+        pdims[3*cc+2] = P;
+    }
+    return;
+}
+
+/* Deconvolve tile tt of T, one image per channel. The tiles in im
+ * are freed and replaced by the deconvolved tiles. The number of
+ * iterations used per channel is written to iters, -1 for tiles
+ * that were only copied, see --tile-skip-bg. */
+static void deconvolve_tile(tiling * T, int tt, float ** im,
+                            int nCh, float ** psf, const int64_t * pdims,
+                            int * iters, dw_opts * s)
+{
+    if(s->verbosity > 0)
+    {
+        printf("-> Processing tile %d / %d\n", tt+1, T->nTiles);
+        fprintf(s->log, "-> Processing tile %d / %d\n", tt+1, T->nTiles);
+    }
+
+    int64_t tileM = T->tiles[tt]->xsize[0];
+    int64_t tileN = T->tiles[tt]->xsize[1];
+    int64_t tileP = T->tiles[tt]->xsize[2];
+
+    if(s->verbosity > 10)
+    {
+        char * tfname = calloc(128, 1);
+        assert(tfname != NULL);
+        sprintf(tfname, "tile%03d.tif", tt);
+        printf("writing to %s\n", tfname);
+#pragma omp critical(fim_tiff)
+        fim_tiff_write(tfname, im[0], NULL, tileM, tileN, tileP);
+        free(tfname);
+    }
+
+    /* Tiles with only background are passed through */
+    const size_t tileMNP = tileM*tileN*tileP;
+    int nSkip = 0;
+    for(int cc = 0; cc < nCh; cc++)
+    {
+        iters[cc] = 0;
+        if(s->tile_skip_bg >= 0 && fim_max(im[cc], tileMNP) < s->tile_skip_bg)
+        {
+            iters[cc] = -1;
+            nSkip++;
+        }
+    }
+    if(nSkip > 0)
+    {
+        if(s->verbosity > 0)
+        {
+            printf("   %d / %d channels only contain background, "
+                   "not deconvolved\n", nSkip, nCh);
+        }
+        fprintf(s->log, "   %d / %d channels only contain background, "
+                "not deconvolved\n", nSkip, nCh);
+    }
+    if(nSkip == nCh)
+    {
+        return;
+    }
+
+    /* Per tile stopping, see --tile-relerror. The ceiling is the
+     * same for all tiles and the floor keeps the tiles similar
+     * enough at the seams. */
+    dw_opts st = *s;
+    st.checkpoint_iter = 0;
+    st.checkpoint_time = 0;
+    st.resume = 0;
+    if(s->tile_relerror > 0)
+    {
+        st.iter_type = DW_ITER_REL;
+        st.err_rel = s->tile_relerror;
+        st.maxiter = s->iter_type == DW_ITER_FIXED ? s->nIter : s->maxiter;
+        st.miniter = s->tile_miniter < st.maxiter ? s->tile_miniter : st.maxiter;
+    }
+
+    // Temporal copies of the PSFs that might be cropped to fit the tile
+    float ** tpsf = malloc(nCh*sizeof(float*));
+    assert(tpsf != NULL);
+    int64_t * tdims = malloc(3*nCh*sizeof(int64_t));
+    assert(tdims != NULL);
+    for(int cc = 0; cc < nCh; cc++)
+    {
+        int64_t * d = tdims + 3*cc;
+        memcpy(d, pdims + 3*cc, 3*sizeof(int64_t));
+        tpsf[cc] = fim_copy(psf[cc], d[0]*d[1]*d[2]);
+
+        fim_normalize_sum1(tpsf[cc], d[0], d[1], d[2]);
+
+        tpsf[cc] = psf_autocrop(tpsf[cc], d, d+1, d+2,
+                                tileM, tileN, tileP, s);
+
+        fim_normalize_sum1(tpsf[cc], d[0], d[1], d[2]);
+    }
+    /* The PSFs can be cropped differently */
+    psf_pad_common(tpsf, tdims, nCh);
+
+    for(int cc = 0; cc < nCh; cc++)
+    {
+        if(iters[cc] < 0)
+        {
+            fim_free(tpsf[cc]);
+            continue;
+        }
+        if(nCh > 1 && s->verbosity > 1)
+        {
+            printf("   Channel %d / %d\n", cc+1, nCh);
+        }
+        if(s->offset > 0)
+        {
+            fim_add_scalar(im[cc], tileM*tileN*tileP, s->offset);
+        }
+
+        /* Note: tpsf[cc] is freed by s->fun */
+        st.iter_done = iters + cc;
+        float * dw_im_tile = s->fun(im[cc], tileM, tileN, tileP, // input image and size
+                                    tpsf[cc], tdims[3*cc], tdims[3*cc+1], tdims[3*cc+2], // psf and size
+                                    &st);
+        fim_free(im[cc]);
+        if(s->offset > 0)
+        {
+            fim_add_scalar(dw_im_tile, tileM*tileN*tileP, -s->offset);
+            fim_project_positive(dw_im_tile, tileM*tileN*tileP);
+        }
+        im[cc] = dw_im_tile;
+    }
+    free(tpsf);
+    free(tdims);
+    return;
+}
+
+/* Where the tiles are read from and written to */
+typedef struct {
+    const char * imFile; /* Input image */
+    char * imFileRaw; /* Raw copy of the input image, or NULL */
+    tiling_map * in_map; /* Mapped input image, or NULL */
+    char * tfile; /* Raw or npy output file */
+    tiling_map * out_map; /* Mapped output file, or NULL */
+    const char * tiledir; /* Write each tile to a file here, see --tile-out */
+    int channel;
+} tile_io;
+
+/* File for tile tt and channel cc with --tile-out, numbered from 1 */
+static char * tile_shard_file(const char * dir, int tt, int cc)
+{
+    char * name = malloc(strlen(dir) + 64);
+    assert(name != NULL);
+    sprintf(name, "%s%ctile%05d_c%d.raw", dir, FILESEP, tt+1, cc+1);
+    return name;
+}
+
+/* Write tile tt as it is, i.e. without the weights, to the
+ * --tile-out folder. The file only gets its final name when it is
+ * complete so partly written tiles are not mistaken as done by dw
+ * merge-tiles. */
+static float tile_shard_write(tiling * T, int tt, const tile_io * io,
+                              const float * S)
+{
+    char * fname = tile_shard_file(io->tiledir, tt, io->channel);
+    char * tmpname = malloc(strlen(fname) + 8);
+    assert(tmpname != NULL);
+    sprintf(tmpname, "%s.tmp", fname);
+
+    const int64_t * xs = T->tiles[tt]->xsize;
+    size_t n = (size_t) xs[0]*xs[1]*xs[2];
+    int ok = 0;
+    FILE * f = fopen(tmpname, "wb");
+    if(f != NULL)
+    {
+        ok = fwrite(S, sizeof(float), n, f) == n;
+        ok = (fclose(f) == 0) && ok;
+    }
+    if(ok)
+    {
+#ifdef WINDOWS
+        remove(fname);
+#endif
+        ok = rename(tmpname, fname) == 0;
+    }
+    if(!ok)
+    {
+        fprintf(stderr, "ERROR: Failed to write %s\n", fname);
+        exit(EXIT_FAILURE);
+    }
+    free(tmpname);
+    free(fname);
+    /* The max of the output is found by dw merge-tiles */
+    return -INFINITY;
+}
+
+/* Read a tile written by tile_shard_write. Returns NULL if the file
+ * is missing or does not have the size of the tile */
+static float * tile_shard_read(tiling * T, int tt, const char * dir, int cc)
+{
+    char * fname = tile_shard_file(dir, tt, cc);
+    const int64_t * xs = T->tiles[tt]->xsize;
+    size_t n = (size_t) xs[0]*xs[1]*xs[2];
+    float * S = NULL;
+    FILE * f = fopen(fname, "rb");
+    if(f != NULL)
+    {
+        S = fim_malloc(n*sizeof(float));
+        if(fread(S, sizeof(float), n, f) != n || fgetc(f) != EOF)
+        {
+            fim_free(S);
+            S = NULL;
+        }
+        fclose(f);
+    }
+    free(fname);
+    return S;
+}
+
+static float * get_tile(tiling * T, int tt, const tile_io * io)
+{
+    if(io->in_map != NULL)
+    {
+        return tiling_get_tile_map(T, tt, io->in_map);
+    }
+    if(io->imFileRaw != NULL)
+    {
+        return tiling_get_tile_raw(T, tt, io->imFileRaw);
+    }
+    return tiling_get_tile_file(T, tt, io->imFile);
+}
+
+static float put_tile(tiling * T, int tt, tile_io * io, float * S)
+{
+    if(io->tiledir != NULL)
+    {
+        return tile_shard_write(T, tt, io, S);
+    }
+    if(io->out_map != NULL)
+    {
+        return tiling_put_tile_map(T, tt, io->out_map, S);
+    }
+    return tiling_put_tile_raw(T, tt, io->tfile, S);
+}
+
+/* Map the input and output files to memory when possible.
+ * The input can be mapped when it is a raw copy or a float npy
+ * file. */
+static void tile_io_map(dw_opts * s, tiling * T, tile_io * io)
+{
+    if(io->tfile != NULL)
+    {
+        io->out_map = tiling_map_open(T, io->tfile, T->raw_offset, 1);
+    }
+
+    if(io->imFileRaw != NULL)
+    {
+        io->in_map = tiling_map_open(T, io->imFileRaw, 0, 0);
+    } else if(io->imFile != NULL && npyfilename(io->imFile))
+    {
+        npio_t * meta = npio_load_metadata(io->imFile);
+        if(meta != NULL)
+        {
+            if(meta->dtype == NPIO_F32 && meta->fortran_order == 0)
+            {
+                io->in_map = tiling_map_open(T, io->imFile,
+                                             meta->data_offset, 0);
+            }
+            npio_free(meta);
+        }
+    }
+
+    if(io->tfile != NULL && io->out_map == NULL)
+    {
+        if(s->verbosity > 0)
+        {
+            printf("Could not map %s to memory, using stdio\n", io->tfile);
+        }
+        fprintf(s->log, "Could not map %s to memory, using stdio\n", io->tfile);
+    }
+    if(s->verbosity > 1)
+    {
+        printf("Tiles are read %s and written %s\n",
+               io->in_map ? "from memory mapped file" : "using stdio",
+               io->out_map ? "to memory mapped file" : "using stdio");
+    }
+}
+
+static void tile_io_unmap(dw_opts * s, tile_io * io)
+{
+    tiling_map_close(io->in_map);
+    io->in_map = NULL;
+    if(tiling_map_close(io->out_map) != 0)
+    {
+        fprintf(stderr, "Failed to sync %s to disk\n", io->tfile);
+        fprintf(s->log, "Failed to sync %s to disk\n", io->tfile);
+        exit(EXIT_FAILURE);
+    }
+    io->out_map = NULL;
+}
+
+/* Read tile tt for all channels */
+static float ** get_tiles(tiling * T, int tt, const tile_io * io, int nCh)
+{
+    float ** im = malloc(nCh*sizeof(float*));
+    assert(im != NULL);
+    for(int cc = 0; cc < nCh; cc++)
+    {
+        im[cc] = get_tile(T, tt, io + cc);
+    }
+    return im;
+}
+
+/* Write tile tt for all channels and update the max of each output.
+ * The tiles are freed. */
+static void put_tiles(tiling * T, int tt, tile_io * io, int nCh,
+                      float ** S, float * outmax)
+{
+    for(int cc = 0; cc < nCh; cc++)
+    {
+        float tmax = put_tile(T, tt, io + cc, S[cc]);
+        tmax > outmax[cc] ? outmax[cc] = tmax : 0;
+        fim_free(S[cc]);
+    }
+    free(S);
+}
+
+#ifdef _OPENMP
+/* Write tile tt to the output. There is one lock per tile
+ * and the locks of all tiles that overlap with tt are held while
+ * writing. They are taken in increasing order to avoid dead locks. */
+static void tile_put_locked(tiling * T, int tt, tile_io * io, int nCh,
+                            float ** S, float * outmax,
+                            omp_lock_t * locks)
+{
+    for(int kk = 0; kk < T->nTiles; kk++)
+    {
+        if(tiling_tiles_overlap(T, tt, kk))
+        {
+            omp_set_lock(locks + kk);
+        }
+    }
+
+    put_tiles(T, tt, io, nCh, S, outmax);
+
+    for(int kk = 0; kk < T->nTiles; kk++)
+    {
+        if(tiling_tiles_overlap(T, tt, kk))
+        {
+            omp_unset_lock(locks + kk);
+        }
+    }
+}
+#endif
+
+/* Create the output of one channel for deconvolve_tiles, initialized
+ * to zeros. A float npy file can be written to directly, for
+ * anything else a raw file is used that is converted by
+ * tiles_write_output at the end since the tiles don't cover full
+ * planes. Returns 1 when written directly. */
+static int tiles_init_output(dw_opts * s, tiling * T, tile_io * io,
+                             const char * outFile)
+{
+    const int64_t M = T->M, N = T->N, P = T->P;
+    if(npyfilename(outFile) && s->outFormat == 32)
+    {
+        io->tfile = strdup(outFile);
+        assert(io->tfile != NULL);
+        if(s->verbosity > 0)
+        {
+            printf("Writing tiles directly to %s\n", io->tfile); fflush(stdout);
+        }
+        T->raw_offset = npy_setzeros(io->tfile, M, N, P);
+        return 1;
+    }
+
+    io->tfile = malloc(strlen(outFile)+10);
+    assert(io->tfile != NULL);
+    sprintf(io->tfile, "%s.raw", outFile);
+
+    if(s->verbosity > 0)
+    {
+        printf("Initializing %s to 0\n", io->tfile); fflush(stdout);
+    }
+    fsetzeros(io->tfile, (size_t) M* (size_t) N* (size_t) P*sizeof(float));
+    return 0;
+}
+
+/* Convert the output of one channel, see tiles_init_output, to its
+ * final format. outmax is the max of the output, only used when
+ * complete is set, i.e. when all tiles were written. */
+static void tiles_write_output(dw_opts * s, tiling * T, tile_io * io,
+                               const char * outFile, int direct_out,
+                               float outmax, int complete,
+                               float scaling0, int nCh)
+{
+    const int64_t M = T->M, N = T->N, P = T->P;
+    const char * tfile = io->tfile;
+    float scaling = scaling0;
+    if(s->outFormat == 32)
+    {
+        scaling = 1;
+    } else {
+        if(scaling <= 0)
+        {
+            /* When only the first tile is processed the max
+             * is not known */
+            float rawmax = outmax;
+            if(!complete)
+            {
+                rawmax = raw_file_single_max(tfile, (size_t) M * (size_t) N * (size_t) P );
+            }
+            if(rawmax > 0)
+            {
+                scaling = 65535/rawmax;
+            }
+        }
+    }
+    if(nCh > 1)
+    {
+        fprintf(s->log, "scaling channel %d: %f\n", io->channel+1, scaling);
+    } else {
+        s->scaling = scaling;
+        fprintf(s->log, "scaling: %f\n", scaling);
+    }
+
+    if(direct_out)
+    {
+        return;
+    }
+
+    if(s->verbosity > 2)
+    {
+        printf("converting %s to %s\n", tfile, outFile);
+    }
+
+    if(npyfilename(outFile))
+    {
+        if(raw_to_npio(outFile, tfile, M, N, P,
+                       s->outFormat,
+                       scaling))
+        {
+            fprintf(stderr, "Error converting %s to %s\n", outFile, tfile);
+            exit(EXIT_FAILURE);
+        }
+
+    } else {
+        if(s->outFormat == 32)
+        {
+            fim_tiff_imwrite_f32_from_raw(outFile,
+                                          M, N, P,
+                                          tfile, s->imFile);
+        } else {
+            fim_tiff_imwrite_u16_from_raw(outFile,
+                                          M, N, P,
+                                          tfile, s->imFile,
+                                          scaling);
+        }}
+
+    if(s->verbosity > 1)
+    {
+        printf("conversion done\n");
+    }
+
+    if(s->verbosity < 5)
+    {
+        remove(tfile);
+    } else {
+        printf("Keeping %s for inspection, remove manually\n", tfile);
+    }
+}
+
+/* Description of the tiles in a --tile-out folder, see
+ * tiles_write_manifest */
+static char * tiles_manifest_file(const char * dir)
+{
+    char * name = malloc(strlen(dir) + 32);
+    assert(name != NULL);
+    sprintf(name, "%s%cdw_tiles.txt", dir, FILESEP);
+    return name;
+}
+
+/* Read what is needed to merge the tiles into s and return the
+ * tiling. Returns NULL on failure. */
+static tiling * tiles_read_manifest(const char * dir, dw_opts * s)
+{
+    char * fname = tiles_manifest_file(dir);
+    FILE * f = fopen(fname, "r");
+    if(f == NULL)
+    {
+        fprintf(stderr, "ERROR: Could not open %s\n", fname);
+        free(fname);
+        return NULL;
+    }
+    int version = 0;
+    int64_t M = 0, N = 0, P = 0;
+    int maxSize = 0, overlap = 0;
+    int64_t maxSizeP = 0, overlapP = 0;
+    int nTiles = 0;
+    char * line = NULL;
+    size_t len = 0;
+    while(getline(&line, &len, f) > 0)
+    {
+        line[strcspn(line, "\r\n")] = '\0';
+        char * val = strchr(line, ' ');
+        if(val == NULL)
+        {
+            continue;
+        }
+        val[0] = '\0';
+        val++;
+        if(strcmp(line, "deconwolf") == 0)
+        {
+            sscanf(val, "tiles %d", &version);
+        } else if(strcmp(line, "size") == 0)
+        {
+            sscanf(val, "%" SCNd64 " %" SCNd64 " %" SCNd64, &M, &N, &P);
+        } else if(strcmp(line, "tiling") == 0)
+        {
+            sscanf(val, "%d %d %" SCNd64 " %" SCNd64,
+                   &maxSize, &overlap, &maxSizeP, &overlapP);
+        } else if(strcmp(line, "tiles") == 0)
+        {
+            nTiles = atoi(val);
+        } else if(strcmp(line, "channels") == 0)
+        {
+            s->nChannels = atoi(val);
+        } else if(strcmp(line, "format") == 0)
+        {
+            s->outFormat = atoi(val);
+        } else if(strcmp(line, "scaling") == 0)
+        {
+            s->scaling = atof(val);
+        } else if(strcmp(line, "image") == 0)
+        {
+            free(s->imFile);
+            s->imFile = strdup(val);
+        } else if(strcmp(line, "out") == 0)
+        {
+            free(s->outFile);
+            s->outFile = strdup(val);
+        }
+    }
+    free(line);
+    fclose(f);
+
+    tiling * T = NULL;
+    if(version == 1 && M > 0 && N > 0 && P > 0 && maxSize > 0
+       && s->nChannels > 0 && s->outFile != NULL)
+    {
+        T = tiling_create_3d(M, N, P, maxSize, overlap, maxSizeP, overlapP);
+    }
+    if(T != NULL && T->nTiles != nTiles)
+    {
+        tiling_free(T);
+        free(T);
+        T = NULL;
+    }
+    if(T == NULL)
+    {
+        fprintf(stderr, "ERROR: %s is not valid\n", fname);
+    }
+    free(fname);
+    return T;
+}
+
+/* Describe the tiling in the --tile-out folder so that dw merge-tiles
+ * can put the tiles together. If there already is a description, from
+ * another process, it has to match. */
+static void tiles_write_manifest(dw_opts * s, tiling * T, int nCh)
+{
+    char * fname = tiles_manifest_file(s->tileOutDir);
+    if(dw_isfile(fname))
+    {
+        dw_opts * s0 = dw_opts_new();
+        tiling * T0 = tiles_read_manifest(s->tileOutDir, s0);
+        int match = T0 != NULL
+            && T0->M == T->M && T0->N == T->N && T0->P == T->P
+            && T0->maxSize == T->maxSize && T0->overlap == T->overlap
+            && T0->maxSizeP == T->maxSizeP && T0->overlapP == T->overlapP
+            && s0->nChannels == nCh
+            && strcmp(s0->outFile, s->outFile) == 0;
+        if(T0 != NULL)
+        {
+            tiling_free(T0);
+            free(T0);
+        }
+        dw_opts_free(&s0);
+        if(!match)
+        {
+            fprintf(stderr, "ERROR: %s describes another image or tiling. "
+                    "Use another folder or remove the old tiles\n", fname);
+            exit(EXIT_FAILURE);
+        }
+        free(fname);
+        return;
+    }
+
+    char * tag = dw_tiles_tag(s);
+    char * tmpname = malloc(strlen(fname) + strlen(tag) + 8);
+    assert(tmpname != NULL);
+    sprintf(tmpname, "%s.%s.tmp", fname, tag);
+    free(tag);
+    FILE * f = fopen(tmpname, "w");
+    if(f == NULL)
+    {
+        fprintf(stderr, "ERROR: Could not write to %s\n", tmpname);
+        exit(EXIT_FAILURE);
+    }
+    fprintf(f, "deconwolf tiles 1\n");
+    fprintf(f, "size %" PRId64 " %" PRId64 " %" PRId64 "\n", T->M, T->N, T->P);
+    fprintf(f, "tiling %d %d %" PRId64 " %" PRId64 "\n",
+            T->maxSize, T->overlap, T->maxSizeP, T->overlapP);
+    fprintf(f, "tiles %d\n", T->nTiles);
+    fprintf(f, "channels %d\n", nCh);
+    fprintf(f, "format %d\n", s->outFormat);
+    fprintf(f, "scaling %f\n", s->scaling);
+    fprintf(f, "image %s\n", s->imFile);
+    fprintf(f, "out %s\n", s->outFile);
+    fclose(f);
+#ifdef WINDOWS
+    remove(fname);
+#endif
+    rename(tmpname, fname);
+    free(tmpname);
+    free(fname);
+}
+
+/* Write the number of iterations per tile to the log, and with --tsv
+ * also to a separate file, <tsv>_tiles.tsv */
+static void tile_iters_report(dw_opts * s, int tt0, int tt1, int nCh,
+                              const int * iters)
+{
+    int64_t total = 0;
+    int nSkip = 0;
+    int imin = -1;
+    int imax = -1;
+    fprintf(s->log, "Iterations per tile:\n");
+    for(int tt = tt0; tt < tt1; tt++)
+    {
+        fprintf(s->log, "  tile %d:", tt+1);
+        for(int cc = 0; cc < nCh; cc++)
+        {
+            int n = iters[tt*nCh + cc];
+            if(n < 0)
+            {
+                fprintf(s->log, " background");
+                nSkip++;
+                continue;
+            }
+            fprintf(s->log, " %d", n);
+            total += n;
+            (imin < 0 || n < imin) ? imin = n : 0;
+            n > imax ? imax = n : 0;
+        }
+        fprintf(s->log, "\n");
+    }
+    fprintf(s->log, "%" PRId64 " iterations in total, %d to %d per tile, "
+            "%d tiles not deconvolved\n", total, imin, imax, nSkip);
+    if(s->verbosity > 0 && (s->tile_relerror > 0 || nSkip > 0))
+    {
+        printf("%" PRId64 " iterations in total, %d to %d per tile, "
+               "%d tiles not deconvolved\n", total, imin, imax, nSkip);
+    }
+
+    if(s->tsvFile == NULL)
+    {
+        return;
+    }
+    char * fname = dw_suffix_file(s->tsvFile, "tiles");
+    FILE * f = fopen(fname, "w");
+    if(f == NULL)
+    {
+        fprintf(stderr, "Failed to open %s for writing\n", fname);
+        free(fname);
+        return;
+    }
+    fprintf(f, "tile\tchannel\titerations\tskipped\n");
+    for(int tt = tt0; tt < tt1; tt++)
+    {
+        for(int cc = 0; cc < nCh; cc++)
+        {
+            int n = iters[tt*nCh + cc];
+            fprintf(f, "%d\t%d\t%d\t%d\n", tt+1, cc+1,
+                    n < 0 ? 0 : n, n < 0);
+        }
+    }
+    fclose(f);
+    free(fname);
+}
+
+/* Decide how many tiles to process at the same time, see
+ * --tile-workers. With "auto" there should be at least 8 threads per
+ * tile and the estimated peak memory of all workers should fit in the
+ * available memory, or in --max-mem if smaller. */
+static int dw_tile_workers(dw_opts * s, tiling * T, int nTiles,
+                           int64_t pM, int64_t pN, int64_t pP)
+{
+    int K = s->tile_workers;
+    if(K == 1)
+    {
+        return 1;
+    }
+#ifndef _OPENMP
+    printf("WARNING: --tile-workers requires OpenMP\n");
+    return 1;
+#endif
+
+    if(K <= 0)
+    {
+        K = s->nThreads_OMP / 8;
+
+        /* Estimated memory for the largest tile */
+        size_t per_tile = 0;
+        for(int kk = 0; kk < nTiles; kk++)
+        {
+            const int64_t * xs = T->tiles[kk]->xsize;
+            size_t m = dw_estimate_memory(s, xs[0], xs[1], xs[2], pM, pN, pP);
+            m > per_tile ? per_tile = m : 0;
+        }
+        size_t avail = dw_get_available_memoryKB()*1024;
+        if(s->max_mem > 0 && (avail == 0 || s->max_mem < avail))
+        {
+            avail = s->max_mem;
+        }
+        if(avail > 0)
+        {
+            size_t Kmem = avail / per_tile;
+            if((size_t) K > Kmem)
+            {
+                K = (int) Kmem;
+            }
+        }
+        fprintf(s->log, "--tile-workers auto: %.1f GB available, "
+                "%.1f GB per tile\n",
+                avail/1e9, per_tile/1e9);
+    }
+
+    K > nTiles ? K = nTiles : 0;
+    K > s->nThreads_OMP ? K = s->nThreads_OMP : 0;
+    K > FFT_MAX_WORKERS ? K = FFT_MAX_WORKERS : 0;
+    K < 1 ? K = 1 : 0;
+    return K;
+}
+
+/* Deconvolve an image of size [M x N x P] in tiles, see --tilesize.
+ *
+ * With nCh > 1 the image has several channels with one PSF each,
+ * and imFilesRaw holds the raw data per channel. All channels of a
+ * tile are processed together so that the tiling and the FFTW plans
+ * are shared. With nCh == 1, imFilesRaw should be NULL and the tiles
+ * are read from s->imFile.
+ * pdims contains [pM, pN, pP] for each PSF.
+ */
+static int
+deconvolve_tiles(const int64_t M, const int64_t N, const int64_t P,
+                 int nCh, float ** psf, const int64_t * pdims,
+                 char ** imFilesRaw,
+                 dw_opts * s)
+{
+
+    /* With only --tilesize-z the tiles cover full planes */
+    int64_t maxSize = s->tiling_maxSize;
+    if(maxSize <= 0)
+    {
+        maxSize = M > N ? M : N;
+    }
+    tiling * T = tiling_create_3d(M, N, P,
+                                  maxSize, s->tiling_padding,
+                                  s->tiling_maxSizeP, s->tiling_paddingP);
+    if( T == NULL)
+    {
+        fprintf(stderr, "Tiling failed, please check your settings\n");
+        exit(1);
+    }
+
+    if( T->nTiles == 1)
+    {
+        fprintf(stderr, "\n"
+                "ERROR: Only one tile! Please omit the `--tilesize` parameter if "
+                "that is what you intended to to or decrease the value if you "
+                "want to process the image in tiles."
+                "\n\n");
+        exit(1);
+    }
+
+    if(s->verbosity > 0)
+    {
+        printf("-> Divided the [%" PRId64 " x %" PRId64 " x %" PRId64 "] image into %d tiles\n", M, N, P, T->nTiles);
+    }
+
+    if(s->tile_first >= T->nTiles)
+    {
+        fprintf(stderr, "ERROR: --tiles %d-%d, but there are only %d tiles\n",
+                s->tile_first+1, s->tile_last+1, T->nTiles);
+        exit(EXIT_FAILURE);
+    }
+    if(s->tileOutDir != NULL)
+    {
+        tiles_write_manifest(s, T, nCh);
+    }
+
+    /* Output images initialize as zeros
+     * will be updated block by block. With --tile-out the tiles are
+     * written to separate files instead, see tile_shard_write.
+     */
+    tile_io * io = calloc(nCh, sizeof(tile_io));
+    assert(io != NULL);
+    int * direct_out = calloc(nCh, sizeof(int));
+    assert(direct_out != NULL);
+    char ** outFiles = calloc(nCh, sizeof(char*));
+    assert(outFiles != NULL);
+    for(int cc = 0; cc < nCh; cc++)
+    {
+        outFiles[cc] = dw_channel_file(s, cc);
+        io[cc].imFile = s->imFile;
+        io[cc].channel = cc;
+        if(s->tileOutDir != NULL)
+        {
+            io[cc].tiledir = s->tileOutDir;
+        } else {
+            direct_out[cc] = tiles_init_output(s, T, io + cc, outFiles[cc]);
+        }
+    }
+
+    /* Tiles are read directly from the input image when possible,
+     * otherwise from a raw copy of it. */
+    char * imFileRaw = NULL;
+    if(imFilesRaw != NULL)
+    {
+        for(int cc = 0; cc < nCh; cc++)
+        {
+            io[cc].imFileRaw = imFilesRaw[cc];
+        }
+    } else if(tiling_file_supported(T, s->imFile))
+    {
+        if(s->verbosity > 1)
+        {
+            printf("Reading tiles directly from %s\n", s->imFile);
+        }
+    } else {
+        imFileRaw = dw_raw_copy_file(s, s->imFile);
+
+        if(s->verbosity > 0)
+        {
+            printf("Dumping %s to %s (for quicker io)\n", s->imFile, imFileRaw);
+        }
+
+        fim_to_raw(s->imFile, imFileRaw);
+
+        if(s->verbosity > 10){
+            printf("Writing to imdump.tif\n");
+            fim_tiff_imwrite_u16_from_raw("imdump.tif", M, N, P, imFileRaw,
+                                          NULL, s->scaling);
+        }
+        io[0].imFileRaw = imFileRaw;
+    }
+
+    if(s->tiling_mmap)
+    {
+        for(int cc = 0; cc < nCh; cc++)
+        {
+            tile_io_map(s, T, io + cc);
+        }
+    }
+
+    //fim_tiff_write_zeros(s->outFile, M, N, P);
+    if(s->verbosity > 0)
+    {
+        printf("\n"); fflush(stdout);
+    }
+
+    int nTiles = T->nTiles;
+    if(s->onetile == 1)
+    {
+        nTiles = 1;
+        fprintf(s->log, "DEBUG: only the first tile to be deconvolved\n");
+        fprintf(stdout, "DEBUG: only the first tile to be deconvolved\n");
+    }
+
+    /* With --tiles only a range of the tiles, the others are
+     * processed by other processes and merged by dw merge-tiles */
+    int tt0 = 0;
+    int tt1 = nTiles;
+    if(s->tile_first >= 0)
+    {
+        tt0 = s->tile_first;
+        s->tile_last + 1 < tt1 ? tt1 = s->tile_last + 1 : 0;
+        if(s->verbosity > 0)
+        {
+            printf("Processing tile %d to %d of %d\n", tt0+1, tt1, T->nTiles);
+        }
+        fprintf(s->log, "Processing tile %d to %d of %d\n", tt0+1, tt1, T->nTiles);
+    }
+
+    /* Most tiles have the same size, keep the transformed PSF
+     * and the Bertero weights between them. In batch mode the cache
+     * is already set up and shared between images. */
+    int own_otf_cache = 0;
+    if(s->otf_cache == NULL)
+    {
+        s->otf_cache = dw_otf_cache_new(nCh*DW_OTF_CACHE_SIZE);
+        own_otf_cache = 1;
+    }
+
+    /* All PSFs have the same size at this point */
+    int nWorkers = dw_tile_workers(s, T, tt1-tt0, pdims[0], pdims[1], pdims[2]);
+
+    /* Max of the output images, tracked while the tiles are written */
+    float * outmax = malloc(nCh*sizeof(float));
+    assert(outmax != NULL);
+    for(int cc = 0; cc < nCh; cc++)
+    {
+        outmax[cc] = -INFINITY;
+    }
+
+    if(dw_checkpoint_enabled(s) || s->resume)
+    {
+        fprintf(stderr, "Warning: checkpoints are not used when tiling\n");
+        fprintf(s->log, "Warning: checkpoints are not used when tiling\n");
+    }
+
+    /* Iterations per tile and channel */
+    int * tile_iters = calloc(T->nTiles*nCh, sizeof(int));
+    assert(tile_iters != NULL);
+
+    if(nWorkers == 1)
+    {
+        /* Three stage pipeline: while tile tt is deconvolved, tile
+         * tt+1 is read and tile tt-1 is written to disk. At most two
+         * tile buffers (per channel) more than when processed one by
+         * one. */
+#ifdef _OPENMP
+        omp_set_max_active_levels(2);
+#endif
+        float ** im_next = get_tiles(T, tt0, io, nCh);
+        float ** dw_im_prev = NULL;
+        int prev = -1;
+        for(int tt = tt0; tt < tt1; tt++)
+        {
+            float ** im_tile = im_next;
+            im_next = NULL;
+#pragma omp parallel num_threads(3)
+            {
+                int id = 0;
+                int nt = 1;
+#ifdef _OPENMP
+                id = omp_get_thread_num();
+                nt = omp_get_num_threads();
+#endif
+                /* The deconvolution is done by thread 0, the one that
+                 * called fft_train, so that the FFTW plans are reused.
+                 * Stages without a thread of their own, if fewer than
+                 * three were given, are run after it. */
+                if(id == 0)
+                {
+                    deconvolve_tile(T, tt, im_tile,
+                                    nCh, psf, pdims,
+                                    tile_iters + tt*nCh, s);
+                }
+                if(id == (nt > 1 ? 1 : 0) && tt + 1 < tt1)
+                {
+#ifdef _OPENMP
+                    omp_set_num_threads(1);
+#endif
+                    im_next = get_tiles(T, tt+1, io, nCh);
+                }
+                if(id == (nt > 2 ? 2 : 0) && dw_im_prev != NULL)
+                {
+#ifdef _OPENMP
+                    omp_set_num_threads(1);
+#endif
+                    put_tiles(T, prev, io, nCh, dw_im_prev, outmax);
+                }
+            }
+            dw_im_prev = im_tile;
+            prev = tt;
+        }
+        if(dw_im_prev != NULL)
+        {
+            if(s->verbosity > 1)
+            {
+                printf("Saving the last tile to disk\n");
+            }
+            put_tiles(T, prev, io, nCh, dw_im_prev, outmax);
+        }
+    }
+#ifdef _OPENMP
+    else {
+        /* Several tiles at once, each with a share of the threads */
+        int nThreads_worker = s->nThreads_OMP / nWorkers;
+        nThreads_worker < 1 ? nThreads_worker = 1 : 0;
+        if(s->verbosity > 0)
+        {
+            printf("Processing %d tiles at a time using %d threads each\n",
+                   nWorkers, nThreads_worker);
+        }
+        fprintf(s->log, "Processing %d tiles at a time using %d threads each\n",
+                nWorkers, nThreads_worker);
+
+        omp_lock_t * locks = malloc(T->nTiles*sizeof(omp_lock_t));
+        assert(locks != NULL);
+        for(int kk = 0; kk < T->nTiles; kk++)
+        {
+            omp_init_lock(locks + kk);
+        }
+
+        omp_set_max_active_levels(2);
+#pragma omp parallel num_threads(nWorkers)
+        {
+            /* Each worker has its own settings, threads and
+             * FFTW plans. The OTF cache is shared. */
+            dw_opts sw = *s;
+            sw.nThreads_FFT = nThreads_worker;
+            sw.nThreads_OMP = nThreads_worker;
+            omp_set_num_threads(nThreads_worker);
+            float * wmax = malloc(nCh*sizeof(float));
+            assert(wmax != NULL);
+            for(int cc = 0; cc < nCh; cc++)
+            {
+                wmax[cc] = -INFINITY;
+            }
+
+#pragma omp for schedule(dynamic, 1)
+            for(int tt = tt0; tt < tt1; tt++)
+            {
+                float ** im_tile = get_tiles(T, tt, io, nCh);
+                deconvolve_tile(T, tt, im_tile,
+                                nCh, psf, pdims,
+                                tile_iters + tt*nCh, &sw);
+                tile_put_locked(T, tt, io, nCh, im_tile, wmax, locks);
+            }
+            fft_free_plans();
+#pragma omp critical(dw_tile_outmax)
+            {
+                for(int cc = 0; cc < nCh; cc++)
+                {
+                    wmax[cc] > outmax[cc] ? outmax[cc] = wmax[cc] : 0;
+                }
+            }
+            free(wmax);
+        }
+
+        for(int kk = 0; kk < T->nTiles; kk++)
+        {
+            omp_destroy_lock(locks + kk);
+        }
+        free(locks);
+    }
+#endif
+
+    for(int cc = 0; cc < nCh; cc++)
+    {
+        tile_io_unmap(s, io + cc);
+    }
+
+    tile_iters_report(s, tt0, tt1, nCh, tile_iters);
+    free(tile_iters);
+
+    dw_otf_cache_fprint_stats(s->log, s->otf_cache);
+    if(s->verbosity > 1)
+    {
+        dw_otf_cache_fprint_stats(stdout, s->otf_cache);
+    }
+    if(own_otf_cache)
+    {
+        dw_otf_cache_free(s->otf_cache);
+        s->otf_cache = NULL;
+    }
+
+    if(s->tileOutDir != NULL)
+    {
+        if(s->verbosity > 0)
+        {
+            printf("Wrote tile %d to %d to %s, use dw merge-tiles when all "
+                   "tiles are done\n", tt0+1, tt1, s->tileOutDir);
+        }
+        fprintf(s->log, "Wrote tile %d to %d to %s\n", tt0+1, tt1, s->tileOutDir);
+    } else {
+        /* Scaling set on the command line, if any */
+        const float scaling0 = s->scaling;
+        for(int cc = 0; cc < nCh; cc++)
+        {
+            tiles_write_output(s, T, io + cc, outFiles[cc], direct_out[cc],
+                               outmax[cc], nTiles == T->nTiles,
+                               scaling0, nCh);
+        }
+    }
+    tiling_free(T);
+    free(T);
+
+    if(s->verbosity > 2)
+    {
+        printf("freeing up\n");
+    }
+    for(int cc = 0; cc < nCh; cc++)
+    {
+        free(io[cc].tfile);
+        free(outFiles[cc]);
+    }
+    free(io);
+    free(outFiles);
+    free(direct_out);
+    free(outmax);
+    if(imFileRaw != NULL)
+    {
+        remove(imFileRaw);
+        free(imFileRaw);
+    }
+    if(s->verbosity > 2)
+    {
+        printf("Done with tiling\n");
+    }
+    return 0;
+}
+
+static void merge_tiles_usage(void)
+{
+    printf("Usage for subcommand 'merge-tiles'\n");
+    printf("dw merge-tiles [options] folder\n");
+    printf("Combines the tiles written by dw --tile-out folder, possibly\n"
+           "by several processes using --tiles, to the output image.\n");
+    printf("Options:\n");
+    printf(" --help\n\t"
+           "Show this help message and quit\n");
+    printf(" --verbose v\n\t"
+           "Set verbosity level to v\n");
+    printf(" --overwrite\n\t"
+           "Overwrite the output image if it already exists\n");
+    printf(" --keep\n\t"
+           "Don't remove the tiles when done\n");
+    printf(" --no-mmap\n\t"
+           "Don't use memory mapped files\n");
+    printf("Example:\n");
+    printf("dw --tilesize 1024 --tile-out tiles/ --tiles 1-16 im.tif psf.tif\n"
+           "dw --tilesize 1024 --tile-out tiles/ --tiles 17-32 im.tif psf.tif\n"
+           "dw merge-tiles tiles/\n");
+    return;
+}
+
+int dw_merge_tiles(int argc, char ** argv)
+{
+    dw_opts * s = dw_opts_new();
+    s->log = stdout;
+    int keep = 0;
+
+    struct option longopts[] = {
+        { "help",      no_argument,       NULL, 'h' },
+        { "verbose",   required_argument, NULL, 'v' },
+        { "overwrite", no_argument,       NULL, 'o' },
+        { "keep",      no_argument,       NULL, 'k' },
+        { "no-mmap",   no_argument,       NULL, 'm' },
+        { NULL,        0,                 NULL,  0  }
+    };
+    int ch;
+    while((ch = getopt_long(argc, argv, "hv:okm", longopts, NULL)) != -1)
+    {
+        switch(ch) {
+        case 'h':
+            merge_tiles_usage();
+            dw_opts_free(&s);
+            return EXIT_SUCCESS;
+        case 'v':
+            s->verbosity = atoi(optarg);
+            break;
+        case 'o':
+            s->overwrite = 1;
+            break;
+        case 'k':
+            keep = 1;
+            break;
+        case 'm':
+            s->tiling_mmap = 0;
+            break;
+        default:
+            fprintf(stderr, "Unknown argument, see dw merge-tiles --help\n");
+            exit(EXIT_FAILURE);
+        }
+    }
+    if(optind >= argc)
+    {
+        merge_tiles_usage();
+        dw_opts_free(&s);
+        return EXIT_FAILURE;
+    }
+    const char * dir = argv[optind];
+
+    tiling * T = tiles_read_manifest(dir, s);
+    if(T == NULL)
+    {
+        dw_opts_free(&s);
+        return EXIT_FAILURE;
+    }
+    const int nCh = s->nChannels;
+
+    /* The metadata is copied from the input image when it is
+     * available */
+    if(s->imFile != NULL && !dw_isfile(s->imFile))
+    {
+        free(s->imFile);
+        s->imFile = NULL;
+    }
+
+    char ** outFiles = calloc(nCh, sizeof(char*));
+    assert(outFiles != NULL);
+    int nExist = 0;
+    for(int cc = 0; cc < nCh; cc++)
+    {
+        outFiles[cc] = dw_channel_file(s, cc);
+        nExist += dw_isfile(outFiles[cc]);
+    }
+    if(nExist > 0 && s->overwrite == 0)
+    {
+        printf("%s already exist. Use --overwrite to overwrite existing files.\n",
+               outFiles[0]);
+        exit(EXIT_SUCCESS);
+    }
+
+    /* All tiles have to be there before anything is written */
+    int nMissing = 0;
+    for(int tt = 0; tt < T->nTiles; tt++)
+    {
+        for(int cc = 0; cc < nCh; cc++)
+        {
+            char * fname = tile_shard_file(dir, tt, cc);
+            if(!dw_isfile(fname))
+            {
+                nMissing++;
+                if(s->verbosity > 0)
+                {
+                    printf("Missing: %s\n", fname);
+                }
+            }
+            free(fname);
+        }
+    }
+    if(nMissing > 0)
+    {
+        fprintf(stderr, "ERROR: %d of %d tiles are missing in %s\n",
+                nMissing, T->nTiles*nCh, dir);
+        exit(EXIT_FAILURE);
+    }
+
+    fim_tiff_init();
+
+    tile_io * io = calloc(nCh, sizeof(tile_io));
+    assert(io != NULL);
+    int * direct_out = calloc(nCh, sizeof(int));
+    assert(direct_out != NULL);
+    float * outmax = malloc(nCh*sizeof(float));
+    assert(outmax != NULL);
+    for(int cc = 0; cc < nCh; cc++)
+    {
+        io[cc].channel = cc;
+        outmax[cc] = -INFINITY;
+        direct_out[cc] = tiles_init_output(s, T, io + cc, outFiles[cc]);
+        if(s->tiling_mmap)
+        {
+            tile_io_map(s, T, io + cc);
+        }
+    }
+
+    /* In the same order as deconvolve_tiles, all channels of a tile
+     * before the next tile */
+    for(int tt = 0; tt < T->nTiles; tt++)
+    {
+        if(s->verbosity > 1)
+        {
+            printf("Merging tile %d / %d\n", tt+1, T->nTiles);
+        }
+        float ** S = malloc(nCh*sizeof(float*));
+        assert(S != NULL);
+        for(int cc = 0; cc < nCh; cc++)
+        {
+            S[cc] = tile_shard_read(T, tt, dir, cc);
+            if(S[cc] == NULL)
+            {
+                char * fname = tile_shard_file(dir, tt, cc);
+                fprintf(stderr, "ERROR: %s is not complete\n", fname);
+                exit(EXIT_FAILURE);
+            }
+        }
+        put_tiles(T, tt, io, nCh, S, outmax);
+    }
+
+    for(int cc = 0; cc < nCh; cc++)
+    {
+        tile_io_unmap(s, io + cc);
+        tiles_write_output(s, T, io + cc, outFiles[cc], direct_out[cc],
+                           outmax[cc], 1, s->scaling, nCh);
+        if(s->verbosity > 0)
+        {
+            printf("Wrote %s\n", outFiles[cc]);
+        }
+    }
+
+    if(!keep)
+    {
+        for(int tt = 0; tt < T->nTiles; tt++)
+        {
+            for(int cc = 0; cc < nCh; cc++)
+            {
+                char * fname = tile_shard_file(dir, tt, cc);
+                remove(fname);
+                free(fname);
+            }
+        }
+        char * fname = tiles_manifest_file(dir);
+        remove(fname);
+        free(fname);
+    }
+
+    for(int cc = 0; cc < nCh; cc++)
+    {
+        free(io[cc].tfile);
+        free(outFiles[cc]);
+    }
+    free(io);
+    free(outFiles);
+    free(direct_out);
+    free(outmax);
+    tiling_free(T);
+    free(T);
+    dw_opts_free(&s);
+    return EXIT_SUCCESS;
+}
+
+
+void timings()
+{
+    printf("-> Timings\n");
+    tictoc
+        int64_t M = 1024, N = 1024, P = 50;
+
+#ifndef WINDOWS
+    tic
+        usleep(1000);
+    toc(usleep_1000)
+#endif
+        tic
+        float * V = fim_malloc(M*N*P*sizeof(float));
+    toc(malloc)
+
+        float * A = fim_malloc(M*N*P*sizeof(float));
+
+    tic
+        memset(V, 0, M*N*P*sizeof(float));
+    toc(memset)
+        memset(A, 0, M*N*P*sizeof(float));
+
+
+    tic
+        for(size_t kk = 0; kk < (size_t) M*N*P; kk++)
+        {
+            A[kk] = (float) rand()/(float) RAND_MAX;
+        }
+    toc(rand)
+
+        // ---
+        tic
+        fftwf_plan p = fftwf_plan_dft_r2c_3d(P, N, M,
+                                             V, NULL,
+                                             FFTW_WISDOM_ONLY | FFTW_MEASURE);
+    fftwf_destroy_plan(p);
+    toc(fftwf_plan_create_and_destroy)
+
+
+        // ---
+        tic
+        fim_flipall(V, A, M, N, P);
+    toc(fim_flipall)
+
+        // ---
+        tic
+        float e1 = getError_ref(V, A, M, N, P, M, N, P);
+    toc(getError_ref)
+        V[0]+= e1;
+
+    tic
+        float e2 = getError(V, A, M, N, P, M, N, P, DW_METRIC_MSE);
+    toc(getError)
+        V[0]+=e2;
+
+    printf("e1: %f, e2: %f, fabs(e1-e2): %f\n", e1, e1, fabs(e1-e2));
+
+    // ---
+    tic
+        float * S1 = fim_subregion(V, M, N, P, M-1, N-1, P-1);
+    toc(fim_subregion)
+
+        tic
+        float * S2 = fim_subregion_ref(V, M, N, P, M-1, N-1, P-1);
+    toc(fim_subregion_ref)
+        printf("S1 - S2 = %f\n", getError(S1, S1, M-1, N-1, P-1, M-1, N-1, P-1, DW_METRIC_MSE));
+    fim_free(S1);
+    fim_free(S2);
+
+    // ---
+    tic
+        fim_insert(V, M, N, P, A, M-1, N-1, P-1);
+    toc(fim_subregion)
+
+        tic
+        fim_insert_ref(V, M, N, P, A, M-1, N-1, P-1);
+    toc(fim_subregion_ref)
+
+        // ---
+
+
+        ((float volatile *)V)[0] = V[0];
+    printf("V[0] = %f\n", V[0]);
+    fim_free(A);
+    fim_free(V);
+}
+
+/* Check the stop conditions with --error-every and the row
+ * selection of --error-sample */
+static void dw_iterator_ut(void)
+{
+    dw_opts * s = dw_opts_new();
+    s->iter_type = DW_ITER_REL;
+    s->err_rel = 0.01;
+    s->maxiter = 1000;
+
+    /* error = 1/(k+1) changes with about 1/k per iteration, so it
+     * should stop after about 100 iterations, later with
+     * error_every since the error is not always evaluated */
+    int every[] = {0, 1, 3, 10};
+    for(int kk = 0; kk < 4; kk++)
+    {
+        s->error_every = every[kk];
+        dw_iterator_t * it = dw_iterator_new(s);
+        int nerr = 0;
+        while(dw_iterator_next(it) >= 0)
+        {
+            if(dw_iterator_need_error(it))
+            {
+                dw_iterator_set_error(it, 1.0/(it->iter + 1.0));
+                nerr++;
+            }
+        }
+        printf("dw_iterator_ut: --error-every %2d: %d iterations, "
+               "%d errors\n", every[kk], it->iter, nerr);
+        if(it->iter < 95 || it->iter > 102 + 2*every[kk])
+        {
+            printf("dw_iterator_ut: unexpected number of iterations\n");
+            exit(EXIT_FAILURE);
+        }
+        dw_iterator_free(it);
+    }
+
+    /* Fixed number of iterations: only the last needs the error */
+    s->iter_type = DW_ITER_FIXED;
+    s->nIter = 20;
+    s->error_every = 0;
+    dw_iterator_t * it = dw_iterator_new(s);
+    int nerr = 0;
+    while(dw_iterator_next(it) >= 0)
+    {
+        if(dw_iterator_need_error(it))
+        {
+            nerr++;
+        }
+    }
+    dw_iterator_free(it);
+    if(nerr != 1)
+    {
+        printf("dw_iterator_ut: %d errors with a fixed number of "
+               "iterations, expected 1\n", nerr);
+        exit(EXIT_FAILURE);
+    }
+    dw_opts_free(&s);
+
+    float f = 0.1;
+    int64_t nsel = 0;
+    for(int64_t row = 0; row < 100000; row++)
+    {
+        nsel += dw_error_row(row, f);
+    }
+    printf("dw_iterator_ut: %" PRId64 " of 100000 rows selected with f=%.2f\n",
+           nsel, f);
+    if(nsel < 9000 || nsel > 11000)
+    {
+        printf("dw_iterator_ut: bad row selection\n");
+        exit(EXIT_FAILURE);
+    }
+}
+
+/* Synthetic image: point sources on a background, blurred by a
+ * Gaussian. Returns the image, and the PSF in psf. */
+static float * dw_pyramid_ut_image(int64_t M, int64_t N, int64_t P,
+                                   float ** psf, int64_t pM, int64_t pN, int64_t pP,
+                                   float sxy, float sz)
+{
+    float * im = fim_malloc(M*N*P*sizeof(float));
+    for(int64_t kk = 0; kk < M*N*P; kk++)
+    {
+        im[kk] = 10;
+    }
+
+    srand(1);
+    for(int dd = 0; dd < 40; dd++)
+    {
+        float cm = 4 + (M-8) * (float) rand() / (float) RAND_MAX;
+        float cn = 4 + (N-8) * (float) rand() / (float) RAND_MAX;
+        float cp = 2 + (P-4) * (float) rand() / (float) RAND_MAX;
+        float a = 1000 + 4000 * (float) rand() / (float) RAND_MAX;
+        for(int64_t pp = 0; pp < P; pp++)
+        {
+            for(int64_t nn = 0; nn < N; nn++)
+            {
+                for(int64_t mm = 0; mm < M; mm++)
+                {
+                    float r2 = (pow(mm-cm, 2) + pow(nn-cn, 2))/(sxy*sxy)
+                        + pow(pp-cp, 2)/(sz*sz);
+                    im[pp*M*N + nn*M + mm] += a*exp(-0.5*r2);
+                }
+            }
+        }
+    }
+
+    float * K = fim_malloc(pM*pN*pP*sizeof(float));
+    for(int64_t pp = 0; pp < pP; pp++)
+    {
+        for(int64_t nn = 0; nn < pN; nn++)
+        {
+            for(int64_t mm = 0; mm < pM; mm++)
+            {
+                float r2 = (pow(mm-(pM-1)/2, 2) + pow(nn-(pN-1)/2, 2))/(sxy*sxy)
+                    + pow(pp-(pP-1)/2, 2)/(sz*sz);
+                K[pp*pM*pN + nn*pM + mm] = exp(-0.5*r2);
+            }
+        }
+    }
+    fim_normalize_sum1(K, pM, pN, pP);
+    psf[0] = K;
+    return im;
+}
+
+/* Last error in the tsv output of s->fun */
+static double dw_pyramid_ut_tsv_error(FILE * tsv)
+{
+    rewind(tsv);
+    int iter = 0;
+    double time = 0, err = 0, KL = 0, last = -1;
+    while(fscanf(tsv, "%d %lf %lf %lf", &iter, &time, &err, &KL) == 4)
+    {
+        last = err;
+    }
+    return last;
+}
+
+/* After a few iterations at full resolution the error should be lower
+ * with --start pyramid than with a flat start. It does not save any
+ * iterations when many are used, see the --start documentation. */
+static void dw_pyramid_ut(void)
+{
+    const int64_t M = 64, N = 64, P = 24;
+    const int64_t pM = 15, pN = 15, pP = 15;
+    const int nIter = 5;
+
+    dw_opts * s = dw_opts_new();
+    s->verbosity = 0;
+    s->log = tmpfile();
+    s->nThreads_FFT = 2;
+    myfftw_start(s->nThreads_FFT, 0, NULL);
+
+    float * psf = NULL;
+    float * im = dw_pyramid_ut_image(M, N, P, &psf, pM, pN, pP, 2, 3);
+    float * psf2 = fim_malloc(pM*pN*pP*sizeof(float));
+    memcpy(psf2, psf, pM*pN*pP*sizeof(float));
+
+    s->iter_type = DW_ITER_FIXED;
+    s->nIter = nIter;
+
+    s->tsv = tmpfile();
+    s->start_condition = DW_START_FLAT;
+    float * x = s->fun(im, M, N, P, psf, pM, pN, pP, s);
+    fim_free(x);
+    double err_flat = dw_pyramid_ut_tsv_error(s->tsv);
+    fclose(s->tsv);
+
+    s->tsv = tmpfile();
+    s->start_condition = DW_START_PYRAMID;
+    x = s->fun(im, M, N, P, psf2, pM, pN, pP, s);
+    fim_free(x);
+    double err_pyramid = dw_pyramid_ut_tsv_error(s->tsv);
+    fclose(s->tsv);
+    s->tsv = NULL;
+    fim_free(im);
+
+    printf("dw_pyramid_ut: error after %d iterations: %e (flat start), "
+           "%e (pyramid start)\n", nIter, err_flat, err_pyramid);
+    if(err_flat <= 0 || err_pyramid <= 0 || err_pyramid >= err_flat)
+    {
+        printf("dw_pyramid_ut: --start pyramid did not give a better "
+               "initial guess\n");
+        exit(EXIT_FAILURE);
+    }
+    fclose(s->log);
+    s->log = NULL;
+    dw_opts_free(&s);
+    myfftw_stop();
+}
+
+void dw_unittests()
+{
+    fprint_peak_memory(stdout);
+    timings();
+
+    //fim_ut();
+    fim_tiff_ut();
+    fim_half_ut();
+    fim_simd_ut();
+    dw_checkpoint_ut();
+    dw_iterator_ut();
+    dw_pyramid_ut();
+    dw_accel_ut();
+    fft_ut();
+    printf("done\n");
+}
+
+void show_time(FILE * f)
+{
+    f == NULL ? f = stdout : 0;
+    int buf_len = 256;
+    char buf[256];
+
+    time_t now = time(NULL);
+    struct tm * ptm = localtime(&now);
+    strftime(buf, buf_len, "%FT%T", ptm);
+
+    fprintf(f, "%s\n", buf);
+    return;
+}
+
+float * psf_makeOdd(float * psf, int64_t * pM, int64_t * pN, int64_t *pP)
+{
+    // Expand the psf so that it had odd dimensions it if doesn't already have that
+    int64_t m = pM[0];
+    int64_t n = pN[0];
+    int64_t p = pP[0];
+    int reshape = 0;
+    if(m % 2 == 0)
+    { m++; reshape = 1;}
+    if(n % 2 == 0)
+    { n++; reshape = 1;}
+    if(p % 2 == 0)
+    { p++; reshape = 1;}
+
+    if(reshape == 0)
+    {  return psf; }
+    // printf("%d %d %d -> %d %d %d\n", pM[0], pN[0], pP[0], m, n, p);
+    float * psf2 = fim_zeros(m*n*p);
+    fim_insert(psf2, m, n, p, psf, pM[0], pN[0], pP[0]);
+    fim_free(psf);
+    pM[0] = m;
+    pN[0] = n;
+    pP[0] = p;
+    return psf2;
+}
+
+
+void dcw_init_log(dw_opts * s)
+{
+    s->log = fopen(s->logFile, "w");
+    if (s->log == NULL)
+    {
+        fprintf(stderr, "Unable to open %s for writing\n", s->logFile);
+        fprintf(stderr,
+                "Please check that you have permissions to write to the folder\n"
+                "and that the drive is not full\n");
+        exit(EXIT_FAILURE);
+    }
+    assert(s->log != NULL);
+    show_time(s->log);
+    dw_opts_fprint(s->log, s);
+    dw_fprint_info(s->log, s);
+}
+
+void dcw_close_log(dw_opts * s)
+{
+    fprint_peak_memory(s->log);
+    show_time(s->log);
+    fclose(s->log);
+}
+
+double get_nbg(float * I, size_t N, float bg)
+{ // count the number of pixels in the image
+    // that are set to the background level
+    double nbg = 0;
+    for(size_t kk = 0; kk<N; kk++)
+    {
+        if(I[kk] == bg)
+        {
+            nbg++;
+        }
+    }
+    return nbg;
+}
+
+
+void flatfieldCorrection(dw_opts * s, float * im, int64_t M, int64_t N, int64_t P)
+{
+    printf("Experimental: applying flat field correction using %s\n",
+           s->flatfieldFile);
+    ttags * T = ttags_new();
+    int64_t m = 0, n = 0, p = 0;
+    float * C = fim_imread(s->flatfieldFile, T, &m, &n, &p, s->verbosity);
+    ttags_free(&T);
+
+    assert(m == M);
+    assert(n == N);
+    assert(p == 1);
+
+    // TODO:
+    // check that it is positive
+
+    for(int64_t zz = 0; zz<P; zz++)
+    {
+        for(size_t pos = 0; pos < (size_t) M*N; pos++)
+        {
+            im[M*N*zz + pos] /= C[pos];
+        }
+    }
+    fim_free(C);
+}
+
+
+static void prefilter(dw_opts * s,
+                      float * im, int64_t M, int64_t N, int64_t P,
+                      __attribute__((unused)) float * psf,
+                      __attribute__((unused)) int64_t pM,
+                      __attribute__((unused)) int64_t pN,
+                      __attribute__((unused)) int64_t pP)
+{
+
+    if(s->psigma<= 0)
+    {
+        return;
+    }
+
+    /* A stack of 2D images, see --stack2d, is smoothed plane by
+     * plane */
+    const int64_t nstack = fft_get_batch2d() ? P : 1;
+    const int64_t sP = P / nstack;
+    fim_anscombe(im, M*N*P);
+    for(int64_t kk = 0; kk < nstack; kk++)
+    {
+        fim_gsmooth(im + kk*M*N*sP, M, N, sP, s->psigma);
+    }
+    fim_ianscombe(im, M*N*P);
+
+    return;
+}
+
+/** Create initial guess: the fft of an image that is 1 in MNP and 0
+ * outside M, N, P is the dimension of the microscopic image
+ *
+ * Possibly more stable to use the mean of the input image rather than 1
+ */
+fftwf_complex * initial_guess(const int64_t M, const int64_t N, const int64_t P,
+                              const int64_t wM, const int64_t wN, const int64_t wP)
+{
+    assert(wM >= M); assert(wN >= N); assert(wP >= P);
+
+    float * one = fim_zeros(wM*wN*wP);
+
+#pragma omp parallel for shared(one)
+    for(int64_t cc = 0; cc < P; cc++) {
+        for(int64_t bb = 0; bb < N; bb++) {
+            for(int64_t aa = 0; aa < M; aa++) {
+                one[aa + wM*bb + wM*wN*cc] = 1;
+            }
+        }
+    }
+    //printf("writing to one.tif");
+    //fim_tiff_write_float("one.tif", one, NULL, wM, wN, wP);
+    //  writetif("one.tif", one, wM, wN, wP);
+
+    fftwf_complex * Fone = fft(one, wM, wN, wP);
+
+    fim_free(one);
+    return Fone;
+}
+
+static void dw_set_omp_threads(const dw_opts *s)
+{
+#ifdef _OPENMP
+#ifdef MKL
+    mkl_set_num_threads(s->nThreads_FFT);
+    fprintf(s->log, "Set the number of MKL threads to %d\n", s->nThreads_FFT);
+#else
+    omp_set_num_threads(s->nThreads_OMP);
+    fprintf(s->log, "Set the number of OMP threads to %d\n", s->nThreads_OMP);
+    /* Fastest of static, dynamic and guided in limited tests */
+    omp_set_dynamic(false);
+    omp_set_schedule(omp_sched_static, 0);
+    fprintf(s->log, "Using static scheduling for OMP\n");
+    /* Better on heavily loaded machine? */
+    //omp_set_schedule(omp_sched_guided, 0);
+#endif
+#endif
+    return;
+}
+
+/* Returns non-zero if the image can't be deconvolved and warns if the
+ * intensities are low */
+static int dw_check_image(const dw_opts * s, const float * im,
+                           int64_t M, int64_t N, int64_t P,
+                           FILE * log)
+{
+    if(fim_min(im, M*N*P) < 0)
+    {
+        fprintf(stderr,
+                "ERROR: The image contains negative values, can not continue!\n");
+        fprintf(log,
+                "ERROR: The image contains negative values, can not continue!\n");
+        return -1;
     }
-
-    if(s->verbosity > 0)
+    float maxval = fim_max(im, M*N*P);
+    if(maxval < 1.0)
     {
-        printf("-> Divided the [%" PRId64 " x %" PRId64 " x %" PRId64 "] image into %d tiles\n", M, N, P, T->nTiles);
+        fprintf(stderr,
+                "ERROR: The image has too low intensity, can not continue!\n");
+        fprintf(log,
+                "ERROR: The image has too low intensity, can not continue!\n");
+        fprintf(log, "The largest value of the input image is %f\n",
+                maxval);
+        return -1;
     }
 
-    /* Output image initialize as zeros
-     * will be updated block by block
-     */
-    char * tfile = malloc(strlen(s->outFile)+10);
-    assert(tfile != NULL);
-    sprintf(tfile, "%s.raw", s->outFile);
-
-    if(s->verbosity > 0)
+    if(maxval < 100)
     {
-        printf("Initializing %s to 0\n", tfile); fflush(stdout);
+        if(s->verbosity > 0)
+        {
+            printf("WARNING: The largest value of the input image is %f\n",
+                   maxval);
+        }
+        fprintf(log,
+                "WARNING: The largest value of the input image is %f\n",
+                maxval);
     }
-    fsetzeros(tfile, (size_t) M* (size_t) N* (size_t) P*sizeof(float));
-
-    char * imFileRaw = malloc(strlen(s->imFile) + 10);
-    assert(imFileRaw != NULL);
-    sprintf(imFileRaw, "%s.raw", s->imFile);
+    return 0;
+}
 
-    if(s->verbosity > 0)
+/* The number of planes of an image with P planes after --zcrop or
+ * --auto-zcrop, as done by dw_read_image */
+static int64_t dw_cropped_planes(const dw_opts * s, int64_t P)
+{
+    if(s->auto_zcrop > 0)
+    {
+        P = s->auto_zcrop;
+    }
+    if(s->zcrop > 0)
     {
-        printf("Dumping %s to %s (for quicker io)\n", s->imFile, imFileRaw);
+        P = P - 2*s->zcrop;
     }
+    return P;
+}
 
-    fim_to_raw(s->imFile, imFileRaw);
+/* Read an image, crop it in z if requested and check that it can be
+ * deconvolved. Warnings are written to log. Returns NULL, after
+ * writing why to stderr, if the image can't be read or deconvolved. */
+static float * dw_read_image(dw_opts * s, const char * imFile, ttags * T,
+                             int64_t * pM, int64_t * pN, int64_t * pP,
+                             FILE * log)
+{
+    int64_t M = 0, N = 0, P = 0;
 
-    if(s->verbosity > 10){
-        printf("Writing to imdump.tif\n");
-        fim_tiff_imwrite_u16_from_raw("imdump.tif", M, N, P, imFileRaw,
-                                      NULL, s->scaling);
+    if(s->verbosity > 0 )
+    {
+        printf("Reading %s\n", imFile);
     }
 
-    //fim_tiff_write_zeros(s->outFile, M, N, P);
-    if(s->verbosity > 0)
+    float * im = fim_imread(imFile, T, &M, &N, &P, s->verbosity);
+    if(im == NULL)
     {
-        printf("\n"); fflush(stdout);
+        fprintf(stderr, "Failed to open %s\n", imFile);
+        return NULL;
     }
 
-    int nTiles = T->nTiles;
-    if(s->onetile == 1)
+    if(s->verbosity > 4)
     {
-        nTiles = 1;
-        fprintf(s->log, "DEBUG: only the first tile to be deconvolved\n");
-        fprintf(stdout, "DEBUG: only the first tile to be deconvolved\n");
+        if(M > 9)
+        {
+            printf("image data: ");
+            for(size_t kk = 0; kk<10; kk++)
+            {
+                printf("%f ", im[kk]);
+            }
+            printf("\n");
+        }
+        printf("Done reading\n"); fflush(stdout);
     }
 
-    for(int tt = 0; tt < nTiles; tt++)
+    if(s->auto_zcrop > 0)
     {
-        // Temporal copy of the PSF that might be cropped to fit the tile
-        float * tpsf = fim_copy(psf, pM*pN*pP);
-        int64_t tpM = pM, tpN = pN, tpP = pP;
-
         if(s->verbosity > 0)
         {
-            printf("-> Processing tile %d / %d\n", tt+1, T->nTiles);
-            fprintf(s->log, "-> Processing tile %d / %d\n", tt+1, T->nTiles);
+            printf("Cropping the image to %" PRId64 " x %" PRId64 " x %d\n",
+                   M, N, s->auto_zcrop);
         }
-
-        //    tictoc
-        //   tic
-        //float * im_tile = tiling_get_tile_tiff(T, tt, s->imFile);
-        float * im_tile = tiling_get_tile_raw(T, tt, imFileRaw);
-        //    toc(tiling_get_tile_tiff)
-
-        int64_t tileM = T->tiles[tt]->xsize[0];
-        int64_t tileN = T->tiles[tt]->xsize[1];
-        int64_t tileP = T->tiles[tt]->xsize[2];
-
-        if(s->verbosity > 10)
+        float * zim = fim_auto_zcrop(im, M, N, P, s->auto_zcrop);
+        if(zim == NULL)
         {
-            char * tfname = calloc(128, 1);
-            assert(tfname != NULL);
-            sprintf(tfname, "tile%03d.tif", tt);
-            printf("writing to %s\n", tfname);
-            fim_tiff_write(tfname, im_tile, NULL, tileM, tileN, tileP);
-            free(tfname);
+            fprintf(stderr,
+                    "Automatic cropping failed\n");
+            fim_free(im);
+            return NULL;
         }
+        fim_free(im);
+        im = zim;
+        P = s->auto_zcrop;
 
-        fim_normalize_sum1(tpsf, tpM, tpN, tpP);
-
-        tpsf = psf_autocrop(tpsf, &tpM, &tpN, &tpP,
-                            tileM, tileN, tileP, s);
-
-        fim_normalize_sum1(tpsf, tpM, tpN, tpP);
+    }
 
-        if(s->offset > 0)
+    if(s->zcrop > 0)
+    {
+        if(2*s->zcrop >= P)
         {
-            fim_add_scalar(im_tile, tileM*tileN*tileP, s->offset);
+            fprintf(stderr, "Impossible to remove 2x%d planes from an image with %" PRId64 " planes\n",
+                    s->zcrop, P);
+            fim_free(im);
+            return NULL;
         }
-
-        float * dw_im_tile = s->fun(im_tile, tileM, tileN, tileP, // input image and size
-                                    tpsf, tpM, tpN, tpP, // psf and size
-                                    s);
-        fim_free(im_tile);
-        if(s->offset > 0)
+        if(s->verbosity > 0)
         {
-            fim_add_scalar(dw_im_tile, tileM*tileN*tileP, -s->offset);
-            fim_project_positive(dw_im_tile, tileM*tileN*tileP);
+            printf("Removing %d planes from the top and bottom of the image\n",
+                   s->zcrop);
         }
-        if(s->verbosity > 1)
+        float * zim = fim_zcrop(im, M, N, P, (size_t )s->zcrop);
+        if(zim == NULL)
+        {
+            fprintf(stderr,
+                    "Automatic cropping failed\n");
+            fim_free(im);
+            return NULL;
+        }
+        fim_free(im);
+        im = zim;
+        P = P - 2*s->zcrop;
+        if(s->verbosity > 0)
         {
-            printf("Saving tile to disk\n");
+            printf("New image size: [%" PRId64 "x %" PRId64 "x %" PRId64 "]\n",
+                   M, N, P);
         }
-        tiling_put_tile_raw(T, tt, tfile, dw_im_tile);
-        fim_free(dw_im_tile);
-        // free(tpsf);
     }
-    tiling_free(T);
-    free(T);
 
-    if(s->verbosity > 2)
+    if(dw_check_image(s, im, M, N, P, log))
     {
-        printf("converting %s to %s\n", tfile, s->outFile);
+        fim_free(im);
+        return NULL;
     }
 
-    if(s->outFormat == 32)
+    pM[0] = M;
+    pN[0] = N;
+    pP[0] = P;
+    return im;
+}
+
+
+/* Read the PSF and normalize it to sum 1 */
+static float * dw_read_psf(dw_opts * s, const char * psfFile,
+                           int64_t * pM, int64_t * pN, int64_t * pP)
+{
+    if(s->verbosity > 0)
     {
-        s->scaling = 1;
-    } else {
-        if(s->scaling <= 0)
+        printf("Reading %s\n", psfFile);
+    }
+    float * psf = fim_imread(psfFile, NULL, pM, pN, pP, s->verbosity);
+    if(psf == NULL)
+    {
+        fprintf(stderr, "Failed to open %s\n", psfFile);
+        exit(1);
+    }
+    if(s->verbosity > 4)
+    {
+        if(pM[0] > 9)
         {
-            float rawmax = raw_file_single_max(tfile, (size_t) M * (size_t) N * (size_t) P );
-            if(rawmax > 0)
+            printf("image data: ");
+            for(size_t kk = 0; kk<10; kk++)
             {
-                s->scaling = 65535/rawmax;
+                printf("%f ", psf[kk]);
             }
+            printf("\n");
         }
     }
-    fprintf(s->log, "scaling: %f\n", s->scaling);
 
-    // TODO: fim_from_raw( ... )
-    if(npyfilename(s->outFile))
+    if(fim_maxAtOrigo(psf, pM[0], pN[0], pP[0]) == 0)
     {
-        if(raw_to_npio(s->outFile, tfile, M, N, P,
-                       s->outFormat,
-                       s->scaling))
+        /* It might still be centered between pixels */
+        if(s->verbosity > 0)
         {
-            fprintf(stderr, "Error converting %s to %s\n", s->outFile, tfile);
-            exit(EXIT_FAILURE);
+            warning(stdout);
+            printf("The PSF is not centered!\n");
         }
+        fprintf(s->log, " ! The PSF is not centered\n");
+    }
 
-    } else {
-        if(s->outFormat == 32)
-        {
-            fim_tiff_imwrite_f32_from_raw(s->outFile,
-                                          M, N, P,
-                                          tfile, s->imFile);
-        } else {
-            fim_tiff_imwrite_u16_from_raw(s->outFile,
-                                          M, N, P,
-                                          tfile, s->imFile,
-                                          s->scaling);
-        }}
+    fim_normalize_sum1(psf, pM[0], pN[0], pP[0]);
+    return psf;
+}
 
-    if(s->verbosity > 1)
+/* Deconvolve an image that is already loaded. The psf is freed. */
+static float * dw_deconvolve_image(dw_opts * s,
+                                   float * im, int64_t M, int64_t N, int64_t P,
+                                   float * psf, int64_t pM, int64_t pN, int64_t pP)
+{
+    fim_normalize_sum1(psf, pM, pN, pP);
+    if(s->flatfieldFile != NULL)
     {
-        printf("conversion done\n");
+        flatfieldCorrection(s, im, M, N, P);
     }
 
-    if(s->verbosity < 5)
-    {
-        remove(tfile);
-    } else {
-        printf("Keeping %s for inspection, remove manually\n", tfile);
-    }
+    /* Pre filter by psigma */
+    prefilter(s, im, M, N, P, psf, pM, pN, pP);
 
-    if(s->verbosity > 2)
+    if(s->offset > 0)
     {
-        printf("freeing up\n");
+        fim_add_scalar(im, M*N*P, s->offset);
     }
-    free(tfile);
-    remove(imFileRaw);
-    free(imFileRaw);
-    if(s->verbosity > 2)
+
+    /* Note: psf is freed bu the deconvolve_* functions*/
+    float * out = s->fun(im, M, N, P, // input image and size
+                         psf, pM, pN, pP, // psf and size
+                         s);// settings
+
+    if(s->offset > 0)
     {
-        printf("Done with tiling\n");
+        fim_add_scalar(im, M*N*P, -s->offset);
+        fim_project_positive(im, M*N*P);
     }
-    return 0;
+    return out;
 }
 
-
-
-void timings()
+/* Write the deconvolved image to s->outFile */
+static void dw_write_image(dw_opts * s, float * out, ttags * T,
+                           int64_t M, int64_t N, int64_t P)
 {
-    printf("-> Timings\n");
-    tictoc
-        int64_t M = 1024, N = 1024, P = 50;
-
-#ifndef WINDOWS
-    tic
-        usleep(1000);
-    toc(usleep_1000)
-#endif
-        tic
-        float * V = fim_malloc(M*N*P*sizeof(float));
-    toc(malloc)
-
-        float * A = fim_malloc(M*N*P*sizeof(float));
+    if(out == NULL)
+    {
+        if(s->verbosity > 0)
+        {
+            printf("Nothing to write to disk :(\n");
+        }
+        return;
+    }
 
-    tic
-        memset(V, 0, M*N*P*sizeof(float));
-    toc(memset)
-        memset(A, 0, M*N*P*sizeof(float));
+    double nZeros = get_nbg(out, M*N*P, s->bg);
+    fprintf(s->log, "%f%% pixels at bg level in the output image.\n", 100*nZeros/(M*N*P));
+    if(s->verbosity > 1)
+    {
+        printf("%f%% pixels at bg level in the output image.\n", 100*nZeros/(M*N*P));
+        printf("Writing to %s\n", s->outFile); fflush(stdout);
+        printf("Outformat: %d\n", s->outFormat);
+    }
 
 
-    tic
-        for(size_t kk = 0; kk < (size_t) M*N*P; kk++)
+    if(s->outFormat == 32)
+    {
+        if(s->iterdump)
         {
-            A[kk] = (float) rand()/(float) RAND_MAX;
+            char * outFile = gen_iterdump_name(s, s->nIter);
+            fim_imwrite_f32(outFile, out, T, M, N, P);
+            free(outFile);
+        } else {
+            fim_imwrite_f32(s->outFile, out, T, M, N, P);
         }
-    toc(rand)
+    } else {
+        if(s->iterdump)
+        {
+            char * outFile = gen_iterdump_name(s, s->nIter);
+            float scaling = scaling_for_u16(out, M*N*P);
+            fim_imwrite_u16(outFile, out, T, M, N, P, scaling);
+            free(outFile);
+        } else {
+            if(s->scaling <= 0)
+            {
+                s->scaling = scaling_for_u16(out, M*N*P);
+            }
+            fprintf(s->log, "scaling: %f\n", s->scaling);
+            fim_imwrite_u16(s->outFile, out, T, M, N, P, s->scaling);
+        }
+    }
+    return;
+}
 
-        // ---
-        tic
-        fftwf_plan p = fftwf_plan_dft_r2c_3d(P, N, M,
-                                             V, NULL,
-                                             FFTW_WISDOM_ONLY | FFTW_MEASURE);
-    fftwf_destroy_plan(p);
-    toc(fftwf_plan_create_and_destroy)
+static void dw_set_software_tag(ttags * T)
+{
+    // Set up the string for the TIFFTAG_SOFTWARE
+    char * swstring = malloc(1024);
+    assert(swstring != NULL);
+    sprintf(swstring, "deconwolf %s", deconwolf_version);
+    ttags_set_software(T, swstring);
+    free(swstring);
+}
 
+static int dw_run_batch(dw_opts * s);
+static int dw_run_channels(dw_opts * s);
 
-        // ---
-        tic
-        fim_flipall(V, A, M, N, P);
-    toc(fim_flipall)
+int dw_run(dw_opts * s)
+{
+    if(s->batchFile != NULL)
+    {
+        return dw_run_batch(s);
+    }
+    if(s->nChannels > 1)
+    {
+        return dw_run_channels(s);
+    }
 
-        // ---
-        tic
-        float e1 = getError_ref(V, A, M, N, P, M, N, P);
-    toc(getError_ref)
-        V[0]+= e1;
+    struct timespec tstart, tend;
+    dw_gettime(&tstart);
+    dcw_init_log(s);
 
-    tic
-        float e2 = getError(V, A, M, N, P, M, N, P, DW_METRIC_MSE);
-    toc(getError)
-        V[0]+=e2;
+    if(s->verbosity > 1)
+    {
+        dw_opts_fprint(NULL, s);
+        printf("\n");
+    }
 
-    printf("e1: %f, e2: %f, fabs(e1-e2): %f\n", e1, e1, fabs(e1-e2));
+    s->verbosity > 1 ? dw_fprint_info(NULL, s) : 0;
+    dw_set_omp_threads(s);
 
-    // ---
-    tic
-        float * S1 = fim_subregion(V, M, N, P, M-1, N-1, P-1);
-    toc(fim_subregion)
+    logfile = stdout;
 
-        tic
-        float * S2 = fim_subregion_ref(V, M, N, P, M-1, N-1, P-1);
-    toc(fim_subregion_ref)
-        printf("S1 - S2 = %f\n", getError(S1, S1, M-1, N-1, P-1, M-1, N-1, P-1, DW_METRIC_MSE));
-    free(S1);
-    free(S2);
+    fim_tiff_init();
+    fim_tiff_set_log(s->log);
+    if(s->verbosity > 2)
+    {
+        fim_tiff_set_log(s->log);
+    }
 
-    // ---
-    tic
-        fim_insert(V, M, N, P, A, M-1, N-1, P-1);
-    toc(fim_subregion)
+    int64_t M = 0, N = 0, P = 0;
+    if(fim_imread_size(s->imFile, &M, &N, &P))
+    {
+        printf("fim_imread_size failed to open %s\n", s->imFile);
+        return -1;
+    } else {
+        if(s->verbosity > 3)
+        {
+            printf("Got image info from %s\n", s->imFile);
+        }
+    }
 
-        tic
-        fim_insert_ref(V, M, N, P, A, M-1, N-1, P-1);
-    toc(fim_subregion_ref)
+    if(s->verbosity > 1)
+    {
+        printf("Image dimensions: %" PRId64 " x %" PRId64 " x %" PRId64 "\n",
+               M, N, P);
+    }
 
-        // ---
 
+    /* The size that is deconvolved */
+    P = dw_cropped_planes(s, P);
 
-        ((float volatile *)V)[0] = V[0];
-    printf("V[0] = %f\n", V[0]);
-    free(A);
-    free(V);
-}
+    int64_t pM = 0, pN = 0, pP = 0;
+    float * psf = dw_read_psf(s, s->psfFile, &pM, &pN, &pP);
 
-void dw_unittests()
-{
-    fprint_peak_memory(stdout);
-    timings();
+    /* Might enable tiling, hence before the image is read. The PSF is
+     * not cropped yet so the estimate is on the safe side. */
+    size_t est_mem = dw_apply_max_mem(s, M, N, P, pM, pN, pP);
+    fprintf(s->log, "Estimated peak memory: %.2f GB\n", est_mem/1e9);
 
-    //fim_ut();
-    fim_tiff_ut();
-    fft_ut();
-    printf("done\n");
-}
+    int tiling = dw_tiling_needed(s, M, N, P);
 
-void show_time(FILE * f)
-{
-    f == NULL ? f = stdout : 0;
-    int buf_len = 256;
-    char buf[256];
+    float * im = NULL;
+    ttags * T = ttags_new();
 
-    time_t now = time(NULL);
-    struct tm * ptm = localtime(&now);
-    strftime(buf, buf_len, "%FT%T", ptm);
+    if(tiling == 0)
+    {
+        im = dw_read_image(s, s->imFile, T, &M, &N, &P, s->log);
+        if(im == NULL)
+        {
+            exit(EXIT_FAILURE);
+        }
 
-    fprintf(f, "%s\n", buf);
-    return;
-}
+        if(s->refFile != NULL)
+        {
+            int64_t rM = 0, rN = 0, rP = 0;
+            s->ref = fim_imread(s->refFile, NULL, &rM, &rN, &rP, s->verbosity);
+            if(s->ref == NULL)
+            {
+                fprintf(stderr, "Failed to open %s\n", s->imFile);
+                exit(1);
+            }
+            if( (rM != M) || (rN != N) || (rP != P) )
+            {
+                fprintf(stderr, "Image and reference image does not have matching size\n");
+                exit(1);
+            }
+        }
 
-float * psf_makeOdd(float * psf, int64_t * pM, int64_t * pN, int64_t *pP)
-{
-    // Expand the psf so that it had odd dimensions it if doesn't already have that
-    int64_t m = pM[0];
-    int64_t n = pN[0];
-    int64_t p = pP[0];
-    int reshape = 0;
-    if(m % 2 == 0)
-    { m++; reshape = 1;}
-    if(n % 2 == 0)
-    { n++; reshape = 1;}
-    if(p % 2 == 0)
-    { p++; reshape = 1;}
+    }
 
-    if(reshape == 0)
-    {  return psf; }
-    // printf("%d %d %d -> %d %d %d\n", pM[0], pN[0], pP[0], m, n, p);
-    float * psf2 = fim_zeros(m*n*p);
-    fim_insert(psf2, m, n, p, psf, pM[0], pN[0], pP[0]);
-    free(psf);
-    pM[0] = m;
-    pN[0] = n;
-    pP[0] = p;
-    return psf2;
-}
+    dw_set_software_tag(T);
 
+    // fim_tiff_write("identity.tif", im, M, N, P);
 
-void dcw_init_log(dw_opts * s)
-{
-    s->log = fopen(s->logFile, "w");
-    if (s->log == NULL)
+    // Possibly the PSF will be cropped even more per tile later on
+    if(1)
     {
-        fprintf(stderr, "Unable to open %s for writing\n", s->logFile);
-        fprintf(stderr,
-                "Please check that you have permissions to write to the folder\n"
-                "and that the drive is not full\n");
-        exit(EXIT_FAILURE);
+        psf = psf_autocrop(psf, &pM, &pN, &pP,
+                           M, N, P, s);
     }
-    assert(s->log != NULL);
-    show_time(s->log);
-    dw_opts_fprint(s->log, s);
-    dw_fprint_info(s->log, s);
-}
 
-void dcw_close_log(dw_opts * s)
-{
-    fprint_peak_memory(s->log);
-    show_time(s->log);
-    fclose(s->log);
-}
 
-double get_nbg(float * I, size_t N, float bg)
-{ // count the number of pixels in the image
-    // that are set to the background level
-    double nbg = 0;
-    for(size_t kk = 0; kk<N; kk++)
+    if(s->verbosity > 0)
     {
-        if(I[kk] == bg)
-        {
-            nbg++;
-        }
+        printf("Output: %s(.log.txt)\n", s->outFile);
     }
-    return nbg;
-}
-
-
-void flatfieldCorrection(dw_opts * s, float * im, int64_t M, int64_t N, int64_t P)
-{
-    printf("Experimental: applying flat field correction using %s\n",
-           s->flatfieldFile);
-    ttags * T = ttags_new();
-    int64_t m = 0, n = 0, p = 0;
-    float * C = fim_imread(s->flatfieldFile, T, &m, &n, &p, s->verbosity);
-    ttags_free(&T);
 
-    assert(m == M);
-    assert(n == N);
-    assert(p == 1);
+    myfftw_start(s->nThreads_FFT, s->verbosity, s->log);
 
-    // TODO:
-    // check that it is positive
+    float * out = NULL;
 
-    for(int64_t zz = 0; zz<P; zz++)
+    if(tiling)
     {
-        for(size_t pos = 0; pos < (size_t) M*N; pos++)
+        if(s->flatfieldFile != NULL)
         {
-            im[M*N*zz + pos] /= C[pos];
+            warning(stdout);
+            printf("Flat-field correction can't be used in tiled mode\n");
         }
+        int64_t pdims[3] = {pM, pN, pP};
+        deconvolve_tiles(M, N, P,
+                         1, &psf, pdims, NULL, // psf and size
+                         s);// settings
+        fim_free(psf);
+    } else {
+        out = dw_deconvolve_image(s, im, M, N, P,
+                                  psf, pM, pN, pP);
+        psf = NULL;
     }
-    free(C);
-}
-
-
-static void prefilter(dw_opts * s,
-                      float * im, int64_t M, int64_t N, int64_t P,
-                      __attribute__((unused)) float * psf,
-                      __attribute__((unused)) int64_t pM,
-                      __attribute__((unused)) int64_t pN,
-                      __attribute__((unused)) int64_t pP)
-{
 
-    if(s->psigma<= 0)
+    if(tiling == 0)
     {
-        return;
+        fim_free(im);
+        dw_write_image(s, out, T, M, N, P);
     }
 
-    fim_anscombe(im, M*N*P);
-    fim_gsmooth(im, M, N, P, s->psigma);
-    fim_ianscombe(im, M*N*P);
+    ttags_free(&T);
 
-    return;
-}
+    if(s->verbosity > 1)
+    {
+        printf("Finalizing "); fflush(stdout);
+    }
 
-/** Create initial guess: the fft of an image that is 1 in MNP and 0
- * outside M, N, P is the dimension of the microscopic image
- *
- * Possibly more stable to use the mean of the input image rather than 1
- */
-fftwf_complex * initial_guess(const int64_t M, const int64_t N, const int64_t P,
-                              const int64_t wM, const int64_t wN, const int64_t wP)
-{
-    assert(wM >= M); assert(wN >= N); assert(wP >= P);
+    fim_free(out);
+    myfftw_stop();
+    fim_pool_trim();
 
-    float * one = fim_zeros(wM*wN*wP);
+    dw_gettime(&tend);
+    fprintf(s->log, "Took: %f s\n", timespec_diff(&tend, &tstart));
+    dw_fprint_memory(s->log, s, est_mem);
+    fft_plan_stats_fprint(s->log);
+    fim_pool_fprint(s->log);
+    dcw_close_log(s);
 
-#pragma omp parallel for shared(one)
-    for(int64_t cc = 0; cc < P; cc++) {
-        for(int64_t bb = 0; bb < N; bb++) {
-            for(int64_t aa = 0; aa < M; aa++) {
-                one[aa + wM*bb + wM*wN*cc] = 1;
-            }
-        }
+    if(s->verbosity > 1)
+    {
+        fprint_peak_memory(stdout);
+        fft_plan_stats_fprint(stdout);
+        fim_pool_fprint(stdout);
+        dw_fprint_memory(stdout, s, est_mem);
     }
-    //printf("writing to one.tif");
-    //fim_tiff_write_float("one.tif", one, NULL, wM, wN, wP);
-    //  writetif("one.tif", one, wM, wN, wP);
 
-    fftwf_complex * Fone = fft(one, wM, wN, wP);
+    if(s->verbosity > 0)
+    { printf("Done!\n"); }
 
-    fim_free(one);
-    return Fone;
-}
+    dw_opts_free(&s);
 
-static void dw_set_omp_threads(const dw_opts *s)
-{
-#ifdef _OPENMP
-#ifdef MKL
-    mkl_set_num_threads(s->nThreads_FFT);
-    fprintf(s->log, "Set the number of MKL threads to %d\n", s->nThreads_FFT);
-#else
-    omp_set_num_threads(s->nThreads_OMP);
-    fprintf(s->log, "Set the number of OMP threads to %d\n", s->nThreads_OMP);
-    /* Fastest of static, dynamic and guided in limited tests */
-    omp_set_dynamic(false);
-    omp_set_schedule(omp_sched_static, 0);
-    fprintf(s->log, "Using static scheduling for OMP\n");
-    /* Better on heavily loaded machine? */
-    //omp_set_schedule(omp_sched_guided, 0);
-#endif
-#endif
-    return;
+    return 0;
 }
 
-int dw_run(dw_opts * s)
+/* Multi-channel mode, i.e., when more than one PSF is given.
+ * The image is an ImageJ hyperstack with one channel per PSF. It is
+ * split into one raw file per channel in a single pass. The PSFs are
+ * padded to a common size so that all channels use the same job size
+ * and hence share the FFTW plans. With tiling, all channels of a tile
+ * are processed before the next tile. */
+static int dw_run_channels(dw_opts * s)
 {
     struct timespec tstart, tend;
     dw_gettime(&tstart);
@@ -2400,346 +5602,714 @@ int dw_run(dw_opts * s)
 
     fim_tiff_init();
     fim_tiff_set_log(s->log);
-    if(s->verbosity > 2)
+
+    const int nCh = s->nChannels;
+    int64_t M = 0, N = 0, P = 0;
+    if(npyfilename(s->imFile) || fim_imread_size(s->imFile, &M, &N, &P))
     {
-        fim_tiff_set_log(s->log);
+        fprintf(stderr, "ERROR: With more than one PSF, %s has to be "
+                "a tif file with one channel per PSF\n", s->imFile);
+        exit(EXIT_FAILURE);
+    }
+    int nChFile = fim_tiff_get_channels(s->imFile);
+    if(nChFile != nCh)
+    {
+        fprintf(stderr, "ERROR: %s has %d channel(s) according to the "
+                "metadata but %d PSFs were given\n",
+                s->imFile, nChFile, nCh);
+        exit(EXIT_FAILURE);
+    }
+    if(P % nCh != 0)
+    {
+        fprintf(stderr, "ERROR: %s has %" PRId64 " planes which is not "
+                "a multiple of %d channels\n", s->imFile, P, nCh);
+        exit(EXIT_FAILURE);
     }
+    P /= nCh;
 
-    int64_t M = 0, N = 0, P = 0;
-    if(fim_imread_size(s->imFile, &M, &N, &P))
+    if(s->verbosity > 1)
     {
-        printf("fim_imread_size failed to open %s\n", s->imFile);
-        return -1;
-    } else {
-        if(s->verbosity > 3)
-        {
-            printf("Got image info from %s\n", s->imFile);
-        }
+        printf("Image dimensions: %" PRId64 " x %" PRId64 " x %" PRId64
+               ", %d channels\n", M, N, P, nCh);
+    }
+    fprintf(s->log, "%d channels of size %" PRId64 " x %" PRId64 " x %" PRId64 "\n",
+            nCh, M, N, P);
+
+    float ** psf = malloc(nCh*sizeof(float*));
+    assert(psf != NULL);
+    int64_t * pdims = malloc(3*nCh*sizeof(int64_t));
+    assert(pdims != NULL);
+    int64_t pM = 0, pN = 0, pP = 0;
+    for(int cc = 0; cc < nCh; cc++)
+    {
+        int64_t * d = pdims + 3*cc;
+        psf[cc] = dw_read_psf(s, s->psfFiles[cc], d, d+1, d+2);
+        pM = int64_t_max(pM, d[0]);
+        pN = int64_t_max(pN, d[1]);
+        pP = int64_t_max(pP, d[2]);
+    }
+
+    /* The channels are processed one after the other, the estimate
+     * is for one channel with the largest PSF */
+    size_t est_mem = dw_apply_max_mem(s, M, N, P, pM, pN, pP);
+    fprintf(s->log, "Estimated peak memory: %.2f GB\n", est_mem/1e9);
+
+    int tiling = dw_tiling_needed(s, M, N, P);
+
+    /* Split the channels, the input file is only read once */
+    char ** rawFiles = malloc(nCh*sizeof(char*));
+    assert(rawFiles != NULL);
+    for(int cc = 0; cc < nCh; cc++)
+    {
+        char * chFile = malloc(strlen(s->imFile) + 32);
+        assert(chFile != NULL);
+        sprintf(chFile, "%s.c%d", s->imFile, cc+1);
+        rawFiles[cc] = dw_raw_copy_file(s, chFile);
+        free(chFile);
+    }
+    if(s->verbosity > 0)
+    {
+        printf("Splitting %s into %d channels\n", s->imFile, nCh);
+    }
+    ttags * T = ttags_new();
+    if(fim_tiff_to_raw_f32_channels(s->imFile, nCh, rawFiles, T))
+    {
+        fprintf(stderr, "ERROR: Failed to read the channels of %s\n", s->imFile);
+        exit(EXIT_FAILURE);
     }
+    dw_set_software_tag(T);
 
+    // Possibly the PSFs will be cropped even more per tile later on
+    for(int cc = 0; cc < nCh; cc++)
+    {
+        int64_t * d = pdims + 3*cc;
+        psf[cc] = psf_autocrop(psf[cc], d, d+1, d+2,
+                               M, N, P, s);
+    }
+    psf_pad_common(psf, pdims, nCh);
     if(s->verbosity > 1)
     {
-        printf("Image dimensions: %" PRId64 " x %" PRId64 " x %" PRId64 "\n",
-               M, N, P);
+        printf("Common PSF size: %" PRId64 " x %" PRId64 " x %" PRId64 "\n",
+               pdims[0], pdims[1], pdims[2]);
     }
 
-
-    int tiling = 0;
-    if(s->tiling_maxSize > 0 && (M > s->tiling_maxSize || N > s->tiling_maxSize))
+    if(s->verbosity > 0)
     {
-        tiling = 1;
+        printf("Output: %s(.log.txt)\n", s->outFile);
     }
 
-    float * im = NULL;
-    ttags * T = ttags_new();
+    myfftw_start(s->nThreads_FFT, s->verbosity, s->log);
 
-    if(tiling == 0)
+    if(tiling)
     {
-        if(s->verbosity > 0 )
-        {
-            printf("Reading %s\n", s->imFile);
-        }
-
-        im = fim_imread(s->imFile, T, &M, &N, &P, s->verbosity);
-        if(im == NULL)
-        {
-            fprintf(stderr, "Failed to open %s\n", s->imFile);
-            exit(EXIT_FAILURE);
-        }
-
-        if(s->verbosity > 4)
+        deconvolve_tiles(M, N, P,
+                         nCh, psf, pdims, rawFiles,
+                         s);
+    } else {
+        /* Scaling set on the command line, if any */
+        const float scaling = s->scaling;
+        char * outFile = s->outFile;
+        char ** outFiles = malloc(nCh*sizeof(char*));
+        assert(outFiles != NULL);
+        for(int cc = 0; cc < nCh; cc++)
         {
-            if(M > 9)
-            {
-                printf("image data: ");
-                for(size_t kk = 0; kk<10; kk++)
-                {
-                    printf("%f ", im[kk]);
-                }
-                printf("\n");
-            }
-            printf("Done reading\n"); fflush(stdout);
+            outFiles[cc] = dw_channel_file(s, cc);
         }
 
-        if(s->auto_zcrop > 0)
+        for(int cc = 0; cc < nCh; cc++)
         {
             if(s->verbosity > 0)
             {
-                printf("Cropping the image to %" PRId64 " x %" PRId64 " x %d\n",
-                       M, N, s->auto_zcrop);
+                printf("-> Channel %d / %d\n", cc+1, nCh);
             }
-            float * zim = fim_auto_zcrop(im, M, N, P, s->auto_zcrop);
-            if(zim == NULL)
+            fprintf(s->log, "-> Channel %d / %d: %s -> %s\n", cc+1, nCh,
+                    s->psfFiles[cc], outFiles[cc]);
+
+            float * im = dw_read_raw(rawFiles[cc], (size_t) M*N*P);
+            if(dw_check_image(s, im, M, N, P, s->log))
             {
-                fprintf(stderr,
-                        "Automatic cropping failed\n");
                 exit(EXIT_FAILURE);
             }
+            int64_t * d = pdims + 3*cc;
+            /* Also gives one checkpoint file per channel */
+            s->outFile = outFiles[cc];
+            float * out = dw_deconvolve_image(s, im, M, N, P,
+                                              fim_copy(psf[cc], d[0]*d[1]*d[2]),
+                                              d[0], d[1], d[2]);
             fim_free(im);
-            im = zim;
-            P = s->auto_zcrop;
 
+            s->scaling = scaling;
+            dw_write_image(s, out, T, M, N, P);
+            fim_free(out);
         }
-
-        if(s->zcrop > 0)
+        s->outFile = outFile;
+        for(int cc = 0; cc < nCh; cc++)
         {
-            if(2*s->zcrop > P)
-            {
-                fprintf(stderr, "Impossible to remove 2x%d planes from an image with %zu planes\n",
-                        s->zcrop, P);
-            }
-            if(s->verbosity > 0)
-            {
-                printf("Removing %d planes from the top and bottom of the image\n",
-                       s->zcrop);
-            }
-            float * zim = fim_zcrop(im, M, N, P, (size_t )s->zcrop);
-            if(zim == NULL)
-            {
-                fprintf(stderr,
-                        "Automatic cropping failed\n");
-                exit(EXIT_FAILURE);
-            }
-            fim_free(im);
-            im = zim;
-            P = P - 2*s->zcrop;
-            if(s->verbosity > 0)
-            {
-                printf("New image size: [%" PRId64 "x %" PRId64 "x %" PRId64 "]\n",
-                       M, N, P);
-            }
+            free(outFiles[cc]);
         }
+        free(outFiles);
+    }
+
+    ttags_free(&T);
+    for(int cc = 0; cc < nCh; cc++)
+    {
+        remove(rawFiles[cc]);
+        free(rawFiles[cc]);
+        fim_free(psf[cc]);
+    }
+    free(rawFiles);
+    free(psf);
+    free(pdims);
+
+    myfftw_stop();
+    fim_pool_trim();
+
+    dw_gettime(&tend);
+    fprintf(s->log, "Took: %f s\n", timespec_diff(&tend, &tstart));
+    dw_fprint_memory(s->log, s, est_mem);
+    fft_plan_stats_fprint(s->log);
+    fim_pool_fprint(s->log);
+    dcw_close_log(s);
+
+    if(s->verbosity > 1)
+    {
+        fprint_peak_memory(stdout);
+        fft_plan_stats_fprint(stdout);
+        fim_pool_fprint(stdout);
+        dw_fprint_memory(stdout, s, est_mem);
+    }
+
+    if(s->verbosity > 0)
+    { printf("Done!\n"); }
+
+    dw_opts_free(&s);
+
+    return 0;
+}
+
+/* Read the list of images for --batch, one file name per line.
+ * Empty lines and lines starting with # are ignored. */
+static char ** dw_read_batch_list(const char * listFile, int * nFiles)
+{
+    FILE * fid = fopen(listFile, "r");
+    if(fid == NULL)
+    {
+        fprintf(stderr, "ERROR: Can't open %s\n", listFile);
+        exit(EXIT_FAILURE);
+    }
 
+    int nalloc = 64;
+    int n = 0;
+    char ** files = malloc(nalloc*sizeof(char*));
+    assert(files != NULL);
 
-        if(fim_min(im, M*N*P) < 0)
+    char * line = NULL;
+    size_t len = 0;
+    while(getline(&line, &len, fid) != -1)
+    {
+        size_t l = strlen(line);
+        while(l > 0 && (line[l-1] == '\n' || line[l-1] == '\r'
+                        || line[l-1] == ' ' || line[l-1] == '\t'))
         {
-            fprintf(stderr,
-                    "ERROR: The image contains negative values, can not continue!\n");
-            fprintf(s->log,
-                    "ERROR: The image contains negative values, can not continue!\n");
-            exit(EXIT_FAILURE);
+            line[--l] = '\0';
         }
-        float maxval = fim_max(im, M*N*P);
-        if(maxval < 1.0)
+        if(l == 0 || line[0] == '#')
         {
-            fprintf(stderr,
-                    "ERROR: The image has too low intensity, can not continue!\n");
-            fprintf(s->log,
-                    "ERROR: The image has too low intensity, can not continue!\n");
-            fprintf(s->log, "The largest value of the input image is %f\n",
-                    maxval);
-            exit(EXIT_FAILURE);
+            continue;
         }
-
-        if(maxval < 100)
+#ifdef WINDOWS
+        char * name = strdup(line);
+#else
+        char * name = realpath(line, 0);
+#endif
+        if(name == NULL)
         {
-            if(s->verbosity > 0)
-            {
-                printf("WARNING: The largest value of the input image is %f\n",
-                       maxval);
-            }
-            fprintf(s->log,
-                    "WARNING: The largest value of the input image is %f\n",
-                    maxval);
+            /* Does not exist, reported and skipped by dw_run_batch */
+            name = strdup(line);
+            assert(name != NULL);
+        }
+        if(n == nalloc)
+        {
+            nalloc *= 2;
+            files = realloc(files, nalloc*sizeof(char*));
+            assert(files != NULL);
         }
+        files[n++] = name;
+    }
+    free(line);
+    fclose(fid);
 
+    nFiles[0] = n;
+    return files;
+}
 
-        if(s->refFile != NULL)
+/* Deconvolve the 2D images files[idx[0]], ..., files[idx[n-1]], all of
+ * size [M x N], together as a [M x N x n] stack, see --stack2d. The
+ * FFTs are batched 2D transforms and the 2D PSF, [pM x pN], is shared
+ * by all images. The output is written per image, each with its own
+ * log. Progress of the iterations goes to batchlog. Images that can't
+ * be read are skipped, returns the number of deconvolved images. */
+static int dw_deconvolve_stack2d(dw_opts * s, char ** files,
+                                  const int * idx, int n,
+                                  int64_t M, int64_t N,
+                                  const float * psf, int64_t pM, int64_t pN,
+                                  float scaling, FILE * batchlog)
+{
+    const size_t MN = M*N;
+    float * stack = fim_malloc(MN*n*sizeof(float));
+    ttags ** T = malloc(n*sizeof(ttags*));
+    assert(T != NULL);
+    /* The files that could be read */
+    int * ok = malloc(n*sizeof(int));
+    assert(ok != NULL);
+
+    int nok = 0;
+    for(int kk = 0; kk < n; kk++)
+    {
+        int64_t m = 0, nn = 0, p = 0;
+        T[nok] = ttags_new();
+        float * im = dw_read_image(s, files[idx[kk]], T[nok],
+                                   &m, &nn, &p, batchlog);
+        if(im == NULL)
         {
-            int64_t rM = 0, rN = 0, rP = 0;
-            s->ref = fim_imread(s->refFile, NULL, &rM, &rN, &rP, s->verbosity);
-            if(s->ref == NULL)
-            {
-                fprintf(stderr, "Failed to open %s\n", s->imFile);
-                exit(1);
-            }
-            if( (rM != M) || (rN != N) || (rP != P) )
-            {
-                fprintf(stderr, "Image and reference image does not have matching size\n");
-                exit(1);
-            }
+            fprintf(batchlog, "Could not read %s, skipped\n", files[idx[kk]]);
+            ttags_free(&T[nok]);
+            continue;
         }
+        assert(m == M && nn == N && p == 1);
+        memcpy(stack + nok*MN, im, MN*sizeof(float));
+        fim_free(im);
+        ok[nok++] = idx[kk];
+    }
+    if(nok == 0)
+    {
+        fim_free(stack);
+        free(T);
+        free(ok);
+        return 0;
+    }
+    n = nok;
 
+    fprintf(batchlog, "-> Stack of %d images\n", n);
+    if(s->verbosity > 0)
+    {
+        printf("-> Deconvolving a stack of %d images\n", n);
     }
 
-    // Set up the string for the TIFFTAG_SOFTWARE
-    char * swstring = malloc(1024);
-    assert(swstring != NULL);
-    sprintf(swstring, "deconwolf %s", deconwolf_version);
-    ttags_set_software(T, swstring);
-    free(swstring);
+    fft_set_batch2d(1);
+    float * out = dw_deconvolve_image(s, stack, M, N, n,
+                                      fim_copy(psf, pM*pN), pM, pN, 1);
+    fft_set_batch2d(0);
+    fim_free(stack);
 
-    // fim_tiff_write("identity.tif", im, M, N, P);
+    for(int kk = 0; kk < n; kk++)
+    {
+        free(s->imFile);
+        s->imFile = strdup(files[ok[kk]]);
+        assert(s->imFile != NULL);
+        dw_set_outfile(s, s->batchOut);
+        s->scaling = scaling;
+        dcw_init_log(s);
+        fprintf(s->log, "Deconvolved as image %d / %d of a 2D stack, "
+                "see the batch log\n", kk+1, n);
+        dw_set_software_tag(T[kk]);
+        fim_tiff_set_log(s->log);
+        dw_write_image(s, out + kk*MN, T[kk], M, N, 1);
+        ttags_free(&T[kk]);
+        dcw_close_log(s);
+    }
+    s->log = batchlog;
+    fim_tiff_set_log(batchlog);
+    free(T);
+    free(ok);
+    fim_free(out);
+    return n;
+}
 
-    int64_t pM = 0, pN = 0, pP = 0;
-    float * psf = NULL;
+/* Batch mode, --batch
+ * Deconvolve all images listed in s->batchFile with the same PSF.
+ * The FFTW plans and the transformed PSF are kept between the
+ * images. While one image is deconvolved the next is read from disk.
+ */
+static int dw_run_batch(dw_opts * s)
+{
+    struct timespec tstart, tend;
+    dw_gettime(&tstart);
 
-    if(s->verbosity > 0)
+    if(s->refFile != NULL)
     {
-        printf("Reading %s\n", s->psfFile);
+        fprintf(stderr, "ERROR: --ref can't be used with --batch\n");
+        exit(EXIT_FAILURE);
     }
-    psf = fim_imread(s->psfFile, NULL, &pM, &pN, &pP, s->verbosity);
-    if(psf == NULL)
+
+    int nFiles = 0;
+    char ** files = dw_read_batch_list(s->batchFile, &nFiles);
+    if(nFiles == 0)
     {
-        fprintf(stderr, "Failed to open %s\n", s->psfFile);
-        exit(1);
+        fprintf(stderr, "ERROR: No images listed in %s\n", s->batchFile);
+        exit(EXIT_FAILURE);
     }
-    if(s->verbosity > 4)
+
+    /* The log for the whole batch, each image gets its own as well */
+    dcw_init_log(s);
+    FILE * batchlog = s->log;
+    fprintf(batchlog, "%d images listed in %s\n", nFiles, s->batchFile);
+
+    s->verbosity > 1 ? dw_fprint_info(NULL, s) : 0;
+    dw_set_omp_threads(s);
+#ifdef _OPENMP
+    /* One level for the prefetching and one for the processing */
+    omp_set_max_active_levels(2);
+#endif
+
+    logfile = stdout;
+
+    fim_tiff_init();
+    fim_tiff_set_log(batchlog);
+
+    /* Get the image sizes up front, after --zcrop or --auto-zcrop.
+     * Files that can't be read get the size 0 and are skipped */
+    int nFailed = 0;
+    int64_t * dims = malloc(3*nFiles*sizeof(int64_t));
+    assert(dims != NULL);
+    for(int kk = 0; kk < nFiles; kk++)
     {
-        if(M > 9)
+        int64_t * d = dims + 3*kk;
+        if(fim_imread_size(files[kk], d, d+1, d+2))
         {
-            printf("image data: ");
-            for(size_t kk = 0; kk<10; kk++)
-            {
-                printf("%f ", psf[kk]);
-            }
-            printf("\n");
+            fprintf(stderr, "WARNING: Can't read %s, skipping it\n", files[kk]);
+            fprintf(batchlog, "WARNING: Can't read %s, skipping it\n", files[kk]);
+            d[0] = 0; d[1] = 0; d[2] = 0;
+            nFailed++;
+            continue;
         }
-    }
-
-    if(fim_maxAtOrigo(psf, pM, pN, pP) == 0)
-    {
-        /* It might still be centered between pixels */
-        if(s->verbosity > 0)
+        d[2] = dw_cropped_planes(s, d[2]);
+        if(d[2] < 1)
         {
-            warning(stdout);
-            printf("The PSF is not centered!\n");
+            fprintf(stderr, "WARNING: %s has too few planes for --zcrop, "
+                    "skipping it\n", files[kk]);
+            fprintf(batchlog, "WARNING: %s has too few planes for --zcrop, "
+                    "skipping it\n", files[kk]);
+            d[0] = 0; d[1] = 0; d[2] = 0;
+            nFailed++;
         }
-        fprintf(s->log, " ! The PSF is not centered\n");
     }
 
-    // Possibly the PSF will be cropped even more per tile later on
+    int64_t pM = 0, pN = 0, pP = 0;
+    float * psf = dw_read_psf(s, s->psfFile, &pM, &pN, &pP);
 
-    fim_normalize_sum1(psf, pM, pN, pP);
-    if(1)
+    /* 2D images are deconvolved in stacks, see --stack2d */
+    const int stack2d = s->stack2d > 0 && pP == 1;
+    if(s->stack2d > 0 && pP > 1)
     {
-        psf = psf_autocrop(psf, &pM, &pN, &pP,
-                           M, N, P, s);
+        warning(stdout);
+        printf("--stack2d requires a 2D PSF, not used\n");
+        fprintf(batchlog, "--stack2d requires a 2D PSF, not used\n");
     }
 
-
-    if(s->verbosity > 0)
+    /* The settings for --max-mem are based on the largest job, a 2D
+     * image counts as a full stack */
+    int largest = 0;
+    int64_t largestP = 0;
+    for(int kk = 0; kk < nFiles; kk++)
     {
-        printf("Output: %s(.log.txt)\n", s->outFile);
+        int64_t P = dims[3*kk+2];
+        if(stack2d && P == 1)
+        {
+            P = s->stack2d;
+        }
+        if(dims[3*kk]*dims[3*kk+1]*P >
+           dims[3*largest]*dims[3*largest+1]*largestP)
+        {
+            largest = kk;
+            largestP = P;
+        }
     }
+    size_t est_mem = dw_apply_max_mem(s, dims[3*largest], dims[3*largest+1],
+                                      largestP, pM, pN, pP);
+    fprintf(batchlog, "Estimated peak memory: %.2f GB\n", est_mem/1e9);
 
-    myfftw_start(s->nThreads_FFT, s->verbosity, s->log);
+    /* The PSF cropped for the last image size */
+    float * cpsf = NULL;
+    int64_t cpM = 0, cpN = 0, cpP = 0;
+    int64_t cM = 0, cN = 0, cP = 0;
 
-    float * out = NULL;
+    myfftw_start(s->nThreads_FFT, s->verbosity, batchlog);
+    s->otf_cache = dw_otf_cache_new(DW_OTF_CACHE_SIZE);
 
-    if(tiling)
+    /* Scaling set on the command line, if any */
+    const float scaling = s->scaling;
+
+    /* Prefetched image */
+    float * next_im = NULL;
+    ttags * next_T = NULL;
+    int64_t nM = 0, nN = 0, nP = 0;
+
+    int nDone = 0;
+    for(int kk = 0; kk < nFiles; kk++)
     {
-        if(s->flatfieldFile != NULL)
+        free(s->imFile);
+        s->imFile = strdup(files[kk]);
+        assert(s->imFile != NULL);
+        dw_set_outfile(s, s->batchOut);
+        s->scaling = scaling;
+
+        if(s->verbosity > 0)
         {
-            warning(stdout);
-            printf("Flat-field correction can't be used in tiled mode\n");
+            printf("-> Image %d / %d: %s\n", kk+1, nFiles, s->imFile);
         }
-        deconvolve_tiles(M, N, P,
-                         psf, pM, pN, pP, // psf and size
-                         s);// settings
-        fim_free(psf);
-    } else {
-        fim_normalize_sum1(psf, pM, pN, pP);
-        if(s->flatfieldFile != NULL)
+        fprintf(batchlog, "-> Image %d / %d: %s -> %s\n", kk+1, nFiles,
+                s->imFile, s->outFile);
+        if(dims[3*kk] == 0)
         {
-            flatfieldCorrection(s, im, M, N, P);
+            /* Could not be read, see above */
+            continue;
         }
 
-        /* Pre filter by psigma */
-        prefilter(s, im, M, N, P, psf, pM, pN, pP);
+        int64_t M = dims[3*kk];
+        int64_t N = dims[3*kk+1];
+        int64_t P = dims[3*kk+2];
+        int tiling = dw_tiling_needed(s, M, N, P);
 
-        if(s->offset > 0)
+        if(!s->iterdump && s->overwrite == 0 && dw_isfile(s->outFile))
         {
-            fim_add_scalar(im, M*N*P, s->offset);
+            printf("%s already exist, skipping. "
+                   "Use --overwrite to overwrite existing files.\n",
+                   s->outFile);
+            fprintf(batchlog, "%s already exist, skipping\n", s->outFile);
+            if(next_im != NULL)
+            {
+                fim_free(next_im);
+                next_im = NULL;
+                ttags_free(&next_T);
+            }
+            continue;
         }
 
-        /* Note: psf is freed bu the deconvolve_* functions*/
-        out = s->fun(im, M, N, P, // input image and size
-                     psf, pM, pN, pP, // psf and size
-                     s);// settings
+        /* With --stack2d, this and the following 2D images of the
+         * same size are handled by dw_deconvolve_stack2d */
+        const int stacked = stack2d && P == 1 && tiling == 0;
 
-        if(s->offset > 0)
+        struct timespec t0, t1;
+        dw_gettime(&t0);
+        if(stacked == 0)
         {
-            fim_add_scalar(im, M*N*P, -s->offset);
-            fim_project_positive(im, M*N*P);
+            dcw_init_log(s);
+            fim_tiff_set_log(s->log);
         }
 
-        psf = NULL;
-    }
-
-    if(tiling == 0)
-    {
-        fim_free(im);
+        float * im = next_im;
+        ttags * T = next_T;
+        next_im = NULL;
+        next_T = NULL;
+        if(im != NULL)
+        {
+            M = nM; N = nN; P = nP;
+        } else {
+            T = ttags_new();
+            if(tiling == 0 && stacked == 0)
+            {
+                im = dw_read_image(s, s->imFile, T, &M, &N, &P, s->log);
+            }
+            if(tiling == 0 && stacked == 0 && im == NULL)
+            {
+                fprintf(batchlog, "Could not read %s, skipped\n", s->imFile);
+                nFailed++;
+                ttags_free(&T);
+                dcw_close_log(s);
+                s->log = batchlog;
+                fim_tiff_set_log(batchlog);
+                continue;
+            }
+        }
+        dw_set_software_tag(T);
 
+        /* Crop the PSF unless already done for this image size */
+        if(cpsf == NULL || cM != M || cN != N || cP != P)
+        {
+            fim_free(cpsf);
+            cpsf = fim_copy(psf, pM*pN*pP);
+            cpM = pM; cpN = pN; cpP = pP;
+            cpsf = psf_autocrop(cpsf, &cpM, &cpN, &cpP,
+                                M, N, P, s);
+            cM = M; cN = N; cP = P;
+        }
 
-        if(out == NULL)
+        if(stacked)
         {
-            if(s->verbosity > 0)
+            /* Up to s->stack2d images, skipping those already done.
+             * These are never prefetched. */
+            assert(im == NULL);
+            ttags_free(&T);
+            int * idx = malloc(s->stack2d*sizeof(int));
+            assert(idx != NULL);
+            int n = 0;
+            idx[n++] = kk;
+            int next = kk + 1;
+            while(n < s->stack2d && next < nFiles
+                  && dims[3*next] == M && dims[3*next+1] == N
+                  && dims[3*next+2] == 1)
             {
-                printf("Nothing to write to disk :(\n");
+                free(s->imFile);
+                s->imFile = strdup(files[next]);
+                assert(s->imFile != NULL);
+                dw_set_outfile(s, s->batchOut);
+                if(!s->iterdump && s->overwrite == 0 && dw_isfile(s->outFile))
+                {
+                    printf("%s already exist, skipping. "
+                           "Use --overwrite to overwrite existing files.\n",
+                           s->outFile);
+                    fprintf(batchlog, "%s already exist, skipping\n",
+                            s->outFile);
+                } else {
+                    if(s->verbosity > 0)
+                    {
+                        printf("-> Image %d / %d: %s\n",
+                               next+1, nFiles, s->imFile);
+                    }
+                    fprintf(batchlog, "-> Image %d / %d: %s -> %s\n",
+                            next+1, nFiles, s->imFile, s->outFile);
+                    idx[n++] = next;
+                }
+                next++;
             }
-        } else
+
+            int nstack = dw_deconvolve_stack2d(s, files, idx, n, M, N,
+                                               cpsf, cpM, cpN, scaling,
+                                               batchlog);
+            free(idx);
+            nDone += nstack;
+            nFailed += n - nstack;
+            kk = next - 1;
+
+            dw_gettime(&t1);
+            fprintf(batchlog, "Took: %f s\n", timespec_diff(&t1, &t0));
+            continue;
+        }
+
+        /* Prefetch the next image if it is not processed in tiles and
+         * not going to be skipped */
+        const char * next_file = NULL;
+        if(kk + 1 < nFiles)
         {
-            double nZeros = get_nbg(out, M*N*P, s->bg);
-            fprintf(s->log, "%f%% pixels at bg level in the output image.\n", 100*nZeros/(M*N*P));
-            if(s->verbosity > 1)
+            int64_t * d = dims + 3*(kk+1);
+            int next_tiling = dw_tiling_needed(s, d[0], d[1], d[2]);
+            int next_stacked = stack2d && d[2] == 1;
+            size_t next_size = (size_t) d[0]*d[1]*d[2]*sizeof(float);
+            if(d[0] > 0 && next_tiling == 0 && next_stacked == 0 &&
+               (s->max_mem == 0 || est_mem + next_size <= s->max_mem))
             {
-                printf("%f%% pixels at bg level in the output image.\n", 100*nZeros/(M*N*P));
-                printf("Writing to %s\n", s->outFile); fflush(stdout);
-                printf("Outformat: %d\n", s->outFormat);
+                next_file = files[kk+1];
             }
+        }
 
-
-            if(s->outFormat == 32)
+        float * out = NULL;
+        if(tiling)
+        {
+            if(s->flatfieldFile != NULL)
+            {
+                warning(stdout);
+                printf("Flat-field correction can't be used in tiled mode\n");
+            }
+            /* deconvolve_tiles reads from s->imFile, no overlap with
+             * reading of the next image here */
+            int64_t cpdims[3] = {cpM, cpN, cpP};
+            deconvolve_tiles(M, N, P,
+                             1, &cpsf, cpdims, NULL,
+                             s);
+        } else {
+#pragma omp parallel num_threads(2)
             {
-                if(s->iterdump)
+                int id = 0;
+                int nt = 1;
+#ifdef _OPENMP
+                id = omp_get_thread_num();
+                nt = omp_get_num_threads();
+#endif
+                /* Thread 0 deconvolves so that the FFTW plans from
+                 * the previous file are found, see fft_train. With
+                 * only one thread it reads the next image after. */
+                if(id == 0)
                 {
-                    char * outFile = gen_iterdump_name(s, s->nIter);
-                    fim_imwrite_f32(outFile, out, T, M, N, P);
-                    free(outFile);
-                } else {
-                    fim_imwrite_f32(s->outFile, out, T, M, N, P);
+                    out = dw_deconvolve_image(s, im, M, N, P,
+                                              fim_copy(cpsf, cpM*cpN*cpP),
+                                              cpM, cpN, cpP);
                 }
-            } else {
-                if(s->iterdump)
+                if(id == (nt > 1 ? 1 : 0) && next_file != NULL)
                 {
-                    char * outFile = gen_iterdump_name(s, s->nIter);
-                    float scaling = scaling_for_u16(out, M*N*P);
-                    fim_imwrite_u16(outFile, out, T, M, N, P, scaling);
-                    free(outFile);
-                } else {
-                    if(s->scaling <= 0)
+#ifdef _OPENMP
+                    /* Reading is limited by the disk, leave the
+                     * cores to the deconvolution */
+                    omp_set_num_threads(1);
+#endif
+                    next_T = ttags_new();
+                    next_im = dw_read_image(s, next_file, next_T,
+                                            &nM, &nN, &nP, batchlog);
+                    if(next_im == NULL)
                     {
-                        s->scaling = scaling_for_u16(out, M*N*P);
+                        /* Read again, and skipped, in the next round */
+                        ttags_free(&next_T);
                     }
-                    fprintf(s->log, "scaling: %f\n", s->scaling);
-                    fim_imwrite_u16(s->outFile, out, T, M, N, P, s->scaling);
                 }
             }
+            fim_free(im);
+            dw_write_image(s, out, T, M, N, P);
+            fim_free(out);
         }
+        ttags_free(&T);
+
+        dw_gettime(&t1);
+        fprintf(s->log, "Took: %f s\n", timespec_diff(&t1, &t0));
+        dcw_close_log(s);
+        s->log = batchlog;
+        fim_tiff_set_log(batchlog);
+        nDone++;
     }
 
-    ttags_free(&T);
-
+    dw_otf_cache_fprint_stats(batchlog, s->otf_cache);
     if(s->verbosity > 1)
     {
-        printf("Finalizing "); fflush(stdout);
+        dw_otf_cache_fprint_stats(stdout, s->otf_cache);
     }
+    dw_otf_cache_free(s->otf_cache);
+    s->otf_cache = NULL;
+
+    fim_free(cpsf);
+    fim_free(psf);
+    free(dims);
+    for(int kk = 0; kk < nFiles; kk++)
+    {
+        free(files[kk]);
+    }
+    free(files);
 
-    fim_free(out);
     myfftw_stop();
+    fim_pool_trim();
 
     dw_gettime(&tend);
-    fprintf(s->log, "Took: %f s\n", timespec_diff(&tend, &tstart));
+    fprintf(batchlog, "Deconvolved %d / %d images\n", nDone, nFiles);
+    if(nFailed > 0)
+    {
+        fprintf(batchlog, "%d images could not be deconvolved\n", nFailed);
+    }
+    fprintf(batchlog, "Took: %f s\n", timespec_diff(&tend, &tstart));
+    dw_fprint_memory(batchlog, s, est_mem);
+    fft_plan_stats_fprint(batchlog);
+    fim_pool_fprint(batchlog);
     dcw_close_log(s);
 
     if(s->verbosity > 1)
-    { fprint_peak_memory(stdout); }
+    { fprint_peak_memory(stdout); fft_plan_stats_fprint(stdout);
+        fim_pool_fprint(stdout); }
 
     if(s->verbosity > 0)
-    { printf("Done!\n"); }
+    { printf("Done! Deconvolved %d / %d images\n", nDone, nFiles); }
+    if(nFailed > 0)
+    {
+        fprintf(stderr, "WARNING: %d images could not be deconvolved\n", nFailed);
+    }
 
     dw_opts_free(&s);
 
-    return 0;
+    return nFailed == 0 ? 0 : -1;
 }
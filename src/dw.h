@@ -17,6 +17,7 @@
  */
 
 #include <assert.h>
+#include <ctype.h>
 #include <inttypes.h>
 #include <fftw3.h>
 #include <getopt.h>
@@ -63,6 +64,8 @@
 #endif
 
 #include "fim.h"
+#include "fim_half.h"
+#include "fim_simd.h"
 #include "fim_tiff.h"
 #include "fft.h"
 #include "tiling.h"
@@ -96,6 +99,9 @@ typedef enum {
     DW_START_LP,
     /* The input image itself */
     DW_START_IDENTITY,
+    /* Upsampled result of a few iterations on a downsampled copy of
+     * the image, see dw_pyramid_start */
+    DW_START_PYRAMID,
 } dw_start_condition;
 
 typedef enum {
@@ -109,10 +115,20 @@ typedef enum {
     DW_ITER_FIXED
 } dw_iter_type;
 
+typedef enum {
+    DW_ACCEL_NONE,
+    DW_ACCEL_ANDERSON /* See dw_accel.h */
+} dw_accel_type;
+
 
 struct _dw_opts; /* Forward declaration */
 typedef struct _dw_opts dw_opts;
 
+struct _dw_otf_cache; /* Defined in dw_otf.h */
+typedef struct _dw_otf_cache dw_otf_cache_t;
+struct _dw_otf; /* Defined in dw_otf.h */
+typedef struct _dw_otf dw_otf_t;
+
 typedef float * (*dw_function) (float * restrict im, const int64_t M, const int64_t N, const int64_t P,
                               float * restrict psf, const int64_t pM, const int64_t pN, const int64_t pP,
                               dw_opts * s);
@@ -123,8 +139,15 @@ struct _dw_opts{
 
     char * imFile;
     char * psfFile;
+    /* One PSF per channel for multi-channel images, psfFiles[0] is
+     * psfFile. NULL unless more than one PSF is given */
+    char ** psfFiles;
+    int nChannels;
+    char * batchFile; /* List of images for --batch */
+    char * batchOut; /* Output folder for --batch, possibly NULL */
     char * refFile; /* Name of reference image */
     char * tsvFile; /* Where to write tsv benchmark data */
+    char * traceFile; /* Timeline in the Chrome trace format, see --trace */
     float * ref; /* Reference image */
     char * outFile;
     char * logFile;
@@ -135,14 +158,31 @@ struct _dw_opts{
     FILE * tsv;
     int tiling_maxSize;
     int tiling_padding;
+    int tiling_maxSizeP; /* Largest tile size along z, -1 = no tiling in z */
+    int tiling_paddingP; /* Overlap between tiles along z */
+    int tile_workers; /* Number of tiles to process at once, 0 = auto */
+    int tiling_mmap; /* Use memory mapped files for the tiles, else stdio */
+    float tile_relerror; /* Stop each tile on this relative error, 0 = off */
+    int tile_miniter; /* Min number of iterations per tile with tile_relerror */
+    float tile_skip_bg; /* Don't deconvolve tiles with max below this, < 0 = off */
+    int tile_first; /* Only process tiles tile_first to tile_last (from 0), */
+    int tile_last;  /* -1 = all tiles, see --tiles */
+    char * tileOutDir; /* Write the tiles here instead of to the output, see --tile-out */
     int overwrite; /* overwrite output if exist */
 
     int nIter_auto; /* Automatic stopping? */
     int nIter; /* Fixed number of iterations, used when nIter_auto = 0 */
     int maxiter; /* Max number of iter for rel and abs mode */
+    int miniter; /* Min number of iter for rel and abs mode */
+    int * iter_done; /* If set, the number of iterations run is written here */
+    int checkpoint_iter; /* Write a checkpoint every this many iterations, 0 = off */
+    double checkpoint_time; /* or every this many minutes, 0 = off */
+    int resume; /* Continue from the checkpoint, if any, see dw_checkpoint.h */
     float err_rel;
     float err_abs;
     dw_iter_type iter_type;
+    int error_every; /* Evaluate the error every this many iterations, 0 = auto */
+    float error_sample; /* Fraction of the image rows used for the error */
 
     int verbosity;
     int color; /* Show colored things in terminal */
@@ -161,6 +201,13 @@ struct _dw_opts{
 
     /* Select what the initial guess should be */
     dw_start_condition start_condition;
+    int pyramid_iter; /* Iterations at half resolution for DW_START_PYRAMID */
+    dw_accel_type accel; /* See --accel */
+    int accel_window; /* History size for DW_ACCEL_ANDERSON */
+    int first_touch; /* See fim_set_first_touch and --first-touch */
+    int pool; /* Recycle large buffers, see fim_set_pool and --pool */
+    int stack2d; /* Max number of 2D images per stack with --batch, 0 = off */
+    const char * bind; /* OMP_PROC_BIND to use, NULL = as is, see --bind */
     /* How aggressive should the Biggs acceleration be.
      *  0 = off,
      *  1 = low/default, safe for most images
@@ -192,6 +239,7 @@ struct _dw_opts{
     int fulldump; /* write also what is outside of the image */
     /* How far should bigger image sizes be considered? */
     int lookahead;
+    int fft_pad; /* Max extra job size per dimension, see fft_plan_size */
     int eve; /* Use Exponential vector extrapolation */
 
     float alphamax;
@@ -204,7 +252,13 @@ struct _dw_opts{
     fftwf_plan ifft_plan;
     int fftw3_planning;
     int fft_inplace;
+    size_t max_mem; /* Memory budget in bytes, 0 = no limit, see --max-mem */
+    fim_dtype storage; /* Storage of W and the input image, see --storage */
+    int storage_momentum; /* Also store x-xp as s->storage */
     struct timespec tstart;
+
+    /* Transfer functions shared between tiles, NULL when not used */
+    dw_otf_cache_t * otf_cache;
 };
 
 
@@ -219,6 +273,10 @@ void dw_unittests();
 
 int  dw_run(dw_opts *);
 
+/* Subcommand merge-tiles: Combine tiles written with --tile-out to
+ * the output image */
+int dw_merge_tiles(int argc, char ** argv);
+
 /* Additive Vector Extrapolation (AVE) */
 float * deconvolve_ave(float * restrict im, const int64_t M, const int64_t N, const int64_t P,
                        float * restrict psf, const int64_t pM, const int64_t pN, const int64_t pP,
@@ -239,6 +297,30 @@ float * psf_autocrop(float * psf, int64_t * pM, int64_t * pN, int64_t * pP,  //
                      int64_t M, int64_t N, int64_t P, // image size
                      dw_opts * s);
 
+/* Initial guess for DW_START_PYRAMID.
+ * The image and the PSF are downsampled by 2 along each dimension and
+ * deconvolved with s->pyramid_iter iterations of s->fun. The result
+ * is upsampled to [M x N x P]. The PSF is not freed. Call before the
+ * FFT plans for the full size are created since it uses other
+ * plans. */
+float * dw_pyramid_start(const float * im, int64_t M, int64_t N, int64_t P,
+                         const float * psf, int64_t pM, int64_t pN, int64_t pP,
+                         dw_opts * s);
+
+/* Size of the FFTs, i.e. the job size, for an image of size
+ * [M x N x P] and a PSF of size [pM x pN x pP], depends on
+ * s->borderQuality */
+void dw_job_size(const dw_opts * s,
+                 int64_t M, int64_t N, int64_t P,
+                 int64_t pM, int64_t pN, int64_t pP,
+                 int64_t * wM, int64_t * wN, int64_t * wP);
+
+/* Estimated peak memory, in bytes, for deconvolution of an image of
+ * size [M x N x P] with one of the CPU methods. */
+size_t dw_estimate_memory(const dw_opts * s,
+                          int64_t M, int64_t N, int64_t P,
+                          int64_t pM, int64_t pN, int64_t pP);
+
 #define ANSI_COLOR_RED     "\x1b[31m"
 #define ANSI_COLOR_GREEN   "\x1b[32m"
 #define ANSI_COLOR_YELLOW  "\x1b[33m"
@@ -293,10 +375,17 @@ double clockdiff(struct timespec* end, struct timespec * start);
 /* Show a green dot and flush stdout */
 void putdot(const dw_opts *s);
 int64_t int64_t_max(int64_t a, int64_t b);
+int64_t int64_t_min(int64_t a, int64_t b);
 
 /* Write diagostics to s->tsv if open
  * To do: add timings as well (excluding) this function
 */
+/* Returns 1 if row, i.e. the index y + z*N, of the image is used to
+ * estimate the error with --error-sample f. The rows are selected by
+ * a hash of the index, so the same rows are used in all
+ * iterations. */
+int dw_error_row(int64_t row, float f);
+
 void benchmark_write(dw_opts * s, int iter, double fMSE, const float * x,
                      const int64_t M, const int64_t N, const int64_t P,
                      const int64_t wM, const int64_t wN, const int64_t wP);
@@ -315,11 +404,26 @@ typedef struct{
     float relerror; /* Relative error to stop at */
     float abserror; /* Absolute error to stop at */
     dw_iter_type itertype; /* Stop condition class */
+    int miniter; /* Don't stop on the error before this */
+    int * iter_done; /* Set to the number of iterations when done, if not NULL */
+    int error_every; /* See dw_iterator_need_error */
+    int error_always; /* Needed every iteration, i.e., for --tsv */
+    int error_iter; /* Iteration when error was set, -1 = never */
+    int lasterror_iter; /* and lasterror */
+    int nerror; /* Number of times the error was set */
 } dw_iterator_t;
 
 dw_iterator_t * dw_iterator_new(const dw_opts *);
 int dw_iterator_next(dw_iterator_t * );
+/* Returns 1 if the error is used in the current iteration, i.e.,
+ * for the stop condition or --tsv, see --error-every. When 0 the
+ * error does not have to be computed and dw_iterator_set_error
+ * should not be called. */
+int dw_iterator_need_error(const dw_iterator_t *);
 void dw_iterator_set_error(dw_iterator_t *, float);
+/* Restore the state after iter iterations, see --resume */
+void dw_iterator_resume(dw_iterator_t *, int iter,
+                        float error, float lasterror);
 void dw_iterator_show(dw_iterator_t *, const dw_opts *);
 void dw_iterator_free(dw_iterator_t * );
 
@@ -328,6 +432,9 @@ void dw_iterator_free(dw_iterator_t * );
 #include "method_shb_cl2.h"
 #endif
 
+#include "dw_otf.h"
+#include "dw_checkpoint.h"
+#include "dw_accel.h"
 #include "method_identity.h"
 #include "method_rl.h"
 #include "method_shb.h"
@@ -0,0 +1,389 @@
+/*    Copyright (C) 2020 Erik L. G. Wernersson
+ *
+ *    This program is free software: you can redistribute it and/or modify
+ *    it under the terms of the GNU General Public License as published by
+ *    the Free Software Foundation, either version 3 of the License, or
+ *    (at your option) any later version.
+ *
+ *    This program is distributed in the hope that it will be useful,
+ *    but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *    GNU General Public License for more details.
+ *
+ *    You should have received a copy of the GNU General Public License
+ *    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include "dw_accel.h"
+
+#define DW_ACCEL_MAXWINDOW 8
+/* Voxels per block when the dot products are computed, small enough
+ * for all the columns of a block to stay in cache */
+#define DW_ACCEL_CHUNK 4096
+
+struct dw_accel {
+    dw_accel_type type;
+    size_t n; /* Number of voxels */
+    float lb; /* Lower bound of the guess */
+    int m; /* Window size */
+    float * dF[DW_ACCEL_MAXWINDOW]; /* Differences of the residuals */
+    float * dG[DW_ACCEL_MAXWINDOW]; /* and of the outputs */
+    float * f; /* Last residual, G(x) - x */
+    float * g; /* Last output, G(x) */
+    int has_last; /* f and g are set */
+    int ncol; /* Number of columns in use in dF and dG */
+    int head; /* Column to write next */
+    float lasterror;
+    int has_lasterror;
+    int nrestart;
+    int napplied; /* Number of extrapolated guesses */
+};
+
+int dw_accel_nvolumes(const dw_opts * s)
+{
+    if(s->accel == DW_ACCEL_ANDERSON)
+    {
+        return 2*s->accel_window + 2;
+    }
+    return 0;
+}
+
+dw_accel_t * dw_accel_new(const dw_opts * s, size_t n, float lb)
+{
+    if(s->accel == DW_ACCEL_NONE)
+    {
+        return NULL;
+    }
+    assert(s->accel_window >= 1);
+    assert(s->accel_window <= DW_ACCEL_MAXWINDOW);
+
+    dw_accel_t * A = calloc(1, sizeof(dw_accel_t));
+    assert(A != NULL);
+    A->type = s->accel;
+    A->n = n;
+    A->lb = lb;
+    A->m = s->accel_window;
+    for(int kk = 0; kk < A->m; kk++)
+    {
+        A->dF[kk] = fim_malloc(n*sizeof(float));
+        A->dG[kk] = fim_malloc(n*sizeof(float));
+    }
+    A->f = fim_malloc(n*sizeof(float));
+    A->g = fim_malloc(n*sizeof(float));
+    return A;
+}
+
+void dw_accel_free(dw_accel_t * A)
+{
+    if(A == NULL)
+    {
+        return;
+    }
+    for(int kk = 0; kk < A->m; kk++)
+    {
+        fim_free(A->dF[kk]);
+        fim_free(A->dG[kk]);
+    }
+    fim_free(A->f);
+    fim_free(A->g);
+    free(A);
+}
+
+void dw_accel_fprint(FILE * f, const dw_accel_t * A)
+{
+    if(f == NULL || A == NULL)
+    {
+        return;
+    }
+    fprintf(f, "Anderson acceleration, window %d: %d extrapolated guesses, "
+            "%d restarts\n", A->m, A->napplied, A->nrestart);
+}
+
+/* Forget the history, the next iteration is not accelerated */
+static void dw_accel_restart(dw_accel_t * A)
+{
+    A->has_last = 0;
+    A->ncol = 0;
+    A->head = 0;
+    A->nrestart++;
+}
+
+/* H = dF'*dF and b = dF'*f, H is [ncol x ncol] with stride
+ * DW_ACCEL_MAXWINDOW. All dot products in one pass over the data. */
+static void dw_accel_gram(const dw_accel_t * A, double * H, double * b)
+{
+    const int nc = A->ncol;
+    const size_t n = A->n;
+    memset(H, 0, DW_ACCEL_MAXWINDOW*DW_ACCEL_MAXWINDOW*sizeof(double));
+    memset(b, 0, DW_ACCEL_MAXWINDOW*sizeof(double));
+
+#pragma omp parallel
+    {
+        double h[DW_ACCEL_MAXWINDOW*DW_ACCEL_MAXWINDOW] = {0};
+        double r[DW_ACCEL_MAXWINDOW] = {0};
+#pragma omp for
+        for(size_t c0 = 0; c0 < n; c0 += DW_ACCEL_CHUNK)
+        {
+            const size_t c1 = c0 + DW_ACCEL_CHUNK < n ? c0 + DW_ACCEL_CHUNK : n;
+            for(int aa = 0; aa < nc; aa++)
+            {
+                const float * restrict fa = A->dF[aa];
+                const float * restrict f = A->f;
+                double s = 0;
+                for(size_t kk = c0; kk < c1; kk++)
+                {
+                    s += fa[kk]*f[kk];
+                }
+                r[aa] += s;
+                for(int bb = 0; bb <= aa; bb++)
+                {
+                    const float * restrict fb = A->dF[bb];
+                    s = 0;
+                    for(size_t kk = c0; kk < c1; kk++)
+                    {
+                        s += fa[kk]*fb[kk];
+                    }
+                    h[aa*DW_ACCEL_MAXWINDOW + bb] += s;
+                }
+            }
+        }
+#pragma omp critical(dw_accel_gram)
+        {
+            for(int aa = 0; aa < nc; aa++)
+            {
+                b[aa] += r[aa];
+                for(int bb = 0; bb <= aa; bb++)
+                {
+                    H[aa*DW_ACCEL_MAXWINDOW + bb] += h[aa*DW_ACCEL_MAXWINDOW + bb];
+                }
+            }
+        }
+    }
+
+    for(int aa = 0; aa < nc; aa++)
+    {
+        for(int bb = aa+1; bb < nc; bb++)
+        {
+            H[aa*DW_ACCEL_MAXWINDOW + bb] = H[bb*DW_ACCEL_MAXWINDOW + aa];
+        }
+    }
+}
+
+/* Solve H*x = b, [n x n] with stride DW_ACCEL_MAXWINDOW, by Gaussian
+ * elimination with partial pivoting. H and b are destroyed. Returns 0
+ * on success. */
+static int dw_accel_solve(double * H, double * b, double * x, int n)
+{
+    const int S = DW_ACCEL_MAXWINDOW;
+    for(int kk = 0; kk < n; kk++)
+    {
+        int piv = kk;
+        for(int ii = kk+1; ii < n; ii++)
+        {
+            if(fabs(H[ii*S+kk]) > fabs(H[piv*S+kk]))
+            {
+                piv = ii;
+            }
+        }
+        if(!(fabs(H[piv*S+kk]) > 0))
+        {
+            return 1;
+        }
+        if(piv != kk)
+        {
+            for(int jj = 0; jj < n; jj++)
+            {
+                double t = H[kk*S+jj];
+                H[kk*S+jj] = H[piv*S+jj];
+                H[piv*S+jj] = t;
+            }
+            double t = b[kk]; b[kk] = b[piv]; b[piv] = t;
+        }
+        for(int ii = kk+1; ii < n; ii++)
+        {
+            double w = H[ii*S+kk]/H[kk*S+kk];
+            for(int jj = kk; jj < n; jj++)
+            {
+                H[ii*S+jj] -= w*H[kk*S+jj];
+            }
+            b[ii] -= w*b[kk];
+        }
+    }
+    for(int kk = n-1; kk >= 0; kk--)
+    {
+        double v = b[kk];
+        for(int jj = kk+1; jj < n; jj++)
+        {
+            v -= H[kk*S+jj]*x[jj];
+        }
+        x[kk] = v/H[kk*S+kk];
+        if(!isfinite(x[kk]))
+        {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+void dw_accel_apply(dw_accel_t * A, float * x, const float * xin,
+                    float error, int has_error)
+{
+    if(A == NULL)
+    {
+        return;
+    }
+    const size_t n = A->n;
+
+    /* Adaptive restart: the last extrapolation made it worse */
+    if(has_error)
+    {
+        if(A->has_lasterror && error > A->lasterror)
+        {
+            dw_accel_restart(A);
+        }
+        A->lasterror = error;
+        A->has_lasterror = 1;
+    }
+
+    float * restrict f = A->f;
+    float * restrict g = A->g;
+
+    if(!A->has_last)
+    {
+#pragma omp parallel for shared(f, g, x, xin)
+        for(size_t kk = 0; kk < n; kk++)
+        {
+            f[kk] = x[kk] - xin[kk];
+            g[kk] = x[kk];
+        }
+        A->has_last = 1;
+        return;
+    }
+
+    /* Add a column to the window, update f and g */
+    float * restrict dF = A->dF[A->head];
+    float * restrict dG = A->dG[A->head];
+#pragma omp parallel for shared(f, g, dF, dG, x, xin)
+    for(size_t kk = 0; kk < n; kk++)
+    {
+        float fk = x[kk] - xin[kk];
+        dF[kk] = fk - f[kk];
+        dG[kk] = x[kk] - g[kk];
+        f[kk] = fk;
+        g[kk] = x[kk];
+    }
+    A->head = (A->head + 1) % A->m;
+    A->ncol < A->m ? A->ncol++ : 0;
+
+    /* gamma = argmin |f - dF*gamma|, from the normal equations with a
+     * little Tikhonov regularization since the columns tend to be
+     * close to parallel */
+    const int nc = A->ncol;
+    double H[DW_ACCEL_MAXWINDOW*DW_ACCEL_MAXWINDOW];
+    double b[DW_ACCEL_MAXWINDOW];
+    double gamma[DW_ACCEL_MAXWINDOW];
+    dw_accel_gram(A, H, b);
+    double trace = 0;
+    for(int kk = 0; kk < nc; kk++)
+    {
+        trace += H[kk*DW_ACCEL_MAXWINDOW + kk];
+    }
+    if(!(trace > 0))
+    {
+        /* Nothing changed, e.g. already converged */
+        return;
+    }
+    for(int kk = 0; kk < nc; kk++)
+    {
+        H[kk*DW_ACCEL_MAXWINDOW + kk] += 1e-10*trace/nc;
+    }
+    if(dw_accel_solve(H, b, gamma, nc))
+    {
+        dw_accel_restart(A);
+        return;
+    }
+
+    /* x = g - dG*gamma, x already holds g */
+    const float lb = A->lb;
+    float gf[DW_ACCEL_MAXWINDOW];
+    for(int cc = 0; cc < nc; cc++)
+    {
+        gf[cc] = (float) gamma[cc];
+    }
+#pragma omp parallel for shared(x)
+    for(size_t kk = 0; kk < n; kk++)
+    {
+        float v = x[kk];
+        for(int cc = 0; cc < nc; cc++)
+        {
+            v -= gf[cc]*A->dG[cc][kk];
+        }
+        x[kk] = v < lb ? lb : v;
+    }
+    A->napplied++;
+    return;
+}
+
+void dw_accel_ut(void)
+{
+    /* A linear fixed point problem, G(x) = a.*x + c with three
+     * distinct contraction factors. Anderson with a window of three
+     * solves it in a few iterations while the plain iteration
+     * converges as 0.99^k */
+    const size_t n = 3000;
+    float * a = fim_malloc(n*sizeof(float));
+    float * c = fim_malloc(n*sizeof(float));
+    const float av[3] = {0.5, 0.9, 0.99};
+    for(size_t kk = 0; kk < n; kk++)
+    {
+        a[kk] = av[kk % 3];
+        c[kk] = 1.0 + (float) (kk % 7);
+    }
+
+    dw_opts * s = dw_opts_new();
+    s->accel = DW_ACCEL_ANDERSON;
+    s->accel_window = 3;
+
+    double res[2] = {0, 0};
+    for(int accel = 0; accel < 2; accel++)
+    {
+        dw_accel_t * A = accel ? dw_accel_new(s, n, -INFINITY) : NULL;
+        float * x = fim_malloc(n*sizeof(float));
+        float * xin = fim_malloc(n*sizeof(float));
+        for(size_t kk = 0; kk < n; kk++)
+        {
+            x[kk] = 0;
+        }
+        for(int iter = 0; iter < 20; iter++)
+        {
+            memcpy(xin, x, n*sizeof(float));
+            for(size_t kk = 0; kk < n; kk++)
+            {
+                x[kk] = a[kk]*xin[kk] + c[kk];
+            }
+            dw_accel_apply(A, x, xin, 0, 0);
+        }
+        /* Distance to the fixed point, c/(1-a) */
+        double r = 0;
+        for(size_t kk = 0; kk < n; kk++)
+        {
+            double d = x[kk] - c[kk]/(1.0-a[kk]);
+            r += d*d;
+        }
+        res[accel] = sqrt(r/n);
+        fim_free(x);
+        fim_free(xin);
+        dw_accel_fprint(stdout, A);
+        dw_accel_free(A);
+    }
+    printf("dw_accel_ut: rms error after 20 iterations, plain: %e, "
+           "Anderson: %e\n", res[0], res[1]);
+    if(!(res[1] < 1e-3*res[0]))
+    {
+        printf("dw_accel_ut: Anderson acceleration did not help\n");
+        exit(EXIT_FAILURE);
+    }
+    dw_opts_free(&s);
+    fim_free(a);
+    fim_free(c);
+}
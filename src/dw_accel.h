@@ -0,0 +1,58 @@
+#pragma once
+
+/*    Copyright (C) 2020 Erik L. G. Wernersson
+ *
+ *    This program is free software: you can redistribute it and/or modify
+ *    it under the terms of the GNU General Public License as published by
+ *    the Free Software Foundation, either version 3 of the License, or
+ *    (at your option) any later version.
+ *
+ *    This program is distributed in the hope that it will be useful,
+ *    but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *    GNU General Public License for more details.
+ *
+ *    You should have received a copy of the GNU General Public License
+ *    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include "dw.h"
+
+/* Acceleration of the iterations, see --accel.
+ *
+ * The iterations of a method are seen as a fixed point map, x_(k+1) =
+ * G(x_k). After each iteration the method calls dw_accel_apply with
+ * its input, x_k, and output, G(x_k). The output is replaced by the
+ * accelerated guess, which is used as input to the next iteration.
+ *
+ * DW_ACCEL_ANDERSON: Anderson acceleration (type II) with a window of
+ * the last m iterations, --accel-window. The differences of the
+ * outputs and of the residuals, G(x) - x, are kept in a ring buffer of
+ * 2m volumes of the job size. Two more volumes hold the last output
+ * and residual. The history is cleared, i.e., the method restarts
+ * from the plain iteration, when the error goes up.
+ */
+
+typedef struct dw_accel dw_accel_t;
+
+/* Returns NULL when s->accel is DW_ACCEL_NONE. n is the number of
+ * voxels and lb the lower bound of the guess, -INFINITY for none. */
+dw_accel_t * dw_accel_new(const dw_opts * s, size_t n, float lb);
+
+/* x: the output of the iteration, G(xin), is replaced by the
+ * accelerated guess. error: the error evaluated in the iteration,
+ * i.e., of xin. Use has_error = 0 if it was not evaluated. */
+void dw_accel_apply(dw_accel_t * A, float * x, const float * xin,
+                    float error, int has_error);
+
+/* Number of volumes of the job size used by the method, for the
+ * memory estimate */
+int dw_accel_nvolumes(const dw_opts * s);
+
+/* Write a summary to f, e.g. the number of restarts */
+void dw_accel_fprint(FILE * f, const dw_accel_t * A);
+
+void dw_accel_free(dw_accel_t * A);
+
+/* Unit tests */
+void dw_accel_ut(void);
@@ -0,0 +1,763 @@
+/*    Copyright (C) 2020 Erik L. G. Wernersson
+ *
+ *    This program is free software: you can redistribute it and/or modify
+ *    it under the terms of the GNU General Public License as published by
+ *    the Free Software Foundation, either version 3 of the License, or
+ *    (at your option) any later version.
+ *
+ *    This program is distributed in the hope that it will be useful,
+ *    but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *    GNU General Public License for more details.
+ *
+ *    You should have received a copy of the GNU General Public License
+ *    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include "dw_bench.h"
+#include "dw_otf.h"
+#include "method_shb.h"
+
+#ifndef WINDOWS
+#include <dirent.h>
+#endif
+
+typedef struct{
+    int64_t M, N, P; /* Size of the synthetic volumes */
+    int nthreads;
+    int repeat; /* Number of timed runs per stage */
+    int64_t tilesize;
+    int64_t overlap;
+    char * stages; /* Comma separated list, NULL = all */
+    char * dir; /* For the temporary files */
+    char * outFile; /* NULL = stdout */
+    int verbose;
+} opts;
+
+/* The data shared by the stages */
+typedef struct{
+    const opts * s;
+    int64_t M, N, P;
+    size_t n; /* Number of voxels */
+    size_t nc; /* Number of complex numbers in a transform */
+    float * V; /* Random volumes */
+    float * G;
+    fftwf_complex * FA; /* Random transforms */
+    fftwf_complex * FB;
+    dw_opts * dwo; /* Settings for iter_shb and the OTF */
+    dw_otf_t * otf;
+    char * tiffFile;
+    tiling * T;
+} bench_ctx;
+
+/* Runs a stage once and returns the time of the measured part.
+ * nbytes is set to the number of bytes read and written by it. */
+typedef double (*bench_fun)(bench_ctx * C, double * nbytes);
+
+typedef struct{
+    const char * name;
+    bench_fun fun;
+} bench_stage;
+
+static opts * opts_new();
+static void opts_free(opts * s);
+static void usage(__attribute__((unused)) int argc, char ** argv);
+static void argparsing(int argc, char ** argv, opts * s);
+
+static opts * opts_new()
+{
+    opts * s = calloc(1, sizeof(opts));
+    assert(s != NULL);
+    s->M = 512;
+    s->N = 512;
+    s->P = 64;
+    s->nthreads = dw_get_threads();
+    s->repeat = 5;
+    s->tilesize = 256;
+    s->overlap = 20;
+    s->stages = NULL;
+    s->dir = strdup(".");
+    assert(s->dir != NULL);
+    s->outFile = NULL;
+    s->verbose = 1;
+    return s;
+}
+
+static void opts_free(opts * s)
+{
+    free(s->stages);
+    free(s->dir);
+    free(s->outFile);
+    free(s);
+}
+
+static double seconds_since(const struct timespec * t0)
+{
+    struct timespec t1;
+    dw_gettime(&t1);
+    return timespec_diff(&t1, (struct timespec *) t0);
+}
+
+/*
+ * Stages
+ */
+
+static double bench_fft_r2c(bench_ctx * C, double * nbytes)
+{
+    struct timespec t0;
+    dw_gettime(&t0);
+    fftwf_complex * F = fft(C->V, C->M, C->N, C->P);
+    double t = seconds_since(&t0);
+    fim_free(F);
+    nbytes[0] = C->n*sizeof(float) + C->nc*sizeof(fftwf_complex);
+    return t;
+}
+
+static double bench_fft_c2r(bench_ctx * C, double * nbytes)
+{
+    struct timespec t0;
+    dw_gettime(&t0);
+    float * X = ifft(C->FA, C->M, C->N, C->P);
+    double t = seconds_since(&t0);
+    fim_free(X);
+    nbytes[0] = C->n*sizeof(float) + C->nc*sizeof(fftwf_complex);
+    return t;
+}
+
+static double bench_fft_mul(bench_ctx * C, double * nbytes)
+{
+    fftwf_complex * F = fim_malloc(C->nc*sizeof(fftwf_complex));
+    struct timespec t0;
+    dw_gettime(&t0);
+    fft_mul(F, C->FA, C->FB, C->M, C->N, C->P);
+    double t = seconds_since(&t0);
+    fim_free(F);
+    nbytes[0] = 3.0*C->nc*sizeof(fftwf_complex);
+    return t;
+}
+
+/* The momentum step of deconvolve_shb */
+static double bench_shb_update(bench_ctx * C, double * nbytes)
+{
+    float * X = fim_malloc(C->n*sizeof(float));
+    struct timespec t0;
+    dw_gettime(&t0);
+    fim_simd_momentum(X, C->V, C->G, 0.5, C->dwo->bg, C->n);
+    double t = seconds_since(&t0);
+    fim_free(X);
+    nbytes[0] = 3.0*C->n*sizeof(float);
+    return t;
+}
+
+/* One full iteration, iter_shb, including the error */
+static double bench_shb_iter(bench_ctx * C, double * nbytes)
+{
+    float * pk = fim_copy(C->V, C->n);
+    float * x = NULL;
+    struct timespec t0;
+    dw_gettime(&t0);
+    iter_shb(&x, C->G, C->otf, pk, C->otf->W,
+             C->M, C->N, C->P, C->M, C->N, C->P,
+             NULL, 1, C->dwo);
+    double t = seconds_since(&t0);
+    fim_free(x);
+    /* Besides the four transforms, about eight passes over volumes,
+     * as in the cost model of fft_plan_size */
+    nbytes[0] = 8.0*C->n*sizeof(float);
+    return t;
+}
+
+static double bench_error_idiv(bench_ctx * C, double * nbytes)
+{
+    struct timespec t0;
+    dw_gettime(&t0);
+    volatile float e = getError(C->V, C->G, C->M, C->N, C->P,
+                                C->M, C->N, C->P, DW_METRIC_IDIV);
+    (void) e;
+    double t = seconds_since(&t0);
+    nbytes[0] = 2.0*C->n*sizeof(float);
+    return t;
+}
+
+static double bench_error_mse(bench_ctx * C, double * nbytes)
+{
+    struct timespec t0;
+    dw_gettime(&t0);
+    volatile float e = getError(C->V, C->G, C->M, C->N, C->P,
+                                C->M, C->N, C->P, DW_METRIC_MSE);
+    (void) e;
+    double t = seconds_since(&t0);
+    nbytes[0] = 2.0*C->n*sizeof(float);
+    return t;
+}
+
+static double bench_gsmooth(bench_ctx * C, double * nbytes)
+{
+    float * X = fim_copy(C->V, C->n);
+    struct timespec t0;
+    dw_gettime(&t0);
+    fim_gsmooth(X, C->M, C->N, C->P, 2);
+    double t = seconds_since(&t0);
+    fim_free(X);
+    /* One read and one write per dimension */
+    nbytes[0] = 6.0*C->n*sizeof(float);
+    return t;
+}
+
+static double bench_tiff_write(bench_ctx * C, double * nbytes)
+{
+    struct timespec t0;
+    dw_gettime(&t0);
+    if(fim_tiff_write_float(C->tiffFile, C->V, NULL, C->M, C->N, C->P))
+    {
+        fprintf(stderr, "ERROR: Failed to write %s\n", C->tiffFile);
+        exit(EXIT_FAILURE);
+    }
+    double t = seconds_since(&t0);
+    nbytes[0] = C->n*sizeof(float);
+    return t;
+}
+
+static double bench_tiff_read(bench_ctx * C, double * nbytes)
+{
+    if(!dw_isfile(C->tiffFile))
+    {
+        double ignore = 0;
+        bench_tiff_write(C, &ignore);
+    }
+    int64_t M = 0, N = 0, P = 0;
+    struct timespec t0;
+    dw_gettime(&t0);
+    float * X = fim_tiff_read(C->tiffFile, NULL, &M, &N, &P, 0);
+    double t = seconds_since(&t0);
+    if(X == NULL || M != C->M || N != C->N || P != C->P)
+    {
+        fprintf(stderr, "ERROR: Failed to read back %s\n", C->tiffFile);
+        exit(EXIT_FAILURE);
+    }
+    fim_free(X);
+    nbytes[0] = C->n*sizeof(float);
+    return t;
+}
+
+static size_t tile_voxels(const tiling * T, int tt)
+{
+    const int64_t * xs = T->tiles[tt]->xsize;
+    return xs[0]*xs[1]*xs[2];
+}
+
+static double bench_tile_get(bench_ctx * C, double * nbytes)
+{
+    tiling * T = C->T;
+    float ** tiles = malloc(T->nTiles*sizeof(float*));
+    assert(tiles != NULL);
+    struct timespec t0;
+    dw_gettime(&t0);
+    for(int tt = 0; tt < T->nTiles; tt++)
+    {
+        tiles[tt] = tiling_get_tile(T, tt, C->V);
+    }
+    double t = seconds_since(&t0);
+    nbytes[0] = 0;
+    for(int tt = 0; tt < T->nTiles; tt++)
+    {
+        nbytes[0] += 2.0*tile_voxels(T, tt)*sizeof(float);
+        fim_free(tiles[tt]);
+    }
+    free(tiles);
+    return t;
+}
+
+/* Blending of the tiles into the output image */
+static double bench_tile_put(bench_ctx * C, double * nbytes)
+{
+    tiling * T = C->T;
+    float ** tiles = malloc(T->nTiles*sizeof(float*));
+    assert(tiles != NULL);
+    for(int tt = 0; tt < T->nTiles; tt++)
+    {
+        tiles[tt] = tiling_get_tile(T, tt, C->V);
+    }
+    float * X = fim_zeros(C->n);
+    struct timespec t0;
+    dw_gettime(&t0);
+    for(int tt = 0; tt < T->nTiles; tt++)
+    {
+        tiling_put_tile(T, tt, X, tiles[tt]);
+    }
+    double t = seconds_since(&t0);
+    nbytes[0] = 0;
+    for(int tt = 0; tt < T->nTiles; tt++)
+    {
+        nbytes[0] += 3.0*tile_voxels(T, tt)*sizeof(float);
+        fim_free(tiles[tt]);
+    }
+    free(tiles);
+    fim_free(X);
+    return t;
+}
+
+static const bench_stage stages[] = {
+    {"fft_r2c", bench_fft_r2c},
+    {"fft_c2r", bench_fft_c2r},
+    {"fft_mul", bench_fft_mul},
+    {"shb_update", bench_shb_update},
+    {"shb_iter", bench_shb_iter},
+    {"error_idiv", bench_error_idiv},
+    {"error_mse", bench_error_mse},
+    {"gsmooth", bench_gsmooth},
+    {"tiff_write", bench_tiff_write},
+    {"tiff_read", bench_tiff_read},
+    {"tile_get", bench_tile_get},
+    {"tile_put", bench_tile_put},
+};
+static const int nstages = sizeof(stages)/sizeof(stages[0]);
+
+/* Returns 1 if name is in the comma separated list, or if list is
+ * NULL */
+static int stage_selected(const char * list, const char * name)
+{
+    if(list == NULL)
+    {
+        return 1;
+    }
+    size_t len = strlen(name);
+    const char * p = list;
+    while(p != NULL && *p != '\0')
+    {
+        const char * end = strchr(p, ',');
+        size_t l = end == NULL ? strlen(p) : (size_t) (end - p);
+        if(l == len && strncmp(p, name, len) == 0)
+        {
+            return 1;
+        }
+        p = end == NULL ? NULL : end + 1;
+    }
+    return 0;
+}
+
+static float * random_volume(size_t n, float lo, float hi)
+{
+    float * V = fim_malloc(n*sizeof(float));
+    for(size_t kk = 0; kk < n; kk++)
+    {
+        V[kk] = lo + (hi-lo)*(float) rand() / (float) RAND_MAX;
+    }
+    return V;
+}
+
+/* A Gaussian PSF of at most 15 pixels along each dimension */
+static float * bench_psf(int64_t M, int64_t N, int64_t P,
+                         int64_t * pM, int64_t * pN, int64_t * pP)
+{
+    int64_t dims[3] = {M, N, P};
+    for(int dd = 0; dd < 3; dd++)
+    {
+        int64_t d = dims[dd] < 15 ? dims[dd] : 15;
+        if(d % 2 == 0)
+        {
+            d--;
+        }
+        dims[dd] = d;
+    }
+    float * psf = fim_malloc(dims[0]*dims[1]*dims[2]*sizeof(float));
+    for(int64_t cc = 0; cc < dims[2]; cc++)
+    {
+        for(int64_t bb = 0; bb < dims[1]; bb++)
+        {
+            for(int64_t aa = 0; aa < dims[0]; aa++)
+            {
+                float x = aa - dims[0]/2;
+                float y = bb - dims[1]/2;
+                float z = cc - dims[2]/2;
+                psf[aa + bb*dims[0] + cc*dims[0]*dims[1]] =
+                    expf(-(x*x + y*y)/(2*1.5*1.5) - z*z/(2*3.0*3.0));
+            }
+        }
+    }
+    pM[0] = dims[0];
+    pN[0] = dims[1];
+    pP[0] = dims[2];
+    return psf;
+}
+
+/*
+ * Machine info
+ */
+
+static char * cpu_model(void)
+{
+    char * model = NULL;
+#ifdef __linux__
+    FILE * fid = fopen("/proc/cpuinfo", "r");
+    if(fid != NULL)
+    {
+        char * line = NULL;
+        size_t len = 0;
+        while(model == NULL && getline(&line, &len, fid) != -1)
+        {
+            if(strncmp(line, "model name", 10) == 0)
+            {
+                char * v = strchr(line, ':');
+                if(v != NULL)
+                {
+                    v++;
+                    while(*v == ' ' || *v == '\t')
+                    {
+                        v++;
+                    }
+                    v[strcspn(v, "\n")] = '\0';
+                    model = strdup(v);
+                }
+            }
+        }
+        free(line);
+        fclose(fid);
+    }
+#endif
+    if(model == NULL)
+    {
+        model = strdup("unknown");
+    }
+    return model;
+}
+
+static int numa_nodes(void)
+{
+    int n = 0;
+#ifdef __linux__
+    DIR * dir = opendir("/sys/devices/system/node/");
+    if(dir == NULL)
+    {
+        return 0;
+    }
+    struct dirent * e;
+    while((e = readdir(dir)) != NULL)
+    {
+        if(strncmp(e->d_name, "node", 4) == 0
+           && isdigit((unsigned char) e->d_name[4]))
+        {
+            n++;
+        }
+    }
+    closedir(dir);
+#endif
+    return n;
+}
+
+/* Write the machine and build as comment lines, "# key value" */
+static void fprint_machine(FILE * f, const opts * s)
+{
+    fprintf(f, "# deconwolf\t%s\n", deconwolf_version);
+#ifdef GIT_VERSION
+    fprintf(f, "# git\t%s\n", GIT_VERSION);
+#endif
+#ifdef CC_VERSION
+    fprintf(f, "# compiler\t%s\n", CC_VERSION);
+#endif
+    fprintf(f, "# build_date\t%s\n", __DATE__);
+#ifndef WINDOWS
+    fprintf(f, "# fft\t%s\n", fftwf_version);
+#endif
+    fprintf(f, "# tiff\t%s\n", TIFFGetVersion());
+#ifndef WINDOWS
+    char hname[256];
+    if(gethostname(hname, sizeof(hname)-1) == 0)
+    {
+        hname[sizeof(hname)-1] = '\0';
+        fprintf(f, "# hostname\t%s\n", hname);
+    }
+#endif
+    char * model = cpu_model();
+    fprintf(f, "# cpu\t%s\n", model);
+    free(model);
+#ifdef _OPENMP
+    fprintf(f, "# cpus\t%d\n", omp_get_num_procs());
+#endif
+    fprintf(f, "# numa_nodes\t%d\n", numa_nodes());
+    fprintf(f, "# memory_available_gb\t%.1f\n",
+            dw_get_available_memoryKB()/1e6);
+    fprintf(f, "# threads\t%d\n", s->nthreads);
+    const char * bind = getenv("OMP_PROC_BIND");
+    fprintf(f, "# omp_proc_bind\t%s\n", bind == NULL ? "unset" : bind);
+    fprintf(f, "# simd\t%s\n", fim_simd_name(fim_simd_get()));
+    char date[64];
+    time_t now = time(NULL);
+    strftime(date, sizeof(date), "%Y-%m-%dT%H:%M:%S", localtime(&now));
+    fprintf(f, "# date\t%s\n", date);
+    fprintf(f, "# size\t%" PRId64 "x%" PRId64 "x%" PRId64 "\n",
+            s->M, s->N, s->P);
+    fprintf(f, "# repeat\t%d\n", s->repeat);
+    fprintf(f, "# tilesize\t%" PRId64 "\n", s->tilesize);
+}
+
+static int cmp_double(const void * a, const void * b)
+{
+    double x = *(const double *) a;
+    double y = *(const double *) b;
+    return (x > y) - (x < y);
+}
+
+static void usage(__attribute__((unused)) int argc, char ** argv)
+{
+    printf("Usage: %s [<options>]\n", argv[0]);
+    printf("Time the stages of a deconvolution on synthetic data and write\n"
+           "the throughput per stage as tab separated values, preceded by\n"
+           "a description of the machine.\n");
+    printf("\n");
+    printf("Options:\n");
+    printf(" --size MxNxP\n"
+           "\tsize of the volumes (default 512x512x64)\n");
+    printf(" --repeat k\n"
+           "\ttimed runs per stage, the median is used (default 5)\n");
+    printf(" --threads t\n"
+           "\tnumber of threads to use\n");
+    printf(" --stages list\n"
+           "\tcomma separated list of stages to run (default all):\n\t");
+    for(int kk = 0; kk < nstages; kk++)
+    {
+        printf("%s%s", stages[kk].name, kk + 1 < nstages ? ", " : "\n");
+    }
+    printf(" --tilesize n\n"
+           "\ttile size for tile_get and tile_put (default 256)\n");
+    printf(" --dir folder\n"
+           "\twhere to write the temporary tif file (default .)\n");
+    printf(" --out file.tsv\n"
+           "\twrite the results to a file instead of stdout\n");
+    printf(" --verbose v\n"
+           "\tset verbosity level\n");
+    printf(" --help\n\t Show this message\n");
+}
+
+static void argparsing(int argc, char ** argv, opts * s)
+{
+    struct option longopts[] = {
+        {"help", no_argument, NULL, 'h'},
+        {"size", required_argument, NULL, 's'},
+        {"repeat", required_argument, NULL, 'r'},
+        {"threads", required_argument, NULL, 't'},
+        {"stages", required_argument, NULL, 'S'},
+        {"tilesize", required_argument, NULL, 'T'},
+        {"dir", required_argument, NULL, 'd'},
+        {"out", required_argument, NULL, 'o'},
+        {"verbose", required_argument, NULL, 'v'},
+        {NULL, 0, NULL, 0}};
+
+    int ch;
+    while((ch = getopt_long(argc, argv, "hs:r:t:S:T:d:o:v:", longopts, NULL)) != -1)
+    {
+        switch(ch){
+        case 'h':
+            usage(argc, argv);
+            exit(0);
+            break;
+        case 's':
+            s->P = 1;
+            if(sscanf(optarg, "%" SCNd64 "x%" SCNd64 "x%" SCNd64,
+                      &s->M, &s->N, &s->P) < 2
+               || s->M < 1 || s->N < 1 || s->P < 1)
+            {
+                fprintf(stderr, "--size: could not parse '%s', "
+                        "use for example 512x512x64\n", optarg);
+                exit(EXIT_FAILURE);
+            }
+            break;
+        case 'r':
+            s->repeat = atoi(optarg);
+            if(s->repeat < 1)
+            {
+                fprintf(stderr, "--repeat should be at least 1\n");
+                exit(EXIT_FAILURE);
+            }
+            break;
+        case 't':
+            s->nthreads = atoi(optarg);
+            if(s->nthreads < 1)
+            {
+                fprintf(stderr, "--threads should be at least 1\n");
+                exit(EXIT_FAILURE);
+            }
+            break;
+        case 'S':
+            free(s->stages);
+            s->stages = strdup(optarg);
+            break;
+        case 'T':
+            s->tilesize = atol(optarg);
+            break;
+        case 'd':
+            free(s->dir);
+            s->dir = strdup(optarg);
+            break;
+        case 'o':
+            free(s->outFile);
+            s->outFile = strdup(optarg);
+            break;
+        case 'v':
+            s->verbose = atoi(optarg);
+            break;
+        default:
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    if(s->stages != NULL)
+    {
+        /* Check the names */
+        char * list = strdup(s->stages);
+        assert(list != NULL);
+        for(char * name = strtok(list, ","); name != NULL;
+            name = strtok(NULL, ","))
+        {
+            int found = 0;
+            for(int kk = 0; kk < nstages; kk++)
+            {
+                found += strcmp(name, stages[kk].name) == 0;
+            }
+            if(!found)
+            {
+                fprintf(stderr, "--stages: unknown stage '%s', "
+                        "see --help\n", name);
+                exit(EXIT_FAILURE);
+            }
+        }
+        free(list);
+    }
+    if(s->tilesize < 2*s->overlap + 1)
+    {
+        fprintf(stderr, "--tilesize should be larger than %" PRId64 "\n",
+                2*s->overlap);
+        exit(EXIT_FAILURE);
+    }
+    if(!dw_isdir(s->dir))
+    {
+        fprintf(stderr, "--dir: %s is not a folder\n", s->dir);
+        exit(EXIT_FAILURE);
+    }
+    return;
+}
+
+int dw_bench(int argc, char ** argv)
+{
+    opts * s = opts_new();
+    argparsing(argc, argv, s);
+
+    FILE * f = stdout;
+    if(s->outFile != NULL)
+    {
+        f = fopen(s->outFile, "w");
+        if(f == NULL)
+        {
+            fprintf(stderr, "ERROR: Can't open %s for writing\n", s->outFile);
+            exit(EXIT_FAILURE);
+        }
+    }
+
+#ifdef _OPENMP
+    omp_set_num_threads(s->nthreads);
+#endif
+    fim_tiff_init();
+    srand(1);
+
+    bench_ctx C = {0};
+    C.s = s;
+    C.M = s->M;
+    C.N = s->N;
+    C.P = s->P;
+    C.n = s->M*s->N*s->P;
+    C.nc = (s->M/2+1)*s->N*s->P;
+    if(s->verbose > 0)
+    {
+        fprintf(stderr, "Preparing [%" PRId64 " x %" PRId64 " x %" PRId64
+                "] volumes\n", C.M, C.N, C.P);
+    }
+    C.V = random_volume(C.n, 1, 100);
+    C.G = random_volume(C.n, 1, 100);
+
+    /* The planning is timed separately, it is typically only done
+     * the first time a size is used */
+    myfftw_start(s->nthreads, 0, NULL);
+    struct timespec t0;
+    dw_gettime(&t0);
+    fft_train(C.M, C.N, C.P, 0, s->nthreads, stderr);
+    double t_plan = seconds_since(&t0);
+
+    C.FA = fft(C.V, C.M, C.N, C.P);
+    C.FB = fft(C.G, C.M, C.N, C.P);
+
+    C.dwo = dw_opts_new();
+    C.dwo->verbosity = 0;
+    C.dwo->nThreads_FFT = s->nthreads;
+    int64_t pM = 0, pN = 0, pP = 0;
+    float * psf = bench_psf(C.M, C.N, C.P, &pM, &pN, &pP);
+    fim_normalize_sum1(psf, pM, pN, pP);
+    C.otf = dw_otf_get(C.dwo, psf, pM, pN, pP,
+                       C.M, C.N, C.P, C.M, C.N, C.P);
+    fim_free(psf);
+
+    C.tiffFile = malloc(strlen(s->dir) + 64);
+    assert(C.tiffFile != NULL);
+    sprintf(C.tiffFile, "%s%cdw_bench_%d.tif", s->dir, FILESEP, (int) getpid());
+    C.T = tiling_create(C.M, C.N, C.P, s->tilesize, s->overlap);
+
+    fprint_machine(f, s);
+    fprintf(f, "stage\tM\tN\tP\tthreads\trepeat\tbest_s\tmedian_s"
+            "\tvoxels_per_s\tGB_per_s\n");
+    fprintf(f, "fft_plan\t%" PRId64 "\t%" PRId64 "\t%" PRId64
+            "\t%d\t1\t%.6f\t%.6f\t-\t-\n",
+            C.M, C.N, C.P, s->nthreads, t_plan, t_plan);
+    fflush(f);
+
+    double * times = malloc(s->repeat*sizeof(double));
+    assert(times != NULL);
+    for(int kk = 0; kk < nstages; kk++)
+    {
+        if(!stage_selected(s->stages, stages[kk].name))
+        {
+            continue;
+        }
+        if(s->verbose > 0)
+        {
+            fprintf(stderr, "-> %s\n", stages[kk].name);
+        }
+        /* One untimed run to warm up the caches and the allocator */
+        double nbytes = 0;
+        stages[kk].fun(&C, &nbytes);
+        for(int rr = 0; rr < s->repeat; rr++)
+        {
+            times[rr] = stages[kk].fun(&C, &nbytes);
+        }
+        qsort(times, s->repeat, sizeof(double), cmp_double);
+        double best = times[0];
+        double median = times[s->repeat/2];
+        if(s->repeat % 2 == 0)
+        {
+            median = 0.5*(times[s->repeat/2-1] + times[s->repeat/2]);
+        }
+        double nvox = (double) C.n;
+        fprintf(f, "%s\t%" PRId64 "\t%" PRId64 "\t%" PRId64
+                "\t%d\t%d\t%.6f\t%.6f\t%.4e\t%.3f\n",
+                stages[kk].name, C.M, C.N, C.P, s->nthreads, s->repeat,
+                best, median, nvox/median, nbytes/median/1e9);
+        fflush(f);
+    }
+    free(times);
+
+    remove(C.tiffFile);
+    free(C.tiffFile);
+    tiling_free(C.T);
+    free(C.T);
+    dw_otf_release(C.dwo, C.otf);
+    dw_opts_free(&C.dwo);
+    fim_free(C.FA);
+    fim_free(C.FB);
+    fim_free(C.V);
+    fim_free(C.G);
+    myfftw_stop();
+    if(f != stdout)
+    {
+        fclose(f);
+    }
+    opts_free(s);
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,32 @@
+#pragma once
+
+/*    Copyright (C) 2020 Erik L. G. Wernersson
+ *
+ *    This program is free software: you can redistribute it and/or modify
+ *    it under the terms of the GNU General Public License as published by
+ *    the Free Software Foundation, either version 3 of the License, or
+ *    (at your option) any later version.
+ *
+ *    This program is distributed in the hope that it will be useful,
+ *    but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *    GNU General Public License for more details.
+ *
+ *    You should have received a copy of the GNU General Public License
+ *    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include "dw.h"
+
+/* dw bench
+ *
+ * Time the building blocks of a deconvolution on synthetic data: the
+ * FFTs, the multiplication of transforms, the SHB update and a full
+ * SHB iteration, the error, Gaussian smoothing, tiff I/O and the tile
+ * extraction and blending. One row per stage is written as tab
+ * separated values, preceded by a description of the machine as
+ * comment lines starting with #, so that results from different
+ * machines and releases can be compared. See dw bench --help.
+ */
+
+int dw_bench(int argc, char ** argv);
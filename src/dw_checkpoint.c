@@ -0,0 +1,424 @@
+/*    Copyright (C) 2020 Erik L. G. Wernersson
+ *
+ *    This program is free software: you can redistribute it and/or modify
+ *    it under the terms of the GNU General Public License as published by
+ *    the Free Software Foundation, either version 3 of the License, or
+ *    (at your option) any later version.
+ *
+ *    This program is distributed in the hope that it will be useful,
+ *    but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *    GNU General Public License for more details.
+ *
+ *    You should have received a copy of the GNU General Public License
+ *    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#ifndef WINDOWS
+#include <unistd.h>
+#endif
+#include "dw_checkpoint.h"
+
+/* Elements per write when x - dh is streamed to disk */
+#define DW_CHECKPOINT_CHUNK ((size_t) 1<<20)
+
+static uint64_t fnv1a(uint64_t h, const void * data, size_t nbytes)
+{
+    const uint8_t * b = (const uint8_t *) data;
+    for(size_t kk = 0; kk < nbytes; kk++)
+    {
+        h ^= b[kk];
+        h *= 1099511628211ULL;
+    }
+    return h;
+}
+
+dw_checkpoint_t dw_checkpoint_header(uint64_t key,
+                                     int64_t wM, int64_t wN, int64_t wP,
+                                     int nArrays)
+{
+    dw_checkpoint_t C;
+    memset(&C, 0, sizeof(C));
+    strcpy(C.magic, DW_CHECKPOINT_MAGIC);
+    C.key = key;
+    C.wM = wM; C.wN = wN; C.wP = wP;
+    C.nArrays = nArrays;
+    return C;
+}
+
+int dw_checkpoint_enabled(const dw_opts * s)
+{
+    return s->checkpoint_iter > 0 || s->checkpoint_time > 0;
+}
+
+char * dw_checkpoint_file(const dw_opts * s)
+{
+    assert(s->outFile != NULL);
+    size_t len = strlen(s->outFile) + 6;
+    char * name = calloc(len, 1);
+    assert(name != NULL);
+    snprintf(name, len, "%s.ckpt", s->outFile);
+    return name;
+}
+
+uint64_t dw_checkpoint_key(const dw_opts * s,
+                           const float * im,
+                           int64_t M, int64_t N, int64_t P,
+                           const float * psf,
+                           int64_t pM, int64_t pN, int64_t pP)
+{
+    uint64_t h = 14695981039346656037ULL;
+    int64_t dims[6] = {M, N, P, pM, pN, pP};
+    h = fnv1a(h, dims, sizeof(dims));
+
+    /* Not the number of iterations or the stop conditions, so that a
+     * run can be resumed with more iterations */
+    int32_t iopts[8] = {s->method, s->metric, s->borderQuality,
+                        s->positivity, s->biggs, s->storage,
+                        s->storage_momentum, s->bg_auto};
+    h = fnv1a(h, iopts, sizeof(iopts));
+    double fopts[4] = {s->offset, s->psigma, s->alphamax,
+                       s->bg_auto ? 0 : s->bg};
+    h = fnv1a(h, fopts, sizeof(fopts));
+    if(s->imFile != NULL)
+    {
+        h = fnv1a(h, s->imFile, strlen(s->imFile));
+    }
+
+    h = fnv1a(h, psf, pM*pN*pP*sizeof(float));
+
+    /* A sample of the image is enough to tell images apart */
+    size_t MNP = M*N*P;
+    size_t step = MNP / 4096;
+    step < 1 ? step = 1 : 0;
+    for(size_t kk = 0; kk < MNP; kk += step)
+    {
+        h = fnv1a(h, im + kk, sizeof(float));
+    }
+    return h;
+}
+
+int dw_checkpoint_due(const dw_opts * s, int iter, struct timespec * last)
+{
+    int due = 0;
+    if(s->checkpoint_iter > 0 && iter % s->checkpoint_iter == 0)
+    {
+        due = 1;
+    }
+    struct timespec now;
+    dw_gettime(&now);
+    if(s->checkpoint_time > 0
+       && timespec_diff(&now, last) >= 60.0*s->checkpoint_time)
+    {
+        due = 1;
+    }
+    if(due)
+    {
+        last[0] = now;
+    }
+    return due;
+}
+
+static int write_floats(FILE * f, const float * X, size_t n)
+{
+    return fwrite(X, sizeof(float), n, f) == n ? 0 : -1;
+}
+
+/* Write x - dh without allocating a full size array */
+static int write_diff(FILE * f, const float * x, const fim_half * dh, size_t n)
+{
+    float * buf = fim_malloc(DW_CHECKPOINT_CHUNK*sizeof(float));
+    int status = 0;
+    for(size_t pos = 0; pos < n && status == 0; pos += DW_CHECKPOINT_CHUNK)
+    {
+        size_t nel = n - pos;
+        nel > DW_CHECKPOINT_CHUNK ? nel = DW_CHECKPOINT_CHUNK : 0;
+        for(size_t kk = 0; kk < nel; kk++)
+        {
+            buf[kk] = x[pos+kk] - fim_half_get(dh, pos+kk);
+        }
+        status = write_floats(f, buf, nel);
+    }
+    fim_free(buf);
+    return status;
+}
+
+int dw_checkpoint_write(const dw_opts * s, const dw_checkpoint_t * C,
+                        const float * x, const float * xp,
+                        const fim_half * dh)
+{
+    char * name = dw_checkpoint_file(s);
+    size_t len = strlen(name) + 5;
+    char * tmpname = calloc(len, 1);
+    assert(tmpname != NULL);
+    snprintf(tmpname, len, "%s.tmp", name);
+
+    struct timespec t0, t1;
+    dw_gettime(&t0);
+
+    size_t n = C->wM*C->wN*C->wP;
+    int status = 0;
+    FILE * f = fopen(tmpname, "wb");
+    if(f == NULL)
+    {
+        status = -1;
+        goto done;
+    }
+    if(fwrite(C, sizeof(dw_checkpoint_t), 1, f) != 1)
+    {
+        status = -1;
+    }
+    if(status == 0)
+    {
+        status = write_floats(f, x, n);
+    }
+    if(status == 0 && C->nArrays > 1)
+    {
+        if(xp != NULL)
+        {
+            status = write_floats(f, xp, n);
+        } else {
+            assert(dh != NULL);
+            status = write_diff(f, x, dh, n);
+        }
+    }
+    if(fflush(f) != 0)
+    {
+        status = -1;
+    }
+#ifndef WINDOWS
+    if(status == 0 && fsync(fileno(f)) != 0)
+    {
+        status = -1;
+    }
+#endif
+    if(fclose(f) != 0)
+    {
+        status = -1;
+    }
+
+    if(status == 0)
+    {
+#ifdef WINDOWS
+        /* rename does not replace existing files on Windows */
+        remove(name);
+#endif
+        if(rename(tmpname, name) != 0)
+        {
+            status = -1;
+        }
+    }
+
+ done:
+    dw_gettime(&t1);
+    if(status != 0)
+    {
+        fprintf(stderr, "Warning: Could not write the checkpoint %s\n", name);
+        fprintf(s->log, "Warning: Could not write the checkpoint %s\n", name);
+        remove(tmpname);
+    } else {
+        if(s->verbosity > 1)
+        {
+            printf(" Checkpoint at iteration %d written to %s\n", C->iter, name);
+        }
+        fprintf(s->log, "Checkpoint at iteration %d written to %s (%.2f s)\n",
+                C->iter, name, timespec_diff(&t1, &t0));
+    }
+    free(tmpname);
+    free(name);
+    return status;
+}
+
+int dw_checkpoint_probe(const dw_opts * s, uint64_t key,
+                        int64_t wM, int64_t wN, int64_t wP,
+                        int nArrays, dw_checkpoint_t * C)
+{
+    char * name = dw_checkpoint_file(s);
+    FILE * f = fopen(name, "rb");
+    if(f == NULL)
+    {
+        if(s->verbosity > 0)
+        {
+            printf("No checkpoint found (%s), starting from the beginning\n", name);
+        }
+        fprintf(s->log, "No checkpoint found (%s)\n", name);
+        free(name);
+        return -1;
+    }
+
+    const char * problem = NULL;
+    dw_checkpoint_t H;
+    if(fread(&H, sizeof(dw_checkpoint_t), 1, f) != 1
+       || strncmp(H.magic, DW_CHECKPOINT_MAGIC, sizeof(H.magic)) != 0)
+    {
+        problem = "not a checkpoint";
+    } else if(H.key != key)
+    {
+        problem = "made with other settings or data";
+    } else if(H.wM != wM || H.wN != wN || H.wP != wP)
+    {
+        problem = "the job size differs";
+    } else if(H.nArrays != nArrays)
+    {
+        problem = "made with another method";
+    } else {
+        /* Check that the data is complete */
+        size_t expected = sizeof(dw_checkpoint_t)
+            + (size_t) nArrays*wM*wN*wP*sizeof(float);
+        if(fseek(f, 0, SEEK_END) != 0 || (size_t) ftell(f) != expected)
+        {
+            problem = "truncated";
+        }
+    }
+    fclose(f);
+
+    if(problem != NULL)
+    {
+        fprintf(stderr, "Warning: Ignoring the checkpoint %s, %s\n",
+                name, problem);
+        fprintf(s->log, "Ignoring the checkpoint %s, %s\n", name, problem);
+        free(name);
+        return -1;
+    }
+
+    if(s->verbosity > 0)
+    {
+        printf("Resuming from %s after %d iterations\n", name, H.iter);
+    }
+    fprintf(s->log, "Resuming from %s after %d iterations\n", name, H.iter);
+    free(name);
+    C[0] = H;
+    return 0;
+}
+
+int dw_checkpoint_read(const dw_opts * s, const dw_checkpoint_t * C,
+                       float * x, float * xp, fim_half * dh)
+{
+    char * name = dw_checkpoint_file(s);
+    FILE * f = fopen(name, "rb");
+    free(name);
+    if(f == NULL)
+    {
+        return -1;
+    }
+    size_t n = C->wM*C->wN*C->wP;
+    int status = 0;
+    if(fseek(f, sizeof(dw_checkpoint_t), SEEK_SET) != 0
+       || fread(x, sizeof(float), n, f) != n)
+    {
+        status = -1;
+    }
+    if(status == 0 && C->nArrays > 1)
+    {
+        if(xp != NULL)
+        {
+            if(fread(xp, sizeof(float), n, f) != n)
+            {
+                status = -1;
+            }
+        } else {
+            assert(dh != NULL);
+            float * buf = fim_malloc(DW_CHECKPOINT_CHUNK*sizeof(float));
+            for(size_t pos = 0; pos < n && status == 0;
+                pos += DW_CHECKPOINT_CHUNK)
+            {
+                size_t nel = n - pos;
+                nel > DW_CHECKPOINT_CHUNK ? nel = DW_CHECKPOINT_CHUNK : 0;
+                if(fread(buf, sizeof(float), nel, f) != nel)
+                {
+                    status = -1;
+                    break;
+                }
+                for(size_t kk = 0; kk < nel; kk++)
+                {
+                    fim_half_set(dh, pos+kk, x[pos+kk] - buf[kk]);
+                }
+            }
+            fim_free(buf);
+        }
+    }
+    fclose(f);
+    return status;
+}
+
+void dw_checkpoint_remove(const dw_opts * s)
+{
+    char * name = dw_checkpoint_file(s);
+    remove(name);
+    free(name);
+}
+
+void dw_checkpoint_ut(void)
+{
+    dw_opts * s = dw_opts_new();
+    s->outFile = strdup("dw_checkpoint_ut.tif");
+    s->log = stdout;
+    s->verbosity = 0;
+
+    const int64_t M = 17, N = 13, P = 5;
+    const size_t n = M*N*P;
+    float * x = fim_malloc(n*sizeof(float));
+    float * xp = fim_malloc(n*sizeof(float));
+    for(size_t kk = 0; kk < n; kk++)
+    {
+        x[kk] = (float) kk;
+        xp[kk] = (float) kk + 0.5;
+    }
+
+    dw_checkpoint_t C =
+        dw_checkpoint_header(dw_checkpoint_key(s, x, M, N, P, xp, 3, 3, 3),
+                             M, N, P, 2);
+    C.iter = 7;
+    C.error = 0.25;
+    if(dw_checkpoint_write(s, &C, x, xp, NULL) != 0)
+    {
+        fprintf(stderr, "dw_checkpoint_ut: dw_checkpoint_write failed\n");
+        exit(EXIT_FAILURE);
+    }
+
+    /* Wrong key, size or number of arrays */
+    dw_checkpoint_t R;
+    int wrong_key = dw_checkpoint_probe(s, C.key+1, M, N, P, 2, &R);
+    int wrong_size = dw_checkpoint_probe(s, C.key, M, N, P+1, 2, &R);
+    int wrong_narrays = dw_checkpoint_probe(s, C.key, M, N, P, 1, &R);
+    if(wrong_key == 0 || wrong_size == 0 || wrong_narrays == 0)
+    {
+        fprintf(stderr, "dw_checkpoint_ut: a mismatching checkpoint was accepted\n");
+        exit(EXIT_FAILURE);
+    }
+    if(dw_checkpoint_probe(s, C.key, M, N, P, 2, &R) != 0)
+    {
+        fprintf(stderr, "dw_checkpoint_ut: dw_checkpoint_probe failed\n");
+        exit(EXIT_FAILURE);
+    }
+    assert(R.iter == 7);
+    assert(R.error == C.error);
+
+    float * y = fim_malloc(n*sizeof(float));
+    float * yp = fim_malloc(n*sizeof(float));
+    if(dw_checkpoint_read(s, &R, y, yp, NULL) != 0)
+    {
+        fprintf(stderr, "dw_checkpoint_ut: dw_checkpoint_read failed\n");
+        exit(EXIT_FAILURE);
+    }
+    for(size_t kk = 0; kk < n; kk++)
+    {
+        assert(y[kk] == x[kk]);
+        assert(yp[kk] == xp[kk]);
+    }
+    dw_checkpoint_remove(s);
+    int removed = dw_checkpoint_probe(s, C.key, M, N, P, 2, &R);
+    if(removed == 0)
+    {
+        fprintf(stderr, "dw_checkpoint_ut: the checkpoint was not removed\n");
+        exit(EXIT_FAILURE);
+    }
+
+    fim_free(y);
+    fim_free(yp);
+    fim_free(x);
+    fim_free(xp);
+    dw_opts_free(&s);
+    printf("dw_checkpoint_ut: ok\n");
+    return;
+}
@@ -0,0 +1,100 @@
+#pragma once
+
+/*    Copyright (C) 2020 Erik L. G. Wernersson
+ *
+ *    This program is free software: you can redistribute it and/or modify
+ *    it under the terms of the GNU General Public License as published by
+ *    the Free Software Foundation, either version 3 of the License, or
+ *    (at your option) any later version.
+ *
+ *    This program is distributed in the hope that it will be useful,
+ *    but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *    GNU General Public License for more details.
+ *
+ *    You should have received a copy of the GNU General Public License
+ *    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include "dw.h"
+
+/* Checkpoints of the iterations, see --checkpoint and --resume.
+ *
+ * A checkpoint holds the current guess, x, and, for methods with
+ * momentum, the previous guess xp, both of the job size, together
+ * with the iterator state and the background level. It is written to
+ * <outFile>.ckpt as a dw_checkpoint_t header followed by the raw
+ * float arrays. The file is first written under a temporary name and
+ * then renamed, so an interrupted write leaves the previous
+ * checkpoint intact.
+ *
+ * The transfer function and the weights are not stored since they
+ * are recomputed with two FFTs. The key is a hash of the settings
+ * and the data that the iterations depend on, a checkpoint with
+ * another key is not used.
+ */
+
+#define DW_CHECKPOINT_MAGIC "DWCKPT1"
+
+typedef struct {
+    char magic[8];
+    uint64_t key;
+    int64_t wM, wN, wP; /* Job size */
+    int32_t iter; /* Number of iterations done */
+    int32_t nArrays; /* 1: x, 2: x and xp */
+    float error; /* Iterator state, see dw_iterator_t */
+    float lasterror;
+    float bg;
+} dw_checkpoint_t;
+
+/* A header with the magic string, key, job size and number of
+ * arrays set. The iterator state and bg are set by the caller. */
+dw_checkpoint_t dw_checkpoint_header(uint64_t key,
+                                     int64_t wM, int64_t wN, int64_t wP,
+                                     int nArrays);
+
+/* 1 if --checkpoint or --checkpoint-time is used */
+int dw_checkpoint_enabled(const dw_opts * s);
+
+/* Name of the checkpoint file, <outFile>.ckpt */
+char * dw_checkpoint_file(const dw_opts * s);
+
+/* Hash of what the iterations depend on: the method and its
+ * settings, the image and the PSF. Only a sample of the image voxels
+ * is used. */
+uint64_t dw_checkpoint_key(const dw_opts * s,
+                           const float * im,
+                           int64_t M, int64_t N, int64_t P,
+                           const float * psf,
+                           int64_t pM, int64_t pN, int64_t pP);
+
+/* Returns 1 if a checkpoint should be written after iter iterations,
+ * according to --checkpoint N or --checkpoint-time T. last is the
+ * time of the last checkpoint, or of the start, and is updated. */
+int dw_checkpoint_due(const dw_opts * s, int iter, struct timespec * last);
+
+/* Write a checkpoint. The previous guess is either xp or given by
+ * x - dh, if xp is NULL and dh is not. With both NULL only x is
+ * written. Failures are reported but not fatal. Returns 0 on
+ * success. */
+int dw_checkpoint_write(const dw_opts * s, const dw_checkpoint_t * C,
+                        const float * x, const float * xp,
+                        const fim_half * dh);
+
+/* Read the header of the checkpoint for s, if any, and check that it
+ * matches key, the job size and the number of arrays. Returns 0 if
+ * it can be used and sets C. */
+int dw_checkpoint_probe(const dw_opts * s, uint64_t key,
+                        int64_t wM, int64_t wN, int64_t wP,
+                        int nArrays, dw_checkpoint_t * C);
+
+/* Read the arrays of a checkpoint accepted by dw_checkpoint_probe into
+ * x and xp, or dh, see dw_checkpoint_write. Returns 0 on success */
+int dw_checkpoint_read(const dw_opts * s, const dw_checkpoint_t * C,
+                       float * x, float * xp, fim_half * dh);
+
+/* Remove the checkpoint, when the iterations are done */
+void dw_checkpoint_remove(const dw_opts * s);
+
+/* Unit tests */
+void dw_checkpoint_ut(void);
@@ -0,0 +1,337 @@
+/*    Copyright (C) 2020 Erik L. G. Wernersson
+ *
+ *    This program is free software: you can redistribute it and/or modify
+ *    it under the terms of the GNU General Public License as published by
+ *    the Free Software Foundation, either version 3 of the License, or
+ *    (at your option) any later version.
+ *
+ *    This program is distributed in the hope that it will be useful,
+ *    but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *    GNU General Public License for more details.
+ *
+ *    You should have received a copy of the GNU General Public License
+ *    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include "dw_otf.h"
+
+/* FNV-1a over the raw bytes of the PSF */
+static uint64_t psf_hash(const float * psf, size_t n)
+{
+    const uint8_t * b = (const uint8_t *) psf;
+    uint64_t h = 14695981039346656037ULL;
+    for(size_t kk = 0; kk < n*sizeof(float); kk++)
+    {
+        h ^= b[kk];
+        h *= 1099511628211ULL;
+    }
+    return h;
+}
+
+static void dw_otf_free(dw_otf_t * otf)
+{
+    if(otf == NULL)
+    {
+        return;
+    }
+    fim_free(otf->cK);
+    fim_free(otf->rK);
+    fim_free(otf->W);
+    fim_half_free(otf->hW);
+    free(otf);
+}
+
+static int dw_otf_match(const dw_otf_t * otf,
+                        int64_t pM, int64_t pN, int64_t pP,
+                        int64_t M, int64_t N, int64_t P,
+                        int64_t wM, int64_t wN, int64_t wP,
+                        uint64_t hash, int borderQuality, fim_dtype storage,
+                        int batch2d)
+{
+    return otf->M == M && otf->N == N && otf->P == P
+        && otf->pM == pM && otf->pN == pN && otf->pP == pP
+        && otf->wM == wM && otf->wN == wN && otf->wP == wP
+        && otf->psf_hash == hash
+        && otf->borderQuality == borderQuality
+        && otf->storage == storage
+        && otf->batch2d == batch2d;
+}
+
+/* Set up cK and W, previously done at the start of deconvolve_shb
+ * and deconvolve_rl */
+static void dw_otf_compute(dw_otf_t * otf, dw_opts * s, const float * psf)
+{
+    const int64_t wM = otf->wM;
+    const int64_t wN = otf->wN;
+    const int64_t wP = otf->wP;
+    const size_t wMNP = wM*wN*wP;
+
+    float * Z = fim_malloc(wMNP*sizeof(float));
+    memset(Z, 0, wMNP*sizeof(float));
+    /* Insert the psf into the bigger Z */
+    fim_insert(Z, wM, wN, wP,
+               psf, otf->pM, otf->pN, otf->pP);
+
+    /* Shift the PSF so that the mid is at (0,0,0) */
+    int64_t midM, midN, midP = -1;
+    fim_argmax(Z, wM, wN, wP, &midM, &midN, &midP);
+    fim_circshift(Z, wM, wN, wP, -midM, -midN, -midP);
+    if(Z[0] != fim_max(Z, wM*wN*wP))
+    {
+        printf("Something went wrong here, the max of the PSF is in the wrong place\n");
+        exit(1);
+    }
+
+    /* For a stack of 2D images, one copy of the 2D PSF per plane */
+    if(otf->batch2d)
+    {
+        assert(otf->pP == 1);
+        for(int64_t pp = 1; pp < wP; pp++)
+        {
+            memcpy(Z + pp*wM*wN, Z, wM*wN*sizeof(float));
+        }
+    }
+
+    if(s->fulldump)
+    {
+        printf("Dumping to fullPSF.tif\n");
+        fim_tiff_write_float("fullPSF.tif", Z, NULL, wM, wN, wP);
+    }
+
+    otf->cK = fft_and_free(Z, wM, wN, wP);
+    putdot(s);
+
+    otf->W = NULL;
+    otf->hW = NULL;
+    if(otf->borderQuality > 0)
+    {
+        /* F_one is 1 over the image domain */
+        fftwf_complex * F_one = initial_guess(otf->M, otf->N, otf->P,
+                                              wM, wN, wP);
+        /* Bertero, Eq. 15 */
+        float * W = fft_convolve_cc_conj_f2(otf->cK, F_one, wM, wN, wP);
+        F_one = NULL; /* Freed by the call above */
+
+        /* Sigma in Bertero's paper, introduced for Eq. 17 */
+        float sigma = 0.01; // Until 2021.11.25 used 0.001
+#pragma omp parallel for shared(W)
+        for(size_t kk = 0; kk<wMNP; kk++)
+        {
+            if(W[kk] > sigma)
+            {
+                W[kk] = 1.0/W[kk];
+            } else {
+                W[kk] = 0;
+            }
+        }
+        otf->W = W;
+
+        if(otf->storage != FIM_FP32)
+        {
+            otf->hW = fim_half_from_float(W, wMNP, otf->storage);
+            fim_free(W);
+            otf->W = NULL;
+        }
+    }
+
+    /* With a symmetric PSF, half of the memory and a cheaper
+     * multiplication is enough */
+    otf->rK = NULL;
+    if(fft_is_real(otf->cK, wM, wN, wP, DW_OTF_REAL_TOL))
+    {
+        if(s->verbosity > 1)
+        {
+            printf("The PSF is symmetric, using a real valued transfer function\n");
+        }
+        otf->rK = fft_real_and_free(otf->cK, wM, wN, wP);
+        otf->cK = NULL;
+    }
+    return;
+}
+
+float * dw_otf_convolve(const dw_otf_t * otf, fftwf_complex * B)
+{
+    if(otf->rK != NULL)
+    {
+        return fft_convolve_rc_f2(otf->rK, B, otf->wM, otf->wN, otf->wP);
+    }
+    return fft_convolve_cc_f2(otf->cK, B, otf->wM, otf->wN, otf->wP);
+}
+
+float * dw_otf_convolve_conj(const dw_otf_t * otf, fftwf_complex * B)
+{
+    if(otf->rK != NULL)
+    {
+        /* conj(rK) = rK */
+        return fft_convolve_rc_f2(otf->rK, B, otf->wM, otf->wN, otf->wP);
+    }
+    return fft_convolve_cc_conj_f2(otf->cK, B, otf->wM, otf->wN, otf->wP);
+}
+
+dw_otf_cache_t * dw_otf_cache_new(int capacity)
+{
+    assert(capacity > 0);
+    dw_otf_cache_t * C = calloc(1, sizeof(dw_otf_cache_t));
+    assert(C != NULL);
+    C->entries = calloc(capacity, sizeof(dw_otf_t*));
+    assert(C->entries != NULL);
+    C->capacity = capacity;
+#ifdef _OPENMP
+    omp_init_lock(&C->lock);
+#endif
+    return C;
+}
+
+void dw_otf_cache_free(dw_otf_cache_t * C)
+{
+    if(C == NULL)
+    {
+        return;
+    }
+    for(int kk = 0; kk < C->capacity; kk++)
+    {
+        dw_otf_free(C->entries[kk]);
+    }
+    free(C->entries);
+#ifdef _OPENMP
+    omp_destroy_lock(&C->lock);
+#endif
+    free(C);
+}
+
+void dw_otf_cache_fprint_stats(FILE * f, const dw_otf_cache_t * C)
+{
+    if(f == NULL || C == NULL)
+    {
+        return;
+    }
+    fprintf(f, "OTF cache: %zu hits, %zu misses\n", C->hits, C->misses);
+}
+
+static void cache_lock(dw_otf_cache_t * C)
+{
+#ifdef _OPENMP
+    omp_set_lock(&C->lock);
+#else
+    (void) C;
+#endif
+}
+
+static void cache_unlock(dw_otf_cache_t * C)
+{
+#ifdef _OPENMP
+    omp_unset_lock(&C->lock);
+#else
+    (void) C;
+#endif
+}
+
+static dw_otf_t * dw_otf_new(dw_opts * s,
+                             const float * psf,
+                             int64_t pM, int64_t pN, int64_t pP,
+                             int64_t M, int64_t N, int64_t P,
+                             int64_t wM, int64_t wN, int64_t wP,
+                             uint64_t hash)
+{
+    dw_otf_t * otf = calloc(1, sizeof(dw_otf_t));
+    assert(otf != NULL);
+    otf->M = M; otf->N = N; otf->P = P;
+    otf->pM = pM; otf->pN = pN; otf->pP = pP;
+    otf->wM = wM; otf->wN = wN; otf->wP = wP;
+    otf->psf_hash = hash;
+    otf->borderQuality = s->borderQuality;
+    otf->storage = s->storage;
+    otf->batch2d = fft_get_batch2d();
+    otf->refcount = 1;
+    dw_otf_compute(otf, s, psf);
+    return otf;
+}
+
+dw_otf_t * dw_otf_get(dw_opts * s,
+                      const float * psf,
+                      int64_t pM, int64_t pN, int64_t pP,
+                      int64_t M, int64_t N, int64_t P,
+                      int64_t wM, int64_t wN, int64_t wP)
+{
+    dw_otf_cache_t * C = s->otf_cache;
+    uint64_t hash = psf_hash(psf, pM*pN*pP);
+
+    if(C == NULL)
+    {
+        return dw_otf_new(s, psf, pM, pN, pP, M, N, P, wM, wN, wP, hash);
+    }
+
+    /* The lock is kept while a missing entry is computed. With
+     * several tile workers they typically need the same entry at
+     * the same time, and then it is only computed once. */
+    cache_lock(C);
+    C->tick++;
+    for(int kk = 0; kk < C->capacity; kk++)
+    {
+        dw_otf_t * e = C->entries[kk];
+        if(e != NULL && dw_otf_match(e, pM, pN, pP, M, N, P, wM, wN, wP,
+                                     hash, s->borderQuality, s->storage,
+                                     fft_get_batch2d()))
+        {
+            e->last_used = C->tick;
+            e->refcount++;
+            C->hits++;
+            cache_unlock(C);
+            if(s->verbosity > 1)
+            {
+                printf("Reusing the transfer function from the cache\n");
+            }
+            return e;
+        }
+    }
+    C->misses++;
+
+    dw_otf_t * otf = dw_otf_new(s, psf, pM, pN, pP, M, N, P, wM, wN, wP, hash);
+
+    /* Use an empty slot or evict the least recently used entry that
+     * is not in use */
+    int slot = -1;
+    for(int kk = 0; kk < C->capacity; kk++)
+    {
+        if(C->entries[kk] == NULL)
+        {
+            slot = kk;
+            break;
+        }
+        if(C->entries[kk]->refcount > 0)
+        {
+            continue;
+        }
+        if(slot < 0 || C->entries[kk]->last_used < C->entries[slot]->last_used)
+        {
+            slot = kk;
+        }
+    }
+    if(slot >= 0)
+    {
+        dw_otf_free(C->entries[slot]);
+        otf->last_used = C->tick;
+        otf->cached = 1;
+        C->entries[slot] = otf;
+    }
+    cache_unlock(C);
+    return otf;
+}
+
+void dw_otf_release(dw_opts * s, dw_otf_t * otf)
+{
+    if(otf == NULL)
+    {
+        return;
+    }
+    if(otf->cached == 0)
+    {
+        dw_otf_free(otf);
+        return;
+    }
+    cache_lock(s->otf_cache);
+    otf->refcount--;
+    cache_unlock(s->otf_cache);
+    return;
+}
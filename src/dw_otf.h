@@ -0,0 +1,101 @@
+#pragma once
+
+/*    Copyright (C) 2020 Erik L. G. Wernersson
+ *
+ *    This program is free software: you can redistribute it and/or modify
+ *    it under the terms of the GNU General Public License as published by
+ *    the Free Software Foundation, either version 3 of the License, or
+ *    (at your option) any later version.
+ *
+ *    This program is distributed in the hope that it will be useful,
+ *    but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *    GNU General Public License for more details.
+ *
+ *    You should have received a copy of the GNU General Public License
+ *    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include "dw.h"
+
+/* The transfer function, i.e. the FFT of the expanded and centered
+ * PSF, and the weights used for Bertero's boundary handling.
+ *
+ * Setting them up costs two FFTs of the full job size. When tiling is
+ * used, most tiles have the same size and the same (cropped) PSF so
+ * they are cached in s->otf_cache and shared between tiles.
+ */
+
+/* Default number of entries in the cache. Enough to cover first,
+ * interior and last tiles along the second dimension. */
+#define DW_OTF_CACHE_SIZE 3
+
+/* The transfer function is stored as real numbers when the imaginary
+ * parts are at most this times the largest component. That is the
+ * case for PSFs that are symmetric around the center, for example
+ * widefield PSFs from dw_bw. */
+#define DW_OTF_REAL_TOL 1e-5
+
+struct _dw_otf {
+    /* Key */
+    int64_t M, N, P; /* Image size */
+    int64_t pM, pN, pP; /* PSF size */
+    int64_t wM, wN, wP; /* Job size */
+    uint64_t psf_hash; /* Hash of the PSF data */
+    int borderQuality;
+    fim_dtype storage;
+    int batch2d; /* See fft_set_batch2d */
+
+    /* Data */
+    fftwf_complex * cK; /* fft of the PSF, of size [wM x wN x wP] */
+    float * rK; /* Real part of cK. If set, cK is NULL */
+    float * W; /* Bertero weights, NULL when borderQuality == 0 */
+    fim_half * hW; /* W in reduced precision, see --storage. If set, W is NULL */
+
+    uint64_t last_used; /* For LRU eviction */
+    int refcount; /* Number of users, entries in use are not evicted */
+    int cached; /* Set if owned by a cache */
+};
+
+struct _dw_otf_cache {
+    dw_otf_t ** entries;
+    int capacity;
+    uint64_t tick;
+    size_t hits;
+    size_t misses;
+#ifdef _OPENMP
+    /* The cache is shared by the tile workers, see --tile-workers */
+    omp_lock_t lock;
+#endif
+};
+
+/* Create a cache that can hold capacity entries */
+dw_otf_cache_t * dw_otf_cache_new(int capacity);
+
+/* Free the cache and all entries */
+void dw_otf_cache_free(dw_otf_cache_t * C);
+
+/* Write the number of hits and misses to f */
+void dw_otf_cache_fprint_stats(FILE * f, const dw_otf_cache_t * C);
+
+/** @brief Get the transfer function and the weights for a job
+ *
+ * The PSF of size [pM x pN x pP] is not freed. If s->otf_cache is
+ * set the returned object is looked up in, or added to, the cache
+ * and is owned by it. In any case, call dw_otf_release when done.
+ */
+dw_otf_t * dw_otf_get(dw_opts * s,
+                      const float * psf,
+                      int64_t pM, int64_t pN, int64_t pP,
+                      int64_t M, int64_t N, int64_t P,
+                      int64_t wM, int64_t wN, int64_t wP);
+
+/* Y = ifft(cK*B), B is freed */
+float * dw_otf_convolve(const dw_otf_t * otf, fftwf_complex * B);
+
+/* Y = ifft(conj(cK)*B), B is freed */
+float * dw_otf_convolve_conj(const dw_otf_t * otf, fftwf_complex * B);
+
+/* Free otf unless it is owned by s->otf_cache.
+ * dw_otf_get and dw_otf_release are thread safe */
+void dw_otf_release(dw_opts * s, dw_otf_t * otf);
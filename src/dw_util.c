@@ -280,6 +280,46 @@ int get_peakMemoryKB(size_t * _VmPeak, size_t * _VmHWM)
 #endif
 #endif
 
+#ifdef WINDOWS
+size_t dw_get_available_memoryKB(void)
+{
+    return 0;
+}
+#else
+size_t dw_get_available_memoryKB(void)
+{
+    size_t avail = 0;
+#ifndef __APPLE__
+    FILE * mf = fopen("/proc/meminfo", "r");
+    if(mf != NULL)
+    {
+        char * line = NULL;
+        size_t len = 0;
+        while( getline(&line, &len, mf) > 0)
+        {
+            if(strncmp(line, "MemAvailable:", 13) == 0)
+            {
+                avail = (size_t) atol(line+13);
+                break;
+            }
+        }
+        free(line);
+        fclose(mf);
+    }
+#endif
+    if(avail == 0)
+    {
+        long pages = sysconf(_SC_PHYS_PAGES);
+        long page_size = sysconf(_SC_PAGE_SIZE);
+        if(pages > 0 && page_size > 0)
+        {
+            avail = (size_t) pages / 1024 * (size_t) page_size;
+        }
+    }
+    return avail;
+}
+#endif
+
 void fprint_peak_memory(FILE * fid)
 {
     size_t VmPeak = 0;
@@ -293,6 +333,115 @@ void fprint_peak_memory(FILE * fid)
     return;
 }
 
+#ifdef __linux__
+/* Copy the first line of fname, without the newline, to buf */
+static int read_first_line(const char * fname, char * buf, size_t len)
+{
+    FILE * fid = fopen(fname, "r");
+    if(fid == NULL)
+    {
+        return 1;
+    }
+    int ok = fgets(buf, len, fid) != NULL;
+    fclose(fid);
+    if(!ok)
+    {
+        return 1;
+    }
+    buf[strcspn(buf, "\n")] = '\0';
+    return 0;
+}
+#endif
+
+void dw_fprint_numa(FILE * fid)
+{
+#ifdef __linux__
+    DIR * dir = opendir("/sys/devices/system/node/");
+    if(dir == NULL)
+    {
+        return;
+    }
+    struct dirent * ent;
+    int nNodes = 0;
+    char buf[1024];
+    while((ent = readdir(dir)) != NULL)
+    {
+        int node = 0;
+        if(sscanf(ent->d_name, "node%d", &node) != 1)
+        {
+            continue;
+        }
+        char fname[512];
+        snprintf(fname, sizeof(fname),
+                 "/sys/devices/system/node/%s/cpulist", ent->d_name);
+        if(read_first_line(fname, buf, sizeof(buf)) == 0)
+        {
+            fprintf(fid, "NUMA node %d: cpus %s\n", node, buf);
+        }
+        nNodes++;
+    }
+    closedir(dir);
+    fprintf(fid, "NUMA nodes: %d\n", nNodes);
+
+    /* The CPUs that this process may run on, e.g. set by taskset or
+     * a job scheduler */
+    FILE * status = fopen("/proc/self/status", "r");
+    if(status != NULL)
+    {
+        char * line = NULL;
+        size_t len = 0;
+        while(getline(&line, &len, status) > 0)
+        {
+            if(strncmp(line, "Cpus_allowed_list:", 18) == 0)
+            {
+                char * v = line + 18;
+                v += strspn(v, " \t");
+                fprintf(fid, "CPUs allowed: %s", v);
+                break;
+            }
+        }
+        free(line);
+        fclose(status);
+    }
+#else
+    (void) fid;
+#endif
+    return;
+}
+
+int dw_exec_with_binding(const char * bind, char ** argv)
+{
+#ifdef __linux__
+    const char * env_bind = getenv("OMP_PROC_BIND");
+    if(env_bind != NULL)
+    {
+        /* Already set by the user, or by the exec below */
+        if(strcasecmp(env_bind, bind) != 0)
+        {
+            fprintf(stderr, "WARNING: --bind %s is ignored since "
+                    "OMP_PROC_BIND is set to %s\n", bind, env_bind);
+        }
+        return 0;
+    }
+    if(setenv("OMP_PROC_BIND", bind, 1))
+    {
+        return 1;
+    }
+    if(getenv("OMP_PLACES") == NULL)
+    {
+        setenv("OMP_PLACES", "cores", 1);
+    }
+    fflush(NULL);
+    execv("/proc/self/exe", argv);
+    /* Only reached on failure */
+    unsetenv("OMP_PROC_BIND");
+    return 1;
+#else
+    (void) bind;
+    (void) argv;
+    return 1;
+#endif
+}
 
 float dw_read_scaling(const char * file)
 {
@@ -445,6 +594,28 @@ dw_prefix_file(const char * inFile, const char * prefix)
 #endif
 }
 
+char *
+dw_suffix_file(const char * inFile, const char * suffix)
+{
+    assert(inFile != NULL);
+    assert(suffix != NULL);
+    char * outFile = calloc(strlen(inFile) + strlen(suffix) + 16, 1);
+    assert(outFile != NULL);
+
+    /* The extension starts at the last '.' of the file name */
+    const char * fname = strrchr(inFile, FILESEP);
+    fname == NULL ? fname = inFile : 0;
+    const char * ext = strrchr(fname, '.');
+    if(ext == NULL)
+    {
+        sprintf(outFile, "%s_%s", inFile, suffix);
+        return outFile;
+    }
+    memcpy(outFile, inFile, ext - inFile);
+    sprintf(outFile + (ext - inFile), "_%s%s", suffix, ext);
+    return outFile;
+}
+
 float abbe_res_xy(float lambda, float NA)
 {
     return lambda/(2.0*NA);
@@ -508,3 +679,107 @@ int npyfilename(const char * filename)
     }
     return 0;
 }
+
+/*
+ * Trace, see --trace
+ */
+
+#ifdef __linux__
+#include <sys/syscall.h>
+#endif
+#ifdef _OPENMP
+#include <omp.h>
+#endif
+
+int dw_trace_on = 0;
+
+static FILE * trace_fid = NULL;
+static struct timespec trace_t0;
+static long trace_nevents = 0;
+
+static long trace_pid(void)
+{
+#ifdef WINDOWS
+    return 1;
+#else
+    return (long) getpid();
+#endif
+}
+
+/* The kernel thread id when available, so that the threads of fftw
+ * and OpenMP are told apart, else the OpenMP thread number */
+static long trace_tid(void)
+{
+#ifdef __linux__
+    return (long) syscall(SYS_gettid);
+#elif defined _OPENMP
+    return (long) omp_get_thread_num();
+#else
+    return 0;
+#endif
+}
+
+int dw_trace_start(const char * fname)
+{
+    if(trace_fid != NULL)
+    {
+        dw_trace_stop();
+    }
+    trace_fid = fopen(fname, "w");
+    if(trace_fid == NULL)
+    {
+        fprintf(stderr, "ERROR: Can't open %s for writing\n", fname);
+        return EXIT_FAILURE;
+    }
+    static int registered = 0;
+    if(!registered)
+    {
+        /* Also when dw exits on an error */
+        atexit(dw_trace_stop);
+        registered = 1;
+    }
+    dw_gettime(&trace_t0);
+    trace_nevents = 0;
+    fprintf(trace_fid, "[\n");
+    fprintf(trace_fid, "{\"name\":\"process_name\",\"ph\":\"M\",\"pid\":%ld,"
+            "\"tid\":%ld,\"args\":{\"name\":\"deconwolf\"}}",
+            trace_pid(), trace_tid());
+    trace_nevents++;
+    dw_trace_on = 1;
+    return EXIT_SUCCESS;
+}
+
+void dw_trace_stop(void)
+{
+    dw_trace_on = 0;
+    if(trace_fid == NULL)
+    {
+        return;
+    }
+    fprintf(trace_fid, "\n]\n");
+    fclose(trace_fid);
+    trace_fid = NULL;
+}
+
+void dw_trace_event(const char * name, char phase)
+{
+    struct timespec t;
+    dw_gettime(&t);
+    /* Double precision, a float would only resolve ms after a few
+     * minutes */
+    double us = 1e6*(double) (t.tv_sec - trace_t0.tv_sec)
+        + 1e-3*(double) (t.tv_nsec - trace_t0.tv_nsec);
+    long tid = trace_tid();
+
+#pragma omp critical(dw_trace)
+    {
+        if(trace_fid != NULL)
+        {
+            fprintf(trace_fid, "%s\n{\"name\":\"%s\",\"ph\":\"%c\","
+                    "\"ts\":%.3f,\"pid\":%ld,\"tid\":%ld}",
+                    trace_nevents > 0 ? "," : "",
+                    name, phase, us, trace_pid(), tid);
+            trace_nevents++;
+        }
+    }
+}
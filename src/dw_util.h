@@ -111,6 +111,24 @@ int get_peakMemoryKB(size_t * physical, size_t * virtual);
 /* Print a line about peak memory usage to a file */
 void fprint_peak_memory(FILE * fid);
 
+/* Print the NUMA nodes with their CPUs and the CPUs that the process
+ * is allowed to use. Only on Linux, prints nothing elsewhere */
+void dw_fprint_numa(FILE * fid);
+
+/* Restart the program with OMP_PROC_BIND=bind, and OMP_PLACES=cores
+ * unless OMP_PLACES is set, since the OpenMP runtime reads them when
+ * it is loaded. Does nothing and returns 0 if OMP_PROC_BIND is
+ * already set, with a warning if it differs from bind. Does not
+ * return on success, returns non-zero if it could not be done, e.g.,
+ * when not on Linux. */
+int dw_exec_with_binding(const char * bind, char ** argv);
+
+/* Memory that is available for new allocations, in KB.
+ * On Linux: MemAvailable from /proc/meminfo
+ * Other UNIX: Total physical memory
+ * On Windows: 0, i.e., unknown */
+size_t dw_get_available_memoryKB(void);
+
 /* Read the scaling of file from the .log.txt file if exists */
 float dw_read_scaling(const char * file);
 
@@ -138,6 +156,13 @@ char * dw_getcwd(char * buf, size_t size);
  **/
 char * dw_prefix_file(const char * file, const char * prefix);
 
+/** Add a suffix to a file, before the extension
+ * Examples:
+ * ("file.tif", "c1") -> "file_c1.tif"
+ * ("/dir/file", "c1") -> "/dir/file_c1"
+ **/
+char * dw_suffix_file(const char * file, const char * suffix);
+
 #ifdef WINDOWS
 int getline(char **lineptr, size_t *n, FILE *stream);
 #endif
@@ -155,3 +180,33 @@ int dw_fseek(FILE *, int64_t offset, int whence);
 
 /* Check if a file name ends with .npy while ignoring case */
 int npyfilename(const char * filename);
+
+/* Timeline of a run, see --trace.
+ *
+ * Begin and end events are written to a file in the Chrome Trace Event
+ * format (a JSON array) that can be opened with https://ui.perfetto.dev
+ * or chrome://tracing. Each event has a name, a time stamp in us since
+ * dw_trace_start and the id of the calling thread. Events of the same
+ * thread have to be nested.
+ *
+ * Nothing is recorded unless dw_trace_start was called. When tracing
+ * is off DW_TRACE_BEGIN and DW_TRACE_END only test a global flag.
+ */
+
+extern int dw_trace_on;
+
+/* Open fname for writing and start recording. dw_trace_stop is
+ * called at exit. Returns EXIT_SUCCESS or EXIT_FAILURE if the file
+ * can't be opened. */
+int dw_trace_start(const char * fname);
+
+/* Terminate the JSON array and close the file */
+void dw_trace_stop(void);
+
+/* Write one event, phase is 'B' (begin) or 'E' (end). The name is
+ * written as is, i.e. it should not need any escaping in JSON. Use the
+ * macros below instead of calling this directly. */
+void dw_trace_event(const char * name, char phase);
+
+#define DW_TRACE_BEGIN(name) do { if(dw_trace_on) { dw_trace_event(name, 'B'); } } while(0)
+#define DW_TRACE_END(name) do { if(dw_trace_on) { dw_trace_event(name, 'E'); } } while(0)
@@ -25,9 +25,16 @@
 #include <math.h>
 #include <sys/stat.h>
 #include <sys/types.h>
+#ifndef WINDOWS
+#include <unistd.h>
+#endif
+#ifdef _OPENMP
+#include <omp.h>
+#endif
 
 #include "fim.h"
 #include "dw_util.h"
+#include "fim_simd.h"
 
 /* This provides some utility functions for using fftw3.
  *
@@ -44,12 +51,48 @@ static unsigned int FFTW3_PLANNING = FFTW_MEASURE;
 static int fft_nthreads = 1;
 /* Enable with fft_set_inplace() */
 static int use_inplace = 0;
+/* Enable with fft_set_batch2d() */
+static int use_batch2d = 0;
 
 
-fftwf_plan plan_r2c = NULL;
-fftwf_plan plan_c2r = NULL;
-fftwf_plan plan_r2c_inplace = NULL;
-fftwf_plan plan_c2r_inplace = NULL;
+/* Plans are cached per shape and settings, see fft_train, so that
+ * jobs alternating between a few sizes, like the interior and edge
+ * tiles or fim_xcorr2 in between, are not planned over and over. When
+ * full, the least recently used entry is replaced.
+ *
+ * There is one cache per worker, i.e., per thread of the outermost
+ * parallel region, see fft_worker, so that several tiles can be
+ * processed at the same time, see --tile-workers. The caches belong
+ * to the process and not to the OS threads: a worker finds its plans
+ * also when OpenMP runs it on another thread, and myfftw_stop frees
+ * the plans of all workers. */
+#define FFT_PLAN_CACHE_SIZE 8
+
+typedef struct {
+    size_t M, N, P; /* Shape, M = 0 for an empty entry */
+    int nthreads;
+    unsigned int flags; /* FFTW3_PLANNING */
+    int batch2d; /* P transforms of size [M x N], see fft_set_batch2d */
+    /* Both kinds are needed since fft() is used also with in-place */
+    fftwf_plan r2c, c2r, r2c_inplace, c2r_inplace;
+    uint64_t used; /* When last used, for the LRU replacement */
+} fft_plans_t;
+
+typedef struct {
+    fft_plans_t cache[FFT_PLAN_CACHE_SIZE];
+    uint64_t clock;
+    /* The plans from the last call to fft_train, NULL if none */
+    fft_plans_t * current;
+} fft_worker_t;
+
+/* Only changed with the fftw_planner lock held */
+static fft_worker_t plan_workers[FFT_MAX_WORKERS];
+
+/* Summed over all threads, see fft_plan_stats_fprint */
+static size_t plan_hits = 0;
+static size_t plan_misses = 0;
+static size_t plan_evictions = 0;
+static double plan_seconds = 0;
 
 
 /*
@@ -151,7 +194,48 @@ static size_t nch(size_t M, size_t N, size_t P)
     return (1+M/2)*N*P;
 }
 
-static char * get_swf_file_name(int nThreads)
+/* The cache of the calling worker. Threads of nested parallel regions
+ * share the worker of their ancestor in the outermost region. */
+static fft_worker_t * fft_worker(void)
+{
+    int w = 0;
+#ifdef _OPENMP
+    if(omp_get_level() > 0)
+    {
+        w = omp_get_ancestor_thread_num(1);
+    }
+#endif
+    if(w < 0 || w >= FFT_MAX_WORKERS)
+    {
+        fprintf(stderr, "ERROR: fft: worker %d, at most %d are supported\n",
+                w, FFT_MAX_WORKERS);
+        exit(EXIT_FAILURE);
+    }
+    return plan_workers + w;
+}
+
+/* The plans from the last call to fft_train by the calling worker */
+static const fft_plans_t * fft_current(void)
+{
+    const fft_plans_t * p = fft_worker()->current;
+    assert(p != NULL);
+    return p;
+}
+
+/* Number of elements per transform with the current plans, i.e., the
+ * scaling of an unnormalized forward and backward transform */
+static size_t fft_norm(size_t M, size_t N, size_t P)
+{
+    if(fft_current()->batch2d)
+    {
+        return M*N;
+    }
+    return M*N*P;
+}
+
+/* Path to the file called name in ~/.config/deconwolf/ or just name
+ * if that folder can't be used */
+static char * get_config_file_name(const char * name)
 {
     char * dir_home = getenv("HOME");
     char * dir_config = malloc(1024*sizeof(char));
@@ -159,12 +243,7 @@ static char * get_swf_file_name(int nThreads)
     char * swf = malloc(1024*sizeof(char));
     assert(swf != NULL);
 
-    if(use_inplace == 0)
-    {
-        sprintf(swf, "fftw_wisdom_float_threads_%d.dat", nThreads);
-    } else {
-        sprintf(swf, "fftw_wisdom_float_inplace_threads_%d.dat", nThreads);
-    }
+    sprintf(swf, "%s", name);
 
     sprintf(dir_config, "%s/.config/", dir_home);
     // printf("dir_config = %s\n", dir_config);
@@ -190,6 +269,18 @@ static char * get_swf_file_name(int nThreads)
     }
 }
 
+static char * get_swf_file_name(int nThreads)
+{
+    char swf[128];
+    if(use_inplace == 0)
+    {
+        sprintf(swf, "fftw_wisdom_float_threads_%d.dat", nThreads);
+    } else {
+        sprintf(swf, "fftw_wisdom_float_inplace_threads_%d.dat", nThreads);
+    }
+    return get_config_file_name(swf);
+}
+
 #ifdef CUDA
 void myfftw_start(__attribute__((unused)) const int nThreads,
                   __attribute__((unused)) int verbose,
@@ -283,13 +374,70 @@ void myfftw_start(const int nThreads, int verbose, FILE * log)
 }
 #endif
 
+#ifndef CUDA
+/* Destroy the plans of an entry. Call with the planner locked */
+static void fft_plans_destroy(fft_plans_t * e)
+{
+    if(e->r2c != NULL)
+    {
+        fftwf_destroy_plan(e->r2c);
+        fftwf_destroy_plan(e->c2r);
+        fftwf_destroy_plan(e->r2c_inplace);
+        fftwf_destroy_plan(e->c2r_inplace);
+    }
+    memset(e, 0, sizeof(fft_plans_t));
+}
+#endif
+
+/* Destroy the plans of w. Call with the planner locked */
+static void fft_worker_free(fft_worker_t * w)
+{
+#ifndef CUDA
+    for(int kk = 0; kk < FFT_PLAN_CACHE_SIZE; kk++)
+    {
+        fft_plans_destroy(w->cache + kk);
+    }
+#endif
+    w->current = NULL;
+}
+
+void fft_free_plans(void)
+{
+    fft_worker_t * w = fft_worker();
+    /* The planner is not thread safe and destroying plans use it */
+#pragma omp critical(fftw_planner)
+    fft_worker_free(w);
+}
+
+void fft_plan_stats_fprint(FILE * f)
+{
+    if(f == NULL)
+    {
+        return;
+    }
+    size_t hits, misses, evictions;
+    double seconds;
+#pragma omp critical(fft_plan_stats)
+    {
+        hits = plan_hits;
+        misses = plan_misses;
+        evictions = plan_evictions;
+        seconds = plan_seconds;
+    }
+    fprintf(f, "fftw3 plans: %zu reused, %zu created in %.2f s, "
+            "%zu evicted\n", hits, misses, seconds, evictions);
+}
+
 void myfftw_stop(void)
 {
+#pragma omp critical(fftw_planner)
+    {
+        for(int kk = 0; kk < FFT_MAX_WORKERS; kk++)
+        {
+            fft_worker_free(plan_workers + kk);
+        }
+    }
 #ifndef CUDA
-    fftwf_destroy_plan(plan_r2c);
-    fftwf_destroy_plan(plan_c2r);
-    fftwf_destroy_plan(plan_r2c_inplace);
-    fftwf_destroy_plan(plan_c2r_inplace);
     fftwf_cleanup_threads();
 #endif
     fftwf_cleanup();
@@ -299,15 +447,19 @@ void myfftw_stop(void)
 float * ifft(const fftwf_complex * fX, size_t M, size_t N, size_t P)
 {
 
-    float * X = fim_malloc(M*N*P*sizeof(float));
+    /* All elements are written by the transform */
+    float * X = fim_malloc_nozero(M*N*P*sizeof(float));
     assert(X != NULL);
 
-    fftwf_execute_dft_c2r(plan_c2r, (fftwf_complex*) fX, X);
+    DW_TRACE_BEGIN("fft_c2r");
+    fftwf_execute_dft_c2r(fft_current()->c2r, (fftwf_complex*) fX, X);
+    DW_TRACE_END("fft_c2r");
 
+    const float norm = (float) fft_norm(M, N, P);
 #pragma omp parallel for shared(X)
     for(size_t kk = 0 ; kk < M*N*P; kk++)
     {
-        X[kk] /= (float) (M*N*P);
+        X[kk] /= norm;
     }
 
     return X;
@@ -318,13 +470,16 @@ fftwf_complex * fft(const float * restrict in,
                     const int n1, const int n2, const int n3)
 {
     assert(in != NULL);
+    const fftwf_plan plan_r2c = fft_current()->r2c;
     assert(plan_r2c != NULL);
     size_t N = nch(n1, n2, n3);
-    fftwf_complex * out = fim_malloc(N*sizeof(fftwf_complex));
+    /* All elements are written by the transform */
+    fftwf_complex * out = fim_malloc_nozero(N*sizeof(fftwf_complex));
     assert(out != NULL);
-    memset(out, 0, N*sizeof(fftwf_complex));
 
+    DW_TRACE_BEGIN("fft_r2c");
     fftwf_execute_dft_r2c(plan_r2c, (float*) in, out);
+    DW_TRACE_END("fft_r2c");
 
     return out;
 }
@@ -336,14 +491,7 @@ void fft_mul(fftwf_complex * restrict C,
 {
     size_t N = nch(n1, n2, n3);
     /* C = A*B */
-#pragma omp parallel for shared(A,B,C)
-    for(size_t kk = 0; kk<N; kk++)
-    {
-        float a = A[kk][0]; float ac = A[kk][1];
-        float b = B[kk][0]; float bc = B[kk][1];
-        C[kk][0] = a*b - ac*bc;
-        C[kk][1] = a*bc + b*ac;
-    }
+    fim_simd_cmul((float*) C, (float*) A, (float*) B, N);
     return;
 }
 
@@ -352,15 +500,8 @@ void fft_mul_inplace(fftwf_complex * restrict A,
                      const size_t n1, const size_t n2, const size_t n3)
 {
     size_t N = nch(n1, n2, n3);
-    /* C = A*B */
-#pragma omp parallel for shared(A,B)
-    for(size_t kk = 0; kk<N; kk++)
-    {
-        float a = A[kk][0]; float ac = A[kk][1];
-        float b = B[kk][0]; float bc = B[kk][1];
-        B[kk][0] = a*b - ac*bc;
-        B[kk][1] = a*bc + b*ac;
-    }
+    /* B = A*B */
+    fim_simd_cmul((float*) B, (float*) A, (float*) B, N);
     return;
 }
 
@@ -376,23 +517,16 @@ void fft_mul_conj(fftwf_complex * restrict C,
  * */
 {
     size_t N = nch(n1, n2, n3);
-    // C = A*B
-    size_t kk = 0;
-#pragma omp parallel for shared(A, B, C)
-    for(kk = 0; kk<N; kk++)
-    {
-        float a = A[kk][0]; float ac = -A[kk][1];
-        float b = B[kk][0]; float bc = B[kk][1];
-        C[kk][0] = a*b - ac*bc;
-        C[kk][1] = a*bc + b*ac;
-    }
+    fim_simd_cmul_conj((float*) C, (float*) A, (float*) B, N);
     return;
 }
 
 float * fft_convolve_cc_f2(fftwf_complex * A, fftwf_complex * B,
                            const int M, const int N, const int P)
 {
+    DW_TRACE_BEGIN("fft_mul");
     fft_mul_inplace(A, B, M, N, P);
+    DW_TRACE_END("fft_mul");
     float * out = ifft_and_free(B, M, N, P);
     return out;
 }
@@ -405,18 +539,8 @@ void fft_mul_conj_inplace(fftwf_complex * restrict A,
  * All inputs should have the same size [n1 x n2 x n3]
  * */
 {
-    //size_t N = nch(n1, n2, n3);
     size_t N = nch(n1, n2, n3);
-    // C = A*B
-    size_t kk = 0;
-#pragma omp parallel for shared(A, B)
-    for(kk = 0; kk<N; kk++)
-    {
-        float a = A[kk][0]; float ac = -A[kk][1];
-        float b = B[kk][0]; float bc = B[kk][1];
-        B[kk][0] = a*b - ac*bc;
-        B[kk][1] = a*bc + b*ac;
-    }
+    fim_simd_cmul_conj((float*) B, (float*) A, (float*) B, N);
     return;
 }
 
@@ -424,31 +548,92 @@ void fft_mul_conj_inplace(fftwf_complex * restrict A,
 float * fft_convolve_cc_conj_f2(fftwf_complex * A, fftwf_complex * B,
                                 const int M, const int N, const int P)
 {
+    DW_TRACE_BEGIN("fft_mul");
     fft_mul_conj_inplace(A, B, M, N, P);
+    DW_TRACE_END("fft_mul");
     float * out = ifft_and_free(B, M, N, P);
     return out;
 }
 
 
+int fft_is_real(const fftwf_complex * A,
+                const int M, const int N, const int P,
+                const float tol)
+{
+    size_t n = nch(M, N, P);
+    float amax = 0;
+    float imax = 0;
+#pragma omp parallel for reduction(max: amax, imax) shared(A)
+    for(size_t kk = 0; kk < n; kk++)
+    {
+        float re = fabsf(A[kk][0]);
+        float im = fabsf(A[kk][1]);
+        re > amax ? amax = re : 0;
+        im > amax ? amax = im : 0;
+        im > imax ? imax = im : 0;
+    }
+    return imax <= tol*amax;
+}
+
+float * fft_real_and_free(fftwf_complex * A,
+                          const int M, const int N, const int P)
+{
+    size_t n = nch(M, N, P);
+    float * R = fim_malloc_nozero(n*sizeof(float));
+    assert(R != NULL);
+#pragma omp parallel for shared(A, R)
+    for(size_t kk = 0; kk < n; kk++)
+    {
+        R[kk] = A[kk][0];
+    }
+    fim_free(A);
+    return R;
+}
+
+void fft_mul_real_inplace(const float * restrict R,
+                          fftwf_complex * restrict B,
+                          const size_t n1, const size_t n2, const size_t n3)
+/* B = R*B where R is real valued */
+{
+    size_t N = nch(n1, n2, n3);
+    fim_simd_rcmul((float*) B, R, N);
+    return;
+}
+
+float * fft_convolve_rc_f2(const float * R, fftwf_complex * B,
+                           const int M, const int N, const int P)
+{
+    DW_TRACE_BEGIN("fft_mul");
+    fft_mul_real_inplace(R, B, M, N, P);
+    DW_TRACE_END("fft_mul");
+    float * out = ifft_and_free(B, M, N, P);
+    return out;
+}
+
 float * fft_convolve_cc(fftwf_complex * A, fftwf_complex * B,
                         const int M, const int N, const int P)
 {
     size_t n = nch(M, N, P);
-    fftwf_complex * C = fim_malloc(n*sizeof(fftwf_complex));
+    fftwf_complex * C = fim_malloc_nozero(n*sizeof(fftwf_complex));
     assert(C != NULL);
     fft_mul(C, A, B, M, N, P);
 
-    float * out = fim_malloc(M*N*P*sizeof(float));
+    float * out = fim_malloc_nozero(M*N*P*sizeof(float));
     assert(out != NULL);
 
-    fftwf_execute_dft_c2r(plan_r2c, C, out);
+    const fftwf_plan plan_c2r = fft_current()->c2r;
+    assert(plan_c2r != NULL);
+    DW_TRACE_BEGIN("fft_c2r");
+    fftwf_execute_dft_c2r(plan_c2r, C, out);
+    DW_TRACE_END("fft_c2r");
     fim_free(C);
 
     const size_t MNP = M*N*P;
+    const float norm = (float) fft_norm(M, N, P);
 #pragma omp parallel for shared(out)
     for(size_t kk = 0; kk<MNP; kk++)
     {
-        out[kk]/=(MNP);
+        out[kk] /= norm;
     }
     return out;
 }
@@ -457,22 +642,26 @@ float * fft_convolve_cc_conj(fftwf_complex * A, fftwf_complex * B,
                              const int M, const int N, const int P)
 {
     size_t n = nch(M, N, P);
-    fftwf_complex * C = fim_malloc(n*sizeof(fftwf_complex));
+    fftwf_complex * C = fim_malloc_nozero(n*sizeof(fftwf_complex));
     assert(C != NULL);
     fft_mul_conj(C, A, B, M, N, P);
 
-    float * out = fim_malloc(M*N*P*sizeof(float));
+    float * out = fim_malloc_nozero(M*N*P*sizeof(float));
     assert(out != NULL);
+    const fftwf_plan plan_c2r = fft_current()->c2r;
     assert(plan_c2r != NULL);
 
+    DW_TRACE_BEGIN("fft_c2r");
     fftwf_execute_dft_c2r(plan_c2r, C, out);
+    DW_TRACE_END("fft_c2r");
     fim_free(C);
 
     const size_t MNP = M*N*P;
+    const float norm = (float) fft_norm(M, N, P);
 #pragma omp parallel for shared(out)
     for(size_t kk = 0; kk<MNP; kk++)
     {
-        out[kk]/=(MNP);
+        out[kk] /= norm;
     }
     return out;
 }
@@ -487,34 +676,66 @@ void fft_train( __attribute__((unused)) const size_t M,
 {
     return;
 }
+
+void fft_plan_size(__attribute__((unused)) int64_t * wM,
+                   __attribute__((unused)) int64_t * wN,
+                   __attribute__((unused)) int64_t * wP,
+                   __attribute__((unused)) int64_t maxPad,
+                   __attribute__((unused)) int verbosity,
+                   __attribute__((unused)) FILE * log)
+{
+    return;
+}
 #endif
 
 #ifndef CUDA
-void fft_train(const size_t M, const size_t N, const size_t P,
-               const int verbosity, int nThreads,
-               FILE * log)
+/* Real to Hermitian for [M x N x P] or, with batch2d, P transforms
+ * of size [M x N] stored one after the other. The Hermitian layout,
+ * [(M/2+1) x N x P], is the same in both cases so everything but the
+ * transforms is unchanged. */
+static fftwf_plan fft_plan_r2c(const size_t M, const size_t N, const size_t P,
+                               int batch2d,
+                               float * in, fftwf_complex * out,
+                               unsigned int flags)
 {
-    int updatedWisdom = 0;
-
-    if(nThreads < 1)
+    if(batch2d == 0)
     {
-        nThreads = fft_nthreads;
+        return fftwf_plan_dft_r2c_3d(P, N, M, in, out, flags);
     }
-    nThreads < 1 ? nThreads = 1 : 0;
+    int n[2] = {N, M};
+    /* In-place, the rows are padded, see fft_inplace_pad */
+    int rembed[2] = {N, (void *) in == (void *) out ? 2*(M/2+1) : M};
+    return fftwf_plan_many_dft_r2c(2, n, P,
+                                   in, rembed, 1, rembed[0]*rembed[1],
+                                   out, NULL, 1, (M/2+1)*N,
+                                   flags);
+}
 
-    if(verbosity > 0){
-        printf("creating fftw3 plans ... \n"); fflush(stdout);
-    }
-    if(log != stdout)
+/* Hermitian to real, see fft_plan_r2c */
+static fftwf_plan fft_plan_c2r(const size_t M, const size_t N, const size_t P,
+                               int batch2d,
+                               fftwf_complex * in, float * out,
+                               unsigned int flags)
+{
+    if(batch2d == 0)
     {
-        fprintf(log, "--- fftw3 training ---\n");
+        return fftwf_plan_dft_c2r_3d(P, N, M, in, out, flags);
     }
+    int n[2] = {N, M};
+    int rembed[2] = {N, (void *) in == (void *) out ? 2*(M/2+1) : M};
+    return fftwf_plan_many_dft_c2r(2, n, P,
+                                   in, NULL, 1, (M/2+1)*N,
+                                   out, rembed, 1, rembed[0]*rembed[1],
+                                   flags);
+}
 
-    /* Free old plans if exist */
-    fftwf_destroy_plan(plan_r2c);
-    fftwf_destroy_plan(plan_c2r);
-    fftwf_destroy_plan(plan_r2c_inplace);
-    fftwf_destroy_plan(plan_c2r_inplace);
+/* Create the plans of e for the size [M x N x P] and e->batch2d.
+ * Returns 1 if the wisdom was updated. Call with the planner locked. */
+static int fft_create_plans(fft_plans_t * e,
+                            const size_t M, const size_t N, const size_t P)
+{
+    int updatedWisdom = 0;
+    fftwf_plan plan_r2c, plan_c2r, plan_r2c_inplace, plan_c2r_inplace;
 
     fftwf_complex * C = fim_malloc(nch(M, N, P)*sizeof(fftwf_complex));
     assert(C != NULL);
@@ -523,12 +744,12 @@ void fft_train(const size_t M, const size_t N, const size_t P,
 
     /* Hermitian to Real */
 
-    plan_c2r = fftwf_plan_dft_c2r_3d(P, N, M,
-                                     C, R, FFTW3_PLANNING  | FFTW_WISDOM_ONLY);
+    plan_c2r = fft_plan_c2r(M, N, P, e->batch2d,
+                            C, R, FFTW3_PLANNING  | FFTW_WISDOM_ONLY);
     if(plan_c2r == NULL)
     {
-        plan_c2r = fftwf_plan_dft_c2r_3d(P, N, M,
-                                         C, R, FFTW3_PLANNING);
+        plan_c2r = fft_plan_c2r(M, N, P, e->batch2d,
+                                C, R, FFTW3_PLANNING);
 
         printf("   c2r plan ..."); fflush(stdout);
         fftwf_execute(plan_c2r);
@@ -537,12 +758,12 @@ void fft_train(const size_t M, const size_t N, const size_t P,
         updatedWisdom = 1;
     }
 
-    plan_c2r_inplace = fftwf_plan_dft_c2r_3d(P, N, M,
-                                             C, (float *) C, FFTW3_PLANNING  | FFTW_WISDOM_ONLY);
+    plan_c2r_inplace = fft_plan_c2r(M, N, P, e->batch2d,
+                                    C, (float *) C, FFTW3_PLANNING  | FFTW_WISDOM_ONLY);
     if(plan_c2r_inplace == NULL)
     {
-        plan_c2r_inplace = fftwf_plan_dft_c2r_3d(P, N, M,
-                                                 C, (float *) C, FFTW3_PLANNING);
+        plan_c2r_inplace = fft_plan_c2r(M, N, P, e->batch2d,
+                                        C, (float *) C, FFTW3_PLANNING);
         printf("   c2r inplace plan ..."); fflush(stdout);
         fftwf_execute(plan_c2r_inplace);
         printf("\n");
@@ -551,27 +772,27 @@ void fft_train(const size_t M, const size_t N, const size_t P,
 
     /* Real to Hermitian */
 
-    plan_r2c = fftwf_plan_dft_r2c_3d(P, N, M,
-                                     R, C,
-                                     FFTW3_PLANNING | FFTW_WISDOM_ONLY);
+    plan_r2c = fft_plan_r2c(M, N, P, e->batch2d,
+                            R, C,
+                            FFTW3_PLANNING | FFTW_WISDOM_ONLY);
     if(plan_r2c == NULL)
     {
-        plan_r2c = fftwf_plan_dft_r2c_3d(P, N, M,
-                                         R, C,
-                                         FFTW3_PLANNING);
+        plan_r2c = fft_plan_r2c(M, N, P, e->batch2d,
+                                R, C,
+                                FFTW3_PLANNING);
         printf("   r2c plan ..."); fflush(stdout);
         fftwf_execute(plan_r2c);
         printf("\n");
         updatedWisdom = 1;
     }
-    plan_r2c_inplace = fftwf_plan_dft_r2c_3d(P, N, M,
-                                             (float*) C, C,
-                                             FFTW3_PLANNING | FFTW_WISDOM_ONLY);
+    plan_r2c_inplace = fft_plan_r2c(M, N, P, e->batch2d,
+                                    (float*) C, C,
+                                    FFTW3_PLANNING | FFTW_WISDOM_ONLY);
     if(plan_r2c_inplace == NULL)
     {
-        plan_r2c_inplace = fftwf_plan_dft_r2c_3d(P, N, M,
-                                                 (float*) C, C,
-                                                 FFTW3_PLANNING);
+        plan_r2c_inplace = fft_plan_r2c(M, N, P, e->batch2d,
+                                        (float*) C, C,
+                                        FFTW3_PLANNING);
         printf("   r2c inplace plan ..."); fflush(stdout);
         fftwf_execute(plan_r2c_inplace);
         printf("\n");
@@ -580,28 +801,530 @@ void fft_train(const size_t M, const size_t N, const size_t P,
 
     fim_free(C);
     fim_free(R);
+    e->r2c = plan_r2c;
+    e->c2r = plan_c2r;
+    e->r2c_inplace = plan_r2c_inplace;
+    e->c2r_inplace = plan_c2r_inplace;
+    return updatedWisdom;
+}
+
+/* Make the plans of e the current for the worker w */
+static void fft_plans_use(fft_worker_t * w, fft_plans_t * e)
+{
+    e->used = ++w->clock;
+    w->current = e;
+}
+
+void fft_train(const size_t M, const size_t N, const size_t P,
+               const int verbosity, int nThreads,
+               FILE * log)
+{
+    int updatedWisdom = 0;
+    DW_TRACE_BEGIN("fft_train");
 
-    if(updatedWisdom)
+    if(nThreads < 1)
     {
-        char * swf = get_swf_file_name(nThreads);
+        nThreads = fft_nthreads;
+    }
+    nThreads < 1 ? nThreads = 1 : 0;
 
-        assert(swf != NULL);
+    fft_worker_t * w = fft_worker();
+    int reused = 0;
 
-        fprintf(log, "Exporting fftw wisdom to %s\n", swf);
-        int ret = fftwf_export_wisdom_to_filename(swf);
+    /* The planner is not thread safe, and the caches of all workers
+     * are freed by myfftw_stop */
+#pragma omp critical(fftw_planner)
+    {
+        /* Nothing to do if there are plans for this size already,
+         * this happens for all but the first image in batch mode and
+         * for most tiles. Else use an empty entry or the least
+         * recently used. */
+        fft_plans_t * e = NULL;
+        for(int kk = 0; kk < FFT_PLAN_CACHE_SIZE; kk++)
+        {
+            fft_plans_t * c = w->cache + kk;
+            if(c->M == M && c->N == N && c->P == P
+               && c->nthreads == nThreads && c->flags == FFTW3_PLANNING
+               && c->batch2d == use_batch2d)
+            {
+                e = c;
+                reused = 1;
+                break;
+            }
+            if(e == NULL || c->used < e->used)
+            {
+                e = c;
+            }
+        }
 
-        if(ret != 0)
+        if(!reused)
         {
-            if(verbosity > 1)
+            if(verbosity > 0){
+                printf("creating fftw3 plans ... \n"); fflush(stdout);
+            }
+            if(log != stdout)
+            {
+                fprintf(log, "--- fftw3 training ---\n");
+            }
+            if(nThreads != fft_nthreads)
+            {
+                /* A tile worker with its own number of threads */
+                char * swf = get_swf_file_name(nThreads);
+                assert(swf != NULL);
+                fftwf_import_wisdom_from_filename(swf);
+                free(swf);
+            }
+            if(e->r2c != NULL)
+            {
+#pragma omp critical(fft_plan_stats)
+                plan_evictions++;
+            }
+            fft_plans_destroy(e);
+            e->batch2d = use_batch2d;
+            struct timespec t0, t1;
+            dw_gettime(&t0);
+            fftwf_plan_with_nthreads(nThreads);
+            updatedWisdom = fft_create_plans(e, M, N, P);
+            fftwf_plan_with_nthreads(fft_nthreads);
+            dw_gettime(&t1);
+#pragma omp critical(fft_plan_stats)
             {
-                printf("Exported fftw wisdom to %s\n", swf);
+                plan_misses++;
+                plan_seconds += timespec_diff(&t1, &t0);
             }
-        } else {
-            printf("ERROR; Failed to write fftw wisdom to %s\n", swf);
+
+            if(updatedWisdom)
+            {
+                char * swf = get_swf_file_name(nThreads);
+
+                assert(swf != NULL);
+
+                fprintf(log, "Exporting fftw wisdom to %s\n", swf);
+                int ret = fftwf_export_wisdom_to_filename(swf);
+
+                if(ret != 0)
+                {
+                    if(verbosity > 1)
+                    {
+                        printf("Exported fftw wisdom to %s\n", swf);
+                    }
+                } else {
+                    printf("ERROR; Failed to write fftw wisdom to %s\n", swf);
+                }
+                free(swf);
+            }
+            e->M = M; e->N = N; e->P = P;
+            e->nthreads = nThreads;
+            e->flags = FFTW3_PLANNING;
+        }
+        fft_plans_use(w, e);
+    }
+
+    if(reused)
+    {
+#pragma omp critical(fft_plan_stats)
+        plan_hits++;
+        if(verbosity > 1)
+        {
+            printf("Reusing the fftw3 plans\n");
         }
-        free(swf);
     }
 
+    DW_TRACE_END("fft_train");
+    return;
+}
+#endif
+
+#ifndef CUDA
+/*
+ * Job size planning, see fft_plan_size
+ */
+
+/* Name of the file with the measured 1D transform times */
+#define FFT_COST_FILE "fft_cost_1d.txt"
+/* Number of transforms per iteration and passes over memory per
+ * iteration, for the cost of an iteration of shb/rl */
+#define FFT_COST_NFFT 4
+#define FFT_COST_NPASS 8
+/* Largest prime factor of sizes considered when padding. FFTW has
+ * fast code for these. */
+#define FFT_COST_MAXPRIME 13
+
+/* Measured times per 1D transform, 0 = not measured. Guarded by the
+ * fftw_planner critical section. */
+static double * cost_r2c = NULL;
+static double * cost_c2c = NULL;
+static int64_t cost_n = 0;
+/* Time per voxel for one pass over memory */
+static double cost_voxel = 0;
+static int cost_loaded = 0;
+
+static void fft_cost_grow(int64_t n)
+{
+    if(n < cost_n)
+    {
+        return;
+    }
+    int64_t new_n = 2*n;
+    cost_r2c = realloc(cost_r2c, new_n*sizeof(double));
+    assert(cost_r2c != NULL);
+    cost_c2c = realloc(cost_c2c, new_n*sizeof(double));
+    assert(cost_c2c != NULL);
+    for(int64_t kk = cost_n; kk < new_n; kk++)
+    {
+        cost_r2c[kk] = 0;
+        cost_c2c[kk] = 0;
+    }
+    cost_n = new_n;
+}
+
+static void fft_cost_load(void)
+{
+    cost_loaded = 1;
+    char * fname = get_config_file_name(FFT_COST_FILE);
+    FILE * fid = fopen(fname, "r");
+    free(fname);
+    if(fid == NULL)
+    {
+        return;
+    }
+    char kind[16];
+    int64_t n = 0;
+    double t = 0;
+    while(fscanf(fid, "%15s %" SCNd64 " %lf", kind, &n, &t) == 3)
+    {
+        if(n < 1 || t <= 0)
+        {
+            continue;
+        }
+        if(strcmp(kind, "voxel") == 0)
+        {
+            cost_voxel = t;
+            continue;
+        }
+        fft_cost_grow(n);
+        if(strcmp(kind, "r2c") == 0)
+        {
+            cost_r2c[n] = t;
+        }
+        if(strcmp(kind, "c2c") == 0)
+        {
+            cost_c2c[n] = t;
+        }
+    }
+    fclose(fid);
+}
+
+static void fft_cost_save(void)
+{
+    /* Written to a temporary file that replaces the old one, so that
+     * other processes never read a partially written file */
+    char * fname = get_config_file_name(FFT_COST_FILE);
+    size_t len = strlen(fname) + 32;
+    char * tmpname = calloc(len, 1);
+    assert(tmpname != NULL);
+#ifdef WINDOWS
+    snprintf(tmpname, len, "%s.tmp", fname);
+#else
+    /* Several processes might save at the same time */
+    snprintf(tmpname, len, "%s.%d.tmp", fname, (int) getpid());
+#endif
+
+    int status = 0;
+    FILE * fid = fopen(tmpname, "w");
+    if(fid == NULL)
+    {
+        status = -1;
+        goto done;
+    }
+    fprintf(fid, "voxel 1 %e\n", cost_voxel);
+    for(int64_t kk = 1; kk < cost_n; kk++)
+    {
+        if(cost_r2c[kk] > 0)
+        {
+            fprintf(fid, "r2c %" PRId64 " %e\n", kk, cost_r2c[kk]);
+        }
+        if(cost_c2c[kk] > 0)
+        {
+            fprintf(fid, "c2c %" PRId64 " %e\n", kk, cost_c2c[kk]);
+        }
+    }
+    if(ferror(fid))
+    {
+        status = -1;
+    }
+    if(fclose(fid) != 0)
+    {
+        status = -1;
+    }
+    if(status == 0)
+    {
+#ifdef WINDOWS
+        /* rename does not replace existing files on Windows */
+        remove(fname);
+#endif
+        if(rename(tmpname, fname) != 0)
+        {
+            status = -1;
+        }
+    }
+
+ done:
+    if(status != 0)
+    {
+        fprintf(stderr, "Failed to write to %s\n", fname);
+        remove(tmpname);
+    }
+    free(tmpname);
+    free(fname);
+}
+
+/* Time per transform for a batch of 1D transforms of size n, real to
+ * complex if real is set, else complex to complex. Single threaded,
+ * only the relative times are used. */
+static double fft_cost_measure(int64_t n, int real)
+{
+    /* Enough transforms to get a stable timing */
+    int howmany = (int) (1048576 / n);
+    howmany < 1 ? howmany = 1 : 0;
+    float * in = fim_malloc(2*(n+2)*howmany*sizeof(float));
+    assert(in != NULL);
+    fftwf_complex * out = fim_malloc((n+2)*howmany*sizeof(fftwf_complex));
+    assert(out != NULL);
+
+    int nn = (int) n;
+    fftwf_plan_with_nthreads(1);
+    fftwf_plan plan = NULL;
+    if(real)
+    {
+        plan = fftwf_plan_many_dft_r2c(1, &nn, howmany,
+                                       in, NULL, 1, n,
+                                       out, NULL, 1, n/2+1,
+                                       FFTW_MEASURE);
+    } else {
+        plan = fftwf_plan_many_dft(1, &nn, howmany,
+                                   (fftwf_complex *) in, NULL, 1, n,
+                                   out, NULL, 1, n,
+                                   FFTW_FORWARD, FFTW_MEASURE);
+    }
+    fftwf_plan_with_nthreads(fft_nthreads);
+    assert(plan != NULL);
+
+    for(int64_t kk = 0; kk < 2*(n+2)*howmany; kk++)
+    {
+        in[kk] = (float) rand() / (float) RAND_MAX;
+    }
+
+    double best = INFINITY;
+    for(int rep = 0; rep < 3; rep++)
+    {
+        struct timespec t0, t1;
+        dw_gettime(&t0);
+        fftwf_execute(plan);
+        dw_gettime(&t1);
+        double t = timespec_diff(&t1, &t0);
+        t < best ? best = t : 0;
+    }
+    fftwf_destroy_plan(plan);
+    fim_free(out);
+    fim_free(in);
+    return best / (double) howmany;
+}
+
+/* Time per voxel for an element wise multiplication */
+static double fft_cost_measure_voxel(void)
+{
+    const size_t n = 1 << 24;
+    float * a = fim_malloc(n*sizeof(float));
+    float * b = fim_malloc(n*sizeof(float));
+    assert(a != NULL);
+    assert(b != NULL);
+    for(size_t kk = 0; kk < n; kk++)
+    {
+        a[kk] = 1;
+        b[kk] = 1.0001;
+    }
+    double best = INFINITY;
+    for(int rep = 0; rep < 3; rep++)
+    {
+        struct timespec t0, t1;
+        dw_gettime(&t0);
+        for(size_t kk = 0; kk < n; kk++)
+        {
+            a[kk] *= b[kk];
+        }
+        dw_gettime(&t1);
+        double t = timespec_diff(&t1, &t0);
+        t < best ? best = t : 0;
+    }
+    /* Keep the loop */
+    volatile float sink = a[n/2];
+    (void) sink;
+    fim_free(a);
+    fim_free(b);
+    return best / (double) n;
+}
+
+/* Returns the cost, measuring it if not already known. Sets *updated
+ * if a new measurement was made. */
+static double fft_cost_get(int64_t n, int real, int * updated)
+{
+    fft_cost_grow(n);
+    double * table = real ? cost_r2c : cost_c2c;
+    if(table[n] == 0)
+    {
+        table[n] = fft_cost_measure(n, real);
+        *updated = 1;
+    }
+    return table[n];
+}
+
+static int64_t largest_prime_factor(int64_t n)
+{
+    int64_t p = 1;
+    for(int64_t f = 2; f*f <= n; f++)
+    {
+        while(n % f == 0)
+        {
+            p = f;
+            n /= f;
+        }
+    }
+    return n > 1 ? n : p;
+}
+
+/* Candidate sizes in [w, w+maxPad], always including w */
+static int64_t * fft_size_candidates(int64_t w, int64_t maxPad, int * nc)
+{
+    int64_t * c = malloc((maxPad+1)*sizeof(int64_t));
+    assert(c != NULL);
+    int n = 0;
+    c[n++] = w;
+    /* Dimensions of size 1, i.e. 2D images, are not padded */
+    if(w > 1)
+    {
+        for(int64_t kk = w+1; kk <= w+maxPad; kk++)
+        {
+            if(largest_prime_factor(kk) <= FFT_COST_MAXPRIME)
+            {
+                c[n++] = kk;
+            }
+        }
+    }
+    *nc = n;
+    return c;
+}
+
+/* Estimated time for one iteration of shb/rl with the job size
+ * [a x b x c]. A 3D r2c transform is done as b*c real transforms of
+ * size a followed by complex transforms along the other two
+ * dimensions of the (a/2+1) x b x c Hermitian array. */
+static double fft_iteration_cost(int64_t a, double ta,
+                                 int64_t b, double tb,
+                                 int64_t c, double tc)
+{
+    const double h = (double) (a/2+1);
+    double tfft = (double) b*c*ta + h*c*tb + h*b*tc;
+    return FFT_COST_NFFT*tfft + FFT_COST_NPASS*cost_voxel*a*b*c;
+}
+
+void fft_plan_size(int64_t * wM, int64_t * wN, int64_t * wP,
+                   int64_t maxPad, int verbosity, FILE * log)
+{
+    if(maxPad < 1)
+    {
+        return;
+    }
+
+    int nM = 0, nN = 0, nP = 0;
+    int64_t * cM = fft_size_candidates(wM[0], maxPad, &nM);
+    int64_t * cN = fft_size_candidates(wN[0], maxPad, &nN);
+    int64_t * cP = fft_size_candidates(wP[0], maxPad, &nP);
+    double * tM = malloc(nM*sizeof(double));
+    double * tN = malloc(nN*sizeof(double));
+    double * tP = malloc(nP*sizeof(double));
+    assert(tM != NULL);
+    assert(tN != NULL);
+    assert(tP != NULL);
+
+    /* Measuring uses the planner, which is not thread safe. The
+     * measurements are only done once per size and machine. */
+    int updated = 0;
+#pragma omp critical(fftw_planner)
+    {
+        if(cost_loaded == 0)
+        {
+            fft_cost_load();
+        }
+        if(cost_voxel == 0)
+        {
+            cost_voxel = fft_cost_measure_voxel();
+            updated = 1;
+        }
+        for(int kk = 0; kk < nM; kk++)
+        {
+            tM[kk] = fft_cost_get(cM[kk], 1, &updated);
+        }
+        for(int kk = 0; kk < nN; kk++)
+        {
+            tN[kk] = fft_cost_get(cN[kk], 0, &updated);
+        }
+        for(int kk = 0; kk < nP; kk++)
+        {
+            tP[kk] = fft_cost_get(cP[kk], 0, &updated);
+        }
+        if(updated)
+        {
+            fft_cost_save();
+        }
+    }
+
+    const double cost0 = fft_iteration_cost(cM[0], tM[0],
+                                            cN[0], tN[0],
+                                            cP[0], tP[0]);
+    double best = cost0;
+    int bm = 0, bn = 0, bp = 0;
+    for(int mm = 0; mm < nM; mm++)
+    {
+        for(int nn = 0; nn < nN; nn++)
+        {
+            for(int pp = 0; pp < nP; pp++)
+            {
+                double cost = fft_iteration_cost(cM[mm], tM[mm],
+                                                 cN[nn], tN[nn],
+                                                 cP[pp], tP[pp]);
+                if(cost < best)
+                {
+                    best = cost;
+                    bm = mm; bn = nn; bp = pp;
+                }
+            }
+        }
+    }
+
+    if(best < cost0)
+    {
+        if(verbosity > 1)
+        {
+            printf("Job size [%" PRId64 " x %" PRId64 " x %" PRId64 "] -> "
+                   "[%" PRId64 " x %" PRId64 " x %" PRId64 "], "
+                   "estimated speedup %.2f\n",
+                   wM[0], wN[0], wP[0], cM[bm], cN[bn], cP[bp], cost0/best);
+        }
+        if(log != NULL)
+        {
+            fprintf(log, "Job size [%" PRId64 " x %" PRId64 " x %" PRId64 "] -> "
+                    "[%" PRId64 " x %" PRId64 " x %" PRId64 "], "
+                    "estimated speedup %.2f\n",
+                    wM[0], wN[0], wP[0], cM[bm], cN[bn], cP[bp], cost0/best);
+        }
+        wM[0] = cM[bm];
+        wN[0] = cN[bn];
+        wP[0] = cP[bp];
+    }
+
+    free(cM); free(cN); free(cP);
+    free(tM); free(tN); free(tP);
     return;
 }
 #endif
@@ -821,6 +1544,60 @@ void test_inplace(void)
     return;
 }
 
+/* The batched 2D transforms should give the same result as the
+ * planes transformed one by one */
+static void fft_ut_batch2d(void)
+{
+    printf(" -> Testing batched 2D transforms\n");
+    const size_t M = 23, N = 16, P = 5;
+    const size_t nc = nch(M, N, 1);
+    float * X = test_data_rand(M, N, P);
+
+    fft_set_batch2d(0);
+    fft_train(M, N, 1, 0, 1, stdout);
+    fftwf_complex * F1 = fim_malloc(nc*P*sizeof(fftwf_complex));
+    for(size_t pp = 0; pp < P; pp++)
+    {
+        fftwf_complex * f = fft(X + pp*M*N, M, N, 1);
+        memcpy(F1 + pp*nc, f, nc*sizeof(fftwf_complex));
+        fim_free(f);
+    }
+
+    fft_set_batch2d(1);
+    fft_train(M, N, P, 0, 1, stdout);
+    fftwf_complex * F = fft(X, M, N, P);
+    float fmax = 0;
+    float emax = 0;
+    for(size_t kk = 0; kk < 2*nc*P; kk++)
+    {
+        float v = fabsf(((float *) F1)[kk]);
+        float e = fabsf(((float *) F1)[kk] - ((float *) F)[kk]);
+        v > fmax ? fmax = v : 0;
+        e > emax ? emax = e : 0;
+    }
+    printf("batched vs per plane, max rel err: %e\n", emax/fmax);
+    assert(emax <= 1e-5*fmax);
+
+    /* Round trips, out-of-place and in-place */
+    float * Y = ifft(F, M, N, P);
+    float relerr_oo = fim_compare(X, Y, M, N, P);
+    printf("out-of-place max_rel_err: %e\n", relerr_oo);
+    assert(relerr_oo < 1e-5);
+    fftwf_complex * F2 = fft_inplace(fim_copy(X, M*N*P), M, N, P);
+    float * Y2 = ifft_inplace(F2, M, N, P);
+    float relerr_ii = fim_compare(X, Y2, M, N, P);
+    printf("in-place max_rel_err: %e\n", relerr_ii);
+    assert(relerr_ii < 1e-5);
+
+    fft_set_batch2d(0);
+    fim_free(Y2);
+    fim_free(Y);
+    fim_free(F);
+    fim_free(F1);
+    fim_free(X);
+    return;
+}
+
 void fft_ut(void)
 {
     fft_set_inplace(0);
@@ -828,6 +1605,7 @@ void fft_ut(void)
     myfftw_start(8, 1, stdout);
     fftwf_forget_wisdom();
 
+    fft_ut_batch2d();
     test_inplace();
     tictoc;
     tic;
@@ -856,6 +1634,15 @@ void fft_ut(void)
 
 
 
+    // Job size planning, sizes with large prime factors
+    int64_t wM = 257, wN = 263, wP = 67;
+    fft_plan_size(&wM, &wN, &wP, 16, 2, NULL);
+    printf("Planned job size: %" PRId64 " x %" PRId64 " x %" PRId64 "\n",
+           wM, wN, wP);
+    assert(wM >= 257 && wM <= 257+16);
+    assert(wN >= 263 && wN <= 263+16);
+    assert(wP >= 67 && wP <= 67+16);
+
     // Free plans etc
     myfftw_stop();
     return;
@@ -889,6 +1676,16 @@ float * ifft_and_free(fftwf_complex * F,
     }
 }
 
+void fft_set_batch2d(int batch2d)
+{
+    use_batch2d = batch2d != 0;
+}
+
+int fft_get_batch2d(void)
+{
+    return use_batch2d;
+}
+
 void fft_set_inplace(int ip)
 {
     if(ip == 1)
@@ -913,8 +1710,11 @@ fftwf_complex * fft_inplace(float * X, const size_t M, const size_t N, const siz
 {
 
     fft_inplace_pad(&X, M, N, P);
+    const fftwf_plan plan_r2c_inplace = fft_current()->r2c_inplace;
     assert(plan_r2c_inplace != NULL);
+    DW_TRACE_BEGIN("fft_r2c");
     fftwf_execute_dft_r2c(plan_r2c_inplace, X, (fftwf_complex *) X);
+    DW_TRACE_END("fft_r2c");
     return (fftwf_complex*) X;
 }
 
@@ -922,14 +1722,18 @@ float * ifft_inplace(fftwf_complex * fX, const size_t M, const size_t N, const s
 {
     float * X = (float *) fX;
 
+    const fftwf_plan plan_c2r_inplace = fft_current()->c2r_inplace;
     assert(plan_c2r_inplace != NULL);
+    DW_TRACE_BEGIN("fft_c2r");
     fftwf_execute_dft_c2r(plan_c2r_inplace, fX, (float *) X);
+    DW_TRACE_END("fft_c2r");
 
     fft_inplace_unpad(&X, M, N, P);
+    const float norm = (float) fft_norm(M, N, P);
 #pragma omp parallel for shared(X)
     for(size_t kk = 0 ; kk < M*N*P; kk++)
     {
-        X[kk] /= (float) (M*N*P);
+        X[kk] /= norm;
     }
     return X;
 }
@@ -51,6 +51,17 @@ void fft_set_plan(unsigned int plan);
  */
 void fft_set_inplace(int use_inplace);
 
+/* @brief Batched 2D transforms
+ *
+ * When set, the transforms of a [M x N x P] array are P independent
+ * 2D transforms of size [M x N], i.e., each plane is transformed on
+ * its own. Used to process a stack of 2D images at once, see
+ * --stack2d. Applies to the plans created by fft_train after the
+ * call.
+ */
+void fft_set_batch2d(int batch2d);
+int fft_get_batch2d(void);
+
 /** @brief Required initialization routines
  *
  * Initialize, run before any other commands futher down.
@@ -61,12 +72,32 @@ void myfftw_start(int nThreads, int verbosity, FILE * log);
  *
  * Will generate both in-place and out-of place
  * has to be called before using the fft.
+ * The plans for the last few sizes are cached, so switching back to a
+ * size that was used recently is cheap.
  */
 void fft_train(size_t M, size_t N, size_t P,
                int verbosity, int nThreads,
                FILE * log);
 
 
+/* Max number of threads in the outermost parallel region that can
+ * use FFTs at the same time, see --tile-workers */
+#define FFT_MAX_WORKERS 256
+
+/* @brief Free the plans of the calling worker
+ *
+ * The plans created by fft_train are cached per worker, i.e., per
+ * thread of the outermost parallel region. myfftw_stop frees the plans
+ * of all workers, this can be used to free them earlier.
+ */
+void fft_free_plans(void);
+
+/* @brief Write how many times fft_train could reuse cached plans,
+ * how many were created and how long that took, and how many were
+ * replaced since the cache was full. Summed over all threads.
+ */
+void fft_plan_stats_fprint(FILE * f);
+
 /* @brief Free allocated memory
  *
  * Call this when you are done.
@@ -140,11 +171,45 @@ float * fft_convolve_cc_conj_f2(fftwf_complex * A,
                                 int M, int N, int P);
 
 
+/* Returns 1 if the imaginary parts of A, the transform of a
+ * [M x N x P] image, are at most tol times the largest absolute
+ * value of any component of A */
+int fft_is_real(const fftwf_complex * A, int M, int N, int P, float tol);
+
+/* Returns the real part of A, which is freed */
+float * fft_real_and_free(fftwf_complex * A, int M, int N, int P);
+
+/* B = R*B where R is the real part of a transform */
+void fft_mul_real_inplace(const float * restrict R,
+                          fftwf_complex * restrict B,
+                          size_t n1, size_t n2, size_t n3);
+
+/**
+ * @brief like fft_convolve_cc_f2 but with a real valued first argument
+ *
+ * Since R is real this is also the same as fft_convolve_cc_conj_f2.
+ * @param B is freed during the call and should be set to NULL afterwards
+ */
+float * fft_convolve_rc_f2(const float * R,
+                           fftwf_complex * B,
+                           int M, int N, int P);
+
 /**
  * @brief run unit tests
 */
 void fft_ut(void);
 
+/* @brief Pick a faster job size
+ *
+ * Increase the job size [wM x wN x wP] by at most maxPad in each
+ * dimension if that lowers the estimated time per iteration. The
+ * estimate is based on the time for 1D transforms which is measured
+ * the first time a size is used and stored in
+ * ~/.config/deconwolf/fft_cost_1d.txt. Thread safe.
+ */
+void fft_plan_size(int64_t * wM, int64_t * wN, int64_t * wP,
+                   int64_t maxPad, int verbosity, FILE * log);
+
 /* Benchmark 1D ffts of size from, from+1, ... to
  * return time for each size
  */
@@ -33,12 +33,17 @@
 #include "fim.h"
 #include "quickselect.h"
 #include "dw_util.h"
+#include "fim_simd.h"
 
 typedef uint64_t u64;
 typedef int64_t i64;
 typedef uint16_t u16;
 
 static int fim_verbose = 0;
+/* See fim_set_first_touch */
+static int fim_first_touch = 0;
+/* Smaller allocations are zeroed by the calling thread */
+#define FIM_FIRST_TOUCH_MIN ((size_t) 1<<20)
 
 static float * gaussian_kernel(float sigma, size_t * nK);
 static void cumsum_array(float * A, size_t N, size_t stride);
@@ -64,46 +69,273 @@ static const char * fim_boundary_condition_str(fim_boundary_condition bc)
     return "UNKNOWN";
 }
 
+/* Zero p. With fim_first_touch the pages are split over the threads
+ * like the elements of a `omp parallel for` loop, i.e., with the
+ * static schedule, so that the first write places each page on the
+ * NUMA node of the thread that will process it. */
+static void fim_zero(void * p, size_t nbytes)
+{
+    if(fim_first_touch == 0 || nbytes < FIM_FIRST_TOUCH_MIN)
+    {
+        memset(p, 0, nbytes);
+        return;
+    }
+    const size_t page = 4096;
+    const size_t npages = (nbytes + page - 1) / page;
+    char * b = (char *) p;
+#pragma omp parallel for schedule(static) shared(b)
+    for(size_t kk = 0; kk < npages; kk++)
+    {
+        size_t n = page;
+        (kk+1)*page > nbytes ? n = nbytes - kk*page : 0;
+        memset(b + kk*page, 0, n);
+    }
+}
+
+void fim_set_first_touch(int ft)
+{
+    fim_first_touch = ft;
+}
+
 #ifdef __linux__
-void * __attribute__((__aligned__(FIM_ALIGNMENT))) fim_malloc(size_t nbytes)
+/* Pool of large buffers, see fim_set_pool. The blocks are aligned to
+ * the huge page size, which is also used to tell them apart from
+ * other allocations in fim_free. A block is registered in fim_pool
+ * while it is in use and while it is cached. */
+#define FIM_POOL_MIN ((size_t) 1<<24) /* Smaller allocations are not pooled */
+#define FIM_POOL_ALIGN ((size_t) 1<<21)
+#define FIM_POOL_SLOTS 64
+
+typedef struct {
+    void * p; /* NULL for an empty slot */
+    size_t size; /* Capacity in bytes */
+    int used; /* 1: in use, 0: cached */
+} fim_pool_block;
+
+static fim_pool_block fim_pool[FIM_POOL_SLOTS];
+static int fim_pool_on = 0;
+static size_t fim_pool_hits = 0;
+static size_t fim_pool_misses = 0;
+static size_t fim_pool_recycled = 0; /* Bytes */
+static size_t fim_pool_released = 0;
+
+void fim_set_pool(int on)
 {
-    void * p;
-    if(posix_memalign(&p, FIM_ALIGNMENT, nbytes))
+    fim_pool_on = on;
+}
+
+/* A block of at least nbytes from the pool, or NULL if the pool is not
+ * used for this size */
+static void * fim_pool_get(size_t nbytes)
+{
+    if(fim_pool_on == 0 || nbytes < FIM_POOL_MIN)
     {
-        fprintf(stderr, "fim_malloc: unable to allocate %zu bytes\n", nbytes);
+        return NULL;
+    }
+
+    /* The smallest cached block that is not much too large */
+    void * p = NULL;
+#pragma omp critical(fim_pool)
+    {
+        int best = -1;
+        for(int kk = 0; kk < FIM_POOL_SLOTS; kk++)
+        {
+            fim_pool_block * b = fim_pool + kk;
+            if(b->p != NULL && b->used == 0 && b->size >= nbytes
+               && b->size <= nbytes + nbytes/8 + FIM_POOL_ALIGN
+               && (best < 0 || b->size < fim_pool[best].size))
+            {
+                best = kk;
+            }
+        }
+        if(best >= 0)
+        {
+            fim_pool[best].used = 1;
+            p = fim_pool[best].p;
+            fim_pool_hits++;
+            fim_pool_recycled += fim_pool[best].size;
+        }
+    }
+    if(p != NULL)
+    {
+        return p;
+    }
+
+    /* A new block, with some room so that fim_realloc can pad for the
+     * in-place FFTs without moving it */
+    size_t size = nbytes + nbytes/64;
+    size = (size + FIM_POOL_ALIGN - 1) / FIM_POOL_ALIGN * FIM_POOL_ALIGN;
+    if(posix_memalign(&p, FIM_POOL_ALIGN, size))
+    {
+        fprintf(stderr, "fim_malloc: unable to allocate %zu bytes\n", size);
         assert(0);
         exit(EXIT_FAILURE);
     }
+    /* Has to be done before writing the first byte. Failures are
+     * fine, e.g. when transparent huge pages are disabled. */
+    madvise(p, size, MADV_HUGEPAGE);
 
-#if 0
-    const size_t HPAGE_SIZE  = (1 << 21); // 2 Mb
-    if(FIM_ALIGNMENT == HPAGE_SIZE)
+#pragma omp critical(fim_pool)
     {
-        /* Has to be done before writing the first byte */
-        if(madvise( p, nbytes, MADV_HUGEPAGE ))
+        fim_pool_misses++;
+        int slot = -1;
+        for(int kk = 0; kk < FIM_POOL_SLOTS; kk++)
         {
-            fprintf(stderr, "madvise failed\n");
+            if(fim_pool[kk].p == p)
+            {
+                /* Stale, freed without fim_free */
+                fim_pool[kk].p = NULL;
+            }
+            if(fim_pool[kk].p == NULL && slot < 0)
+            {
+                slot = kk;
+            }
         }
-        if(0){ /* Would this decrease the chances of fragmentation? */
-            /* Set one byte to allocate */
-            /* Set one byte of each page to allocate */
-            for (size_t kk = 0; kk < nbytes; kk += HPAGE_SIZE) {
-                memset(p + kk, 0, 1);
+        if(slot < 0)
+        {
+            /* Full, drop a cached block. If all are in use the new
+             * block is simply not pooled. */
+            for(int kk = 0; kk < FIM_POOL_SLOTS; kk++)
+            {
+                if(fim_pool[kk].used == 0)
+                {
+                    free(fim_pool[kk].p);
+                    fim_pool[kk].p = NULL;
+                    fim_pool_released++;
+                    slot = kk;
+                    break;
+                }
             }
         }
+        if(slot >= 0)
+        {
+            fim_pool[slot].p = p;
+            fim_pool[slot].size = size;
+            fim_pool[slot].used = 1;
+        }
     }
-#endif
+    return p;
+}
 
-    memset(p, 0, nbytes);
+/* Capacity of p if it is a block of the pool in use, else 0 */
+static size_t fim_pool_capacity(const void * p)
+{
+    if(p == NULL || (uintptr_t) p % FIM_POOL_ALIGN != 0)
+    {
+        return 0;
+    }
+    size_t size = 0;
+#pragma omp critical(fim_pool)
+    {
+        for(int kk = 0; kk < FIM_POOL_SLOTS; kk++)
+        {
+            if(fim_pool[kk].p == p && fim_pool[kk].used)
+            {
+                size = fim_pool[kk].size;
+                break;
+            }
+        }
+    }
+    return size;
+}
+
+/* Return p to the pool. Returns 0 if p is not from the pool */
+static int fim_pool_put(void * p)
+{
+    if(p == NULL || (uintptr_t) p % FIM_POOL_ALIGN != 0)
+    {
+        return 0;
+    }
+    int found = 0;
+#pragma omp critical(fim_pool)
+    {
+        for(int kk = 0; kk < FIM_POOL_SLOTS; kk++)
+        {
+            if(fim_pool[kk].p == p && fim_pool[kk].used)
+            {
+                fim_pool[kk].used = 0;
+                found = 1;
+                break;
+            }
+        }
+    }
+    return found;
+}
 
+void fim_pool_trim(void)
+{
+#pragma omp critical(fim_pool)
+    {
+        for(int kk = 0; kk < FIM_POOL_SLOTS; kk++)
+        {
+            if(fim_pool[kk].p != NULL && fim_pool[kk].used == 0)
+            {
+                free(fim_pool[kk].p);
+                fim_pool[kk].p = NULL;
+                fim_pool_released++;
+            }
+        }
+    }
+}
+
+void fim_pool_fprint(FILE * f)
+{
+    if(f == NULL || (fim_pool_hits + fim_pool_misses) == 0)
+    {
+        return;
+    }
+    fprintf(f, "Buffer pool: %zu reused (%.2f GB), %zu new, %zu released\n",
+            fim_pool_hits, (double) fim_pool_recycled/1e9,
+            fim_pool_misses, fim_pool_released);
+}
+
+void * __attribute__((__aligned__(FIM_ALIGNMENT))) fim_malloc_nozero(size_t nbytes)
+{
+    void * p = fim_pool_get(nbytes);
+    if(p != NULL)
+    {
+        return p;
+    }
+    if(posix_memalign(&p, FIM_ALIGNMENT, nbytes))
+    {
+        fprintf(stderr, "fim_malloc: unable to allocate %zu bytes\n", nbytes);
+        assert(0);
+        exit(EXIT_FAILURE);
+    }
+    return p;
+}
+
+void * __attribute__((__aligned__(FIM_ALIGNMENT))) fim_malloc(size_t nbytes)
+{
+    void * p = fim_malloc_nozero(nbytes);
+    fim_zero(p, nbytes);
     return p;
 }
 #else
-void * fim_malloc(size_t nbytes)
+void fim_set_pool(__attribute__((unused)) int on)
+{
+    return;
+}
+
+void fim_pool_trim(void)
+{
+    return;
+}
+
+void fim_pool_fprint(__attribute__((unused)) FILE * f)
+{
+    return;
+}
+
+void * fim_malloc_nozero(size_t nbytes)
 {
 #ifdef WINDOWS
     void * p = _aligned_malloc(nbytes, FIM_ALIGNMENT);
-    memset(p, 0, nbytes);
+    if(p == NULL)
+    {
+        fprintf(stderr, "Unable to allocate %zu bytes\n", nbytes);
+        exit(EXIT_FAILURE);
+    }
     return p;
 #else
     void * p;
@@ -117,6 +349,15 @@ void * fim_malloc(size_t nbytes)
     return p;
 #endif
 }
+
+void * fim_malloc(size_t nbytes)
+{
+    void * p = fim_malloc_nozero(nbytes);
+#ifdef WINDOWS
+    fim_zero(p, nbytes);
+#endif
+    return p;
+}
 #endif
 
 #ifdef WINDOWS
@@ -128,6 +369,22 @@ void * fim_realloc(void * p, size_t nbytes)
 #else
 void * __attribute__((__aligned__(FIM_ALIGNMENT))) fim_realloc(void * p, size_t nbytes)
 {
+#ifdef __linux__
+    /* Blocks from the pool are kept if large enough */
+    size_t capacity = fim_pool_capacity(p);
+    if(capacity > 0)
+    {
+        if(nbytes <= capacity)
+        {
+            return p;
+        }
+        void * out = fim_malloc_nozero(nbytes);
+        memcpy(out, p, capacity);
+        fim_free(p);
+        return out;
+    }
+#endif
+
     void * out = realloc(p, nbytes);
     /* If address didn't change, we are good */
     if(p == out)
@@ -152,6 +409,12 @@ void fim_free(void * p)
 #ifdef WINDOWS
     _aligned_free(p);
 #else
+#ifdef __linux__
+    if(fim_pool_put(p))
+    {
+        return;
+    }
+#endif
     free(p);
 #endif
 }
@@ -367,14 +630,7 @@ void fim_argmax0_max(const float * I,
 
 float fim_sum(const float * restrict A, size_t N)
 {
-    double sum = 0;
-#pragma omp parallel for shared(A) reduction(+:sum)
-    for(size_t kk = 0; kk<N; kk++)
-    {
-        sum+=(double) A[kk];
-    }
-
-    return (float) sum;
+    return (float) fim_simd_sum(A, N);
 }
 
 float fim_sum_double(const double * restrict A, size_t N)
@@ -397,14 +653,7 @@ float fim_mean(const float * restrict A, size_t N)
 
 float fim_min(const float * restrict A, size_t N)
 {
-    float amin = A[0];
-#pragma omp parallel for reduction(min:amin)
-    for(size_t kk = 0; kk<N; kk++)
-    {
-        if(A[kk] < amin)
-            amin = A[kk];
-    }
-    return amin;
+    return fim_simd_min(A, N);
 }
 
 void fim_div(float * restrict  A,
@@ -468,14 +717,7 @@ void fim_add(float * restrict  A,
 
 float fim_max(const float * restrict A, size_t N)
 {
-    float amax = A[0];
-#pragma omp parallel for reduction(max:amax)
-    for(size_t kk = 0; kk<N; kk++)
-    {
-        if(A[kk] > amax)
-            amax = A[kk];
-    }
-    return amax;
+    return fim_simd_max(A, N);
 }
 
 float fimo_max(const fimo * A)
@@ -606,6 +848,132 @@ void fim_insert_ref(float * T, int64_t t1, int64_t t2, int64_t t3,
     return;
 }
 
+/* Halve the size along dimension dim of an image of size dims, see
+ * fim_downsample2. dims is updated. */
+static float * fim_downsample2_dim(const float * restrict A, int64_t * dims,
+                                   int dim, int edge)
+{
+    const int64_t n = dims[dim];
+    const int64_t n2 = (n+1)/2;
+    int64_t inner = 1;
+    for(int kk = 0; kk < dim; kk++)
+    {
+        inner *= dims[kk];
+    }
+    const int64_t outer = dims[0]*dims[1]*dims[2]/(inner*n);
+
+    float * B = fim_malloc(inner*n2*outer*sizeof(float));
+#pragma omp parallel for shared(A, B)
+    for(int64_t oo = 0; oo < outer; oo++)
+    {
+        const float * a = A + oo*n*inner;
+        for(int64_t kk = 0; kk < n2; kk++)
+        {
+            const int64_t c = 2*kk;
+            int64_t l = c - 1;
+            int64_t r = c + 1;
+            float wl = 0.25;
+            float wr = 0.25;
+            if(l < 0)
+            {
+                l = edge ? 0 : c;
+                wl = edge ? wl : 0;
+            }
+            if(r >= n)
+            {
+                r = edge ? n-1 : c;
+                wr = edge ? wr : 0;
+            }
+            float * b = B + (oo*n2 + kk)*inner;
+            for(int64_t ii = 0; ii < inner; ii++)
+            {
+                b[ii] = wl*a[l*inner + ii] + 0.5*a[c*inner + ii]
+                    + wr*a[r*inner + ii];
+            }
+        }
+    }
+    dims[dim] = n2;
+    return B;
+}
+
+float * fim_downsample2(const float * A,
+                        int64_t M, int64_t N, int64_t P,
+                        int64_t * M2, int64_t * N2, int64_t * P2,
+                        int edge)
+{
+    int64_t dims[3] = {M, N, P};
+    float * B = fim_copy(A, M*N*P);
+    for(int dim = 0; dim < 3; dim++)
+    {
+        if(dims[dim] > 1)
+        {
+            float * T = fim_downsample2_dim(B, dims, dim, edge);
+            fim_free(B);
+            B = T;
+        }
+    }
+    M2[0] = dims[0];
+    N2[0] = dims[1];
+    P2[0] = dims[2];
+    return B;
+}
+
+/* Double the size along dimension dim, to n, see fim_upsample2 */
+static float * fim_upsample2_dim(const float * restrict A, int64_t * dims,
+                                 int dim, int64_t n)
+{
+    const int64_t n2 = dims[dim];
+    int64_t inner = 1;
+    for(int kk = 0; kk < dim; kk++)
+    {
+        inner *= dims[kk];
+    }
+    const int64_t outer = dims[0]*dims[1]*dims[2]/(inner*n2);
+
+    float * B = fim_malloc(inner*n*outer*sizeof(float));
+#pragma omp parallel for shared(A, B)
+    for(int64_t oo = 0; oo < outer; oo++)
+    {
+        const float * a = A + oo*n2*inner;
+        for(int64_t kk = 0; kk < n; kk++)
+        {
+            /* Voxel kk is at kk/2 in A */
+            const int64_t l = kk/2;
+            const int64_t r = l + 1 < n2 ? l + 1 : l;
+            const float wr = kk % 2 == 1 ? 0.5 : 0;
+            float * b = B + (oo*n + kk)*inner;
+            for(int64_t ii = 0; ii < inner; ii++)
+            {
+                b[ii] = (1.0-wr)*a[l*inner + ii] + wr*a[r*inner + ii];
+            }
+        }
+    }
+    dims[dim] = n;
+    return B;
+}
+
+float * fim_upsample2(const float * A,
+                      int64_t M2, int64_t N2, int64_t P2,
+                      int64_t M, int64_t N, int64_t P)
+{
+    assert(M2 == (M+1)/2 || (M == 1 && M2 == 1));
+    assert(N2 == (N+1)/2 || (N == 1 && N2 == 1));
+    assert(P2 == (P+1)/2 || (P == 1 && P2 == 1));
+    int64_t dims[3] = {M2, N2, P2};
+    const int64_t target[3] = {M, N, P};
+    float * B = fim_copy(A, M2*N2*P2);
+    for(int dim = 0; dim < 3; dim++)
+    {
+        if(target[dim] > 1)
+        {
+            float * T = fim_upsample2_dim(B, dims, dim, target[dim]);
+            fim_free(B);
+            B = T;
+        }
+    }
+    return B;
+}
+
 
 float * fim_get_cuboid(float * restrict A, const int64_t M, const int64_t N, const int64_t P,
                        const int64_t m0, const int64_t m1, const int64_t n0, const int64_t n1, const int64_t p0, const int64_t p1)
@@ -829,11 +1197,7 @@ int fimo_div_image(fimo * A, const fimo * B)
 
 void fim_project_positive(float * I, size_t N)
 {
-#pragma omp parallel for shared(I)
-    for(size_t kk = 0; kk < N ; kk++)
-    {
-        I[kk] < 0 ? I[kk] = 0 : 0;
-    }
+    fim_simd_clamp_min(I, 0, N);
     return;
 }
 
@@ -4890,6 +5254,55 @@ static void fim_DoH_ut(void)
     return;
 }
 
+static void fim_resample2_ut(void)
+{
+    const int64_t M = 7, N = 6, P = 1;
+    float * A = fim_malloc(M*N*P*sizeof(float));
+    for(int64_t kk = 0; kk < M*N*P; kk++)
+    {
+        A[kk] = 3;
+    }
+    int64_t M2 = 0, N2 = 0, P2 = 0;
+    float * B = fim_downsample2(A, M, N, P, &M2, &N2, &P2, 1);
+    assert(M2 == 4 && N2 == 3 && P2 == 1);
+    for(int64_t kk = 0; kk < M2*N2*P2; kk++)
+    {
+        assert(fabs(B[kk] - 3) < 1e-6);
+    }
+    fim_free(B);
+
+    /* A linear ramp is kept by both operations, except close to the
+     * edges where the edge values are repeated */
+    for(int64_t nn = 0; nn < N; nn++)
+    {
+        for(int64_t mm = 0; mm < M; mm++)
+        {
+            A[mm + nn*M] = mm;
+        }
+    }
+    B = fim_downsample2(A, M, N, P, &M2, &N2, &P2, 1);
+    float * C = fim_upsample2(B, M2, N2, P2, M, N, P);
+    for(int64_t nn = 0; nn < N; nn++)
+    {
+        for(int64_t mm = 2; mm < M-2; mm++)
+        {
+            assert(fabs(C[mm + nn*M] - mm) < 1e-5);
+        }
+    }
+    fim_free(B);
+    fim_free(C);
+
+    /* With zeros outside, a centered impulse stays centered */
+    memset(A, 0, M*N*P*sizeof(float));
+    A[4 + 2*M] = 1;
+    B = fim_downsample2(A, M, N, P, &M2, &N2, &P2, 0);
+    int64_t am = -1, an = -1, ap = -1;
+    fim_argmax(B, M2, N2, P2, &am, &an, &ap);
+    assert(am == 2 && an == 1 && ap == 0);
+    fim_free(B);
+    fim_free(A);
+}
+
 void fim_ut()
 {
     #ifdef NDEBUG
@@ -4904,6 +5317,8 @@ void fim_ut()
     assert(npyfilename(NULL) == 0);
     assert(npyfilename(".npy.tif") == 0);
 
+    printf("-> fim_downsample2, fim_upsample2\n");
+    fim_resample2_ut();
     printf("-> DoH_ut\n");
     fim_DoH_ut();
     printf("-> fim_covariance_lp\n");
@@ -5104,6 +5519,10 @@ fim_imread_size(const char * filename,
     if(npyfilename(filename))
     {
         npio_t * npy = npio_load_metadata(filename);
+        if(npy == NULL)
+        {
+            return -1;
+        }
         if(npy->ndim != 3)
         {
             npio_free(npy);
@@ -5112,6 +5531,7 @@ fim_imread_size(const char * filename,
         *P = npy->shape[0];
         *N = npy->shape[1];
         *M = npy->shape[2];
+        npio_free(npy);
         return 0;
     }
     return fim_tiff_get_size(filename, M, N, P);
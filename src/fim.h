@@ -31,6 +31,12 @@
 /* Set verbosity level, default = 0 */
 void fim_set_verbose(int);
 
+/* With 1, large allocations by fim_malloc are zeroed by all OpenMP
+ * threads, each writing the part that it will process in a `omp
+ * parallel for` loop. On NUMA systems the memory is then local to
+ * the threads using it. Default: 0, zeroed by the calling thread. */
+void fim_set_first_touch(int);
+
 #define MAGIC_FIMO 0xFIM35555DEC04301UL
 
 typedef struct{
@@ -60,6 +66,29 @@ typedef struct{
  */
 void * __attribute__((__aligned__(FIM_ALIGNMENT))) fim_malloc(size_t n);
 
+/** @brief Like fim_malloc but the memory is not initialized
+ *
+ * For arrays that are written completely by the caller, e.g. the
+ * output of a FFT.
+ */
+void * __attribute__((__aligned__(FIM_ALIGNMENT))) fim_malloc_nozero(size_t n);
+
+/** @brief Recycle large buffers
+ *
+ * With 1, allocations of 16 MB or more are served from a pool of
+ * blocks released by fim_free, so that the buffers of one iteration
+ * or tile are reused by the next instead of being mapped and faulted
+ * in again. The blocks are aligned to 2 MB and use transparent huge
+ * pages if available. Default: 0. Only on Linux.
+ */
+void fim_set_pool(int on);
+
+/* Release the blocks that are cached by the pool */
+void fim_pool_trim(void);
+
+/* Write the number of reused and new blocks to f, if the pool was used */
+void fim_pool_fprint(FILE * f);
+
 /** @brief Resize p, keeping the same alignment as fim_malloc
  *
  * This function could use some attention, in worst case it will result in
@@ -248,6 +277,27 @@ void fim_insert(float * restrict T,
 void fim_insert_ref(float * T, int64_t t1, int64_t t2, int64_t t3,
                     float * F, int64_t f1, int64_t f2, int64_t f3);
 
+/** @brief Downsample by a factor 2 along each dimension of size > 1
+ *
+ * The image is filtered by [1/4, 1/2, 1/4] and then every second
+ * voxel, starting with the first, is kept. The new size, e.g.
+ * M2 = (M+1)/2, is written to M2, N2, P2. With edge = 0 the image is
+ * zero outside, else the edge values are repeated.
+ */
+float * fim_downsample2(const float * A,
+                        int64_t M, int64_t N, int64_t P,
+                        int64_t * M2, int64_t * N2, int64_t * P2,
+                        int edge);
+
+/** @brief Upsample an image from fim_downsample2 to [M x N x P]
+ *
+ * Linear interpolation, voxel (m, n, p) of the output is taken at
+ * (m/2, n/2, p/2) in A which is of size [M2 x N2 x P2].
+ */
+float * fim_upsample2(const float * A,
+                      int64_t M2, int64_t N2, int64_t P2,
+                      int64_t M, int64_t N, int64_t P);
+
 /** @brief Extract a subregion of an image.
  *
  * Also known as cropping.
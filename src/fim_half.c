@@ -0,0 +1,160 @@
+/*    Copyright (C) 2020 Erik L. G. Wernersson
+ *
+ *    This program is free software: you can redistribute it and/or modify
+ *    it under the terms of the GNU General Public License as published by
+ *    the Free Software Foundation, either version 3 of the License, or
+ *    (at your option) any later version.
+ *
+ *    This program is distributed in the hope that it will be useful,
+ *    but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *    GNU General Public License for more details.
+ *
+ *    You should have received a copy of the GNU General Public License
+ *    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include <assert.h>
+#include <math.h>
+#include <stdio.h>
+
+#include "fim.h"
+#include "fim_half.h"
+
+int fim_dtype_parse(const char * str)
+{
+    if(strcmp(str, "fp32") == 0)
+    {
+        return FIM_FP32;
+    }
+    if(strcmp(str, "fp16") == 0)
+    {
+        return FIM_FP16;
+    }
+    if(strcmp(str, "bf16") == 0)
+    {
+        return FIM_BF16;
+    }
+    return -1;
+}
+
+const char * fim_dtype_name(fim_dtype type)
+{
+    switch(type)
+    {
+    case FIM_FP16:
+        return "fp16";
+    case FIM_BF16:
+        return "bf16";
+    default:
+        return "fp32";
+    }
+}
+
+float fim_half_scale_for(float maxabs, fim_dtype type)
+{
+    if(type != FIM_FP16 || !(maxabs > 0) || !isfinite(maxabs))
+    {
+        return 1;
+    }
+    /* Map the largest value to at most 1024, that leaves a factor 64
+     * of headroom before values are saturated and keeps values down to
+     * maxabs*6e-8 as normal numbers. */
+    int e = 0;
+    frexpf(maxabs/1024.0f, &e);
+    return ldexpf(1.0f, e);
+}
+
+fim_half * fim_half_new(size_t n, fim_dtype type, float scale)
+{
+    assert(type == FIM_FP16 || type == FIM_BF16);
+    assert(scale > 0);
+    fim_half * H = calloc(1, sizeof(fim_half));
+    assert(H != NULL);
+    H->V = fim_malloc(n*sizeof(uint16_t));
+    memset(H->V, 0, n*sizeof(uint16_t));
+    H->n = n;
+    H->type = type;
+    H->scale = scale;
+    H->iscale = 1.0/scale;
+    return H;
+}
+
+fim_half * fim_half_from_float(const float * X, size_t n, fim_dtype type)
+{
+    float maxabs = 0;
+#pragma omp parallel for reduction(max: maxabs)
+    for(size_t kk = 0; kk < n; kk++)
+    {
+        float v = fabsf(X[kk]);
+        v > maxabs ? maxabs = v : 0;
+    }
+
+    fim_half * H = fim_half_new(n, type, fim_half_scale_for(maxabs, type));
+#pragma omp parallel for shared(H, X)
+    for(size_t kk = 0; kk < n; kk++)
+    {
+        fim_half_set(H, kk, X[kk]);
+    }
+    return H;
+}
+
+void fim_half_free(fim_half * H)
+{
+    if(H == NULL)
+    {
+        return;
+    }
+    fim_free(H->V);
+    free(H);
+}
+
+static void fim_half_ut_type(fim_dtype type, double tol)
+{
+    const size_t n = 100000;
+    float * X = fim_malloc(n*sizeof(float));
+    for(size_t kk = 0; kk < n; kk++)
+    {
+        /* Spans the range of 16-bit images */
+        X[kk] = 65535.0*pow((double) kk / (double) n, 4);
+    }
+    fim_half * H = fim_half_from_float(X, n, type);
+    double max_rel = 0;
+    for(size_t kk = 0; kk < n; kk++)
+    {
+        double v = fim_half_get(H, kk);
+        /* Smaller values are subnormal in fp16 */
+        if(X[kk] > 6.2e-5*H->scale)
+        {
+            double rel = fabs(v - X[kk]) / X[kk];
+            rel > max_rel ? max_rel = rel : 0;
+        }
+    }
+    printf("%s: scale %e, max relative error %e\n",
+           fim_dtype_name(type), H->scale, max_rel);
+    assert(max_rel <= tol);
+    fim_half_free(H);
+    fim_free(X);
+}
+
+void fim_half_ut(void)
+{
+    /* Exact values */
+    assert(fim_fp16_to_f32(fim_f32_to_fp16(1.0)) == 1.0);
+    assert(fim_fp16_to_f32(fim_f32_to_fp16(-2.5)) == -2.5);
+    assert(fim_fp16_to_f32(fim_f32_to_fp16(0)) == 0);
+    assert(fim_bf16_to_f32(fim_f32_to_bf16(1.0)) == 1.0);
+    assert(fim_bf16_to_f32(fim_f32_to_bf16(-2.5)) == -2.5);
+    /* Saturation */
+    assert(fim_fp16_to_f32(fim_f32_to_fp16(1e6)) == 65504.0);
+    /* Round to nearest even, 2049 is halfway between 2048 and 2050 */
+    assert(fim_fp16_to_f32(fim_f32_to_fp16(2049)) == 2048);
+    assert(fim_fp16_to_f32(fim_f32_to_fp16(2051)) == 2052);
+    /* Subnormals */
+    assert(fim_fp16_to_f32(fim_f32_to_fp16(5.9604645e-8f)) == 5.9604645e-8f);
+
+    /* 2^-11 and 2^-8 is half of the machine epsilon */
+    fim_half_ut_type(FIM_FP16, pow(2, -11));
+    fim_half_ut_type(FIM_BF16, pow(2, -8));
+    printf("fim_half_ut: ok\n");
+}
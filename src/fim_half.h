@@ -0,0 +1,192 @@
+#pragma once
+
+/*    Copyright (C) 2020 Erik L. G. Wernersson
+ *
+ *    This program is free software: you can redistribute it and/or modify
+ *    it under the terms of the GNU General Public License as published by
+ *    the Free Software Foundation, either version 3 of the License, or
+ *    (at your option) any later version.
+ *
+ *    This program is distributed in the hope that it will be useful,
+ *    but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *    GNU General Public License for more details.
+ *
+ *    You should have received a copy of the GNU General Public License
+ *    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+/* fim_half : images stored with 16 bits per voxel, either as IEEE
+ * half precision (fp16) or as bfloat16 (bf16).
+ *
+ * fp16 has 11 significant bits but a largest value of 65504, bf16 has
+ * the range of a float but only 8 significant bits. To use the range
+ * of fp16 better, the values are stored divided by a power of two,
+ * see fim_half_from_float. All arithmetic is still done in float, the
+ * values are converted when loaded and stored.
+ */
+
+typedef enum {
+    FIM_FP32, /* Not stored as fim_half, i.e. regular float images */
+    FIM_FP16,
+    FIM_BF16
+} fim_dtype;
+
+typedef struct {
+    uint16_t * V;
+    size_t n; /* Number of elements */
+    fim_dtype type; /* FIM_FP16 or FIM_BF16 */
+    float scale; /* Stored values are multiplied by this when loaded */
+    float iscale; /* 1/scale */
+} fim_half;
+
+/* Parse "fp32", "fp16" or "bf16". Returns -1 for anything else */
+int fim_dtype_parse(const char * str);
+
+/* Name of the type as parsed by fim_dtype_parse */
+const char * fim_dtype_name(fim_dtype type);
+
+/* New array of n elements, all 0 */
+fim_half * fim_half_new(size_t n, fim_dtype type, float scale);
+
+/* Convert n floats, the scale is set from the largest absolute
+ * value */
+fim_half * fim_half_from_float(const float * X, size_t n, fim_dtype type);
+
+void fim_half_free(fim_half * H);
+
+/* The scale that fim_half_from_float would use for values up to
+ * maxabs. A power of two so that it does not change the relative
+ * precision. */
+float fim_half_scale_for(float maxabs, fim_dtype type);
+
+/*
+ * Conversions of single values. Round to nearest, ties to even.
+ * Values outside of the fp16 range are saturated.
+ */
+
+static inline uint16_t fim_f32_to_bf16(float f)
+{
+    uint32_t u;
+    memcpy(&u, &f, sizeof(u));
+    u += 0x7fff + ((u >> 16) & 1);
+    return (uint16_t) (u >> 16);
+}
+
+static inline float fim_bf16_to_f32(uint16_t h)
+{
+    uint32_t u = ((uint32_t) h) << 16;
+    float f;
+    memcpy(&f, &u, sizeof(f));
+    return f;
+}
+
+#if defined(__FLT16_MAX__) && (defined(__F16C__) || defined(__aarch64__))
+/* Use the compiler, on x86_64 with F16C and on ARM this is a single
+ * instruction that can be vectorized. Without F16C, e.g., without
+ * -march, gcc calls libgcc instead, which is slower than the code
+ * below. */
+static inline uint16_t fim_f32_to_fp16(float f)
+{
+    f > 65504.0f ? f = 65504.0f : 0;
+    f < -65504.0f ? f = -65504.0f : 0;
+    _Float16 h = (_Float16) f;
+    uint16_t u;
+    memcpy(&u, &h, sizeof(u));
+    return u;
+}
+
+static inline float fim_fp16_to_f32(uint16_t u)
+{
+    _Float16 h;
+    memcpy(&h, &u, sizeof(h));
+    return (float) h;
+}
+#else
+static inline uint16_t fim_f32_to_fp16(float f)
+{
+    f > 65504.0f ? f = 65504.0f : 0;
+    f < -65504.0f ? f = -65504.0f : 0;
+    uint32_t x;
+    memcpy(&x, &f, sizeof(x));
+    uint16_t sign = (uint16_t) ((x >> 16) & 0x8000);
+    uint32_t ax = x & 0x7fffffff;
+    if(ax < 0x33000000) /* Below half of the smallest subnormal */
+    {
+        return sign;
+    }
+    int32_t e = (int32_t) (ax >> 23) - 127 + 15;
+    uint32_t m = ax & 0x7fffff;
+    if(e <= 0)
+    {
+        /* Subnormal */
+        m |= 0x800000;
+        int shift = 14 - e;
+        uint32_t r = m >> shift;
+        uint32_t rem = m & ((1u << shift) - 1);
+        uint32_t half = 1u << (shift - 1);
+        if(rem > half || (rem == half && (r & 1)))
+        {
+            r++;
+        }
+        return sign | (uint16_t) r;
+    }
+    uint32_t r = ((uint32_t) e << 10) | (m >> 13);
+    uint32_t rem = m & 0x1fff;
+    if(rem > 0x1000 || (rem == 0x1000 && (r & 1)))
+    {
+        r++; /* Can carry into the exponent, which is correct */
+    }
+    return sign | (uint16_t) r;
+}
+
+static inline float fim_fp16_to_f32(uint16_t h)
+{
+    uint32_t sign = ((uint32_t) h & 0x8000) << 16;
+    uint32_t e = (h >> 10) & 0x1f;
+    uint32_t m = h & 0x3ff;
+    uint32_t x;
+    if(e == 0)
+    {
+        /* Zero or subnormal */
+        float f = (float) m * 5.9604645e-8f; /* 2^-24 */
+        return sign ? -f : f;
+    } else if(e == 31)
+    {
+        x = sign | 0x7f800000 | (m << 13);
+    } else {
+        x = sign | ((e - 15 + 127) << 23) | (m << 13);
+    }
+    float f;
+    memcpy(&f, &x, sizeof(f));
+    return f;
+}
+#endif
+
+/* Element kk of H as a float */
+static inline float fim_half_get(const fim_half * H, size_t kk)
+{
+    if(H->type == FIM_BF16)
+    {
+        return fim_bf16_to_f32(H->V[kk])*H->scale;
+    }
+    return fim_fp16_to_f32(H->V[kk])*H->scale;
+}
+
+/* Set element kk of H to v */
+static inline void fim_half_set(fim_half * H, size_t kk, float v)
+{
+    if(H->type == FIM_BF16)
+    {
+        H->V[kk] = fim_f32_to_bf16(v*H->iscale);
+        return;
+    }
+    H->V[kk] = fim_f32_to_fp16(v*H->iscale);
+}
+
+/* Unit tests */
+void fim_half_ut(void);
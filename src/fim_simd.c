@@ -0,0 +1,1162 @@
+/*    Copyright (C) 2020 Erik L. G. Wernersson
+ *
+ *    This program is free software: you can redistribute it and/or modify
+ *    it under the terms of the GNU General Public License as published by
+ *    the Free Software Foundation, either version 3 of the License, or
+ *    (at your option) any later version.
+ *
+ *    This program is distributed in the hope that it will be useful,
+ *    but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *    GNU General Public License for more details.
+ *
+ *    You should have received a copy of the GNU General Public License
+ *    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include <assert.h>
+#include <math.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#ifdef _OPENMP
+#include <omp.h>
+#endif
+
+#include "fim_simd.h"
+#include "dw_util.h"
+
+/* The x86 kernels are compiled with the target attribute so that they
+ * can be built without -mavx2 and only used when the CPU supports
+ * them. MSVC has no such attribute and only gets the scalar kernels. */
+#if (defined(__x86_64__) || defined(__i386__)) && (defined(__GNUC__) || defined(__clang__))
+#define FIM_SIMD_X86
+#include <immintrin.h>
+#define FIM_TARGET_AVX2 __attribute__((target("avx2,fma")))
+#define FIM_TARGET_AVX512 __attribute__((target("avx512f,avx2,fma")))
+#endif
+
+/* NEON is always available on 64-bit ARM */
+#if defined(__aarch64__) && defined(__ARM_NEON)
+#define FIM_SIMD_ARM
+#include <arm_neon.h>
+#endif
+
+/* Number of elements per OpenMP work item */
+#define FIM_SIMD_BLOCK 16384
+
+typedef struct {
+    void (*cmul)(float * C, const float * A, const float * B, size_t n);
+    void (*cmul_conj)(float * C, const float * A, const float * B, size_t n);
+    void (*rcmul)(float * B, const float * R, size_t n);
+    void (*momentum)(float * P, const float * X, const float * XP,
+                     float alpha, float lo, size_t n);
+    void (*clamp_min)(float * X, float lo, size_t n);
+    double (*sum)(const float * X, size_t n);
+    float (*max)(const float * X, size_t n);
+    float (*min)(const float * X, size_t n);
+    double (*idiv)(const float * y, const float * g, size_t n);
+} fim_simd_kernels;
+
+
+/*
+ * Scalar kernels, the same loops as used before fim_simd
+ */
+
+static void cmul_scalar(float * C, const float * A, const float * B, size_t n)
+{
+    for(size_t kk = 0; kk < n; kk++)
+    {
+        float a = A[2*kk]; float ac = A[2*kk+1];
+        float b = B[2*kk]; float bc = B[2*kk+1];
+        C[2*kk] = a*b - ac*bc;
+        C[2*kk+1] = a*bc + b*ac;
+    }
+}
+
+static void cmul_conj_scalar(float * C, const float * A, const float * B, size_t n)
+{
+    for(size_t kk = 0; kk < n; kk++)
+    {
+        float a = A[2*kk]; float ac = -A[2*kk+1];
+        float b = B[2*kk]; float bc = B[2*kk+1];
+        C[2*kk] = a*b - ac*bc;
+        C[2*kk+1] = a*bc + b*ac;
+    }
+}
+
+static void rcmul_scalar(float * B, const float * R, size_t n)
+{
+    for(size_t kk = 0; kk < n; kk++)
+    {
+        B[2*kk] *= R[kk];
+        B[2*kk+1] *= R[kk];
+    }
+}
+
+static void momentum_scalar(float * P, const float * X, const float * XP,
+                            float alpha, float lo, size_t n)
+{
+    for(size_t kk = 0; kk < n; kk++)
+    {
+        float p = X[kk] + alpha*(X[kk]-XP[kk]);
+        P[kk] = p < lo ? lo : p;
+    }
+}
+
+static void clamp_min_scalar(float * X, float lo, size_t n)
+{
+    for(size_t kk = 0; kk < n; kk++)
+    {
+        X[kk] < lo ? X[kk] = lo : 0;
+    }
+}
+
+static double sum_scalar(const float * X, size_t n)
+{
+    double sum = 0;
+    for(size_t kk = 0; kk < n; kk++)
+    {
+        sum += (double) X[kk];
+    }
+    return sum;
+}
+
+static float max_scalar(const float * X, size_t n)
+{
+    float amax = X[0];
+    for(size_t kk = 0; kk < n; kk++)
+    {
+        X[kk] > amax ? amax = X[kk] : 0;
+    }
+    return amax;
+}
+
+static float min_scalar(const float * X, size_t n)
+{
+    float amin = X[0];
+    for(size_t kk = 0; kk < n; kk++)
+    {
+        X[kk] < amin ? amin = X[kk] : 0;
+    }
+    return amin;
+}
+
+static double idiv_scalar(const float * y, const float * g, size_t n)
+{
+    double idiv = 0;
+    for(size_t kk = 0; kk < n; kk++)
+    {
+        float est = y[kk];
+        float obs = g[kk];
+        if(est > 0 && obs > 0)
+        {
+            idiv += obs*logf(obs/est) - (obs - est);
+        }
+    }
+    return idiv;
+}
+
+static const fim_simd_kernels kernels_scalar = {
+    cmul_scalar, cmul_conj_scalar, rcmul_scalar, momentum_scalar,
+    clamp_min_scalar, sum_scalar, max_scalar, min_scalar, idiv_scalar
+};
+
+
+#ifdef FIM_SIMD_X86
+
+/*
+ * AVX2 kernels, 8 floats or 4 complex numbers per vector
+ */
+
+FIM_TARGET_AVX2
+static void cmul_avx2(float * C, const float * A, const float * B, size_t n)
+{
+    size_t kk = 0;
+    for( ; kk + 4 <= n; kk += 4)
+    {
+        __m256 a = _mm256_loadu_ps(A + 2*kk);
+        __m256 b = _mm256_loadu_ps(B + 2*kk);
+        __m256 ar = _mm256_moveldup_ps(a);
+        __m256 ai = _mm256_movehdup_ps(a);
+        /* Swap the real and imaginary parts of b */
+        __m256 bs = _mm256_permute_ps(b, 0xB1);
+        /* [ar*br - ai*bi, ar*bi + ai*br] */
+        _mm256_storeu_ps(C + 2*kk,
+                         _mm256_fmaddsub_ps(ar, b, _mm256_mul_ps(ai, bs)));
+    }
+    cmul_scalar(C + 2*kk, A + 2*kk, B + 2*kk, n - kk);
+}
+
+FIM_TARGET_AVX2
+static void cmul_conj_avx2(float * C, const float * A, const float * B, size_t n)
+{
+    size_t kk = 0;
+    for( ; kk + 4 <= n; kk += 4)
+    {
+        __m256 a = _mm256_loadu_ps(A + 2*kk);
+        __m256 b = _mm256_loadu_ps(B + 2*kk);
+        __m256 ar = _mm256_moveldup_ps(a);
+        __m256 ai = _mm256_movehdup_ps(a);
+        __m256 bs = _mm256_permute_ps(b, 0xB1);
+        /* [ar*br + ai*bi, ar*bi - ai*br] */
+        _mm256_storeu_ps(C + 2*kk,
+                         _mm256_fmsubadd_ps(ar, b, _mm256_mul_ps(ai, bs)));
+    }
+    cmul_conj_scalar(C + 2*kk, A + 2*kk, B + 2*kk, n - kk);
+}
+
+FIM_TARGET_AVX2
+static void rcmul_avx2(float * B, const float * R, size_t n)
+{
+    size_t kk = 0;
+    for( ; kk + 4 <= n; kk += 4)
+    {
+        __m128 r = _mm_loadu_ps(R + kk);
+        /* [r0 r0 r1 r1 r2 r2 r3 r3] */
+        __m256 rr = _mm256_insertf128_ps(
+            _mm256_castps128_ps256(_mm_unpacklo_ps(r, r)),
+            _mm_unpackhi_ps(r, r), 1);
+        __m256 b = _mm256_loadu_ps(B + 2*kk);
+        _mm256_storeu_ps(B + 2*kk, _mm256_mul_ps(b, rr));
+    }
+    rcmul_scalar(B + 2*kk, R + kk, n - kk);
+}
+
+FIM_TARGET_AVX2
+static void momentum_avx2(float * P, const float * X, const float * XP,
+                          float alpha, float lo, size_t n)
+{
+    const __m256 va = _mm256_set1_ps(alpha);
+    const __m256 vlo = _mm256_set1_ps(lo);
+    size_t kk = 0;
+    for( ; kk + 8 <= n; kk += 8)
+    {
+        __m256 x = _mm256_loadu_ps(X + kk);
+        __m256 xp = _mm256_loadu_ps(XP + kk);
+        __m256 p = _mm256_fmadd_ps(va, _mm256_sub_ps(x, xp), x);
+        _mm256_storeu_ps(P + kk, _mm256_max_ps(vlo, p));
+    }
+    momentum_scalar(P + kk, X + kk, XP + kk, alpha, lo, n - kk);
+}
+
+FIM_TARGET_AVX2
+static void clamp_min_avx2(float * X, float lo, size_t n)
+{
+    const __m256 vlo = _mm256_set1_ps(lo);
+    size_t kk = 0;
+    for( ; kk + 8 <= n; kk += 8)
+    {
+        _mm256_storeu_ps(X + kk, _mm256_max_ps(vlo, _mm256_loadu_ps(X + kk)));
+    }
+    clamp_min_scalar(X + kk, lo, n - kk);
+}
+
+FIM_TARGET_AVX2
+static double sum_avx2(const float * X, size_t n)
+{
+    __m256d s0 = _mm256_setzero_pd();
+    __m256d s1 = _mm256_setzero_pd();
+    size_t kk = 0;
+    for( ; kk + 8 <= n; kk += 8)
+    {
+        __m256 x = _mm256_loadu_ps(X + kk);
+        s0 = _mm256_add_pd(s0, _mm256_cvtps_pd(_mm256_castps256_ps128(x)));
+        s1 = _mm256_add_pd(s1, _mm256_cvtps_pd(_mm256_extractf128_ps(x, 1)));
+    }
+    double buf[4];
+    _mm256_storeu_pd(buf, _mm256_add_pd(s0, s1));
+    return buf[0] + buf[1] + buf[2] + buf[3] + sum_scalar(X + kk, n - kk);
+}
+
+/* With x NaN, max_ps(x, acc) returns acc, i.e. NaNs are ignored like
+ * in the scalar loop */
+FIM_TARGET_AVX2
+static float max_avx2(const float * X, size_t n)
+{
+    __m256 acc = _mm256_set1_ps(X[0]);
+    size_t kk = 0;
+    for( ; kk + 8 <= n; kk += 8)
+    {
+        acc = _mm256_max_ps(_mm256_loadu_ps(X + kk), acc);
+    }
+    float buf[8];
+    _mm256_storeu_ps(buf, acc);
+    float amax = buf[0];
+    for(int ll = 1; ll < 8; ll++)
+    {
+        buf[ll] > amax ? amax = buf[ll] : 0;
+    }
+    if(kk < n)
+    {
+        float tmax = max_scalar(X + kk, n - kk);
+        tmax > amax ? amax = tmax : 0;
+    }
+    return amax;
+}
+
+FIM_TARGET_AVX2
+static float min_avx2(const float * X, size_t n)
+{
+    __m256 acc = _mm256_set1_ps(X[0]);
+    size_t kk = 0;
+    for( ; kk + 8 <= n; kk += 8)
+    {
+        acc = _mm256_min_ps(_mm256_loadu_ps(X + kk), acc);
+    }
+    float buf[8];
+    _mm256_storeu_ps(buf, acc);
+    float amin = buf[0];
+    for(int ll = 1; ll < 8; ll++)
+    {
+        buf[ll] < amin ? amin = buf[ll] : 0;
+    }
+    if(kk < n)
+    {
+        float tmin = min_scalar(X + kk, n - kk);
+        tmin < amin ? amin = tmin : 0;
+    }
+    return amin;
+}
+
+/* Natural logarithm, the polynomial approximation from the Cephes
+ * library (logf.c), max relative error around 1e-7 for normal
+ * numbers. Subnormal numbers are treated as the smallest normal
+ * number. log(0) = -inf, log(inf) = inf and NaN for x < 0. */
+FIM_TARGET_AVX2
+static __m256 log_avx2(__m256 x)
+{
+    const __m256 one = _mm256_set1_ps(1.0f);
+    const __m256 zero = _mm256_setzero_ps();
+    const __m256 is_zero = _mm256_cmp_ps(x, zero, _CMP_EQ_OQ);
+    const __m256 is_inf = _mm256_cmp_ps(x, _mm256_set1_ps(INFINITY), _CMP_EQ_OQ);
+    /* x < 0 or NaN */
+    const __m256 invalid = _mm256_cmp_ps(x, zero, _CMP_NGE_UQ);
+
+    x = _mm256_max_ps(x, _mm256_castsi256_ps(_mm256_set1_epi32(0x00800000)));
+    __m256i e = _mm256_srli_epi32(_mm256_castps_si256(x), 23);
+    e = _mm256_sub_epi32(e, _mm256_set1_epi32(0x7f));
+    /* Mantissa in [0.5, 1) */
+    x = _mm256_and_ps(x, _mm256_castsi256_ps(_mm256_set1_epi32(~0x7f800000)));
+    x = _mm256_or_ps(x, _mm256_set1_ps(0.5f));
+    __m256 fe = _mm256_add_ps(_mm256_cvtepi32_ps(e), one);
+
+    /* if x < sqrt(1/2): e -= 1, x = 2x - 1, else x = x - 1 */
+    const __m256 small = _mm256_cmp_ps(x, _mm256_set1_ps(0.707106781186547524f), _CMP_LT_OQ);
+    __m256 tmp = _mm256_and_ps(x, small);
+    x = _mm256_sub_ps(x, one);
+    fe = _mm256_sub_ps(fe, _mm256_and_ps(one, small));
+    x = _mm256_add_ps(x, tmp);
+
+    __m256 z = _mm256_mul_ps(x, x);
+    __m256 y = _mm256_set1_ps(7.0376836292E-2f);
+    y = _mm256_fmadd_ps(y, x, _mm256_set1_ps(-1.1514610310E-1f));
+    y = _mm256_fmadd_ps(y, x, _mm256_set1_ps(1.1676998740E-1f));
+    y = _mm256_fmadd_ps(y, x, _mm256_set1_ps(-1.2420140846E-1f));
+    y = _mm256_fmadd_ps(y, x, _mm256_set1_ps(1.4249322787E-1f));
+    y = _mm256_fmadd_ps(y, x, _mm256_set1_ps(-1.6668057665E-1f));
+    y = _mm256_fmadd_ps(y, x, _mm256_set1_ps(2.0000714765E-1f));
+    y = _mm256_fmadd_ps(y, x, _mm256_set1_ps(-2.4999993993E-1f));
+    y = _mm256_fmadd_ps(y, x, _mm256_set1_ps(3.3333331174E-1f));
+    y = _mm256_mul_ps(_mm256_mul_ps(y, x), z);
+    y = _mm256_fmadd_ps(fe, _mm256_set1_ps(-2.12194440e-4f), y);
+    y = _mm256_fnmadd_ps(z, _mm256_set1_ps(0.5f), y);
+    x = _mm256_add_ps(x, y);
+    x = _mm256_fmadd_ps(fe, _mm256_set1_ps(0.693359375f), x);
+
+    x = _mm256_blendv_ps(x, _mm256_set1_ps(-INFINITY), is_zero);
+    x = _mm256_blendv_ps(x, _mm256_set1_ps(INFINITY), is_inf);
+    /* All bits set is a NaN */
+    return _mm256_or_ps(x, invalid);
+}
+
+FIM_TARGET_AVX2
+static double idiv_avx2(const float * y, const float * g, size_t n)
+{
+    __m256d s0 = _mm256_setzero_pd();
+    __m256d s1 = _mm256_setzero_pd();
+    const __m256 zero = _mm256_setzero_ps();
+    size_t kk = 0;
+    for( ; kk + 8 <= n; kk += 8)
+    {
+        __m256 est = _mm256_loadu_ps(y + kk);
+        __m256 obs = _mm256_loadu_ps(g + kk);
+        __m256 pos = _mm256_and_ps(_mm256_cmp_ps(est, zero, _CMP_GT_OQ),
+                                   _mm256_cmp_ps(obs, zero, _CMP_GT_OQ));
+        __m256 l = log_avx2(_mm256_div_ps(obs, est));
+        __m256 t = _mm256_add_ps(_mm256_fmsub_ps(obs, l, obs), est);
+        /* Only where est > 0 and obs > 0 */
+        t = _mm256_and_ps(t, pos);
+        s0 = _mm256_add_pd(s0, _mm256_cvtps_pd(_mm256_castps256_ps128(t)));
+        s1 = _mm256_add_pd(s1, _mm256_cvtps_pd(_mm256_extractf128_ps(t, 1)));
+    }
+    double buf[4];
+    _mm256_storeu_pd(buf, _mm256_add_pd(s0, s1));
+    return buf[0] + buf[1] + buf[2] + buf[3] + idiv_scalar(y + kk, g + kk, n - kk);
+}
+
+static const fim_simd_kernels kernels_avx2 = {
+    cmul_avx2, cmul_conj_avx2, rcmul_avx2, momentum_avx2,
+    clamp_min_avx2, sum_avx2, max_avx2, min_avx2, idiv_avx2
+};
+
+/*
+ * AVX-512 kernels, 16 floats or 8 complex numbers per vector
+ */
+
+FIM_TARGET_AVX512
+static void cmul_avx512(float * C, const float * A, const float * B, size_t n)
+{
+    size_t kk = 0;
+    for( ; kk + 8 <= n; kk += 8)
+    {
+        __m512 a = _mm512_loadu_ps(A + 2*kk);
+        __m512 b = _mm512_loadu_ps(B + 2*kk);
+        __m512 ar = _mm512_moveldup_ps(a);
+        __m512 ai = _mm512_movehdup_ps(a);
+        __m512 bs = _mm512_permute_ps(b, 0xB1);
+        _mm512_storeu_ps(C + 2*kk,
+                         _mm512_fmaddsub_ps(ar, b, _mm512_mul_ps(ai, bs)));
+    }
+    cmul_avx2(C + 2*kk, A + 2*kk, B + 2*kk, n - kk);
+}
+
+FIM_TARGET_AVX512
+static void cmul_conj_avx512(float * C, const float * A, const float * B, size_t n)
+{
+    size_t kk = 0;
+    for( ; kk + 8 <= n; kk += 8)
+    {
+        __m512 a = _mm512_loadu_ps(A + 2*kk);
+        __m512 b = _mm512_loadu_ps(B + 2*kk);
+        __m512 ar = _mm512_moveldup_ps(a);
+        __m512 ai = _mm512_movehdup_ps(a);
+        __m512 bs = _mm512_permute_ps(b, 0xB1);
+        _mm512_storeu_ps(C + 2*kk,
+                         _mm512_fmsubadd_ps(ar, b, _mm512_mul_ps(ai, bs)));
+    }
+    cmul_conj_avx2(C + 2*kk, A + 2*kk, B + 2*kk, n - kk);
+}
+
+FIM_TARGET_AVX512
+static void rcmul_avx512(float * B, const float * R, size_t n)
+{
+    const __m512i idx = _mm512_set_epi32(7, 7, 6, 6, 5, 5, 4, 4,
+                                         3, 3, 2, 2, 1, 1, 0, 0);
+    size_t kk = 0;
+    for( ; kk + 8 <= n; kk += 8)
+    {
+        __m256 r = _mm256_loadu_ps(R + kk);
+        __m512 rr = _mm512_permutexvar_ps(idx, _mm512_castps256_ps512(r));
+        __m512 b = _mm512_loadu_ps(B + 2*kk);
+        _mm512_storeu_ps(B + 2*kk, _mm512_mul_ps(b, rr));
+    }
+    rcmul_avx2(B + 2*kk, R + kk, n - kk);
+}
+
+FIM_TARGET_AVX512
+static void momentum_avx512(float * P, const float * X, const float * XP,
+                            float alpha, float lo, size_t n)
+{
+    const __m512 va = _mm512_set1_ps(alpha);
+    const __m512 vlo = _mm512_set1_ps(lo);
+    size_t kk = 0;
+    for( ; kk + 16 <= n; kk += 16)
+    {
+        __m512 x = _mm512_loadu_ps(X + kk);
+        __m512 xp = _mm512_loadu_ps(XP + kk);
+        __m512 p = _mm512_fmadd_ps(va, _mm512_sub_ps(x, xp), x);
+        _mm512_storeu_ps(P + kk, _mm512_max_ps(vlo, p));
+    }
+    momentum_avx2(P + kk, X + kk, XP + kk, alpha, lo, n - kk);
+}
+
+FIM_TARGET_AVX512
+static void clamp_min_avx512(float * X, float lo, size_t n)
+{
+    const __m512 vlo = _mm512_set1_ps(lo);
+    size_t kk = 0;
+    for( ; kk + 16 <= n; kk += 16)
+    {
+        _mm512_storeu_ps(X + kk, _mm512_max_ps(vlo, _mm512_loadu_ps(X + kk)));
+    }
+    clamp_min_avx2(X + kk, lo, n - kk);
+}
+
+FIM_TARGET_AVX512
+static double sum_avx512(const float * X, size_t n)
+{
+    __m512d s0 = _mm512_setzero_pd();
+    __m512d s1 = _mm512_setzero_pd();
+    size_t kk = 0;
+    for( ; kk + 16 <= n; kk += 16)
+    {
+        __m512 x = _mm512_loadu_ps(X + kk);
+        __m256 hi = _mm256_castpd_ps(_mm512_extractf64x4_pd(_mm512_castps_pd(x), 1));
+        s0 = _mm512_add_pd(s0, _mm512_cvtps_pd(_mm512_castps512_ps256(x)));
+        s1 = _mm512_add_pd(s1, _mm512_cvtps_pd(hi));
+    }
+    return _mm512_reduce_add_pd(_mm512_add_pd(s0, s1)) + sum_avx2(X + kk, n - kk);
+}
+
+FIM_TARGET_AVX512
+static float max_avx512(const float * X, size_t n)
+{
+    __m512 acc = _mm512_set1_ps(X[0]);
+    size_t kk = 0;
+    for( ; kk + 16 <= n; kk += 16)
+    {
+        acc = _mm512_max_ps(_mm512_loadu_ps(X + kk), acc);
+    }
+    float amax = _mm512_reduce_max_ps(acc);
+    if(kk < n)
+    {
+        float tmax = max_avx2(X + kk, n - kk);
+        tmax > amax ? amax = tmax : 0;
+    }
+    return amax;
+}
+
+FIM_TARGET_AVX512
+static float min_avx512(const float * X, size_t n)
+{
+    __m512 acc = _mm512_set1_ps(X[0]);
+    size_t kk = 0;
+    for( ; kk + 16 <= n; kk += 16)
+    {
+        acc = _mm512_min_ps(_mm512_loadu_ps(X + kk), acc);
+    }
+    float amin = _mm512_reduce_min_ps(acc);
+    if(kk < n)
+    {
+        float tmin = min_avx2(X + kk, n - kk);
+        tmin < amin ? amin = tmin : 0;
+    }
+    return amin;
+}
+
+/* The I-divergence is dominated by the division and the logarithm,
+ * the AVX2 version is used. */
+static const fim_simd_kernels kernels_avx512 = {
+    cmul_avx512, cmul_conj_avx512, rcmul_avx512, momentum_avx512,
+    clamp_min_avx512, sum_avx512, max_avx512, min_avx512, idiv_avx2
+};
+
+#endif /* FIM_SIMD_X86 */
+
+
+#ifdef FIM_SIMD_ARM
+
+/*
+ * NEON kernels, 4 floats per vector
+ */
+
+static void cmul_neon(float * C, const float * A, const float * B, size_t n)
+{
+    size_t kk = 0;
+    for( ; kk + 4 <= n; kk += 4)
+    {
+        /* De-interleaved to real and imaginary parts */
+        float32x4x2_t a = vld2q_f32(A + 2*kk);
+        float32x4x2_t b = vld2q_f32(B + 2*kk);
+        float32x4x2_t c;
+        c.val[0] = vfmsq_f32(vmulq_f32(a.val[0], b.val[0]), a.val[1], b.val[1]);
+        c.val[1] = vfmaq_f32(vmulq_f32(a.val[0], b.val[1]), a.val[1], b.val[0]);
+        vst2q_f32(C + 2*kk, c);
+    }
+    cmul_scalar(C + 2*kk, A + 2*kk, B + 2*kk, n - kk);
+}
+
+static void cmul_conj_neon(float * C, const float * A, const float * B, size_t n)
+{
+    size_t kk = 0;
+    for( ; kk + 4 <= n; kk += 4)
+    {
+        float32x4x2_t a = vld2q_f32(A + 2*kk);
+        float32x4x2_t b = vld2q_f32(B + 2*kk);
+        float32x4x2_t c;
+        c.val[0] = vfmaq_f32(vmulq_f32(a.val[0], b.val[0]), a.val[1], b.val[1]);
+        c.val[1] = vfmsq_f32(vmulq_f32(a.val[0], b.val[1]), a.val[1], b.val[0]);
+        vst2q_f32(C + 2*kk, c);
+    }
+    cmul_conj_scalar(C + 2*kk, A + 2*kk, B + 2*kk, n - kk);
+}
+
+static void rcmul_neon(float * B, const float * R, size_t n)
+{
+    size_t kk = 0;
+    for( ; kk + 4 <= n; kk += 4)
+    {
+        float32x4_t r = vld1q_f32(R + kk);
+        float32x4x2_t b = vld2q_f32(B + 2*kk);
+        b.val[0] = vmulq_f32(b.val[0], r);
+        b.val[1] = vmulq_f32(b.val[1], r);
+        vst2q_f32(B + 2*kk, b);
+    }
+    rcmul_scalar(B + 2*kk, R + kk, n - kk);
+}
+
+static void momentum_neon(float * P, const float * X, const float * XP,
+                          float alpha, float lo, size_t n)
+{
+    const float32x4_t va = vdupq_n_f32(alpha);
+    const float32x4_t vlo = vdupq_n_f32(lo);
+    size_t kk = 0;
+    for( ; kk + 4 <= n; kk += 4)
+    {
+        float32x4_t x = vld1q_f32(X + kk);
+        float32x4_t xp = vld1q_f32(XP + kk);
+        float32x4_t p = vfmaq_f32(x, va, vsubq_f32(x, xp));
+        vst1q_f32(P + kk, vmaxq_f32(p, vlo));
+    }
+    momentum_scalar(P + kk, X + kk, XP + kk, alpha, lo, n - kk);
+}
+
+static void clamp_min_neon(float * X, float lo, size_t n)
+{
+    const float32x4_t vlo = vdupq_n_f32(lo);
+    size_t kk = 0;
+    for( ; kk + 4 <= n; kk += 4)
+    {
+        vst1q_f32(X + kk, vmaxq_f32(vld1q_f32(X + kk), vlo));
+    }
+    clamp_min_scalar(X + kk, lo, n - kk);
+}
+
+static double sum_neon(const float * X, size_t n)
+{
+    float64x2_t s0 = vdupq_n_f64(0);
+    float64x2_t s1 = vdupq_n_f64(0);
+    size_t kk = 0;
+    for( ; kk + 4 <= n; kk += 4)
+    {
+        float32x4_t x = vld1q_f32(X + kk);
+        s0 = vaddq_f64(s0, vcvt_f64_f32(vget_low_f32(x)));
+        s1 = vaddq_f64(s1, vcvt_high_f64_f32(x));
+    }
+    return vaddvq_f64(vaddq_f64(s0, s1)) + sum_scalar(X + kk, n - kk);
+}
+
+/* The nm versions ignore NaNs like the scalar loop */
+static float max_neon(const float * X, size_t n)
+{
+    float32x4_t acc = vdupq_n_f32(X[0]);
+    size_t kk = 0;
+    for( ; kk + 4 <= n; kk += 4)
+    {
+        acc = vmaxnmq_f32(acc, vld1q_f32(X + kk));
+    }
+    float amax = vmaxnmvq_f32(acc);
+    if(kk < n)
+    {
+        float tmax = max_scalar(X + kk, n - kk);
+        tmax > amax ? amax = tmax : 0;
+    }
+    return amax;
+}
+
+static float min_neon(const float * X, size_t n)
+{
+    float32x4_t acc = vdupq_n_f32(X[0]);
+    size_t kk = 0;
+    for( ; kk + 4 <= n; kk += 4)
+    {
+        acc = vminnmq_f32(acc, vld1q_f32(X + kk));
+    }
+    float amin = vminnmvq_f32(acc);
+    if(kk < n)
+    {
+        float tmin = min_scalar(X + kk, n - kk);
+        tmin < amin ? amin = tmin : 0;
+    }
+    return amin;
+}
+
+/* No vectorized logarithm for NEON yet, the scalar I-divergence is
+ * used */
+static const fim_simd_kernels kernels_neon = {
+    cmul_neon, cmul_conj_neon, rcmul_neon, momentum_neon,
+    clamp_min_neon, sum_neon, max_neon, min_neon, idiv_scalar
+};
+
+#endif /* FIM_SIMD_ARM */
+
+
+/*
+ * Selection
+ */
+
+static const char * fim_simd_names[FIM_SIMD_N] = {
+    "scalar", "avx2", "avx512", "neon"
+};
+
+static const fim_simd_kernels * fim_simd_K = NULL;
+static fim_simd_level fim_simd_L = FIM_SIMD_SCALAR;
+
+const char * fim_simd_name(fim_simd_level level)
+{
+    if(level < 0 || level >= FIM_SIMD_N)
+    {
+        return "unknown";
+    }
+    return fim_simd_names[level];
+}
+
+int fim_simd_supported(fim_simd_level level)
+{
+    switch(level)
+    {
+    case FIM_SIMD_SCALAR:
+        return 1;
+#ifdef FIM_SIMD_X86
+    case FIM_SIMD_AVX2:
+        __builtin_cpu_init();
+        return __builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma");
+    case FIM_SIMD_AVX512:
+        __builtin_cpu_init();
+        return __builtin_cpu_supports("avx512f")
+            && __builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma");
+#endif
+#ifdef FIM_SIMD_ARM
+    case FIM_SIMD_NEON:
+        return 1;
+#endif
+    default:
+        return 0;
+    }
+}
+
+static const fim_simd_kernels * fim_simd_table(fim_simd_level level)
+{
+    switch(level)
+    {
+#ifdef FIM_SIMD_X86
+    case FIM_SIMD_AVX2:
+        return &kernels_avx2;
+    case FIM_SIMD_AVX512:
+        return &kernels_avx512;
+#endif
+#ifdef FIM_SIMD_ARM
+    case FIM_SIMD_NEON:
+        return &kernels_neon;
+#endif
+    default:
+        return &kernels_scalar;
+    }
+}
+
+int fim_simd_set(fim_simd_level level)
+{
+    if(!fim_simd_supported(level))
+    {
+        return -1;
+    }
+    fim_simd_L = level;
+    fim_simd_K = fim_simd_table(level);
+    return 0;
+}
+
+/* The best supported implementation unless DW_SIMD is set */
+static fim_simd_level fim_simd_detect(void)
+{
+    char * env = getenv("DW_SIMD");
+    if(env != NULL)
+    {
+        for(int kk = 0; kk < FIM_SIMD_N; kk++)
+        {
+            if(strcmp(env, fim_simd_names[kk]) == 0)
+            {
+                if(fim_simd_supported(kk))
+                {
+                    return kk;
+                }
+                fprintf(stderr, "WARNING: DW_SIMD=%s is not supported "
+                        "on this machine\n", env);
+            }
+        }
+    }
+
+    const fim_simd_level order[] = {FIM_SIMD_AVX512, FIM_SIMD_AVX2,
+                                    FIM_SIMD_NEON};
+    for(size_t kk = 0; kk < sizeof(order)/sizeof(order[0]); kk++)
+    {
+        if(fim_simd_supported(order[kk]))
+        {
+            return order[kk];
+        }
+    }
+    return FIM_SIMD_SCALAR;
+}
+
+static const fim_simd_kernels * fim_simd_kernels_get(void)
+{
+    if(fim_simd_K == NULL)
+    {
+#pragma omp critical(fim_simd)
+        {
+            if(fim_simd_K == NULL)
+            {
+                fim_simd_set(fim_simd_detect());
+            }
+        }
+    }
+    return fim_simd_K;
+}
+
+fim_simd_level fim_simd_get(void)
+{
+    fim_simd_kernels_get();
+    return fim_simd_L;
+}
+
+
+/*
+ * Parallel versions, the data is split in blocks of FIM_SIMD_BLOCK
+ * elements
+ */
+
+static size_t nblocks(size_t n)
+{
+    return (n + FIM_SIMD_BLOCK - 1) / FIM_SIMD_BLOCK;
+}
+
+static size_t blocklen(size_t n, size_t bb)
+{
+    size_t first = bb*FIM_SIMD_BLOCK;
+    return n - first < FIM_SIMD_BLOCK ? n - first : FIM_SIMD_BLOCK;
+}
+
+void fim_simd_cmul(float * C, const float * A, const float * B, size_t n)
+{
+    const fim_simd_kernels * K = fim_simd_kernels_get();
+    const size_t nb = nblocks(n);
+#pragma omp parallel for shared(A, B, C)
+    for(size_t bb = 0; bb < nb; bb++)
+    {
+        size_t first = 2*bb*FIM_SIMD_BLOCK;
+        K->cmul(C + first, A + first, B + first, blocklen(n, bb));
+    }
+}
+
+void fim_simd_cmul_conj(float * C, const float * A, const float * B, size_t n)
+{
+    const fim_simd_kernels * K = fim_simd_kernels_get();
+    const size_t nb = nblocks(n);
+#pragma omp parallel for shared(A, B, C)
+    for(size_t bb = 0; bb < nb; bb++)
+    {
+        size_t first = 2*bb*FIM_SIMD_BLOCK;
+        K->cmul_conj(C + first, A + first, B + first, blocklen(n, bb));
+    }
+}
+
+void fim_simd_rcmul(float * B, const float * R, size_t n)
+{
+    const fim_simd_kernels * K = fim_simd_kernels_get();
+    const size_t nb = nblocks(n);
+#pragma omp parallel for shared(B, R)
+    for(size_t bb = 0; bb < nb; bb++)
+    {
+        size_t first = bb*FIM_SIMD_BLOCK;
+        K->rcmul(B + 2*first, R + first, blocklen(n, bb));
+    }
+}
+
+void fim_simd_momentum(float * P, const float * X, const float * XP,
+                       float alpha, float lo, size_t n)
+{
+    const fim_simd_kernels * K = fim_simd_kernels_get();
+    const size_t nb = nblocks(n);
+#pragma omp parallel for shared(P, X, XP)
+    for(size_t bb = 0; bb < nb; bb++)
+    {
+        size_t first = bb*FIM_SIMD_BLOCK;
+        K->momentum(P + first, X + first, XP + first, alpha, lo,
+                    blocklen(n, bb));
+    }
+}
+
+void fim_simd_clamp_min(float * X, float lo, size_t n)
+{
+    const fim_simd_kernels * K = fim_simd_kernels_get();
+    const size_t nb = nblocks(n);
+#pragma omp parallel for shared(X)
+    for(size_t bb = 0; bb < nb; bb++)
+    {
+        K->clamp_min(X + bb*FIM_SIMD_BLOCK, lo, blocklen(n, bb));
+    }
+}
+
+double fim_simd_sum(const float * X, size_t n)
+{
+    const fim_simd_kernels * K = fim_simd_kernels_get();
+    const size_t nb = nblocks(n);
+    double sum = 0;
+#pragma omp parallel for shared(X) reduction(+:sum)
+    for(size_t bb = 0; bb < nb; bb++)
+    {
+        sum += K->sum(X + bb*FIM_SIMD_BLOCK, blocklen(n, bb));
+    }
+    return sum;
+}
+
+float fim_simd_max(const float * X, size_t n)
+{
+    assert(n > 0);
+    const fim_simd_kernels * K = fim_simd_kernels_get();
+    const size_t nb = nblocks(n);
+    float amax = X[0];
+#pragma omp parallel for shared(X) reduction(max:amax)
+    for(size_t bb = 0; bb < nb; bb++)
+    {
+        float m = K->max(X + bb*FIM_SIMD_BLOCK, blocklen(n, bb));
+        m > amax ? amax = m : 0;
+    }
+    return amax;
+}
+
+float fim_simd_min(const float * X, size_t n)
+{
+    assert(n > 0);
+    const fim_simd_kernels * K = fim_simd_kernels_get();
+    const size_t nb = nblocks(n);
+    float amin = X[0];
+#pragma omp parallel for shared(X) reduction(min:amin)
+    for(size_t bb = 0; bb < nb; bb++)
+    {
+        float m = K->min(X + bb*FIM_SIMD_BLOCK, blocklen(n, bb));
+        m < amin ? amin = m : 0;
+    }
+    return amin;
+}
+
+double fim_simd_idiv_row(const float * y, const float * g, size_t n)
+{
+    return fim_simd_kernels_get()->idiv(y, g, n);
+}
+
+
+/*
+ * Tests and benchmark
+ */
+
+static float * ut_rand(size_t n, float lo, float hi)
+{
+    float * X = malloc(n*sizeof(float));
+    assert(X != NULL);
+    for(size_t kk = 0; kk < n; kk++)
+    {
+        X[kk] = lo + (hi-lo)*(float) rand() / (float) RAND_MAX;
+    }
+    return X;
+}
+
+static double ut_maxdiff(const float * A, const float * B, size_t n)
+{
+    double d = 0;
+    for(size_t kk = 0; kk < n; kk++)
+    {
+        double e = fabs((double) A[kk] - (double) B[kk]);
+        e > d ? d = e : 0;
+    }
+    return d;
+}
+
+static void ut_check(const char * level, const char * kernel,
+                     double err, double tol)
+{
+    if(!(err <= tol))
+    {
+        fprintf(stderr, "fim_simd_ut: %s %s, error %e > %e\n",
+                level, kernel, err, tol);
+        exit(EXIT_FAILURE);
+    }
+}
+
+void fim_simd_ut(void)
+{
+    /* Not a multiple of any vector length to also test the tails */
+    const size_t n = 1003;
+    float * A = ut_rand(2*n, -1, 1);
+    float * B = ut_rand(2*n, -1, 1);
+    float * R = ut_rand(n, -1, 1);
+    float * X = ut_rand(n, 0, 100);
+    float * XP = ut_rand(n, 0, 100);
+    /* Some non-positive values that should be skipped */
+    float * Y = ut_rand(n, -10, 100);
+    float * G = ut_rand(n, -10, 100);
+    float * C0 = malloc(2*n*sizeof(float));
+    float * C1 = malloc(2*n*sizeof(float));
+    assert(C0 != NULL);
+    assert(C1 != NULL);
+
+    const fim_simd_kernels * S = &kernels_scalar;
+
+    /* The scalar I-divergence against the definition in get_fIdiv,
+     * Y is the forward projection and G the image */
+    double idiv = 0;
+    for(size_t kk = 0; kk < n; kk++)
+    {
+        if(Y[kk] > 0 && G[kk] > 0)
+        {
+            idiv += G[kk]*log(G[kk]/Y[kk]) - (G[kk] - Y[kk]);
+        }
+    }
+    ut_check("scalar", "idiv", fabs(S->idiv(Y, G, n) - idiv)/idiv, 1e-5);
+
+    int ntested = 0;
+    for(int ll = 1; ll < FIM_SIMD_N; ll++)
+    {
+        if(!fim_simd_supported(ll))
+        {
+            continue;
+        }
+        const char * name = fim_simd_names[ll];
+        const fim_simd_kernels * K = fim_simd_table(ll);
+
+        /* FMA rounds differently, allow a few ulp */
+        S->cmul(C0, A, B, n);
+        K->cmul(C1, A, B, n);
+        ut_check(name, "cmul", ut_maxdiff(C0, C1, 2*n), 1e-6);
+
+        /* In place, C = B */
+        memcpy(C1, B, 2*n*sizeof(float));
+        K->cmul(C1, A, C1, n);
+        ut_check(name, "cmul inplace", ut_maxdiff(C0, C1, 2*n), 1e-6);
+
+        S->cmul_conj(C0, A, B, n);
+        K->cmul_conj(C1, A, B, n);
+        ut_check(name, "cmul_conj", ut_maxdiff(C0, C1, 2*n), 1e-6);
+
+        memcpy(C0, B, 2*n*sizeof(float));
+        memcpy(C1, B, 2*n*sizeof(float));
+        S->rcmul(C0, R, n);
+        K->rcmul(C1, R, n);
+        ut_check(name, "rcmul", ut_maxdiff(C0, C1, 2*n), 0);
+
+        S->momentum(C0, X, XP, 0.7, 10, n);
+        K->momentum(C1, X, XP, 0.7, 10, n);
+        ut_check(name, "momentum", ut_maxdiff(C0, C1, n), 1e-4);
+
+        memcpy(C0, A, n*sizeof(float));
+        memcpy(C1, A, n*sizeof(float));
+        S->clamp_min(C0, 0, n);
+        K->clamp_min(C1, 0, n);
+        ut_check(name, "clamp_min", ut_maxdiff(C0, C1, n), 0);
+
+        double s0 = S->sum(X, n);
+        double s1 = K->sum(X, n);
+        ut_check(name, "sum", fabs(s0-s1)/fabs(s0), 1e-12);
+
+        ut_check(name, "max", fabs(S->max(A, 2*n) - K->max(A, 2*n)), 0);
+        ut_check(name, "min", fabs(S->min(A, 2*n) - K->min(A, 2*n)), 0);
+
+        s0 = S->idiv(Y, G, n);
+        s1 = K->idiv(Y, G, n);
+        ut_check(name, "idiv", fabs(s0-s1)/fabs(s0), 1e-5);
+
+        printf("fim_simd_ut: %s ok\n", name);
+        ntested++;
+    }
+    if(ntested == 0)
+    {
+        printf("fim_simd_ut: only the scalar kernels are available\n");
+    }
+
+    free(A); free(B); free(R); free(X); free(XP); free(Y); free(G);
+    free(C0); free(C1);
+}
+
+void fim_simd_bench(FILE * f, size_t n, int nrep)
+{
+    f == NULL ? f = stdout : 0;
+    float * A = ut_rand(2*n, -1, 1);
+    float * B = ut_rand(2*n, -1, 1);
+    float * C = ut_rand(2*n, -1, 1);
+    float * X = ut_rand(n, 1, 100);
+    float * XP = ut_rand(n, 1, 100);
+
+    const fim_simd_level level0 = fim_simd_get();
+    const char * kernels[] = {"cmul", "cmul_conj", "rcmul", "momentum",
+                              "clamp_min", "sum", "max", "min", "idiv"};
+    const int nkernels = sizeof(kernels)/sizeof(kernels[0]);
+
+    fprintf(f, "# %zu elements, %d repetitions, time per call in ms\n",
+            n, nrep);
+    fprintf(f, "%-10s", "kernel");
+    for(int ll = 0; ll < FIM_SIMD_N; ll++)
+    {
+        if(fim_simd_supported(ll))
+        {
+            fprintf(f, " %10s", fim_simd_names[ll]);
+        }
+    }
+    fprintf(f, " %10s\n", "speedup");
+
+    volatile double sink = 0;
+    for(int kk = 0; kk < nkernels; kk++)
+    {
+        fprintf(f, "%-10s", kernels[kk]);
+        double t_scalar = 0;
+        double t_best = 0;
+        for(int ll = 0; ll < FIM_SIMD_N; ll++)
+        {
+            if(fim_simd_set(ll) != 0)
+            {
+                continue;
+            }
+            struct timespec t0, t1;
+            dw_gettime(&t0);
+            for(int rr = 0; rr < nrep; rr++)
+            {
+                switch(kk)
+                {
+                case 0:
+                    fim_simd_cmul(C, A, B, n);
+                    break;
+                case 1:
+                    fim_simd_cmul_conj(C, A, B, n);
+                    break;
+                case 2:
+                    fim_simd_rcmul(C, X, n);
+                    break;
+                case 3:
+                    fim_simd_momentum(C, X, XP, 0.5, 1, n);
+                    break;
+                case 4:
+                    fim_simd_clamp_min(C, 0, 2*n);
+                    break;
+                case 5:
+                    sink += fim_simd_sum(X, n);
+                    break;
+                case 6:
+                    sink += fim_simd_max(X, n);
+                    break;
+                case 7:
+                    sink += fim_simd_min(X, n);
+                    break;
+                case 8:
+                    sink += fim_simd_idiv_row(X, XP, n);
+                    break;
+                }
+            }
+            dw_gettime(&t1);
+            double t = 1000.0*timespec_diff(&t1, &t0)/(double) nrep;
+            fprintf(f, " %10.3f", t);
+            if(ll == FIM_SIMD_SCALAR)
+            {
+                t_scalar = t;
+            }
+            if(t_best == 0 || t < t_best)
+            {
+                t_best = t;
+            }
+        }
+        fprintf(f, " %10.2f\n", t_scalar/t_best);
+    }
+    (void) sink;
+    fim_simd_set(level0);
+
+    free(A); free(B); free(C); free(X); free(XP);
+}
@@ -0,0 +1,93 @@
+#pragma once
+
+/*    Copyright (C) 2020 Erik L. G. Wernersson
+ *
+ *    This program is free software: you can redistribute it and/or modify
+ *    it under the terms of the GNU General Public License as published by
+ *    the Free Software Foundation, either version 3 of the License, or
+ *    (at your option) any later version.
+ *
+ *    This program is distributed in the hope that it will be useful,
+ *    but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *    GNU General Public License for more details.
+ *
+ *    You should have received a copy of the GNU General Public License
+ *    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include <stddef.h>
+#include <stdio.h>
+
+/* fim_simd : explicitly vectorized versions of the elementwise loops
+ * that are run once or more per iteration, i.e. the complex
+ * multiplications in fft.c, the momentum step of --method shb, the
+ * I-divergence and some reductions in fim.c.
+ *
+ * The implementation is selected at runtime based on what the CPU
+ * supports: AVX-512, AVX2 (with FMA) or NEON. The scalar kernels are
+ * the portable fallback and what the others are tested against. The
+ * environment variable DW_SIMD can be set to "scalar", "avx2",
+ * "avx512" or "neon" to override the selection.
+ *
+ * The functions below are parallelized with OpenMP over blocks of the
+ * data, except fim_simd_idiv_row which is meant to be called per row.
+ */
+
+typedef enum {
+    FIM_SIMD_SCALAR = 0,
+    FIM_SIMD_AVX2,
+    FIM_SIMD_AVX512,
+    FIM_SIMD_NEON,
+    FIM_SIMD_N /* Number of implementations */
+} fim_simd_level;
+
+/* The implementation in use */
+fim_simd_level fim_simd_get(void);
+
+/* Use a specific implementation. Returns -1 and does nothing if it is
+ * not supported by the build or the CPU */
+int fim_simd_set(fim_simd_level level);
+
+/* Returns 1 if the implementation can be used on this machine */
+int fim_simd_supported(fim_simd_level level);
+
+/* "scalar", "avx2", "avx512" or "neon" */
+const char * fim_simd_name(fim_simd_level level);
+
+/* C = A*B for n complex numbers stored as interleaved real and
+ * imaginary parts, like fftwf_complex. C can be the same as A or B */
+void fim_simd_cmul(float * C, const float * A, const float * B, size_t n);
+
+/* C = conj(A)*B, see fim_simd_cmul */
+void fim_simd_cmul_conj(float * C, const float * A, const float * B, size_t n);
+
+/* B = R*B where R is real and B complex with n elements */
+void fim_simd_rcmul(float * B, const float * R, size_t n);
+
+/* P = X + alpha*(X - XP), values below lo set to lo. P can be X */
+void fim_simd_momentum(float * P, const float * X, const float * XP,
+                       float alpha, float lo, size_t n);
+
+/* Values below lo set to lo */
+void fim_simd_clamp_min(float * X, float lo, size_t n);
+
+/* Sum, accumulated in double precision */
+double fim_simd_sum(const float * X, size_t n);
+
+float fim_simd_max(const float * X, size_t n);
+
+float fim_simd_min(const float * X, size_t n);
+
+/* Sum of g*log(g/y) - (g - y) over the elements where y > 0 and
+ * g > 0, where y is the current guess convolved with the PSF and g
+ * the image, i.e. the I-divergence of get_fIdiv for one row. Not
+ * parallelized. */
+double fim_simd_idiv_row(const float * y, const float * g, size_t n);
+
+/* Check all supported implementations against the scalar kernels */
+void fim_simd_ut(void);
+
+/* Time each kernel for each supported implementation on arrays of
+ * n elements, nrep times, and write a table to f */
+void fim_simd_bench(FILE * f, size_t n, int nrep);
@@ -0,0 +1,39 @@
+#include <stdlib.h>
+#include <stdio.h>
+#ifdef _OPENMP
+#include <omp.h>
+#endif
+#include "fim_simd.h"
+
+/* Usage: fim_simd_ut [n] [threads] [repetitions]
+ * Checks the SIMD kernels and then benchmarks them on n elements.
+ * Set DW_SIMD to force a specific implementation. */
+int main(int argc, char ** argv)
+{
+    size_t n = 1 << 22;
+    int nrep = 20;
+    if(argc > 1)
+    {
+        n = strtoul(argv[1], NULL, 10);
+    }
+#ifdef _OPENMP
+    if(argc > 2)
+    {
+        omp_set_num_threads(atoi(argv[2]));
+    }
+#endif
+    if(argc > 3)
+    {
+        nrep = atoi(argv[3]);
+    }
+    if(n < 1 || nrep < 1)
+    {
+        fprintf(stderr, "Usage: %s [n] [threads] [repetitions]\n", argv[0]);
+        return EXIT_FAILURE;
+    }
+
+    fim_simd_ut();
+    printf("Default implementation: %s\n", fim_simd_name(fim_simd_get()));
+    fim_simd_bench(stdout, n, nrep);
+    return EXIT_SUCCESS;
+}
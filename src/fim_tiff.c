@@ -190,132 +190,90 @@ void floatimage_show_stats(float * I, size_t N, size_t M, size_t P)
 }
 
 
-static void sub2ind(size_t ind,
-                    int64_t M, int64_t N, __attribute__((unused)) int64_t P,
-                    int64_t * m, int64_t * n, int64_t * p)
-{
-    /* If ind is the linear index from a [M,N,P] image, figure out the coordinates of ind
-     */
-
-    ldiv_t d = ldiv(ind, M*N);
-    p[0] = d.quot;
-    int64_t t = d.rem;
-    d = ldiv(t, M);
-    n[0] = d.quot;
-    m[0] = d.rem;
-}
-
-void readUint16_sub(TIFF * tfile, float * V,
-                    const uint32_t ssize,
-                    const uint32_t ndirs,
-                    const uint32_t nstrips,
-                    const uint32_t perDirectory,
-                    int64_t M, int64_t N, int64_t P,
-                    int64_t sM, int64_t sN, int64_t sP,
-                    int64_t wM, int64_t wN, int64_t wP)
-{
-
-    // V should hold wM*wN*wP uint16
-
-    // Number of elements per strip
-    size_t nes = ssize/sizeof(uint16_t);
-    uint16_t * buf = _TIFFmalloc(ssize);
-    assert(buf != NULL);
-
-    for(size_t dd=0; dd < ndirs; dd++) {
-        TIFFSetDirectory(tfile, dd);
-        for(size_t kk=0; kk<nstrips; kk++) {
-            size_t strip = kk;
-            tsize_t read = TIFFReadEncodedStrip(tfile, strip, buf, (tsize_t) - 1);
-            assert(read>0);
-
-            for(size_t ii = 0; ii < read/sizeof(uint16_t); ii++) {
-                size_t ipos = ii+kk*nes + dd*perDirectory; // Input position
-
-                int64_t iM = 0; int64_t iN = 0; int64_t iP = 0;
-
-                sub2ind(ipos, M, N, P, &iM, &iN, &iP);
-
-                if(0){
-                    if(ipos % 100000 == 0){
-                        printf("%" PRId64 " %" PRId64 " %" PRId64 ", %zu -> (%" PRId64 ", %" PRId64 ", %" PRId64 ")\n",
-                               M, N, P, ipos, iM, iN, iP);
-                        getchar();
-                    }}
-
-                int64_t oM = (iM-sM);
-                int64_t oN = (iN-sN);
-                int64_t oP = (iP-sP);
-
-                if(oM >= 0 && oM < wM){
-                    if(oN >= 0 && oN < wN){
-                        if(oP >= 0 && oP < wP){
-                            size_t opos = oM + oN*wM + oP*wM*wN;
-                            V[opos] = (float) buf[ii];
-                        }
-                    }
-                }
-            }
-        }
-    }
-    free(buf);
-    return;
-}
-
-void readUint8_sub(TIFF * tfile, float * V,
-                   const uint32_t ssize,
-                   const uint32_t ndirs,
-                   const uint32_t nstrips,
-                   const uint32_t perDirectory,
-                   int64_t M, int64_t N, int64_t P,
+/* Read the sub region [sM, sM+wM-1] x [sN, sN+wN-1] x [sP, sP+wP-1]
+ * into V which should hold wM*wN*wP floats. Only the directories
+ * (z-planes) and the strips that overlap the region are read.
+ * Supports uint8, uint16 and float32 images without compression.
+ * Returns 0 on success.
+ */
+static int readSub(TIFF * tfile, float * V,
+                   int BPS, int isFloat,
+                   int64_t M, int64_t N,
                    int64_t sM, int64_t sN, int64_t sP,
                    int64_t wM, int64_t wN, int64_t wP)
 {
-
-    // V should hold wM*wN*wP uint16
-
-    // Number of elements per strip
-    size_t nes = ssize/sizeof(uint8_t);
+    uint32_t rps = 0;
+    if(TIFFGetField(tfile, TIFFTAG_ROWSPERSTRIP, &rps) == 0
+       || rps == 0 || rps > (uint32_t) N)
+    {
+        rps = N;
+    }
+    const size_t bps = BPS/8; /* Bytes per sample */
+    tmsize_t ssize = TIFFStripSize(tfile);
     uint8_t * buf = _TIFFmalloc(ssize);
-    assert(buf != NULL);
-
-    for(size_t dd=0; dd < ndirs; dd++) {
-        TIFFSetDirectory(tfile, dd);
-        for(size_t kk=0; kk<nstrips; kk++) {
-            size_t strip = kk;
-            tsize_t read = TIFFReadEncodedStrip(tfile, strip, buf, (tsize_t) - 1);
-            assert(read>0);
-
-            for(size_t ii = 0; ii < read/sizeof(uint8_t); ii++) {
-                size_t ipos = ii+kk*nes + dd*perDirectory; // Input position
-
-                int64_t iM = 0; int64_t iN = 0; int64_t iP = 0;
-
-                sub2ind(ipos, M, N, P, &iM, &iN, &iP);
-
-                if(0){
-                    if(ipos % 100000 == 0){
-                        printf("%" PRId64 " %" PRId64 " %" PRId64 ", %zu -> (%" PRId64 ", %" PRId64 ", %" PRId64 ")\n",
-                               M, N, P, ipos, iM, iN, iP);
-                        getchar();
-                    }}
+    if(buf == NULL)
+    {
+        fprintf(fim_tiff_log, "Failed to allocate %zu bytes of memory\n",
+                (size_t) ssize);
+        return 1;
+    }
 
-                int64_t oM = (iM-sM);
-                int64_t oN = (iN-sN);
-                int64_t oP = (iP-sP);
+    const uint32_t strip0 = sN / rps;
+    const uint32_t strip1 = (sN + wN - 1) / rps;
 
-                if(oM >= 0 && oM < wM){
-                    if(oN >= 0 && oN < wN){
-                        if(oP >= 0 && oP < wP){
-                            size_t opos = oM + oN*wM + oP*wM*wN;
-                            V[opos] = (float) buf[ii];
-                        }
+    for(int64_t pp = 0; pp < wP; pp++)
+    {
+        /* TIFFSetDirectory walks the directory chain from the start,
+         * step one directory at a time instead */
+        int ok = pp == 0 ? TIFFSetDirectory(tfile, sP) : TIFFReadDirectory(tfile);
+        if(ok == 0)
+        {
+            fprintf(fim_tiff_log, "Failed to choose directory %" PRId64 "\n",
+                    sP + pp);
+            _TIFFfree(buf);
+            return 1;
+        }
+        uint32_t nstrips = TIFFNumberOfStrips(tfile);
+        for(uint32_t ss = strip0; ss <= strip1 && ss < nstrips; ss++)
+        {
+            tsize_t read = TIFFReadEncodedStrip(tfile, ss, buf, (tsize_t) -1);
+            if(read < 0)
+            {
+                fprintf(fim_tiff_log, "Failed to read strip %u\n", ss);
+                _TIFFfree(buf);
+                return 1;
+            }
+            const int64_t nrows = read / (M*bps);
+            for(int64_t rr = 0; rr < nrows; rr++)
+            {
+                const int64_t nn = (int64_t) ss*rps + rr;
+                if(nn < sN || nn >= sN + wN)
+                {
+                    continue;
+                }
+                float * out = V + (nn - sN)*wM + pp*wM*wN;
+                const uint8_t * row = buf + (rr*M + sM)*bps;
+                if(isFloat)
+                {
+                    memcpy(out, row, wM*sizeof(float));
+                } else if(BPS == 16)
+                {
+                    const uint16_t * row16 = (const uint16_t *) row;
+                    for(int64_t mm = 0; mm < wM; mm++)
+                    {
+                        out[mm] = (float) row16[mm];
+                    }
+                } else {
+                    for(int64_t mm = 0; mm < wM; mm++)
+                    {
+                        out[mm] = (float) row[mm];
                     }
                 }
             }
         }
     }
     _TIFFfree(buf);
+    return 0;
 }
 
 
@@ -537,7 +495,9 @@ float raw_file_single_max(const char * rName, const size_t N)
     return max;
 }
 
-void uint16toraw(TIFF * tfile, const char * ofile,
+/* Directory dd is written to fout[dd % nout], i.e. with nout > 1
+ * the channels of an ImageJ hyperstack end up in separate files */
+void uint16toraw(TIFF * tfile, FILE ** fout, int nout,
                  const uint32_t ssize,
                  const uint32_t ndirs,
                  const uint32_t nstrips)
@@ -546,8 +506,6 @@ void uint16toraw(TIFF * tfile, const char * ofile,
     assert(buf != NULL);
     float * wbuf = calloc(ssize/sizeof(uint16_t), sizeof(float));
     assert(wbuf != NULL);
-    FILE * fout = fopen(ofile, "wb");
-    assert(fout != NULL);
 
     for(int64_t dd=0; dd<ndirs; dd++) {
         TIFFSetDirectory(tfile, dd);
@@ -559,27 +517,21 @@ void uint16toraw(TIFF * tfile, const char * ofile,
             for(size_t ii = 0; ii < read/sizeof(uint16_t); ii++) {
                 wbuf[ii] = (float) buf[ii];
             }
-            fwrite(wbuf, read/sizeof(uint16_t)*sizeof(float), 1, fout);
+            fwrite(wbuf, read/sizeof(uint16_t)*sizeof(float), 1, fout[dd % nout]);
         }
     }
     //  printf("\n");
-    fclose(fout);
     free(wbuf);
     _TIFFfree(buf);
 }
 
-void floattoraw(TIFF * tfile, const char * ofile,
+void floattoraw(TIFF * tfile, FILE ** fout, int nout,
                 const uint32_t ssize,
                 const uint32_t ndirs,
                 const uint32_t nstrips)
 {
     float * buf = _TIFFmalloc(ssize);
     assert(buf != NULL);
-    float * wbuf = calloc(ssize/sizeof(float), sizeof(float));
-    assert(wbuf != NULL);
-    FILE * fout = fopen(ofile, "wb");
-    assert(fout != NULL);
-
 
     for(int64_t dd=0; dd<ndirs; dd++) {
         TIFFSetDirectory(tfile, dd);
@@ -587,16 +539,9 @@ void floattoraw(TIFF * tfile, const char * ofile,
             int64_t strip = kk;
             tsize_t read = TIFFReadEncodedStrip(tfile, strip, buf, (tsize_t) - 1);
             assert(read>0);
-
-            for(size_t ii = 0; ii < read/sizeof(float); ii++) {
-                wbuf[ii] = (float) buf[ii];
-            }
-            fwrite(wbuf, read, 1, fout);
-
+            fwrite(buf, read, 1, fout[dd % nout]);
         }
     }
-    fclose(fout);
-    free(wbuf);
     _TIFFfree(buf);
 }
 
@@ -604,7 +549,14 @@ void floattoraw(TIFF * tfile, const char * ofile,
 int fim_tiff_to_raw_f32(const char * fName, const char * oName)
 {
     // Convert a tif image, fName, to a raw float image, oName
+    char * oNames[1] = {(char *) oName};
+    return fim_tiff_to_raw_f32_channels(fName, 1, oNames, NULL);
+}
 
+int fim_tiff_to_raw_f32_channels(const char * fName,
+                                 int nCh, char ** oNames,
+                                 ttags * T)
+{
     TIFF * tfile = TIFFOpen(fName, "r");
 
     if(tfile == NULL) {
@@ -700,15 +652,47 @@ int fim_tiff_to_raw_f32(const char * fName, const char * oName)
         return -1;
     }
 
+    if(ndirs % nCh != 0)
+    {
+        fprintf(stderr, "%s has %u planes which is not a multiple of %d channels\n",
+                fName, ndirs, nCh);
+        TIFFClose(tfile);
+        return -1;
+    }
+
+    if(T != NULL)
+    {
+        ttags_get(tfile, T);
+        ttags_fix_ij_channels(T);
+    }
+
+    FILE ** fout = calloc(nCh, sizeof(FILE*));
+    assert(fout != NULL);
+    for(int cc = 0; cc < nCh; cc++)
+    {
+        fout[cc] = fopen(oNames[cc], "wb");
+        if(fout[cc] == NULL)
+        {
+            fprintf(stderr, "fim_tiff ERROR: Failed to open %s for writing\n",
+                    oNames[cc]);
+            exit(EXIT_FAILURE);
+        }
+    }
+
     if(isFloat)
     {
-        floattoraw(tfile, oName, ssize, ndirs, nstrips);
+        floattoraw(tfile, fout, nCh, ssize, ndirs, nstrips);
     }
     if(isUint)
     {
-        uint16toraw(tfile, oName, ssize, ndirs, nstrips);
+        uint16toraw(tfile, fout, nCh, ssize, ndirs, nstrips);
     }
 
+    for(int cc = 0; cc < nCh; cc++)
+    {
+        fclose(fout[cc]);
+    }
+    free(fout);
     TIFFClose(tfile);
 
     return 0;
@@ -741,6 +725,7 @@ fim_tiff_imwrite_u16_from_raw(
         if(ref)
         {
             ttags_get(ref, tags);
+            ttags_fix_ij_channels(tags);
             TIFFClose(ref);
         }
     }
@@ -868,6 +853,7 @@ fim_tiff_imwrite_f32_from_raw(
         if(ref)
         {
             ttags_get(ref, tags);
+            ttags_fix_ij_channels(tags);
             TIFFClose(ref);
         }
     }
@@ -964,7 +950,7 @@ int fim_tiff_write_float(const char * fName, const float * V,
                          const ttags * T,
                          int64_t N, int64_t M, int64_t P)
 {
-
+    DW_TRACE_BEGIN("tiff_write");
     if(fim_tiff_log == NULL)
     {
         fim_tiff_log = stdout;
@@ -1035,6 +1021,7 @@ int fim_tiff_write_float(const char * fName, const float * V,
     _TIFFfree(buf);
 
     TIFFClose(out);
+    DW_TRACE_END("tiff_write");
     return 0;
 }
 
@@ -1062,6 +1049,7 @@ int fim_tiff_write_opt(const char * fName, const float * V,
     {
         return EXIT_FAILURE;
     }
+    DW_TRACE_BEGIN("tiff_write");
 
     if(fim_tiff_log == NULL)
     {
@@ -1169,6 +1157,7 @@ int fim_tiff_write_opt(const char * fName, const float * V,
     _TIFFfree(buf);
 
     TIFFClose(out);
+    DW_TRACE_END("tiff_write");
     return 0;
 }
 
@@ -1187,8 +1176,8 @@ int fim_tiff_get_size(const char * fname,
     ok *= TIFFGetField(tiff, TIFFTAG_IMAGELENGTH, &n);
     if(ok != 1)
     {
-        return -1;
         TIFFClose(tiff);
+        return -1;
     }
 
     p = TIFFNumberOfDirectories(tiff);
@@ -1208,10 +1197,13 @@ float * fim_tiff_read(const char * fName,
         fim_tiff_log = stdout;
     }
 
-    return fim_tiff_read_sub(fName, T, N0, M0, P0, verbosity,
-                             0, // sub disabled
-                             0,0,0, // start
-                             0,0,0); // width
+    DW_TRACE_BEGIN("tiff_read");
+    float * V = fim_tiff_read_sub(fName, T, N0, M0, P0, verbosity,
+                                  0, // sub disabled
+                                  0,0,0, // start
+                                  0,0,0); // width
+    DW_TRACE_END("tiff_read");
+    return V;
 }
 
 
@@ -1374,6 +1366,82 @@ void ttags_fix_ij_3d_to_2d(ttags * T)
     return;
 }
 
+/* Number of channels according to the ImageJ metadata, i.e.
+ * 'channels=' in the image description. 1 if not specified. */
+int ttags_get_channels(const ttags * T)
+{
+    if(T->imagedescription == NULL)
+    {
+        return 1;
+    }
+    if(strstr(T->imagedescription, "ImageJ=") == NULL)
+    {
+        return 1;
+    }
+    const char * ch = strstr(T->imagedescription, "channels=");
+    if(ch == NULL)
+    {
+        return 1;
+    }
+    int nch = atoi(ch + strlen("channels="));
+    return nch > 0 ? nch : 1;
+}
+
+/* Use when the tags of a multi-channel ImageJ hyperstack are to be
+ * written to an image with a single channel */
+void ttags_fix_ij_channels(ttags * T)
+{
+    if(ttags_get_channels(T) == 1)
+    {
+        return;
+    }
+
+    char * old = T->imagedescription;
+    char * new = calloc(strlen(T->imagedescription) + 1, 1);
+    assert(new != NULL);
+    char * write = new;
+
+    const char * drop[] = {"images=", "slices=", "channels=",
+                           "hyperstack=", "mode=", NULL};
+    strline_buff B = {0};
+    char * line = NULL;
+    while( (line = strline(old, &B)) )
+    {
+        int use = 1;
+        for(int kk = 0; drop[kk] != NULL; kk++)
+        {
+            if(strncmp(line, drop[kk], strlen(drop[kk])) == 0)
+            {
+                use = 0;
+            }
+        }
+        if(use)
+        {
+            sprintf(write, "%s\n", line);
+            write = write + strlen(write);
+        }
+    }
+
+    free(T->imagedescription);
+    T->imagedescription = new;
+    return;
+}
+
+int fim_tiff_get_channels(const char * fname)
+{
+    TIFF * tiff = TIFFOpen(fname, "r");
+    if(tiff == NULL)
+    {
+        return -1;
+    }
+    ttags * T = ttags_new();
+    ttags_get(tiff, T);
+    TIFFClose(tiff);
+    int nch = ttags_get_channels(T);
+    ttags_free(&T);
+    return nch;
+}
+
 void ttags_free(ttags ** Tp)
 {
     if(Tp == NULL)
@@ -1697,53 +1765,44 @@ float * fim_tiff_read_sub(const char * fName,
     V = fim_malloc(nel*sizeof(float));
     memset(V, 0, nel*sizeof(float));
 
-    if(isFloat)
+    if(subregion)
     {
-        if(verbosity > 1)
+        if(sM < 0 || sN < 0 || sP < 0
+           || sM + wM > M || sN + wN > N || sP + wP > P)
         {
-            fprintf(fim_tiff_log, "ReadFloat ...\n");
+            fprintf(fim_tiff_log, "fim_tiff: The sub region is outside of the image\n");
+            TIFFClose(tfile);
+            fim_free(V);
+            return NULL;
         }
-        if(subregion)
+        if(readSub(tfile, V, BPS, isFloat, M, N,
+                   sM, sN, sP, wM, wN, wP))
         {
-            perror("readFloat_sub is not implemented.\n");
-            exit(EXIT_FAILURE);
-            //readFloat_sub(tfile, V, ssize, ndirs, nstrips, M*N,
-            //sM, sN, sP, wM, wN, wP);
-        } else {
-            readFloat(tfile, V, ssize, ndirs, nstrips, M*N);
+            TIFFClose(tfile);
+            fim_free(V);
+            return NULL;
         }
-    }
-    if(isUint)
-    {
-        if(verbosity > 1)
+    } else {
+        if(isFloat)
         {
-            fprintf(fim_tiff_log, "ReadUint ...\n");
+            if(verbosity > 1)
+            {
+                fprintf(fim_tiff_log, "ReadFloat ...\n");
+            }
+            readFloat(tfile, V, ssize, ndirs, nstrips, M*N);
         }
-        if(BPS == 16)
+        if(isUint)
         {
-            if(subregion)
+            if(verbosity > 1)
+            {
+                fprintf(fim_tiff_log, "ReadUint ...\n");
+            }
+            if(BPS == 16)
             {
-                fprintf(fim_tiff_log, "%" PRId64 " %" PRId64 " %" PRId64 ", %"
-                        PRId64 " %" PRId64 " %" PRId64 ", %" PRId64 " %"
-                        PRId64 " %" PRId64 "\n",
-                        M, N, P, sM, sN, sP, wM, wN, wP);
-                readUint16_sub(tfile, V, ssize, ndirs, nstrips, M*N,
-                               M, N, (int) P, sM, sN, sP, wM, wN, wP);
-            } else {
                 readUint16(tfile, V, ssize, ndirs, nstrips, M*N);
             }
-        }
-        if(BPS == 8)
-        {
-            if(subregion)
+            if(BPS == 8)
             {
-                fprintf(fim_tiff_log, "%" PRId64 " %" PRId64 " %" PRId64 ", %"
-                        PRId64 " %" PRId64 " %" PRId64 ", %" PRId64 " %"
-                        PRId64 " %" PRId64 "\n",
-                        M, N, P, sM, sN, sP, wM, wN, wP);
-                readUint8_sub(tfile, V, ssize, ndirs, nstrips, M*N,
-                              M, N, (int) P, sM, sN, sP, wM, wN, wP);
-            } else {
                 readUint8(tfile, V, ssize, ndirs, nstrips, M*N);
             }
         }
@@ -1757,7 +1816,7 @@ float * fim_tiff_read_sub(const char * fName,
 
     if(inverted == 1)
     {
-        fim_invert(V, M*N*P);
+        fim_invert(V, nel);
     }
 
     return V;
@@ -169,6 +169,17 @@ int
 fim_tiff_to_raw_f32(const char *tif_file_name,
                 const char * output_file_name);
 
+/** @brief Split a multi-channel ImageJ hyperstack into raw float
+ * images, one per channel.
+ * The channels are assumed to be interleaved, i.e. plane z of
+ * channel c is stored in directory z*nCh + c.
+ * @param[out] T tiff tags for a single channel are written to T. Ignored if NULL.
+ */
+int
+fim_tiff_to_raw_f32_channels(const char * tif_file_name,
+                             int nCh, char ** output_file_names,
+                             ttags * T);
+
 /* @brief Read a 3D tif stack as a float array
  * @param fName file name
  * @param verbosity how verbose the function should be
@@ -210,6 +221,18 @@ void fim_tiff_ut();
 int fim_tiff_get_size(const char * fname,
                       int64_t * M, int64_t * N, int64_t * P);
 
+/** @brief Number of channels of an ImageJ hyperstack
+ * @return 1 if not specified in the metadata, -1 if the file can't be read
+ */
+int fim_tiff_get_channels(const char * fname);
+
+/** @brief Number of channels according to the ImageJ metadata */
+int ttags_get_channels(const ttags * T);
+
+/** @brief Remove the hyperstack information from the ImageJ metadata
+ * so that the tags can be used for a single channel */
+void ttags_fix_ij_channels(ttags * T);
+
 /** @brief Max projection from input to output file
  * Not loading the full images into memory.
  * The output file will have the same sample format as the input image.
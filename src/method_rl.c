@@ -16,47 +16,105 @@
 
 #include "method_rl.h"
 
+/* Fused version of getError followed by y = im/y in the image
+ * domain and y = 1e-6 in the padded region. Where y is not
+ * positive it is set to bg and y_has_zero is set.
+ * Returns the error, estimated from the rows selected by
+ * dw_error_row(row, sample), or 0 if sample is 0. */
+static float rl_ratio_error(float * restrict y, const float * restrict im,
+                            const int64_t M, const int64_t N, const int64_t P,
+                            const int64_t wM, const int64_t wN, const int64_t wP,
+                            const dw_metric metric, const float bg,
+                            const float sample, int * y_has_zero)
+{
+    const float pad = 1e-6;
+    double err = 0;
+    int64_t nrows = 0; /* Rows used for the error */
+    int has_zero = 0;
+#pragma omp parallel for reduction(+: err, nrows) reduction(||: has_zero) shared(y, im)
+    for(int64_t cc = 0; cc < wP; cc++)
+    {
+        float * yplane = y + cc*wM*wN;
+        if(cc >= P)
+        {
+            for(int64_t kk = 0; kk < wM*wN; kk++)
+            {
+                yplane[kk] = pad;
+            }
+            continue;
+        }
+        for(int64_t bb = 0; bb < N; bb++)
+        {
+            float * restrict yrow = yplane + bb*wM;
+            const float * restrict imrow = im + bb*M + cc*M*N;
+            /* The row is still in cache for the second loop */
+            if(sample == 0 || !dw_error_row(bb + cc*N, sample))
+            {
+                /* Not used for the error */
+            } else if(metric == DW_METRIC_MSE)
+            {
+                nrows++;
+                for(int64_t aa = 0; aa < M; aa++)
+                {
+                    double d = yrow[aa] - imrow[aa];
+                    err += d*d;
+                }
+            } else {
+                nrows++;
+                err += fim_simd_idiv_row(yrow, imrow, M);
+            }
+            for(int64_t aa = 0; aa < M; aa++)
+            {
+                if(yrow[aa] > 0)
+                {
+                    yrow[aa] = imrow[aa]/yrow[aa];
+                } else {
+                    has_zero = 1;
+                    yrow[aa] = bg;
+                }
+            }
+            for(int64_t aa = M; aa < wM; aa++)
+            {
+                yrow[aa] = pad;
+            }
+        }
+        for(int64_t kk = N*wM; kk < wM*wN; kk++)
+        {
+            yplane[kk] = pad;
+        }
+    }
+    y_has_zero[0] = has_zero;
+    if(nrows == 0)
+    {
+        return 0;
+    }
+    return (float) (err / (double) (nrows*M));
+}
+
 /* One RL iteration */
 float iter_rl(
               float ** xp, // Output, f_(t+1) xkp1
               const float * restrict im, // Input image
-              fftwf_complex * restrict fftPSF,
+              const dw_otf_t * otf, // fft(psf)
               float * restrict f, // Current guess, xk
               float * restrict W, // Bertero Weights
               const int64_t wM, const int64_t wN, const int64_t wP, // expanded size
               const int64_t M, const int64_t N, const int64_t P, // input image size
+              const float err_sample, // See rl_ratio_error, 0: no error
               __attribute__((unused)) const dw_opts * s)
 {
     const size_t wMNP = wM*wN*wP;
+    DW_TRACE_BEGIN("iter_rl");
 
     fftwf_complex * F = fft(f, wM, wN, wP); /* FFT#1 */
     putdot(s);
-    float * y = fft_convolve_cc_f2(fftPSF, F, wM, wN, wP); /* FFT#2 */
+    float * y = dw_otf_convolve(otf, F); /* FFT#2 */
     putdot(s);
-    float error = getError(y, im, M, N, P, wM, wN, wP, s->metric);
-
     int y_has_zero = 0;
-#pragma omp parallel for shared(im, y)
-    for(size_t cc = 0; cc < (size_t) wP; cc++){
-        for(size_t bb = 0; bb < (size_t) wN; bb++){
-            for(size_t aa = 0; aa < (size_t) wM; aa++){
-                size_t yidx = aa + bb*wM + cc*wM*wN;
-                size_t imidx = aa + bb*M + cc*M*N;
-                if(aa < (size_t) M && bb < (size_t) N && cc < (size_t) P)
-                {
-                    if(y[yidx] > 0)
-                    {
-                        y[yidx] = im[imidx]/y[yidx];
-                    } else {
-                        y_has_zero = 1;
-                        y[yidx] = s->bg;
-                    }
-                } else {
-                    y[yidx]=1e-6;
-                }
-            }
-        }
-    }
+    DW_TRACE_BEGIN("rl_ratio_error");
+    float error = rl_ratio_error(y, im, M, N, P, wM, wN, wP,
+                                 s->metric, s->bg, err_sample, &y_has_zero);
+    DW_TRACE_END("rl_ratio_error");
 
     if(y_has_zero == 1)
     {
@@ -70,26 +128,33 @@ float iter_rl(
     fftwf_complex * F_sn = fft_and_free(y, wM, wN, wP); /* FFT#3 */
 
     putdot(s);
-    float * x = fft_convolve_cc_conj_f2(fftPSF, F_sn, wM, wN, wP); /* FFT#4 */
+    float * x = dw_otf_convolve_conj(otf, F_sn); /* FFT#4 */
     putdot(s);
 
-    /* Eq. 18 in Bertero */
+    /* Eq. 18 in Bertero. The lower bound, if used, is applied in
+     * the same pass */
+    const float bg = s->bg > 0 ? s->bg : -INFINITY;
+    DW_TRACE_BEGIN("rl_update");
     if(W != NULL)
     {
 #pragma omp parallel for shared(x,f,W)
         for(size_t cc = 0; cc<wMNP; cc++)
         {
-            x[cc] *= f[cc]*W[cc];
+            float v = x[cc]*f[cc]*W[cc];
+            x[cc] = v < bg ? bg : v;
         }
     } else {
 #pragma omp parallel for shared(x,f)
         for(size_t cc = 0; cc<wMNP; cc++)
         {
-            x[cc] *= f[cc];
+            float v = x[cc]*f[cc];
+            x[cc] = v < bg ? bg : v;
         }
     }
+    DW_TRACE_END("rl_update");
 
     xp[0] = x;
+    DW_TRACE_END("iter_rl");
     return error;
 }
 
@@ -133,28 +198,12 @@ float * deconvolve_rl(float * restrict im, const int64_t M, const int64_t N, con
         }
     }
 
-
     /* This is the 'work dimensions', i.e., dimensions
      * that will be used for all FFTs
      */
 
-    int64_t wM = M + pM -1;
-    int64_t wN = N + pN -1;
-    int64_t wP = P + pP -1;
-
-    if(s->borderQuality == 1)
-    {
-        wM = M + (pM+1)/2;
-        wN = N + (pN+1)/2;
-        wP = P + (pP+1)/2;
-    }
-
-    if(s->borderQuality == 0)
-    {
-        wM = int64_t_max(M, pM);
-        wN = int64_t_max(N, pN);
-        wP = int64_t_max(P, pP);
-    }
+    int64_t wM = 0, wN = 0, wP = 0;
+    dw_job_size(s, M, N, P, pM, pN, pP, &wM, &wN, &wP);
 
     if(wP % 2 == 1) /* Todo: check if prime instead */
     {
@@ -183,7 +232,8 @@ float * deconvolve_rl(float * restrict im, const int64_t M, const int64_t N, con
     }
     if(s->verbosity > 1)
     {
-        printf("TODO: Estimated peak memory usage: %.1f GB\n", wMNP*35.0/1e9);
+        printf("Estimated peak memory usage: %.1f GB\n",
+               dw_estimate_memory(s, M, N, P, pM, pN, pP)/1e9);
     }
     fprintf(s->log, "image: [%" PRId64 "x%" PRId64 "x%" PRId64 "]\n"
             "psf: [%" PRId64 "x%" PRId64 "x%" PRId64 "]\n"
@@ -191,73 +241,44 @@ float * deconvolve_rl(float * restrict im, const int64_t M, const int64_t N, con
             M, N, P, pM, pN, pP, wM, wN, wP, wMNP);
     fflush(s->log);
 
-    fft_train(wM, wN, wP,
-              s->verbosity, s->nThreads_FFT,
-              s->log);
-
-    if(s->verbosity > 0)
+    /* See --checkpoint and --resume. The state is only xp. */
+    uint64_t ckpt_key = 0;
+    dw_checkpoint_t ckpt;
+    int resumed = 0;
+    if(dw_checkpoint_enabled(s) || s->resume)
     {
-        printf("Iterating "); fflush(stdout);
+        ckpt_key = dw_checkpoint_key(s, im, M, N, P, psf, pM, pN, pP);
     }
-
-    /* 1. Expand the PSF to the job size,
-     *    transform it and free the original allocation
-     */
-    float * Z = fim_malloc(wMNP*sizeof(float));
-    memset(Z, 0, wMNP*sizeof(float));
-    /* Insert the psf into the bigger Z */
-    fim_insert(Z, wM, wN, wP,
-               psf, pM, pN, pP);
-    fim_free(psf);
-
-    /* Shift the PSF so that the mid is at (0,0,0) */
-    int64_t midM, midN, midP = -1;
-    fim_argmax(Z, wM, wN, wP, &midM, &midN, &midP);
-    //printf("max(PSF) = %f\n", fim_max(Z, wM*wN*wP));
-    //printf("PSF(%ld, %ld, %ld) = %f\n", midM, midN, midP, Z[midM + wM*midN + wM*wN*midP]);
-    fim_circshift(Z, wM, wN, wP, -midM, -midN, -midP);
-    if(Z[0] != fim_max(Z, wM*wN*wP))
+    if(s->resume)
     {
-        printf("Something went wrong here, the max of the PSF is in the wrong place\n");
-        exit(1);
+        resumed = dw_checkpoint_probe(s, ckpt_key, wM, wN, wP, 1, &ckpt) == 0;
     }
 
-    if(s->fulldump)
+    /* Has to be done before the plans for the job size are
+     * created */
+    float * x0 = NULL;
+    if(s->start_condition == DW_START_PYRAMID && !resumed)
     {
-        printf("Dumping to fullPSF.tif\n");
-        fim_tiff_write_float("fulldump_PSF.tif", Z, NULL, wM, wN, wP);
+        x0 = dw_pyramid_start(im, M, N, P, psf, pM, pN, pP, s);
     }
 
-    fftwf_complex * fftPSF = fft_and_free(Z, wM, wN, wP);
-
-    putdot(s);
-
+    fft_train(wM, wN, wP,
+              s->verbosity, s->nThreads_FFT,
+              s->log);
 
-    /* Step 2. Create the Weight map for Bertero boundary handling  */
-    float * W = NULL;
-    if(s->borderQuality > 0)
+    if(s->verbosity > 0)
     {
-        /* F_one is 1 over the image domain */
-        fftwf_complex * F_one = initial_guess(M, N, P, wM, wN, wP);
-        /* Bertero, Eq. 15 */
-        W = fft_convolve_cc_conj_f2(fftPSF, F_one, wM, wN, wP);
-        F_one = NULL; /* Freed by the call above */
-
-        /* Sigma in Bertero's paper, introduced for Eq. 17 */
-        float sigma = 0.01; // Until 2021.11.25 used 0.001
-#pragma omp parallel for shared(W)
-        for(size_t kk = 0; kk<wMNP; kk++)
-        {
-            if(W[kk] > sigma)
-            {
-                W[kk] = 1.0/W[kk];
-            } else {
-                W[kk] = 0;
-            }
-        }
-
+        printf("Iterating "); fflush(stdout);
     }
 
+    /* 1. Expand the PSF to the job size and transform it,
+     * 2. Create the Weight map for Bertero boundary handling.
+     * Both are shared between tiles when s->otf_cache is set.
+     */
+    dw_otf_t * otf = dw_otf_get(s, psf, pM, pN, pP,
+                                M, N, P, wM, wN, wP);
+    fim_free(psf);
+    float * W = otf->W;
 
     putdot(s);
 
@@ -266,20 +287,25 @@ float * deconvolve_rl(float * restrict im, const int64_t M, const int64_t N, con
 
     float * xp = NULL; /* Initial guess */
 
-    if(s->start_condition == DW_START_FLAT)
+    if(resumed)
+    {
+        xp = fim_malloc(wMNP*sizeof(float));
+        if(dw_checkpoint_read(s, &ckpt, xp, NULL, NULL))
+        {
+            fprintf(stderr, "ERROR: Failed to read the checkpoint\n");
+            exit(EXIT_FAILURE);
+        }
+        s->bg = ckpt.bg;
+    } else if(s->start_condition == DW_START_FLAT)
     {
         float sumg = fim_sum(im, M*N*P);
         xp = fim_constant(wMNP, sumg/wMNP);
-    }
-
-    if(s->start_condition == DW_START_IDENTITY)
+    } else if(s->start_condition == DW_START_IDENTITY)
     {
         xp = fim_malloc(wMNP*sizeof(float));
         fim_insert(xp, wM, wN, wP,
                    im, M, N, P);
-    }
-
-    if(s->start_condition == DW_START_LP)
+    } else if(s->start_condition == DW_START_LP)
     {
         xp = fim_malloc(wMNP*sizeof(float));
         float * im_lp = fim_copy(im, M*N*P);
@@ -287,6 +313,14 @@ float * deconvolve_rl(float * restrict im, const int64_t M, const int64_t N, con
         fim_insert(xp, wM, wN, wP,
                    im_lp, M, N, P);
         fim_free(im_lp);
+    } else if(s->start_condition == DW_START_PYRAMID)
+    {
+        /* Flat outside of the image */
+        float sumg = fim_sum(im, M*N*P);
+        xp = fim_constant(wMNP, sumg/wMNP);
+        fim_insert(xp, wM, wN, wP,
+                   x0, M, N, P);
+        fim_free(x0);
     }
 
 
@@ -298,13 +332,22 @@ float * deconvolve_rl(float * restrict im, const int64_t M, const int64_t N, con
      *  im:      input image,
      *  psf:     input psf, freed at this point.
      * New arrays:
-     *  fftPSF: FFT of the expanded PSF
+     *  otf:    FFT of the expanded PSF
      *  W:      Weights for Bertero's method. Poissibly NULL
      *  xp:     initial guess, i.e. x^{k+1}
      * x: current guess (=NULL)
      */
 
     dw_iterator_t * it = dw_iterator_new(s);
+    if(resumed)
+    {
+        dw_iterator_resume(it, ckpt.iter, ckpt.error, ckpt.lasterror);
+    }
+    struct timespec ckpt_last;
+    dw_gettime(&ckpt_last);
+    dw_accel_t * accel = dw_accel_new(s, wMNP,
+                                      s->bg > 0 ? s->bg : -INFINITY);
+
     while(dw_iterator_next(it) >= 0)
     {
 
@@ -333,53 +376,67 @@ float * deconvolve_rl(float * restrict im, const int64_t M, const int64_t N, con
 
         putdot(s);
 
+        const int need_error = dw_iterator_need_error(it);
         double err = iter_rl(
                              &x, // xp is updated to the next guess
                              im,
-                             fftPSF,
+                             otf,
                              xp, // Current guess
                              W, // Weights (to handle boundaries)
                              wM, wN, wP, // Expanded size
                              M, N, P, // Original size
+                             need_error ? s->error_sample : 0,
                              s);
+        dw_accel_apply(accel, x, xp, err, need_error);
         fim_free(xp);
 
-        dw_iterator_set_error(it, err);
+        if(need_error)
+        {
+            dw_iterator_set_error(it, err);
+        }
         xp = x;
 
         putdot(s);
 
         dw_iterator_show(it, s);
+        /* x >= s->bg is enforced by iter_rl */
 
-        if(s->bg > 0)
+        benchmark_write(s, it->iter, err, x, M, N, P, wM, wN, wP);
+
+        if(dw_checkpoint_enabled(s)
+           && dw_checkpoint_due(s, it->iter+1, &ckpt_last))
         {
-#pragma omp parallel for shared(x)
-            for(size_t kk = 0; kk<wMNP; kk++)
-            {
-                if(x[kk] < s->bg)
-                {
-                    x[kk] = s->bg;
-                }
-            }
+            dw_checkpoint_t C = dw_checkpoint_header(ckpt_key, wM, wN, wP, 1);
+            C.iter = it->iter+1;
+            C.error = it->error;
+            C.lasterror = it->lasterror;
+            C.bg = s->bg;
+            dw_checkpoint_write(s, &C, x, NULL, NULL);
         }
 
-        benchmark_write(s, it->iter, err, x, M, N, P, wM, wN, wP);
-
     } /* End of main loop */
+    dw_accel_fprint(s->log, accel);
+    dw_accel_free(accel);
 
+    if(dw_checkpoint_enabled(s) || resumed)
+    {
+        dw_checkpoint_remove(s);
+    }
 
-    if(s->verbosity > 0) {
-        printf("\n");
+    if(x == NULL)
+    {
+        /* Resumed from a checkpoint with all iterations done */
+        x = xp;
     }
 
 
-    if(W != NULL)
-    {
-        fim_free(W);
+    if(s->verbosity > 0) {
+        printf("\n");
     }
 
+
     fulldump(s, x, wM, wN, wP, "fulldump_x.tif");
-    fim_free(fftPSF);
+    dw_otf_release(s, otf);
 
     /* Extract the observed region from the last iteration */
     float * out = fim_subregion(x, wM, wN, wP, M, N, P);
@@ -56,28 +56,12 @@ float * deconvolve_shb(float * restrict im,
         }
     }
 
-
     /* This is the work dimensions, i.e., dimensions
      * that will be used for all FFTs
      */
 
-    int64_t wM = M + pM -1;
-    int64_t wN = N + pN -1;
-    int64_t wP = P + pP -1;
-
-    if(s->borderQuality == 1)
-    {
-        wM = M + (pM+1)/2;
-        wN = N + (pN+1)/2;
-        wP = P + (pP+1)/2;
-    }
-
-    if(s->borderQuality == 0)
-    {
-        wM = int64_t_max(M, pM);
-        wN = int64_t_max(N, pN);
-        wP = int64_t_max(P, pP);
-    }
+    int64_t wM = 0, wN = 0, wP = 0;
+    dw_job_size(s, M, N, P, pM, pN, pP, &wM, &wN, &wP);
 
     /* Total number of pixels */
     size_t wMNP = wM*wN*wP;
@@ -91,7 +75,8 @@ float * deconvolve_shb(float * restrict im,
     }
     if(s->verbosity > 1)
     {
-        printf("Estimated peak memory usage: %.1f GB\n", wMNP*35.0/1e9);
+        printf("Estimated peak memory usage: %.1f GB\n",
+               dw_estimate_memory(s, M, N, P, pM, pN, pP)/1e9);
     }
     fprintf(s->log, "image: [%" PRId64 "x%" PRId64 "x%" PRId64 "]\n"
             "psf: [%" PRId64 "x%" PRId64 "x%" PRId64 "]\n"
@@ -99,6 +84,27 @@ float * deconvolve_shb(float * restrict im,
             M, N, P, pM, pN, pP, wM, wN, wP, wMNP);
     fflush(s->log);
 
+    /* See --checkpoint and --resume. The state is x and xp. */
+    uint64_t ckpt_key = 0;
+    dw_checkpoint_t ckpt;
+    int resumed = 0;
+    if(dw_checkpoint_enabled(s) || s->resume)
+    {
+        ckpt_key = dw_checkpoint_key(s, im, M, N, P, psf, pM, pN, pP);
+    }
+    if(s->resume)
+    {
+        resumed = dw_checkpoint_probe(s, ckpt_key, wM, wN, wP, 2, &ckpt) == 0;
+    }
+
+    /* Has to be done before the plans for the job size are
+     * created */
+    float * x0 = NULL;
+    if(s->start_condition == DW_START_PYRAMID && !resumed)
+    {
+        x0 = dw_pyramid_start(im, M, N, P, psf, pM, pN, pP, s);
+    }
+
     //myfftw_stop(); nope that was not the problem
     //myfftw_start(s->nThreads_FFT, s->verbosity, s->log);
     fft_train(wM, wN, wP,
@@ -110,75 +116,35 @@ float * deconvolve_shb(float * restrict im,
         printf("Iterating "); fflush(stdout);
     }
 
-    // cK : "full size" fft of the PSF
-    float * Z = fim_malloc(wMNP*sizeof(float));
-    memset(Z, 0, wMNP*sizeof(float));
-    /* Insert the psf into the bigger Z */
-    fim_insert(Z, wM, wN, wP,
-               psf, pM, pN, pP);
-
+    /* otf : "full size" fft of the PSF
+     * W : Bertero weights, NULL when borderQuality == 0 */
+    dw_otf_t * otf = dw_otf_get(s, psf, pM, pN, pP,
+                                M, N, P, wM, wN, wP);
     fim_free(psf);
-
-    /* Shift the PSF so that the mid is at (0,0,0) */
-    int64_t midM, midN, midP = -1;
-    fim_argmax(Z, wM, wN, wP, &midM, &midN, &midP);
-    //printf("max(PSF) = %f\n", fim_max(Z, wM*wN*wP));
-    //printf("PSF(%ld, %ld, %ld) = %f\n", midM, midN, midP, Z[midM + wM*midN + wM*wN*midP]);
-    fim_circshift(Z, wM, wN, wP, -midM, -midN, -midP);
-    if(Z[0] != fim_max(Z, wM*wN*wP))
+    float * W = otf->W;
+
+    /* Reduced precision storage, see --storage. The input image is
+     * still kept by the caller but only the copy is read by
+     * iter_shb. With --storage-momentum, xp is replaced by the
+     * difference to x, see below. */
+    fim_half * imh = NULL;
+    fim_half * dh = NULL;
+    shb_lowp lowp = {NULL, NULL, NULL};
+    shb_lowp * lp = NULL;
+    if(s->storage != FIM_FP32)
     {
-        printf("Something went wrong here, the max of the PSF is in the wrong place\n");
-        exit(1);
-    }
-
-    if(s->fulldump)
-    {
-        printf("Dumping to fullPSF.tif\n");
-        fim_tiff_write_float("fullPSF.tif", Z, NULL, wM, wN, wP);
-    }
-
-    here();
-    fftwf_complex * cK = fft_and_free(Z, wM, wN, wP);
-    here();
-    putdot(s);
-
-    float * W = NULL;
-    /* Sigma in Bertero's paper, introduced for Eq. 17 */
-    if(s->borderQuality > 0)
-    {
-        fftwf_complex * F_one = initial_guess(M, N, P, wM, wN, wP);
-        here();
-        float * P1 = fft_convolve_cc_conj_f2(cK, F_one, wM, wN, wP);
-        here();
-        float sigma = 0.01; // Until 2021.11.25 used 0.001
-#pragma omp parallel for shared(P1)
-        for(size_t kk = 0; kk<wMNP; kk++)
-        {
-            if(P1[kk] > sigma)
-            {
-                P1[kk] = 1.0/P1[kk];
-            } else {
-                P1[kk] = 0;
-            }
-        }
-        W = P1;
-        if(0){
-        printf("\n\nTesting\n\n");
-        for(size_t kk = 0; kk<wMNP; kk++)
+        imh = fim_half_from_float(im, M*N*P, s->storage);
+        if(s->storage_momentum)
         {
-            P1[kk] = 0;
-        }
-        for(int mm = 0; mm<M; mm++)
-        {
-            for(int nn = 0; nn<N; nn++)
-            {
-                for(int pp = 0; pp<P; pp++)
-                {
-                    P1[mm + wM*nn + wM*wN*pp] = 1;
-                }
-            }
-        }
+            /* The differences are at most of the size of the image */
+            dh = fim_half_new(wMNP, s->storage,
+                              fim_half_scale_for(fim_max(im, M*N*P),
+                                                 s->storage));
         }
+        lowp.im = imh;
+        lowp.W = otf->hW;
+        lowp.d = dh;
+        lp = &lowp;
     }
 
     float sumg = fim_sum(im, M*N*P);
@@ -190,21 +156,28 @@ float * deconvolve_shb(float * restrict im,
     float * x = NULL;
     float * xp = NULL;
 
-    if(s->start_condition == DW_START_FLAT)
+    if(resumed)
+    {
+        x = fim_malloc(wMNP*sizeof(float));
+        xp = fim_malloc(wMNP*sizeof(float));
+        /* With dh, x - xp goes directly there */
+        if(dw_checkpoint_read(s, &ckpt, x, dh == NULL ? xp : NULL, dh))
+        {
+            fprintf(stderr, "ERROR: Failed to read the checkpoint\n");
+            exit(EXIT_FAILURE);
+        }
+        s->bg = ckpt.bg;
+    } else if(s->start_condition == DW_START_FLAT)
     {
          x = fim_constant(wMNP, sumg/wMNP);
          xp = fim_copy(x, wMNP);
-    }
-
-    if(s->start_condition == DW_START_IDENTITY)
+    } else if(s->start_condition == DW_START_IDENTITY)
     {
         x = fim_malloc(wMNP*sizeof(float));
         fim_insert(x, wM, wN, wP,
                    im, M, N, P);
         xp = fim_copy(x, wMNP);
-    }
-
-    if(s->start_condition == DW_START_LP)
+    } else if(s->start_condition == DW_START_LP)
     {
         x = fim_malloc(wMNP*sizeof(float));
         float * im_lp = fim_copy(im, M*N*P);
@@ -213,6 +186,14 @@ float * deconvolve_shb(float * restrict im,
                    im_lp, M, N, P);
         xp = fim_copy(x, wMNP);
         fim_free(im_lp);
+    } else if(s->start_condition == DW_START_PYRAMID)
+    {
+        /* Flat outside of the image */
+        x = fim_constant(wMNP, sumg/wMNP);
+        fim_insert(x, wM, wN, wP,
+                   x0, M, N, P);
+        xp = fim_copy(x, wMNP);
+        fim_free(x0);
     }
 
 
@@ -220,8 +201,25 @@ float * deconvolve_shb(float * restrict im,
     assert(x != NULL);
     assert(xp != NULL);
 
+    if(dh != NULL)
+    {
+        /* x - xp = 0 is already in dh, or read from the checkpoint */
+        fim_free(xp);
+        xp = NULL;
+    }
+
 
     dw_iterator_t * it = dw_iterator_new(s);
+    if(resumed)
+    {
+        dw_iterator_resume(it, ckpt.iter, ckpt.error, ckpt.lasterror);
+    }
+    struct timespec ckpt_last;
+    dw_gettime(&ckpt_last);
+    /* With --accel the momentum is replaced by the extrapolation */
+    dw_accel_t * accel = dw_accel_new(s, wMNP,
+                                      s->positivity ? s->bg : -INFINITY);
+
     while(dw_iterator_next(it) >= 0)
     {
         here();
@@ -247,73 +245,119 @@ float * deconvolve_shb(float * restrict im,
             }
         }
 
-        //float * p = fim_copy(x, wMNP);
-        float * p = xp; /* We don't need xp more */
-
         /* Eq. 10 in SHB paper */
         double alpha = ((float) it->iter-1.0)/((float) it->iter+2.0);
         alpha < 0 ? alpha = 0: 0;
         alpha > s->alphamax ? alpha = s->alphamax : 0;
+        accel != NULL ? alpha = 0 : 0;
 
+        //float * p = fim_copy(x, wMNP);
+        float * p = xp; /* We don't need xp more */
 
-#pragma omp parallel for shared(p, x, xp)
-            /* To be interpreted as p^k in Eq. 7 of SHB */
+        DW_TRACE_BEGIN("shb_momentum");
+        if(dh != NULL)
+        {
+            /* p is written over x. The step p - x is kept in dh so
+             * that iter_shb can get x back when it updates dh. */
+            p = x;
+            x = NULL;
+#pragma omp parallel for shared(p, dh)
             for(size_t kk = 0; kk<wMNP; kk++)
             {
-                p[kk] = x[kk] + alpha*(x[kk]-xp[kk]);
-                p[kk] < s->bg ? p[kk] = s->bg : 0; // TODO
+                float xk = p[kk];
+                float v = xk + alpha*fim_half_get(dh, kk);
+                v < s->bg ? v = s->bg : 0;
+                p[kk] = v;
+                fim_half_set(dh, kk, v - xk);
             }
+        } else {
+            /* To be interpreted as p^k in Eq. 7 of SHB. p is xp, that
+             * is fine since the update is elementwise. */
+            fim_simd_momentum(p, x, xp, (float) alpha, s->bg, wMNP);
+        }
+        DW_TRACE_END("shb_momentum");
 
 
         putdot(s);
 
+        const int need_error = dw_iterator_need_error(it);
         double err = iter_shb(
             &xp, // xp is updated to the next guess
             im,
-            cK, // FFT of PSF
+            otf, // FFT of PSF
             p, // Current guess
             //p,
             W, // Weights (to handle boundaries)
             wM, wN, wP, // Expanded size
             M, N, P, // Original size
+            lp,
+            need_error ? s->error_sample : 0,
             s);
         here();
 	//        free(p); // free'ed in iter_shb
         here();
-        dw_iterator_set_error(it, err);
-        if(1){
+        if(need_error)
+        {
+            dw_iterator_set_error(it, err);
+        }
+        if(dh != NULL)
+        {
+            x = xp;
+            xp = NULL;
+        } else {
             /* Swap so that the current is named x */
             float * t = x;
             x = xp;
             xp = t;
+            /* Without momentum xp was also the input */
+            dw_accel_apply(accel, x, xp, err, need_error);
         }
         //free(p);
-        /* Enforce a priori information about the lowest possible value */
-        if(s->positivity)
-        {
-#pragma omp parallel for shared(x)
-            for(size_t kk = 0; kk<wMNP; kk++)
-            {
-                if(x[kk] < s->bg)
-                {
-                    x[kk] = s->bg;
-                }
-            }
-        }
+        /* The a priori information about the lowest possible value,
+         * s->bg, is enforced by iter_shb */
         here();
         putdot(s);
         dw_iterator_show(it, s);
         benchmark_write(s, it->iter, it->error, x, M, N, P, wM, wN, wP);
 
+        if(dw_checkpoint_enabled(s)
+           && dw_checkpoint_due(s, it->iter+1, &ckpt_last))
+        {
+            dw_checkpoint_t C = dw_checkpoint_header(ckpt_key, wM, wN, wP, 2);
+            C.iter = it->iter+1;
+            C.error = it->error;
+            C.lasterror = it->lasterror;
+            C.bg = s->bg;
+            /* xp is NULL when dh is used */
+            dw_checkpoint_write(s, &C, x, xp, dh);
+        }
+
     } /* End of main loop */
     dw_iterator_free(it);
+    dw_accel_fprint(s->log, accel);
+    dw_accel_free(accel);
 
+    if(dw_checkpoint_enabled(s) || resumed)
     {
+        dw_checkpoint_remove(s);
+    }
+
+    if(dh != NULL)
+    {
+        /* The previous guess, as for fp32 below */
+#pragma omp parallel for shared(x, dh)
+        for(size_t kk = 0; kk<wMNP; kk++)
+        {
+            x[kk] -= fim_half_get(dh, kk);
+        }
+    } else {
         /* Swap back so that x is the final iteration */
         float * t = x;
         x = xp;
         xp = t;
     }
+    fim_half_free(dh);
+    fim_half_free(imh);
 
     if(xp != NULL)
     {
@@ -324,11 +368,8 @@ float * deconvolve_shb(float * restrict im,
         printf("\n");
     }
 
-    if(W != NULL)
-    {
-        fim_free(W); /* Allocated as P1 */
-    }
-    fim_free(cK);
+    dw_otf_release(s, otf);
+    W = NULL;
 
     if(s->fulldump)
     {
@@ -349,68 +390,160 @@ float * deconvolve_shb(float * restrict im,
 }
 
 
+/* Fused version of getError followed by y = im/y in the image
+ * domain and y = 0 in the padded region. y is read and written once
+ * instead of three times. Returns the error, estimated from the rows
+ * selected by dw_error_row(row, sample), or 0 if sample is 0. */
+static float shb_ratio_error(float * restrict y, const float * restrict im,
+                             const fim_half * imh,
+                             const int64_t M, const int64_t N, const int64_t P,
+                             const int64_t wM, const int64_t wN, const int64_t wP,
+                             const dw_metric metric, const float sample)
+{
+    const float mindiv = 1e-6; /* Smallest allowed divisor */
+    double err = 0;
+    int64_t nrows = 0; /* Rows used for the error */
+#pragma omp parallel for reduction(+: err, nrows) shared(y, im, imh)
+    for(int64_t cc = 0; cc < wP; cc++)
+    {
+        float * yplane = y + cc*wM*wN;
+        if(cc >= P)
+        {
+            memset(yplane, 0, wM*wN*sizeof(float));
+            continue;
+        }
+        /* Row of the image when stored as fim_half */
+        float * imbuf = NULL;
+        if(imh != NULL)
+        {
+            imbuf = fim_malloc(M*sizeof(float));
+        }
+        for(int64_t bb = 0; bb < N; bb++)
+        {
+            float * restrict yrow = yplane + bb*wM;
+            const float * restrict imrow = NULL;
+            if(imh != NULL)
+            {
+                const size_t offset = bb*M + cc*M*N;
+                for(int64_t aa = 0; aa < M; aa++)
+                {
+                    imbuf[aa] = fim_half_get(imh, offset+aa);
+                }
+                imrow = imbuf;
+            } else {
+                imrow = im + bb*M + cc*M*N;
+            }
+            /* The row is still in cache for the second loop */
+            if(sample == 0 || !dw_error_row(bb + cc*N, sample))
+            {
+                /* Not used for the error */
+            } else if(metric == DW_METRIC_MSE)
+            {
+                nrows++;
+                for(int64_t aa = 0; aa < M; aa++)
+                {
+                    double d = yrow[aa] - imrow[aa];
+                    err += d*d;
+                }
+            } else {
+                nrows++;
+                err += fim_simd_idiv_row(yrow, imrow, M);
+            }
+            for(int64_t aa = 0; aa < M; aa++)
+            {
+                float yval = yrow[aa];
+                /* abs and sign */
+                fabsf(yval) < mindiv ? yval = copysignf(mindiv, yval) : 0;
+                yrow[aa] = imrow[aa]/yval;
+            }
+            memset(yrow + M, 0, (wM-M)*sizeof(float));
+        }
+        memset(yplane + N*wM, 0, (wN-N)*wM*sizeof(float));
+        fim_free(imbuf);
+    }
+    if(nrows == 0)
+    {
+        return 0;
+    }
+    return (float) (err / (double) (nrows*M));
+}
+
 float iter_shb(
     float ** xp, // Output, f_(t+1)
     const float * restrict im, // Input image
-    fftwf_complex * restrict cK, // fft(psf)
+    const dw_otf_t * otf, // fft(psf)
     float * restrict pk, // p_k, estimation of the gradient
     float * restrict W, // Bertero Weights
     const int64_t wM, const int64_t wN, const int64_t wP, // expanded size
     const int64_t M, const int64_t N, const int64_t P, // input image size
+    const shb_lowp * lp, // NULL or reduced precision arrays
+    const float err_sample, // See shb_ratio_error, 0: no error
     __attribute__((unused)) const dw_opts * s)
 {
     const size_t wMNP = wM*wN*wP;
+    DW_TRACE_BEGIN("iter_shb");
 
     fftwf_complex * Pk = fft(pk, wM, wN, wP);
 
     putdot(s);
-    float * y = fft_convolve_cc_f2(cK, Pk, wM, wN, wP); // Pk is freed
+    float * y = dw_otf_convolve(otf, Pk); // Pk is freed
 
-    float error = getError(y, im, M, N, P, wM, wN, wP, s->metric);
+    const fim_half * imh = lp != NULL ? lp->im : NULL;
+    DW_TRACE_BEGIN("shb_ratio_error");
+    float error = shb_ratio_error(y, im, imh, M, N, P, wM, wN, wP,
+                                  s->metric, err_sample);
+    DW_TRACE_END("shb_ratio_error");
     putdot(s);
 
-
-    const double mindiv = 1e-6; /* Smallest allowed divisor */
-#pragma omp parallel for shared(y, im)
-    for(size_t cc =0; cc < (size_t) wP; cc++){
-        for(size_t bb = 0; bb < (size_t) wN; bb++){
-            for(size_t aa = 0; aa < (size_t) wM; aa++){
-                size_t yidx = aa + bb*wM + cc*wM*wN;
-                size_t imidx = aa + bb*M + cc*M*N;
-                if(aa < (size_t) M && bb < (size_t) N && cc < (size_t) P)
-                {
-                    /* abs and sign */
-                    fabs(y[yidx]) < mindiv ? y[yidx] = copysign(mindiv, y[yidx]) : 0;
-                    y[yidx] = im[imidx]/y[yidx];
-                } else {
-                    y[yidx]=0;
-                }
-            }
-        }
-    }
-
     here();
     fftwf_complex * Y = fft_and_free(y, wM, wN, wP);
     here();
-    float * x = fft_convolve_cc_conj_f2(cK, Y, wM, wN, wP); // Y is freed
+    float * x = dw_otf_convolve_conj(otf, Y); // Y is freed
     here();
-    /* Eq. 18 in Bertero */
-    if(W != NULL)
+    /* Eq. 18 in Bertero. The lower bound, if used, is applied in
+     * the same pass */
+    const float bg = s->positivity ? s->bg : -INFINITY;
+    const fim_half * hW = lp != NULL ? lp->W : NULL;
+    fim_half * d = lp != NULL ? lp->d : NULL;
+    DW_TRACE_BEGIN("shb_update");
+    if(hW != NULL || d != NULL)
+    {
+#pragma omp parallel for shared(x, pk, W, hW, d)
+        for(size_t cc = 0; cc<wMNP; cc++)
+        {
+            float w = 1;
+            W != NULL ? w = W[cc] : 0;
+            hW != NULL ? w = fim_half_get(hW, cc) : 0;
+            float v = x[cc]*pk[cc]*w;
+            v = v < bg ? bg : v;
+            if(d != NULL)
+            {
+                /* pk minus the momentum step is the previous guess */
+                float xprev = pk[cc] - fim_half_get(d, cc);
+                fim_half_set(d, cc, v - xprev);
+            }
+            x[cc] = v;
+        }
+    } else if(W != NULL)
     {
 #pragma omp parallel for shared(x, pk, W)
         for(size_t cc = 0; cc<wMNP; cc++)
         {
-            x[cc] *= pk[cc]*W[cc];
+            float v = x[cc]*pk[cc]*W[cc];
+            x[cc] = v < bg ? bg : v;
         }
     } else {
 #pragma omp parallel for shared(x, pk)
         for(size_t cc = 0; cc<wMNP; cc++)
         {
-            x[cc] *= pk[cc];
+            float v = x[cc]*pk[cc];
+            x[cc] = v < bg ? bg : v;
         }
     }
+    DW_TRACE_END("shb_update");
     fim_free(pk);
     here();
     xp[0] = x;
+    DW_TRACE_END("iter_shb");
     return error;
 }
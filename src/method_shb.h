@@ -27,12 +27,24 @@ float * deconvolve_shb(float * restrict im,
                        const int64_t pM, const int64_t pN, const int64_t pP,
                        dw_opts * s);
 
+/* Arrays stored with reduced precision, see --storage. The ones that
+ * are set are used instead of the float arguments to iter_shb. */
+typedef struct {
+    const fim_half * im; /* Input image */
+    const fim_half * W; /* Bertero weights */
+    /* On input pk - x_k, i.e. the momentum step. On output
+     * x_(k+1) - x_k */
+    fim_half * d;
+} shb_lowp;
+
 float iter_shb(
     float ** xp, // Output, f_(t+1)
     const float * restrict im, // Input image
-    fftwf_complex * restrict cK, // fft(psf)
+    const dw_otf_t * otf, // fft(psf)
     float * restrict pk, // Current guess
     float * restrict W, // Bertero Weights
     const int64_t wM, const int64_t wN, const int64_t wP, // expanded size
     const int64_t M, const int64_t N, const int64_t P, // input image size
+    const shb_lowp * lp, // NULL or reduced precision arrays
+    const float err_sample, // See shb_ratio_error, 0: no error
     __attribute__((unused)) const dw_opts * s);
@@ -18,6 +18,14 @@
 #include "fim_tiff.h"
 #include "dw_util.h"
 #include "fim.h"
+#include "npio.h"
+
+#ifndef WINDOWS
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
 
 int64_t * tiling_getDivision(const int64_t M, const int64_t m, int64_t * nDiv)
 {
@@ -67,13 +75,62 @@ int64_t imax(int64_t a, int64_t b)
     if(a > b){ return(a); } else { return(b); } ;
 }
 
+/* Normalized 1D weights of division dd from divs, for the extended
+ * range [x0, x1] of a tile. The weights of all divisions sum to 1 at
+ * each x. */
+static float * tiling_weights1d(const int64_t * divs, int64_t ndiv,
+                                int64_t overlap, int64_t L,
+                                int64_t dd, int64_t x0, int64_t x1)
+{
+    float * w = malloc((x1-x0+1)*sizeof(float));
+    assert(w != NULL);
+    for(int64_t x = x0; x <= x1; x++)
+    {
+        float sum = 0;
+        float wx = 0;
+        for(int64_t kk = 0; kk < ndiv; kk++)
+        {
+            const int64_t b = divs[2*kk];
+            const int64_t c = divs[2*kk+1];
+            const int64_t a = imax(0, b-overlap);
+            const int64_t d = imin(c+overlap, L-1);
+            float v = getWeight1d(a, b, c, d, x);
+            sum += v;
+            if(kk == dd)
+            {
+                wx = v;
+            }
+        }
+        assert(sum > 0);
+        w[x-x0] = wx/sum;
+    }
+    return w;
+}
+
 tiling * tiling_create(const int64_t M, const int64_t N, const int64_t P, const int64_t maxSize, const int64_t overlap)
 {
+    return tiling_create_3d(M, N, P, maxSize, overlap, P, 0);
+}
+
+tiling * tiling_create_3d(const int64_t M, const int64_t N, const int64_t P,
+                          const int64_t maxSize, const int64_t overlap,
+                          int64_t maxSizeP, int64_t overlapP)
+{
+    if(maxSizeP <= 0 || maxSizeP > P)
+    {
+        maxSizeP = P;
+    }
+    if(maxSizeP == P)
+    {
+        overlapP = 0;
+    }
 
     int64_t nM = 0;
     int64_t * divM = tiling_getDivision(M, maxSize, &nM);
     int64_t nN = 0;
     int64_t * divN = tiling_getDivision(N, maxSize, &nN);
+    int64_t nP = 0;
+    int64_t * divP = tiling_getDivision(P, maxSizeP, &nP);
 
 #ifndef NDEBUG
     printf("Dividing %" PRId64 " into:\n", M);
@@ -87,7 +144,7 @@ tiling * tiling_create(const int64_t M, const int64_t N, const int64_t P, const
     tiling * T = malloc(sizeof(tiling));
     T->maxSize = maxSize;
     T->overlap = overlap;
-    T->nTiles = nM*nN;
+    T->nTiles = nM*nN*nP;
     T->tiles = calloc(T->nTiles, sizeof(tile*));
     assert(T->tiles != NULL);
     T->M = M;
@@ -95,37 +152,53 @@ tiling * tiling_create(const int64_t M, const int64_t N, const int64_t P, const
     T->P = P;
     T->maxSize = maxSize;
     T->overlap = overlap;
+    T->maxSizeP = maxSizeP;
+    T->overlapP = overlapP;
+    T->raw_offset = 0;
 
+    /* Tiles are ordered by z-slab first, so that a slab is finished
+     * before the next one is started. */
     int64_t bb = 0;
-    for(int64_t mm = 0; mm<nM; mm++)
+    for(int64_t pp = 0; pp<nP; pp++)
     {
-        for(int64_t nn = 0; nn<nN; nn++)
+        for(int64_t mm = 0; mm<nM; mm++)
         {
-            T->tiles[bb] = tile_create();
-            tile * t = T->tiles[bb];
-            t->size[0] = divM[mm*2+1] - divM[mm*2] + 1;
-            t->size[1] = divN[nn*2+1] - divN[nn*2] + 1;
-            t->size[2] = P;
-
-            t->pos[0]=divM[mm*2]; t->pos[1]=divM[mm*2+1];
-            t->pos[2]=divN[nn*2]; t->pos[3]=divN[nn*2+1];
-            t->pos[4]=0; t->pos[5] = P-1;
-
-            t->xpos[0] = imax(0, t->pos[0]-overlap);
-            t->xpos[1] = imin(t->pos[1]+overlap, M-1);
-            t->xpos[2] = imax(0, t->pos[2]-overlap);
-            t->xpos[3] = imin(t->pos[3]+overlap, N-1);
-            t->xpos[4] = t->pos[4]; t->xpos[5] = t->pos[5];
-
-            t->xsize[0] = t->xpos[1] - t->xpos[0] + 1;
-            t->xsize[1] = t->xpos[3] - t->xpos[2] + 1;
-            t->xsize[2] = t->xpos[5] - t->xpos[4] + 1;
-
-            bb++;
+            for(int64_t nn = 0; nn<nN; nn++)
+            {
+                T->tiles[bb] = tile_create();
+                tile * t = T->tiles[bb];
+                t->size[0] = divM[mm*2+1] - divM[mm*2] + 1;
+                t->size[1] = divN[nn*2+1] - divN[nn*2] + 1;
+                t->size[2] = divP[pp*2+1] - divP[pp*2] + 1;
+
+                t->pos[0]=divM[mm*2]; t->pos[1]=divM[mm*2+1];
+                t->pos[2]=divN[nn*2]; t->pos[3]=divN[nn*2+1];
+                t->pos[4]=divP[pp*2]; t->pos[5]=divP[pp*2+1];
+
+                t->xpos[0] = imax(0, t->pos[0]-overlap);
+                t->xpos[1] = imin(t->pos[1]+overlap, M-1);
+                t->xpos[2] = imax(0, t->pos[2]-overlap);
+                t->xpos[3] = imin(t->pos[3]+overlap, N-1);
+                t->xpos[4] = imax(0, t->pos[4]-overlapP);
+                t->xpos[5] = imin(t->pos[5]+overlapP, P-1);
+
+                t->xsize[0] = t->xpos[1] - t->xpos[0] + 1;
+                t->xsize[1] = t->xpos[3] - t->xpos[2] + 1;
+                t->xsize[2] = t->xpos[5] - t->xpos[4] + 1;
+
+                t->weight[0] = tiling_weights1d(divM, nM, overlap, M, mm,
+                                                t->xpos[0], t->xpos[1]);
+                t->weight[1] = tiling_weights1d(divN, nN, overlap, N, nn,
+                                                t->xpos[2], t->xpos[3]);
+                t->weight[2] = tiling_weights1d(divP, nP, overlapP, P, pp,
+                                                t->xpos[4], t->xpos[5]);
+                bb++;
+            }
         }
     }
     free(divM);
     free(divN);
+    free(divP);
     return T;
 }
 
@@ -134,6 +207,8 @@ void tiling_show(tiling * T)
     printf("Tiling with %d tiles\n", T->nTiles);
     printf("Generated for [%" PRId64 " x %" PRId64 " x %" PRId64 "], maxSize: %d, overlap: %d\n",
            T->M, T->N, T->P, T->maxSize, T->overlap);
+    printf("maxSize in z: %" PRId64 ", overlap in z: %" PRId64 "\n",
+           T->maxSizeP, T->overlapP);
     for(int kk = 0; kk<T->nTiles; kk++)
     {
         tile_show(T->tiles[kk]);
@@ -169,7 +244,7 @@ void tile_show(tile * T)
 float getWeight1d(const float a, const float b, const float c, const float d, const int64_t x)
 {
     assert(a<=b);
-    assert(b<c); // a tile has to have a size
+    assert(b<=c); // a tile has to have a size
     assert(c<=d);
     // f(x) = 0, x<a, or x>d
     //        1    b < x < c
@@ -196,23 +271,33 @@ float getWeight1d(const float a, const float b, const float c, const float d, co
 
 float tile_getWeight(tile * t,
                      const int64_t m, const int64_t n, const int64_t p)
-/* Calculate the weight for tile t at position (m,n,p) */
+/* Calculate the weight for tile t at position (m,n,p)
+ * The weight is separable, i.e., a product of 1D weights. */
 {
-    ((void) p);
-    assert(p>=t->xpos[4]);
-    assert(p<=t->xpos[5]);
     float wm = getWeight1d(t->xpos[0], t->pos[0], t->pos[1], t->xpos[1], m);
     float wn = getWeight1d(t->xpos[2], t->pos[2], t->pos[3], t->xpos[3], n);
-    //  float w = sqrt( pow((wm-pad), 2) + pow((wn-pad),2));
-    assert(wm>=0); assert(wn>=0); assert(wm<=1); assert(wn<=1);
-    float w = fminf(wm,wn);
-    //  printf("wm: %f, wn: %f, w: %f\n", wm, wn, w);
+    float wp = getWeight1d(t->xpos[4], t->pos[4], t->pos[5], t->xpos[5], p);
+    assert(wm>=0); assert(wn>=0); assert(wp>=0);
+    assert(wm<=1); assert(wn<=1); assert(wp<=1);
+    float w = wm*wn*wp;
     assert(w>= 0);
     assert(w<=1);
     return w;
 }
 
+/* Weight for tile t at (m, n, p), normalized so that the weights of
+ * all tiles sum to 1 */
+static float tile_getNormWeight(const tile * t,
+                                const int64_t m, const int64_t n, const int64_t p)
+{
+    return t->weight[0][m - t->xpos[0]]
+        * t->weight[1][n - t->xpos[2]]
+        * t->weight[2][p - t->xpos[4]];
+}
+
 float tiling_getWeights(tiling * T, const int64_t M, const int64_t N, const int64_t P)
+/* Sum of the weights of all tiles at (M, N, P). Slow, loops over all
+ * tiles. The blending uses the tables in tile->weight instead. */
 {
     float w = 0;
     for(int tt = 0; tt < T->nTiles; tt++)
@@ -229,6 +314,10 @@ tile * tile_create()
     t->xsize = malloc(3*sizeof(int64_t));
     t->pos = malloc(6*sizeof(int64_t));
     t->xpos = malloc(6*sizeof(int64_t));
+    t->done = 0;
+    t->weight[0] = NULL;
+    t->weight[1] = NULL;
+    t->weight[2] = NULL;
     return t;
 }
 
@@ -238,11 +327,18 @@ void tile_free(tile * t)
     free(t->xsize);
     free(t->pos);
     free(t->xpos);
+    for(int kk = 0; kk < 3; kk++)
+    {
+        free(t->weight[kk]);
+    }
 }
 
-float * tiling_get_tile_raw(tiling * T, const int tid, const char * fName)
+/* Read tile tid from a file where the image data is stored without
+ * padding, first dimension first, starting at offset. bps is the
+ * number of bytes per sample. 4: float, 2: uint16, 1: uint8 */
+static float * get_tile_rows(tiling * T, const int tid, const char * fName,
+                             size_t offset, size_t bps)
 {
-//  printf("Reading tile from %s\n", fName);
     tile * t = T->tiles[tid];
     FILE * fid = fopen(fName, "rb");
     if(fid == NULL)
@@ -256,7 +352,6 @@ float * tiling_get_tile_raw(tiling * T, const int tid, const char * fName)
     size_t p = t->xsize[2];
 
     size_t npixels = m*n*p;
-//  printf("To populate %zu pixels (%zu x %zu x %zu)\n", npixels, m, n, p);
     float * R = fim_malloc(npixels*sizeof(float));
     if(R == NULL)
     {
@@ -265,21 +360,47 @@ float * tiling_get_tile_raw(tiling * T, const int tid, const char * fName)
     }
     memset(R, 0, npixels*sizeof(float));
 
+    /* Only used when the file is not float */
+    uint8_t * buf = NULL;
+    if(bps != sizeof(float))
+    {
+        buf = malloc(m*bps);
+        assert(buf != NULL);
+    }
+
     for(size_t pp = t->xpos[4]; pp <= (size_t) t->xpos[5]; pp++)
     {
         for(size_t nn = t->xpos[2]; nn <= (size_t) t->xpos[3]; nn++)
         {
-            // seek position in big raw file
+            // seek position in big file
             size_t spos = t->xpos[0] + nn*T->M + pp*T->M*T->N;
             // write position in tile
             size_t wpos = (nn - t->xpos[2])*t->xsize[0] +
                 (pp - t->xpos[4])*t->xsize[0]*t->xsize[1]; // in tile
-//      printf("spos: %zu, wpos: %zu\n", spos, wpos);
             assert(wpos+m <= npixels);
             assert(wpos <= spos);
-            dw_fseek(fid, spos*sizeof(float), SEEK_SET);
+            dw_fseek(fid, offset + spos*bps, SEEK_SET);
             errno = 0;
-            size_t nread = fread(R+wpos, sizeof(float), m, fid);
+            size_t nread = 0;
+            if(buf == NULL)
+            {
+                nread = fread(R+wpos, sizeof(float), m, fid);
+            } else {
+                nread = fread(buf, bps, m, fid);
+                if(bps == 2)
+                {
+                    const uint16_t * buf16 = (const uint16_t *) buf;
+                    for(size_t kk = 0; kk < nread; kk++)
+                    {
+                        R[wpos+kk] = (float) buf16[kk];
+                    }
+                } else {
+                    for(size_t kk = 0; kk < nread; kk++)
+                    {
+                        R[wpos+kk] = (float) buf[kk];
+                    }
+                }
+            }
             if(nread != m)
             {
                 perror("fread error");
@@ -293,34 +414,131 @@ float * tiling_get_tile_raw(tiling * T, const int tid, const char * fName)
         }
     }
 
+    free(buf);
     fclose(fid);
     return R;
 }
 
+float * tiling_get_tile_raw(tiling * T, const int tid, const char * fName)
+{
+    DW_TRACE_BEGIN("tiling_get_tile_raw");
+    float * R = get_tile_rows(T, tid, fName, 0, sizeof(float));
+    DW_TRACE_END("tiling_get_tile_raw");
+    return R;
+}
+
+/* Returns the number of bytes per sample if tiles of T can be read
+ * from the npy file described by meta, else 0 */
+static size_t npy_tile_bps(tiling * T, const npio_t * meta)
+{
+    if(meta->ndim != 3 || meta->fortran_order)
+    {
+        return 0;
+    }
+    if(meta->shape[0] != T->P
+       || meta->shape[1] != T->N
+       || meta->shape[2] != T->M)
+    {
+        return 0;
+    }
+    switch(meta->dtype)
+    {
+    case NPIO_F32:
+        return 4;
+    case NPIO_U16:
+        return 2;
+    case NPIO_U8:
+        return 1;
+    default:
+        return 0;
+    }
+    return 0;
+}
+
+float * tiling_get_tile_npy(tiling * T, const int tid, const char * fName)
+{
+    npio_t * meta = npio_load_metadata(fName);
+    if(meta == NULL)
+    {
+        fprintf(stderr, "Unable to load metadata from %s\n", fName);
+        exit(EXIT_FAILURE);
+    }
+    size_t bps = npy_tile_bps(T, meta);
+    if(bps == 0)
+    {
+        fprintf(stderr, "Can't read tiles from %s with the following metadata:\n",
+                fName);
+        npio_print(stderr, meta);
+        exit(EXIT_FAILURE);
+    }
+    size_t offset = meta->data_offset;
+    npio_free(meta);
+    DW_TRACE_BEGIN("tiling_get_tile_npy");
+    float * R = get_tile_rows(T, tid, fName, offset, bps);
+    DW_TRACE_END("tiling_get_tile_npy");
+    return R;
+}
+
+float * tiling_get_tile_file(tiling * T, const int tid, const char * fName)
+{
+    if(npyfilename(fName))
+    {
+        return tiling_get_tile_npy(T, tid, fName);
+    }
+    float * R = tiling_get_tile_tiff(T, tid, fName);
+    if(R == NULL)
+    {
+        fprintf(stderr, "Failed to read tile %d from %s\n", tid, fName);
+        exit(EXIT_FAILURE);
+    }
+    return R;
+}
+
+int tiling_file_supported(tiling * T, const char * fName)
+{
+    if(npyfilename(fName))
+    {
+        npio_t * meta = npio_load_metadata(fName);
+        if(meta == NULL)
+        {
+            return 0;
+        }
+        int ok = npy_tile_bps(T, meta) > 0;
+        npio_free(meta);
+        return ok;
+    }
+
+    /* Probe by reading a single pixel. Fails for example
+     * for compressed files. */
+    int64_t M = 0; int64_t N = 0; int64_t P = 0;
+    float * R = fim_tiff_read_sub(fName, NULL, &M, &N, &P, 0,
+                                  1, 0, 0, 0, 1, 1, 1);
+    if(R == NULL)
+    {
+        return 0;
+    }
+    fim_free(R);
+    return M == T->M && N == T->N && P == T->P;
+}
+
 float * tiling_get_tile_tiff(tiling * T, const int tid, const char * fName)
 {
     tile * t = T->tiles[tid];
-    int verbosity = 1;
+    int verbosity = 0;
     int64_t M = 0; int64_t N = 0; int64_t P = 0; // Will be set to the image size
+    DW_TRACE_BEGIN("tiling_get_tile_tiff");
     float * R = fim_tiff_read_sub(fName, NULL, &M, &N, &P, verbosity,
                                   1,
                                   t->xpos[0], t->xpos[2], t->xpos[4], // Start pos
                                   t->xsize[0], t->xsize[1], t->xsize[2]); // size
-
-    printf("%" PRId64 " %" PRId64 " %" PRId64 "\n", t->xsize[0], t->xsize[1], t->xsize[2]);
-
-    if(0)
-    {
-        printf("Writing to tile.tif\n");
-        fim_tiff_write("tile.tif", R, NULL, t->xsize[0], t->xsize[1], t->xsize[2]);
-        printf("ok\n"); getchar();
-    }
+    DW_TRACE_END("tiling_get_tile_tiff");
     return R;
 }
 
 float * tiling_get_tile(tiling * T, const int tid, const float * restrict V)
 /* Extract tile number tid from the image V */
 {
+    DW_TRACE_BEGIN("tiling_get_tile");
     tile * t = T->tiles[tid];
     int64_t M = T->M; int64_t N = T->N;
 #ifndef NDEBUG
@@ -349,11 +567,49 @@ float * tiling_get_tile(tiling * T, const int tid, const float * restrict V)
             }
         }
     }
+    DW_TRACE_END("tiling_get_tile");
     return R;
 }
 
+/* List the other tiles that overlap with tile tid and that are not
+ * written yet. done is only read for the overlapping tiles, whose
+ * locks are held by the caller when several tiles are written
+ * concurrently (see tile_put_locked in dw.c). */
+static int * pending_tiles(tiling * T, int tid, int * npending)
+{
+    int * pending = malloc(T->nTiles*sizeof(int));
+    assert(pending != NULL);
+    npending[0] = 0;
+    for(int kk = 0; kk < T->nTiles; kk++)
+    {
+        if(kk != tid && tiling_tiles_overlap(T, tid, kk)
+           && T->tiles[kk]->done == 0)
+        {
+            pending[npending[0]++] = kk;
+        }
+    }
+    return pending;
+}
+
+/* Returns 1 if any of the pending tiles cover (aa, bb, cc) */
+static int voxel_pending(const tiling * T, const int * pending, int npending,
+                         int64_t aa, int64_t bb, int64_t cc)
+{
+    for(int kk = 0; kk < npending; kk++)
+    {
+        const int64_t * xp = T->tiles[pending[kk]]->xpos;
+        if(aa >= xp[0] && aa <= xp[1]
+           && bb >= xp[2] && bb <= xp[3]
+           && cc >= xp[4] && cc <= xp[5])
+        {
+            return 1;
+        }
+    }
+    return 0;
+}
+
 // Write tile directly to raw float file
-void tiling_put_tile_raw(tiling * T, int tid, const char * fname, float * restrict S)
+float tiling_put_tile_raw(tiling * T, int tid, const char * fname, float * restrict S)
 {
     /*
      * Assumes that the raw file is already created and big enough
@@ -361,13 +617,25 @@ void tiling_put_tile_raw(tiling * T, int tid, const char * fname, float * restri
      *
      * TIFF files does not support altering of the contents,
      * that is why I settled for this solution.
+     *
+     * Only the part of each column that is covered by the tile is
+     * read and written. Hence tiles that don't overlap, see
+     * tiling_tiles_overlap, can be written at the same time.
+     *
+     * A voxel is complete when the last of the tiles covering it
+     * is written. Since overlapping tiles are not written at the
+     * same time, each voxel is reported complete exactly once.
      * */
 
+    DW_TRACE_BEGIN("tiling_put_tile_raw");
     tile * t = T->tiles[tid];
     int64_t M = T->M; int64_t N = T->N;
     int64_t m = t->xsize[0];
     int64_t n = t->xsize[1];
 
+    int npending = 0;
+    int * pending = pending_tiles(T, tid, &npending);
+
 //  printf("Opening %s for r/w\n", fname); fflush(stdout);
     FILE * fid = fopen(fname, "rb+");
     if(fid == NULL)
@@ -376,30 +644,38 @@ void tiling_put_tile_raw(tiling * T, int tid, const char * fname, float * restri
         exit(1);
     }
 
-    size_t buf_size = M*sizeof(float);
+    size_t buf_size = m*sizeof(float);
     float * buf = calloc(buf_size, 1);
     assert(buf != NULL);
+    float max = -INFINITY;
 
     for(int64_t cc = t->xpos[4]; cc <= t->xpos[5]; cc++)
     {
         for(int64_t bb = t->xpos[2]; bb <= t->xpos[3]; bb++)
         {
-            size_t colpos = (bb*M + cc*M*N)*sizeof(float);
+            size_t colpos = T->raw_offset
+                + (t->xpos[0] + bb*M + cc*M*N)*sizeof(float);
             //      printf("colpos: %zu\n", colpos);
             //fsetpos(fid, &colpos);
             dw_fseek(fid, colpos, SEEK_SET);
             size_t nread = fread(buf, buf_size, 1, fid);
             (void) nread;
-            size_t buf_pos = t->xpos[0];
+            size_t buf_pos = 0;
             for(int64_t aa = t->xpos[0]; aa <= t->xpos[1]; aa++)
             {
                 // Index in the tile ...
                 size_t Sidx = (aa - t->xpos[0]) +
                     (bb - t->xpos[2])*m +
                     (cc - t->xpos[4])*m*n;
-                float w = tile_getWeight(t, aa, bb, cc);
-                w/= tiling_getWeights(T, aa, bb, cc);
-                buf[buf_pos++] += w*(float) S[Sidx];
+                float w = tile_getNormWeight(t, aa, bb, cc);
+                buf[buf_pos] += w*(float) S[Sidx];
+
+                if(buf[buf_pos] > max
+                   && !voxel_pending(T, pending, npending, aa, bb, cc))
+                {
+                    max = buf[buf_pos];
+                }
+                buf_pos++;
             }
 
             dw_fseek(fid, colpos, SEEK_SET);
@@ -409,7 +685,159 @@ void tiling_put_tile_raw(tiling * T, int tid, const char * fname, float * restri
     }
     fclose(fid);
     free(buf);
+    free(pending);
+    t->done = 1;
+    DW_TRACE_END("tiling_put_tile_raw");
+    return max;
+}
+
+tiling_map * tiling_map_open(tiling * T, const char * fName,
+                             size_t offset, int writable)
+{
+#ifdef WINDOWS
+    (void) T; (void) fName; (void) offset; (void) writable;
+    return NULL;
+#else
+    size_t size = offset + (size_t) T->M*T->N*T->P*sizeof(float);
+    int fd = open(fName, writable ? O_RDWR : O_RDONLY);
+    if(fd < 0)
+    {
+        return NULL;
+    }
+    struct stat st;
+    if(fstat(fd, &st) != 0 || (size_t) st.st_size < size)
+    {
+        close(fd);
+        return NULL;
+    }
+    int prot = writable ? PROT_READ | PROT_WRITE : PROT_READ;
+    void * addr = mmap(NULL, size, prot, MAP_SHARED, fd, 0);
+    /* The mapping is kept after the file is closed */
+    close(fd);
+    if(addr == MAP_FAILED)
+    {
+        return NULL;
+    }
+    /* Tiles are narrow compared to the image, read ahead would mostly
+     * fetch data belonging to other tiles */
+    madvise(addr, size, MADV_RANDOM);
+
+    tiling_map * map = malloc(sizeof(tiling_map));
+    assert(map != NULL);
+    map->addr = addr;
+    map->size = size;
+    map->data = (float *) ((uint8_t *) addr + offset);
+    map->writable = writable;
+    return map;
+#endif
+}
+
+int tiling_map_close(tiling_map * map)
+{
+    if(map == NULL)
+    {
+        return 0;
+    }
+    int status = 0;
+#ifndef WINDOWS
+    if(map->writable)
+    {
+        status = msync(map->addr, map->size, MS_SYNC);
+    }
+    if(munmap(map->addr, map->size) != 0)
+    {
+        status = -1;
+    }
+#endif
+    free(map);
+    return status;
+}
+
+float * tiling_get_tile_map(tiling * T, const int tid, const tiling_map * map)
+{
+    DW_TRACE_BEGIN("tiling_get_tile_map");
+    tile * t = T->tiles[tid];
+    const int64_t M = T->M;
+    const int64_t N = T->N;
+    const int64_t m = t->xsize[0];
+    const int64_t n = t->xsize[1];
+    const int64_t p = t->xsize[2];
+
+    float * R = fim_malloc(m*n*p*sizeof(float));
+    if(R == NULL)
+    {
+        printf("ERROR: memory allocation failed\n");
+        exit(-1);
+    }
+
+#pragma omp parallel for shared(R, map, t)
+    for(int64_t pp = t->xpos[4]; pp <= t->xpos[5]; pp++)
+    {
+        for(int64_t nn = t->xpos[2]; nn <= t->xpos[3]; nn++)
+        {
+            const float * src = map->data + t->xpos[0] + nn*M + pp*M*N;
+            float * dst = R + (nn - t->xpos[2])*m + (pp - t->xpos[4])*m*n;
+            memcpy(dst, src, m*sizeof(float));
+        }
+    }
+    DW_TRACE_END("tiling_get_tile_map");
+    return R;
+}
+
+float tiling_put_tile_map(tiling * T, int tid, tiling_map * map, float * restrict S)
+{
+    /* Same as tiling_put_tile_raw but without any read/write calls,
+     * only the voxels of the tile are touched. */
+    assert(map->writable);
+    DW_TRACE_BEGIN("tiling_put_tile_map");
+    tile * t = T->tiles[tid];
+    const int64_t M = T->M;
+    const int64_t N = T->N;
+    const int64_t m = t->xsize[0];
+    const int64_t n = t->xsize[1];
+
+    int npending = 0;
+    int * pending = pending_tiles(T, tid, &npending);
+
+    float max = -INFINITY;
+#pragma omp parallel for reduction(max:max) shared(S, map, t, pending)
+    for(int64_t cc = t->xpos[4]; cc <= t->xpos[5]; cc++)
+    {
+        for(int64_t bb = t->xpos[2]; bb <= t->xpos[3]; bb++)
+        {
+            float * dst = map->data + t->xpos[0] + bb*M + cc*M*N;
+            const float * src = S + (bb - t->xpos[2])*m + (cc - t->xpos[4])*m*n;
+            for(int64_t aa = t->xpos[0]; aa <= t->xpos[1]; aa++)
+            {
+                const int64_t ii = aa - t->xpos[0];
+                float w = tile_getNormWeight(t, aa, bb, cc);
+                dst[ii] += w*src[ii];
+                if(dst[ii] > max
+                   && !voxel_pending(T, pending, npending, aa, bb, cc))
+                {
+                    max = dst[ii];
+                }
+            }
+        }
+    }
+    free(pending);
+    t->done = 1;
+    DW_TRACE_END("tiling_put_tile_map");
+    return max;
+}
 
+int tiling_tiles_overlap(const tiling * T, int a, int b)
+{
+    const int64_t * pa = T->tiles[a]->xpos;
+    const int64_t * pb = T->tiles[b]->xpos;
+    for(int dd = 0; dd < 3; dd++)
+    {
+        if(pa[2*dd+1] < pb[2*dd] || pb[2*dd+1] < pa[2*dd])
+        {
+            return 0;
+        }
+    }
+    return 1;
 }
 
 void tiling_put_tile(tiling * T, int tid, float * restrict V, float * restrict S)
@@ -419,6 +847,7 @@ void tiling_put_tile(tiling * T, int tid, float * restrict V, float * restrict S
        Typically V should to be initialized to 0 first.
     */
 
+    DW_TRACE_BEGIN("tiling_put_tile");
     tile * t = T->tiles[tid];
     int64_t M = T->M; int64_t N = T->N;
     int64_t m = t->xsize[0];
@@ -433,11 +862,10 @@ void tiling_put_tile(tiling * T, int tid, float * restrict V, float * restrict S
                 size_t Sidx = (aa-t->xpos[0]) +
                     (bb-t->xpos[2])*m +
                     (cc-t->xpos[4])*m*n;
-                float w = tile_getWeight(t, aa, bb, cc);
-                w/= tiling_getWeights(T, aa, bb, cc);
+                float w = tile_getNormWeight(t, aa, bb, cc);
                 V[Vidx] += w*S[Sidx];
             }
         }
     }
-
+    DW_TRACE_END("tiling_put_tile");
 }
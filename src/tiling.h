@@ -31,6 +31,8 @@ typedef struct{
   int64_t * xsize; // M, N, P with padding
   int64_t * pos; // Position in original image (M0, M1, N0, N1, P0, P1)
   int64_t * xpos; // Extended position, including overlap
+  int done; // Set when written, under the lock of the tile with --tile-workers
+  float * weight[3]; // Normalized 1D weights over xpos along M, N and P
 } tile;
 
 typedef struct{
@@ -39,9 +41,18 @@ typedef struct{
   tile ** tiles;
   int maxSize;
   int overlap;
+  int64_t maxSizeP; // Largest tile size and overlap along P
+  int64_t overlapP;
+  size_t raw_offset; // Where the data starts in files used by tiling_put_tile_raw
 } tiling;
 
+/* Tiles of at most [maxSize x maxSize x P], overlapping by overlap */
 tiling * tiling_create(int64_t M, int64_t N, int64_t P, int64_t maxSize, int64_t overlap);
+/* Also divide along P into tiles of at most maxSizeP planes,
+ * overlapping by overlapP planes. maxSizeP <= 0 means no division */
+tiling * tiling_create_3d(int64_t M, int64_t N, int64_t P,
+                          int64_t maxSize, int64_t overlap,
+                          int64_t maxSizeP, int64_t overlapP);
 void tiling_show(tiling * T);
 void tiling_free(tiling * T);
 float tiling_getWeights(tiling * T, int64_t m, int64_t n, int64_t p);
@@ -55,6 +66,18 @@ float * tiling_get_tile_tiff(tiling * T, int t, const char * fName);
 /* Extract tile #t from raw float file */
 float * tiling_get_tile_raw(tiling * T, int t, const char * fName);
 
+/* Extract tile #t from a 3D npy file in C order,
+ * float32, uint16 or uint8 */
+float * tiling_get_tile_npy(tiling * T, int t, const char * fName);
+
+/* Extract tile #t from a tif or npy file, depending on the file name */
+float * tiling_get_tile_file(tiling * T, int t, const char * fName);
+
+/* Returns 1 if tiles can be read from fName with
+ * tiling_get_tile_file, i.e., without converting it to a raw file
+ * first. Returns 0 otherwise. */
+int tiling_file_supported(tiling * T, const char * fName);
+
 
 /* Put back data extracted by tiling_get_tile
  * S extracted data from tile t
@@ -64,9 +87,42 @@ void tiling_put_tile(tiling * T, int t, float * V, float * S);
 
 /* Put back data extracted by tiling_get_tile
  * S extracted data from tile t
- * V target image, dimensions given by T->M, N, P
+ * fName raw float file, dimensions given by T->M, N, P, with the data
+ *       starting at T->raw_offset
+ * Returns the max of the voxels that are complete after this call,
+ * i.e. those not covered by any other tile that is not yet written,
+ * or -INFINITY if there are none. The max of the returned values is
+ * the max of the final image.
  * */
-void tiling_put_tile_raw(tiling * T, int t, const char * fName, float * S);
+float tiling_put_tile_raw(tiling * T, int t, const char * fName, float * S);
+
+/* A raw float image file mapped to memory, see tiling_map_open */
+typedef struct{
+  void * addr; // Start of the mapping
+  size_t size; // Size of the mapping in bytes
+  float * data; // The image data, [T->M x T->N x T->P]
+  int writable;
+} tiling_map;
+
+/* Map the image data of fName, which starts at offset, to memory.
+ * Returns NULL if that is not possible, then the functions using
+ * stdio, i.e. tiling_get_tile_raw and tiling_put_tile_raw,
+ * should be used instead. */
+tiling_map * tiling_map_open(tiling * T, const char * fName,
+                             size_t offset, int writable);
+
+/* Flush any changes to disk and unmap. Returns 0 on success */
+int tiling_map_close(tiling_map * map);
+
+/* Like tiling_get_tile_raw but from a mapped file */
+float * tiling_get_tile_map(tiling * T, int t, const tiling_map * map);
+
+/* Like tiling_put_tile_raw but to a mapped file */
+float tiling_put_tile_map(tiling * T, int t, tiling_map * map, float * S);
+
+/* Returns 1 if the extended regions of tile a and b overlap, i.e.,
+ * if they write to the same voxels with tiling_put_tile_raw */
+int tiling_tiles_overlap(const tiling * T, int a, int b);
 
 tile * tile_create();
 void tile_free(tile *);
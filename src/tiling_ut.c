@@ -85,12 +85,13 @@ printf(" -> test_weights\n");
   free(T);
   }
 
-void test_copy_paste(int M, int N, int P, int maxSize, int overlap)
+void test_copy_paste(int M, int N, int P, int maxSize, int overlap,
+                     int maxSizeP, int overlapP)
   /* Extract tiles and put them into a new image, one by one */
   {
     printf("-> test_copy_paste\n"); fflush(stdout);
 
-  tiling * T = tiling_create(M,N,P, maxSize, overlap);
+  tiling * T = tiling_create_3d(M,N,P, maxSize, overlap, maxSizeP, overlapP);
   //  tiling_show(T);
   size_t MNP = M*N*P;
 
@@ -157,21 +158,28 @@ int main(int argc, char ** argv)
   int M = 1024, N = 1024, P = 1;
   int overlap = 2;
   int maxSize = 400;
+  int maxSizeP = -1;
+  int overlapP = 0;
 
-  if(argc == 6)
+  if(argc == 6 || argc == 8)
   {
     M = atol(argv[1]);
     N = atol(argv[2]);
     P = atol(argv[3]);
     maxSize = atol(argv[4]);
     overlap = atol(argv[5]);
+    if(argc == 8)
+    {
+      maxSizeP = atol(argv[6]);
+      overlapP = atol(argv[7]);
+    }
   } else {
-    printf("Please use:\n$ %s M N P maxSize overlap\n", argv[0]);
+    printf("Please use:\n$ %s M N P maxSize overlap [maxSizeP overlapP]\n", argv[0]);
     exit(1);
   }
 
   test_getWeight1d();
   test_weights(M, N, P, maxSize, overlap);
-  test_copy_paste(M, N, P, maxSize, overlap);
+  test_copy_paste(M, N, P, maxSize, overlap, maxSizeP, overlapP);
 
 }